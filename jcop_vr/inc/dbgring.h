@@ -0,0 +1,64 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file dbgring.h
+ * \brief binary debug event ring shared by the kernel-mode driver and jcop_proxy.
+ * \author Kenichi Kanai
+ *
+ * dbg_bytes only copies its data into a ring entry and dbg_printf formats its
+ * text into one on the calling thread (the arguments may not outlive the
+ * call). Entries are printed later by a background consumer, so the caller
+ * never waits for printf or DbgPrint.
+ *
+ * A producer claims an entry by advancing the head index with a compare
+ * exchange, fills it and then publishes it by setting seq to (index + 1).
+ * The consumer only prints entries whose seq matches the index it expects,
+ * and advances the tail once an entry is printed. A producer finding the
+ * ring full drops its entry (counted as lost), so an entry is never read
+ * while it is written again.
+ */
+#ifndef __DBGRING__
+#define __DBGRING__
+
+// event id.
+#define DBG_EV_TEXT	0x0001	// data is a formatted text (dbg_printf).
+#define DBG_EV_BYTES	0x0002	// data is a raw byte slice (dbg_bytes).
+
+// size of data kept in an entry. longer data is truncated, but the entry
+// still records the original length.
+#define DBG_RING_DATA_SIZE 112
+
+typedef struct _DBG_RING_ENTRY {
+	volatile long seq;	// index of the entry + 1, set when the entry is complete.
+	unsigned short event;	// DBG_EV_XXX
+	unsigned short len;	// original length of data.
+	unsigned long tsLow;	// timestamp (jcop_proxy: performance counter, driver: interrupt time).
+	unsigned long tsHigh;
+	char data[DBG_RING_DATA_SIZE];
+} DBG_RING_ENTRY;
+
+#endif // __DBGRING__
@@ -0,0 +1,127 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file hexfmt.h
+ * \brief bounded hex dump formatter shared by the kernel-mode driver and jcop_proxy,
+ * and the hex digit parser of the user-mode tools.
+ * \author Kenichi Kanai
+ *
+ * Every byte is written as "0xXX:" using a lookup table instead of one
+ * sprintf per byte. The output never exceeds the given buffer: when the
+ * data does not fit, as many whole bytes as possible are written followed
+ * by HEXFMT_TRUNCATED.
+ *
+ * This header does not depend on any OS header.
+ */
+#ifndef __HEXFMT__
+#define __HEXFMT__
+
+#define HEXFMT_CHARS_PER_BYTE 5		// "0xXX:"
+#define HEXFMT_TRUNCATED "..."
+#define HEXFMT_TRUNCATED_LEN 3
+
+/*!
+ * \brief Function returns the buffer size needed to format cnt bytes.<br>
+ */
+inline unsigned long HEXFMT_size(unsigned long const cnt)
+{
+	return cnt * HEXFMT_CHARS_PER_BYTE + 1;
+}
+
+/*!
+ * \brief Function formats a byte array as hex.<br>
+ * <br>
+ * \param [out] pDst output buffer, always null-terminated (if dstSize > 0).
+ * \param [in] dstSize size of output buffer.
+ * \param [in] pSrc byte array.
+ * \param [in] cnt length of byte array.
+ *
+ * \retval number of characters written (excluding the null character).
+ */
+inline unsigned long HEXFMT_encode(
+    char *const pDst,
+    unsigned long const dstSize,
+    char const *const pSrc,
+    unsigned long const cnt
+)
+{
+	static char const hex[] = "0123456789ABCDEF";
+
+	if (dstSize == 0) {
+		return 0;
+	}
+
+	// number of bytes to write.
+	unsigned long n = cnt;
+	bool truncated = false;
+	if (HEXFMT_size(cnt) > dstSize) {
+		truncated = true;
+		n = (dstSize > HEXFMT_TRUNCATED_LEN + 1)
+		    ? (dstSize - HEXFMT_TRUNCATED_LEN - 1) / HEXFMT_CHARS_PER_BYTE
+		    : 0;
+	}
+
+	char *p = pDst;
+	for (unsigned long i = 0; i < n; i++) {
+		unsigned char b = (unsigned char)pSrc[i];
+		p[0] = '0';
+		p[1] = 'x';
+		p[2] = hex[b >> 4];
+		p[3] = hex[b & 0x0f];
+		p[4] = ':';
+		p += HEXFMT_CHARS_PER_BYTE;
+	}
+	if (truncated && dstSize > HEXFMT_TRUNCATED_LEN) {
+		for (int i = 0; i < HEXFMT_TRUNCATED_LEN; i++) {
+			*p++ = HEXFMT_TRUNCATED[i];
+		}
+	}
+	*p = '\0';
+	return (unsigned long)(p - pDst);
+}
+
+/*!
+ * \brief Function returns the value of a hex digit.<br>
+ * <br>
+ * \retval 0 to 15.
+ * \retval -1 c is not a hex digit.
+ */
+inline int HEXFMT_decodeDigit(char const c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+#endif // __HEXFMT__
@@ -0,0 +1,301 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file jcop_msg.h
+ * \brief message framing shared by the kernel-mode driver and jcop_proxy.
+ * \author Kenichi Kanai
+ *
+ * Every message on the driver/proxy channel is framed as the JCOP simulator
+ * socket messages are:
+ *
+ *   MTY NAD LNH LNL | payload (LNH * 256 + LNL bytes)
+ *
+ * MTY 0x11 carries a single T=1 block, which jcop_proxy answers with the
+ * next block. MTY 0x12 carries a whole C-APDU of T=1, which jcop_proxy
+ * answers with the whole R-APDU, so the blocks of a chain never cross the
+ * driver/proxy boundary.
+ *
+ * MTY 0x13 carries a batch of C-APDUs for a script:
+ *
+ *   ABORT_MASK(2) ABORT_SW(2) | 01 NAD LNH LNL C-APDU | 01 NAD LNH LNL C-APDU ...
+ *
+ * jcop_proxy sends them back to back and stops after the first R-APDU
+ * whose SW matches ((SW & ABORT_MASK) == (ABORT_SW & ABORT_MASK)); an
+ * ABORT_MASK of 0 never stops. The answer carries an MTY 0x01 message for
+ * each C-APDU sent, so it has fewer messages than the request when the
+ * batch stopped.
+ *
+ * The answer of jcop_proxy carries the MTY of the request, or
+ * JCOP_MSG_MTY_ERROR with a 4 byte status code (big endian) when the
+ * request failed.
+ *
+ * A request of the driver may be followed by a JCOP_MSG_TIMING trailer
+ * (outside LN) that carries the timestamps of the driver, so jcop_proxy can
+ * attribute the latency of a request to each hop.
+ *
+ * This header does not depend on any OS header.
+ */
+#ifndef __JCOP_MSG__
+#define __JCOP_MSG__
+
+#define JCOP_MSG_HEADER_SIZE 4
+
+// MTY: message types.
+#define JCOP_MSG_MTY_WAIT_FOR_CARD	0x00
+#define JCOP_MSG_MTY_APDU		0x01
+#define JCOP_MSG_MTY_T1			0x11	// original MTY used only for jcop_proxy.
+#define JCOP_MSG_MTY_T1_APDU		0x12	// original MTY used only for jcop_proxy.
+#define JCOP_MSG_MTY_BATCH		0x13	// original MTY used only for jcop_proxy.
+#define JCOP_MSG_MTY_CLOSE		0x7F	// original MTY used only for jcop_proxy.
+#define JCOP_MSG_MTY_ERROR		0xFF	// original MTY used only for jcop_proxy.
+
+// status codes of JCOP_MSG_MTY_ERROR (same values as JCOP_SIMUL_ERROR_XXX).
+#define JCOP_MSG_ERROR_INITIALIZE	0x01
+#define JCOP_MSG_ERROR_TIMEOUT		0x02
+#define JCOP_MSG_ERROR_BUFFER_TOO_SMALL	0x03
+#define JCOP_MSG_ERROR_OTHER		0x04
+#define JCOP_MSG_ERROR_BAD_MESSAGE	0x10	// malformed request.
+#define JCOP_MSG_ERROR_UNKNOWN_MTY	0x11	// MTY not supported by jcop_proxy.
+#define JCOP_MSG_ERROR_IO		0x12	// ReadFile/WriteFile failed.
+
+#define JCOP_MSG_ERROR_PAYLOAD_SIZE 4
+
+// first payload byte of JCOP_MSG_MTY_WAIT_FOR_CARD sent by the driver.
+// jcop_proxy sends its own payload to JCOP simulator.
+#define JCOP_MSG_RESET_COLD	0x00
+#define JCOP_MSG_RESET_WARM	0x01
+
+// JCOP_MSG_MTY_BATCH: ABORT_MASK ABORT_SW before the messages of C-APDUs.
+#define JCOP_MSG_BATCH_HEADER_SIZE	4
+#define JCOP_MSG_BATCH_MAX_CMDS		256
+
+#define JCOP_MSG_TIMING_MAGIC 0x4A435453	// "JCTS"
+
+/*!
+ * \brief timing trailer of a request.<br>
+ * <br>
+ * Timestamps are performance counter values. KeQueryPerformanceCounter of
+ * the driver and QueryPerformanceCounter of jcop_proxy read the same
+ * counter. The time the driver woke up with an answer is only known after
+ * the answer is written, so it is carried by the next request.
+ */
+typedef struct _JCOP_MSG_TIMING {
+	unsigned int magic;	// JCOP_MSG_TIMING_MAGIC
+	unsigned int seq;	// sequence number of the request.
+	unsigned int sentLow;	// the driver signals the request.
+	unsigned int sentHigh;
+	unsigned int wokenLow;	// the driver woke up with the answer of request (seq - 1), 0 if unknown.
+	unsigned int wokenHigh;
+} JCOP_MSG_TIMING;
+
+#define JCOP_MSG_TIMING_SIZE sizeof(JCOP_MSG_TIMING)
+
+/*!
+ * \brief Function sets the message header.<br>
+ * <br>
+ * \param [out] pMsg A pointer to first byte of message.
+ * \param [in] mty MTY: Message type.
+ * \param [in] nad NAD: Node addess
+ * \param [in] len LN: length of payload.
+ *
+ * \retval whole message length.
+ */
+inline unsigned long JCOP_MSG_setHeader(
+    char *const pMsg,
+    unsigned char const mty,
+    unsigned char const nad,
+    unsigned short const len
+)
+{
+	pMsg[0] = (char)mty;		// MTY
+	pMsg[1] = (char)nad;		// NAD
+	pMsg[2] = (char)(len / 256);	// LNH High byte of payload length
+	pMsg[3] = (char)(len % 256);	// LNL Low byte of payload length
+	return (unsigned long)len + JCOP_MSG_HEADER_SIZE;
+}
+
+/*!
+ * \brief Function returns the payload length in the message header.<br>
+ */
+inline unsigned short JCOP_MSG_getLength(char const *const pMsg)
+{
+	return (unsigned short)(((pMsg[2] & 0xff) << 8) + (pMsg[3] & 0xff));
+}
+
+/*!
+ * \brief Function checks the message length is consistent with its header.<br>
+ * <br>
+ * \param [in] pMsg A pointer to first byte of message.
+ * \param [in] msgLen whole message length.
+ *
+ * \retval 1 the message is well-formed.
+ * \retval 0 the message is truncated or has trailing bytes.
+ */
+inline int JCOP_MSG_isValid(char const *const pMsg, unsigned long const msgLen)
+{
+	if (msgLen < JCOP_MSG_HEADER_SIZE) {
+		return 0;
+	}
+	return (msgLen == (unsigned long)JCOP_MSG_getLength(pMsg) + JCOP_MSG_HEADER_SIZE) ? 1 : 0;
+}
+
+/*!
+ * \brief Function returns the length of a message inside the payload of
+ * JCOP_MSG_MTY_BATCH.<br>
+ * <br>
+ * \param [in] pPayload A pointer to first byte of the payload.
+ * \param [in] payloadLen length of the payload.
+ * \param [in] offset offset of the message in the payload.
+ *
+ * \retval whole length of the message.
+ * \retval 0 there is no message at offset, or it is truncated.
+ */
+inline unsigned long JCOP_MSG_getBatchItem(
+    char const *const pPayload,
+    unsigned long const payloadLen,
+    unsigned long const offset
+)
+{
+	if (offset + JCOP_MSG_HEADER_SIZE > payloadLen) {
+		return 0;
+	}
+	unsigned long len = (unsigned long)JCOP_MSG_getLength(pPayload + offset) + JCOP_MSG_HEADER_SIZE;
+	return (offset + len <= payloadLen) ? len : 0;
+}
+
+/*!
+ * \brief Function creates an error message.<br>
+ * <br>
+ * \param [out] pMsg A pointer to output buffer (at least 8 bytes).
+ * \param [in] nad NAD of the failed request.
+ * \param [in] code status code, JCOP_MSG_ERROR_XXX.
+ *
+ * \retval whole message length.
+ */
+inline unsigned long JCOP_MSG_encodeError(
+    char *const pMsg,
+    unsigned char const nad,
+    unsigned long const code
+)
+{
+	pMsg[4] = (char)((code >> 24) & 0xff);
+	pMsg[5] = (char)((code >> 16) & 0xff);
+	pMsg[6] = (char)((code >> 8) & 0xff);
+	pMsg[7] = (char)(code & 0xff);
+	return JCOP_MSG_setHeader(pMsg, JCOP_MSG_MTY_ERROR, nad, JCOP_MSG_ERROR_PAYLOAD_SIZE);
+}
+
+/*!
+ * \brief Function decodes an error message.<br>
+ * <br>
+ * \param [in] pMsg A pointer to first byte of message.
+ * \param [in] msgLen whole message length.
+ * \param [out] pCode status code, JCOP_MSG_ERROR_XXX.
+ *
+ * \retval 1 the message is an error message.
+ * \retval 0 the message is not an error message (pCode is not modified).
+ */
+inline int JCOP_MSG_decodeError(
+    char const *const pMsg,
+    unsigned long const msgLen,
+    unsigned long *const pCode
+)
+{
+	if (!JCOP_MSG_isValid(pMsg, msgLen)) {
+		return 0;
+	}
+	if ((unsigned char)pMsg[0] != JCOP_MSG_MTY_ERROR) {
+		return 0;
+	}
+	if (JCOP_MSG_getLength(pMsg) != JCOP_MSG_ERROR_PAYLOAD_SIZE) {
+		return 0;
+	}
+	*pCode = ((unsigned long)(pMsg[4] & 0xff) << 24)
+	         | ((unsigned long)(pMsg[5] & 0xff) << 16)
+	         | ((unsigned long)(pMsg[6] & 0xff) << 8)
+	         | (unsigned long)(pMsg[7] & 0xff);
+	return 1;
+}
+
+/*!
+ * \brief Function appends the timing trailer to a message.<br>
+ * <br>
+ * \param [out] pMsg A pointer to first byte of message.
+ * \param [in] msgLen whole message length.
+ * \param [in] pTiming timing trailer.
+ *
+ * \retval whole message length including the trailer.
+ */
+inline unsigned long JCOP_MSG_setTiming(
+    char *const pMsg,
+    unsigned long const msgLen,
+    JCOP_MSG_TIMING const *const pTiming
+)
+{
+	char const *pSrc = (char const *)pTiming;
+	for (unsigned long i = 0; i < JCOP_MSG_TIMING_SIZE; i++) {
+		pMsg[msgLen + i] = pSrc[i];
+	}
+	return msgLen + JCOP_MSG_TIMING_SIZE;
+}
+
+/*!
+ * \brief Function gets the timing trailer of a message.<br>
+ * <br>
+ * \param [in] pMsg A pointer to first byte of message.
+ * \param [in] msgLen length of message including the trailer.
+ * \param [out] pTiming timing trailer.
+ *
+ * \retval 1 the message has a timing trailer.
+ * \retval 0 the message has no timing trailer (pTiming is not modified).
+ */
+inline int JCOP_MSG_getTiming(
+    char const *const pMsg,
+    unsigned long const msgLen,
+    JCOP_MSG_TIMING *const pTiming
+)
+{
+	if (msgLen < JCOP_MSG_HEADER_SIZE) {
+		return 0;
+	}
+	unsigned long frameLen = (unsigned long)JCOP_MSG_getLength(pMsg) + JCOP_MSG_HEADER_SIZE;
+	if (msgLen != frameLen + JCOP_MSG_TIMING_SIZE) {
+		return 0;
+	}
+	JCOP_MSG_TIMING timing;
+	char *pDst = (char *)&timing;
+	for (unsigned long i = 0; i < JCOP_MSG_TIMING_SIZE; i++) {
+		pDst[i] = pMsg[frameLen + i];
+	}
+	if (timing.magic != JCOP_MSG_TIMING_MAGIC) {
+		return 0;
+	}
+	*pTiming = timing;
+	return 1;
+}
+
+#endif // __JCOP_MSG__
@@ -0,0 +1,222 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file perf_cntr.h
+ * \brief transfer counters shared by the kernel-mode driver and jcop_proxy.
+ * \author Kenichi Kanai
+ *
+ * The driver counts the requests it sends to jcop_proxy and jcop_proxy
+ * counts the requests it receives, both with JCOP_PERF_countXXX, so the two
+ * sets of counters can be compared. The driver reports its counters by
+ * IOCTL_SMARTCARD_GET_PERF_CNTR (PERF_INFO of smclib) and, with every
+ * counter, by IOCTL_JCOP_PROXY_GET_PERF_COUNTERS.
+ *
+ * This header does not depend on any OS header.
+ */
+#ifndef __PERF_CNTR__
+#define __PERF_CNTR__
+
+#include "jcop_msg.h"
+
+#ifdef _MSC_VER
+typedef unsigned __int64 JCOP_PERF_UINT64;
+#else
+typedef unsigned long long JCOP_PERF_UINT64;
+#endif
+
+#define JCOP_PERF_LANES 2	// lanes of the shared session: short and bulk C-APDUs (chanmux.h).
+
+typedef struct _JCOP_PERF_COUNTERS {
+	JCOP_PERF_UINT64 transmits;	// C-APDUs: MTY 0x01, MTY 0x12, a T=1 I-block which ends a chain, or each answered of MTY 0x13.
+	JCOP_PERF_UINT64 bytesSent;	// payload bytes of the requests.
+	JCOP_PERF_UINT64 bytesReceived;	// payload bytes of the answers.
+	JCOP_PERF_UINT64 t1Blocks;	// MTY 0x11 requests.
+	JCOP_PERF_UINT64 chainingRounds;	// T=1 I-blocks with the M bit and R-blocks.
+	JCOP_PERF_UINT64 resets;	// MTY 0x00 requests.
+	JCOP_PERF_UINT64 timeouts;	// requests failed with a timeout.
+	JCOP_PERF_UINT64 errors;	// requests failed otherwise.
+	JCOP_PERF_UINT64 savedRoundTrips;	// GET RESPONSE and 6Cxx resends done by jcop_proxy (jcop_proxy only).
+	JCOP_PERF_UINT64 cacheHits;	// C-APDUs answered from the response cache (jcop_proxy only).
+	JCOP_PERF_UINT64 cacheMisses;	// whitelisted C-APDUs sent to JCOP simulator (jcop_proxy only).
+	JCOP_PERF_UINT64 prefetchHits;	// GET RESPONSE answered with a prefetched answer (jcop_proxy only).
+	JCOP_PERF_UINT64 prefetchMisses;	// prefetched answers discarded (jcop_proxy only).
+	JCOP_PERF_UINT64 prefetchTicks;	// time JCOP simulator took for the answers of prefetchHits (see frequency).
+	JCOP_PERF_UINT64 laneCommands[JCOP_PERF_LANES];	// commands sent to the shared session (jcop_proxy -mux only).
+	JCOP_PERF_UINT64 laneRefused[JCOP_PERF_LANES];	// commands refused, the lane was full (jcop_proxy -mux only).
+	JCOP_PERF_UINT64 laneWaitTicks[JCOP_PERF_LANES];	// time the commands waited for the shared session (see frequency, jcop_proxy -mux only).
+	JCOP_PERF_UINT64 waitTicks;	// time spent waiting for the answers (see frequency).
+	JCOP_PERF_UINT64 frequency;	// ticks per second of waitTicks.
+} JCOP_PERF_COUNTERS;
+
+/*!
+ * \brief Function clears the counters.<br>
+ * <br>
+ * \param [out] pCounters counters.
+ * \param [in] frequency ticks per second of the wait time.
+ */
+inline void JCOP_PERF_reset(JCOP_PERF_COUNTERS *const pCounters, JCOP_PERF_UINT64 const frequency)
+{
+	char *p = (char *)pCounters;
+	for (unsigned long i = 0; i < sizeof(JCOP_PERF_COUNTERS); i++) {
+		p[i] = 0;
+	}
+	pCounters->frequency = frequency;
+}
+
+/*!
+ * \brief Function counts a request.<br>
+ * <br>
+ * \param [in,out] pCounters counters.
+ * \param [in] pMsg A pointer to first byte of the request (MTY NAD LNH LNL | payload).
+ */
+inline void JCOP_PERF_countRequest(JCOP_PERF_COUNTERS *const pCounters, char const *const pMsg)
+{
+	unsigned short len = JCOP_MSG_getLength(pMsg);
+	pCounters->bytesSent += len;
+	switch ((unsigned char)pMsg[0]) {
+		case JCOP_MSG_MTY_WAIT_FOR_CARD :
+			pCounters->resets++;
+			break;
+		case JCOP_MSG_MTY_APDU :
+		case JCOP_MSG_MTY_T1_APDU :
+			pCounters->transmits++;
+			break;
+		case JCOP_MSG_MTY_T1 : {
+			pCounters->t1Blocks++;
+			if (len < 2) {
+				break;
+			}
+			unsigned char pcb = (unsigned char)pMsg[JCOP_MSG_HEADER_SIZE + 1];
+			if ((pcb & 0x80) == 0x00) {
+				// I-block: the last block of a chain completes the C-APDU.
+				if ((pcb & 0x20) != 0) {
+					pCounters->chainingRounds++;
+				} else {
+					pCounters->transmits++;
+				}
+			} else if ((pcb & 0xC0) == 0x80) {
+				// R-block: requests the next block of a chained answer.
+				pCounters->chainingRounds++;
+			}
+			break;
+		}
+		default:
+			// MTY 0x13: the C-APDUs answered are counted by JCOP_PERF_countBatchAnswer.
+			break;
+	}
+}
+
+/*!
+ * \brief Function counts the answer of a request.<br>
+ * <br>
+ * \param [in,out] pCounters counters.
+ * \param [in] rcvLen payload length of the answer.
+ * \param [in] waitTicks time spent waiting for the answer.
+ */
+inline void JCOP_PERF_countAnswer(
+    JCOP_PERF_COUNTERS *const pCounters,
+    unsigned short const rcvLen,
+    JCOP_PERF_UINT64 const waitTicks
+)
+{
+	pCounters->bytesReceived += rcvLen;
+	pCounters->waitTicks += waitTicks;
+}
+
+/*!
+ * \brief Function counts the C-APDUs answered in the answer of a batch
+ * (MTY 0x13), which may stop before the last one.<br>
+ * <br>
+ * An error message after the R-APDUs (a C-APDU failed) is counted as an
+ * error. Call JCOP_PERF_countAnswer for the answer as well.
+ * <br>
+ * \param [in,out] pCounters counters.
+ * \param [in] pPayload A pointer to first byte of the answer payload.
+ * \param [in] payloadLen length of the answer payload.
+ */
+inline void JCOP_PERF_countBatchAnswer(
+    JCOP_PERF_COUNTERS *const pCounters,
+    char const *const pPayload,
+    unsigned short const payloadLen
+)
+{
+	unsigned long offset = 0;
+	unsigned long itemLen;
+	while ((itemLen = JCOP_MSG_getBatchItem(pPayload, payloadLen, offset)) != 0) {
+		if ((unsigned char)pPayload[offset] == JCOP_MSG_MTY_ERROR) {
+			pCounters->errors++;
+		} else {
+			pCounters->transmits++;
+		}
+		offset += itemLen;
+	}
+}
+
+/*!
+ * \brief Function counts a failed request.<br>
+ * <br>
+ * \param [in,out] pCounters counters.
+ * \param [in] isTimeout the request timed out.
+ * \param [in] waitTicks time spent waiting for the answer.
+ */
+inline void JCOP_PERF_countError(
+    JCOP_PERF_COUNTERS *const pCounters,
+    int const isTimeout,
+    JCOP_PERF_UINT64 const waitTicks
+)
+{
+	if (isTimeout) {
+		pCounters->timeouts++;
+	} else {
+		pCounters->errors++;
+	}
+	pCounters->waitTicks += waitTicks;
+}
+
+/*!
+ * \brief Function returns the wait time in 100 nanosecond units.<br>
+ * <br>
+ * waitTicks is counted in performance counter ticks; PERF_INFO.IoTickCount
+ * of smclib is in system clock ticks, i.e. this value divided by
+ * KeQueryTimeIncrement.
+ * <br>
+ * \param [in] pCounters counters.
+ *
+ * \retval wait time (100 nsec), 0 if the frequency is not known.
+ */
+inline JCOP_PERF_UINT64 JCOP_PERF_getWaitTime(JCOP_PERF_COUNTERS const *const pCounters)
+{
+	JCOP_PERF_UINT64 const freq = pCounters->frequency;
+	if (freq == 0) {
+		return 0;
+	}
+	// split so that waitTicks * 10^7 doesn't overflow.
+	return (pCounters->waitTicks / freq) * 10000000
+	       + ((pCounters->waitTicks % freq) * 10000000) / freq;
+}
+
+#endif // __PERF_CNTR__
@@ -32,6 +32,13 @@
 #ifndef __SHARED_DATA__
 #define __SHARED_DATA__
 
+#include "jcop_msg.h"
+#include "perf_cntr.h"
+
+// IO control codes of the driver (not used by the Linux build of the
+// host tools).
+#ifdef _WIN32
+
 #include "devioctl.h"
 
 typedef struct _JCOP_PROXY_SHARED_EVENTS {
@@ -42,8 +49,42 @@ typedef struct _JCOP_PROXY_SHARED_EVENTS {
 #define IOCTL_JCOP_PROXY_SET_EVENTS \
    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x888, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
-// allocate 1024 bytes as linux version do.
-#define JCOP_PROXY_BUFFER_SIZE 1024
+// debug output level (DBG_LVL_XXX) of each category (DBG_CAT_XXX).
+#define JCOP_PROXY_LOG_CATEGORIES 8
+
+typedef struct _JCOP_PROXY_LOG_LEVELS {
+    unsigned char levels[JCOP_PROXY_LOG_CATEGORIES];
+} JCOP_PROXY_LOG_LEVELS, *PJCOP_PROXY_LOG_LEVELS;
+
+#define IOCTL_JCOP_PROXY_SET_LOG_LEVELS \
+   CTL_CODE(FILE_DEVICE_UNKNOWN, 0x889, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// output: JCOP_PERF_COUNTERS of the driver.
+#define IOCTL_JCOP_PROXY_GET_PERF_COUNTERS \
+   CTL_CODE(FILE_DEVICE_UNKNOWN, 0x88A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// options of the driver, cleared by IOCTL_JCOP_PROXY_SET_EVENTS.
+#define JCOP_PROXY_OPTION_APDU_T1	0x00000001	// T=1 C-APDUs are sent whole in MTY 0x12.
+
+typedef struct _JCOP_PROXY_OPTIONS {
+    unsigned long flags;	// JCOP_PROXY_OPTION_XXX
+} JCOP_PROXY_OPTIONS, *PJCOP_PROXY_OPTIONS;
+
+#define IOCTL_JCOP_PROXY_SET_OPTIONS \
+   CTL_CODE(FILE_DEVICE_UNKNOWN, 0x88B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// vendor IOCTL of the reader (SCardControl), sent to jcop_proxy as MTY 0x13.
+// input: ABORT_MASK ABORT_SW followed by MTY 0x01 messages (see jcop_msg.h).
+// output: an MTY 0x01 message for each C-APDU answered; if a C-APDU failed after
+// others were answered, an MTY 0xFF message of the failure follows them.
+#define IOCTL_JCOP_VR_TRANSMIT_BATCH \
+   CTL_CODE(FILE_DEVICE_SMARTCARD, 3500, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#endif // _WIN32
+
+// allocate 1024 bytes as linux version do, and room for the R-APDUs of
+// extended length that APDU-level T=1 (MTY 0x12) carries in one message.
+#define JCOP_PROXY_BUFFER_SIZE 4096
 #define JCOP_PROXY_MAX_ATR_SIZE 33
 
 // I don't know how to resize Smartcard resource manager's IFSD to 0xFE...
@@ -46,27 +46,200 @@ extern "C"
 
 #ifdef MY_DEBUG
 
-static CCHAR g_buf[8192];
+#include "dbgring.h"
+#include "hexfmt.h"
 
-void dbg_ba2s(char const *const cp, int const cnt)
+unsigned char g_dbgLevel[DBG_CAT_COUNT] = {
+	DBG_LVL_DEFAULT, DBG_LVL_DEFAULT, DBG_LVL_DEFAULT, DBG_LVL_DEFAULT, DBG_LVL_DEFAULT
+};
+
+#define DBG_RING_ENTRIES 256	// must be a power of 2.
+// prefix + formatted entry + "...(N bytes)".
+#define DBG_BUF_SIZE (64 + DBG_RING_DATA_SIZE * HEXFMT_CHARS_PER_BYTE)
+#define DBG_CONSUMER_INTERVAL 50	// msec.
+
+static DBG_RING_ENTRY g_ring[DBG_RING_ENTRIES];
+static volatile LONG g_head = 0;	// index of the next entry to write.
+static volatile LONG g_tail = 0;	// index of the next entry to print (advanced by the consumer).
+static volatile LONG g_lost = 0;	// number of entries dropped, the ring being full.
+
+static PVOID g_pConsumer = NULL;	// consumer system thread object.
+static KEVENT g_eventStop;
+
+static CCHAR g_buf[DBG_BUF_SIZE];
+
+/*!
+ * \brief Function claims a ring entry and stamps it.<br>
+ * <br>
+ * Callable at any IRQL.
+ * <br>
+ * \param [in] event event id, DBG_EV_XXX.
+ * \param [in] len original length of data.
+ * \param [out] pIdx index of the claimed entry.
+ *
+ * \retval A pointer to the claimed entry.
+ * \retval NULL the ring is full; the entry is dropped and counted as lost.
+ */
+static DBG_RING_ENTRY *reserve(unsigned short const event, int const len, LONG *const pIdx)
+{
+	LONG idx;
+	do {
+		idx = g_head;
+		if (idx - g_tail >= DBG_RING_ENTRIES) {
+			// an entry is never overwritten before the consumer printed it.
+			InterlockedIncrement(&g_lost);
+			return NULL;
+		}
+	} while (InterlockedCompareExchange(&g_head, idx + 1, idx) != idx);
+	DBG_RING_ENTRY *pEntry = &g_ring[idx & (DBG_RING_ENTRIES - 1)];
+	InterlockedExchange((PLONG)&pEntry->seq, 0);	// the entry is being written.
+	pEntry->event = event;
+	pEntry->len = (unsigned short)((len > 0xFFFF) ? 0xFFFF : len);
+	// the interrupt time is read from memory; KeQueryPerformanceCounter may
+	// read the hardware timer.
+	ULONGLONG ts = KeQueryInterruptTime();
+	pEntry->tsLow = (unsigned long)(ts & 0xFFFFFFFF);
+	pEntry->tsHigh = (unsigned long)(ts >> 32);
+	*pIdx = idx;
+	return pEntry;
+}
+
+/*!
+ * \brief Function publishes a ring entry to the consumer.<br>
+ */
+static void commit(DBG_RING_ENTRY *const pEntry, LONG const idx)
+{
+	InterlockedExchange((PLONG)&pEntry->seq, idx + 1);
+}
+
+/*!
+ * \brief Function formats a ring entry to the output.<br>
+ */
+static void print_entry(DBG_RING_ENTRY const *const pEntry)
 {
 	int n = sprintf(g_buf, "%s", "[JCOP_VR] ");
-	for (int i = 0; i < cnt; i++) {
-		n += sprintf(g_buf + n, "0x%02X:", cp[i] & 0xff);
+	int cnt = (pEntry->len > DBG_RING_DATA_SIZE) ? DBG_RING_DATA_SIZE : pEntry->len;
+	switch (pEntry->event) {
+		case DBG_EV_TEXT :
+			RtlCopyMemory(g_buf + n, pEntry->data, cnt);
+			n += cnt;
+			break;
+		case DBG_EV_BYTES :
+			n += HEXFMT_encode(g_buf + n, sizeof(g_buf) - n, pEntry->data, cnt);
+			break;
+		default :
+			n += sprintf(g_buf + n, "event 0x%04X", pEntry->event);
+			break;
 	}
+	if (pEntry->len > cnt) {
+		n += sprintf(g_buf + n, "...(%d bytes)", pEntry->len);
+	}
+	g_buf[n] = '\0';
 	// Log to Debug View(Windows Sysinternals).
-	DbgPrint(g_buf);
+	DbgPrint("%s\n", g_buf);
+}
+
+/*!
+ * \brief Function prints all published entries.<br>
+ * <br>
+ * Only the consumer thread (or dbg_exit after it stopped) calls this.
+ */
+static void drain(void)
+{
+	LONG head = g_head;
+	while (g_tail != head) {
+		DBG_RING_ENTRY *pEntry = &g_ring[g_tail & (DBG_RING_ENTRIES - 1)];
+		if (pEntry->seq != g_tail + 1) {
+			// the entry is still being written. retry later.
+			break;
+		}
+		KeMemoryBarrier();	// read the entry after its seq.
+		print_entry(pEntry);
+		// the entry may be written again.
+		InterlockedExchange(&g_tail, g_tail + 1);
+	}
 }
 
-void dbg_log(char const *const pFmt, ...)
+static VOID consumer(PVOID pContext)
 {
-	int n = sprintf(g_buf, "%s", "[JCOP_VR] ");
+	LARGE_INTEGER interval;
+	interval.QuadPart = -10000 * DBG_CONSUMER_INTERVAL;
+
+	while (KeWaitForSingleObject(&g_eventStop, Executive, KernelMode, FALSE, &interval) == STATUS_TIMEOUT) {
+		drain();
+	}
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+void dbg_init(void)
+{
+	if (g_pConsumer != NULL) {
+		return;
+	}
+	KeInitializeEvent(&g_eventStop, NotificationEvent, FALSE);
+
+	HANDLE hThread;
+	NTSTATUS status = PsCreateSystemThread(&hThread, THREAD_ALL_ACCESS, NULL, NULL, NULL, consumer, NULL);
+	if (status != STATUS_SUCCESS) {
+		return;
+	}
+	status = ObReferenceObjectByHandle(hThread, THREAD_ALL_ACCESS, NULL, KernelMode, &g_pConsumer, NULL);
+	if (status != STATUS_SUCCESS) {
+		g_pConsumer = NULL;
+	}
+	ZwClose(hThread);
+}
+
+void dbg_exit(void)
+{
+	if (g_pConsumer != NULL) {
+		KeSetEvent(&g_eventStop, 0, FALSE);
+		KeWaitForSingleObject(g_pConsumer, Executive, KernelMode, FALSE, NULL);
+		ObDereferenceObject(g_pConsumer);
+		g_pConsumer = NULL;
+	}
+	drain();
+	if (g_lost > 0) {
+		DbgPrint("[JCOP_VR] %ld debug entries lost\n", g_lost);
+	}
+}
+
+/*!
+ * \brief Function sets the level of every category.<br>
+ * <br>
+ * \param [in] pLevels DBG_CAT_COUNT levels, DBG_LVL_XXX.
+ */
+void dbg_setLevels(unsigned char const *const pLevels)
+{
+	for (int i = 0; i < DBG_CAT_COUNT; i++) {
+		g_dbgLevel[i] = (pLevels[i] > DBG_LVL_DEBUG) ? DBG_LVL_DEBUG : pLevels[i];
+	}
+}
+
+void dbg_bytes(char const *const cp, int const cnt)
+{
+	LONG idx;
+	DBG_RING_ENTRY *pEntry = reserve(DBG_EV_BYTES, cnt, &idx);
+	if (pEntry == NULL) {
+		return;
+	}
+	RtlCopyMemory(pEntry->data, cp, (cnt > DBG_RING_DATA_SIZE) ? DBG_RING_DATA_SIZE : cnt);
+	commit(pEntry, idx);
+}
+
+void dbg_printf(char const *const pFmt, ...)
+{
+	LONG idx;
+	DBG_RING_ENTRY *pEntry = reserve(DBG_EV_TEXT, 0, &idx);
+	if (pEntry == NULL) {
+		return;
+	}
 	va_list marker;
 	va_start(marker, pFmt);
-	vsprintf(g_buf + n, pFmt, marker);
+	int n = _vsnprintf(pEntry->data, DBG_RING_DATA_SIZE, pFmt, marker);
 	va_end(marker);
-	// Log to Debug View(Windows Sysinternals).
-	DbgPrint(g_buf);
+	pEntry->len = (unsigned short)((n < 0) ? DBG_RING_DATA_SIZE : n);
+	commit(pEntry, idx);
 }
 
 #endif
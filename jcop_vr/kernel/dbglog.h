@@ -28,6 +28,14 @@
  * \file dbglog.h
  * \brief Debug output function prototypes.
  * \author Kenichi Kanai
+ *
+ * Every output has a level and a category. The level of each category can
+ * be changed at runtime; a disabled output costs one comparison and its
+ * arguments are not evaluated.
+ *
+ * A source file selects its category by defining DBG_CATEGORY before
+ * including this header. dbg_logc(cat, lvl)("...", ...) logs to another
+ * category.
  */
 #ifndef __DBGLOG__
 #define __DBGLOG__
@@ -35,12 +43,53 @@
 // Enable Debug output.
 #define MY_DEBUG
 
+// levels.
+#define DBG_LVL_OFF	0
+#define DBG_LVL_ERR	1
+#define DBG_LVL_WARN	2
+#define DBG_LVL_INFO	3
+#define DBG_LVL_DEBUG	4
+
+#define DBG_LVL_DEFAULT DBG_LVL_WARN
+
+// categories.
+#define DBG_CAT_GENERAL		0
+#define DBG_CAT_TRANSPORT	1	// JCOP simulator socket.
+#define DBG_CAT_T1		2	// T=1 protocol.
+#define DBG_CAT_IPC		3	// driver/proxy message exchange.
+#define DBG_CAT_DISPATCH	4	// request dispatch.
+#define DBG_CAT_COUNT		5
+
+#ifndef DBG_CATEGORY
+#define DBG_CATEGORY DBG_CAT_GENERAL
+#endif
+
 #ifdef MY_DEBUG
-void dbg_ba2s(char const *const cp, int const cnt);
-void dbg_log(char const *const pFmt, ...);
+extern unsigned char g_dbgLevel[DBG_CAT_COUNT];
+#define DBG_ENABLED(cat, lvl) (g_dbgLevel[(cat)] >= (lvl))
+
+void dbg_init(void);
+void dbg_exit(void);
+void dbg_setLevels(unsigned char const *const pLevels);
+void dbg_bytes(char const *const cp, int const cnt);
+void dbg_printf(char const *const pFmt, ...);
 #else
-#define dbg_ba2s
-#define dbg_log
+#define DBG_ENABLED(cat, lvl) 0
+
+#define dbg_init()
+#define dbg_exit()
+inline void dbg_setLevels(unsigned char const *const pLevels) {}
+inline void dbg_bytes(char const *const cp, int const cnt) {}
+inline void dbg_printf(char const *const pFmt, ...) {}
 #endif
 
-#endif // __DBGLOG__
\ No newline at end of file
+// dbg_logc(DBG_CAT_XXX, DBG_LVL_XXX)("format", ...);
+#define dbg_logc(cat, lvl) if (!DBG_ENABLED((cat), (lvl))) ; else dbg_printf
+
+#define dbg_err		dbg_logc(DBG_CATEGORY, DBG_LVL_ERR)
+#define dbg_warn	dbg_logc(DBG_CATEGORY, DBG_LVL_WARN)
+#define dbg_info	dbg_logc(DBG_CATEGORY, DBG_LVL_INFO)
+#define dbg_log		dbg_logc(DBG_CATEGORY, DBG_LVL_DEBUG)
+#define dbg_ba2s	if (!DBG_ENABLED(DBG_CATEGORY, DBG_LVL_DEBUG)) ; else dbg_bytes
+
+#endif // __DBGLOG__
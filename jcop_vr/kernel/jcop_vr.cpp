@@ -44,6 +44,7 @@ extern "C"
 
 #include <smclib.h>
 
+#define DBG_CATEGORY DBG_CAT_DISPATCH
 #include "dbglog.h"
 #include "shared_data.h"
 
@@ -56,6 +57,12 @@ extern "C"
 
 #define SMARTCARD_POOL_TAG 'poCJ'
 
+// log of the driver/proxy channel.
+#define dbg_ipc dbg_logc(DBG_CAT_IPC, DBG_LVL_DEBUG)
+#define dbg_ipc_warn dbg_logc(DBG_CAT_IPC, DBG_LVL_WARN)
+#define dbg_ipc_err dbg_logc(DBG_CAT_IPC, DBG_LVL_ERR)
+#define dbg_ipc_bytes if (!DBG_ENABLED(DBG_CAT_IPC, DBG_LVL_DEBUG)) ; else dbg_bytes
+
 typedef struct _DEVICE_EXTENSION {
 	SMARTCARD_EXTENSION smartcardExtension;
 	UNICODE_STRING linkName;
@@ -68,6 +75,10 @@ typedef struct _READER_EXTENSION {
 	HANDLE hEventRcv;
 	unsigned short iRcvLen;
 	PCHAR pRcvBuffer;
+	unsigned int seq;		// sequence number of the last request.
+	LARGE_INTEGER lastWoken;	// woke up with the last answer, 0 if unknown.
+	JCOP_PERF_COUNTERS perf;	// transfer counters (IOCTL_SMARTCARD_GET_PERF_CNTR).
+	unsigned long options;		// JCOP_PROXY_OPTION_XXX set by jcop_proxy.
 } READER_EXTENSION, *PREADER_EXTENSION;
 
 
@@ -75,6 +86,29 @@ typedef struct _READER_EXTENSION {
 // JCOP proxy user-mode application message exchange function.
 ///////////////////////////////////////////////////////////////////////////////
 
+/*!
+ * \brief Function maps the status code of an error message to NTSTATUS.<br>
+ * <br>
+ * \param [in] code status code, JCOP_MSG_ERROR_XXX.
+ *
+ * \retval NTSTATUS to return to the caller of sendMessage.
+ */
+static NTSTATUS mapErrorCode(unsigned long const code)
+{
+	switch (code) {
+		case JCOP_MSG_ERROR_INITIALIZE :
+			return STATUS_NO_MEDIA;
+		case JCOP_MSG_ERROR_TIMEOUT :
+			return STATUS_IO_TIMEOUT;
+		case JCOP_MSG_ERROR_BUFFER_TOO_SMALL :
+			return STATUS_BUFFER_TOO_SMALL;
+		case JCOP_MSG_ERROR_UNKNOWN_MTY :
+			return STATUS_INVALID_DEVICE_REQUEST;
+		default :
+			return STATUS_DEVICE_PROTOCOL_ERROR;
+	}
+}
+
 /*!
  * \brief Message exchange function communicate with user-mode application.<br>
  * <br>
@@ -93,6 +127,13 @@ typedef struct _READER_EXTENSION {
  * \retval STATUS_SUCCESS the routine successfully end.
  * \retval STATUS_IO_TIMEOUT The request timed out.
  * \retval STATUS_BUFFER_TOO_SMALL Expected ATR Length is too small.
+ * \retval STATUS_NO_MEDIA The user-mode application could not connect to the
+	JCOP simulator.
+ * \retval STATUS_INVALID_DEVICE_REQUEST The user-mode application does not
+	support the MTY.
+ * \retval STATUS_DEVICE_PROTOCOL_ERROR The user-mode application failed to
+	process the message, or its answer is malformed.
+ * \retval STATUS_INVALID_BUFFER_SIZE The payload does not fit the message buffer.
  */
 static int sendMessage(
     PREADER_EXTENSION pReaderExtension,
@@ -105,35 +146,51 @@ static int sendMessage(
     unsigned short *const pRcvLen,
     PLARGE_INTEGER pDueTime)
 {
-	dbg_log("sendMessage start");
+	dbg_ipc("sendMessage start");
 
 	NTSTATUS status;
 
 	// set exchanging messages in pReaderExtension->pSndBuffer.
 	if (pReaderExtension == NULL) {
 		status = STATUS_INSUFFICIENT_RESOURCES;
-		dbg_log("pReaderExtension == NULL");
+		dbg_ipc_err("pReaderExtension == NULL");
 		return status;
 	}
 	if (pReaderExtension->pSndBuffer == NULL) {
 		status = STATUS_INSUFFICIENT_RESOURCES;
-		dbg_log("pReaderExtension->pSndBuffer == NULL");
+		dbg_ipc_err("pReaderExtension->pSndBuffer == NULL");
 		return status;
 	}
+	if (sndLen > JCOP_PROXY_BUFFER_SIZE - JCOP_MSG_HEADER_SIZE) {
+		dbg_ipc_err("STATUS_INVALID_BUFFER_SIZE - sndLen: %d", sndLen);
+		return STATUS_INVALID_BUFFER_SIZE;
+	}
 	// set message header.
-	pReaderExtension->pSndBuffer[0] = mty;			// MTY
-	pReaderExtension->pSndBuffer[1] = nad;			// NAD
-	pReaderExtension->pSndBuffer[2] = sndLen / 256;	// LNH High byte of payload length
-	pReaderExtension->pSndBuffer[3] = sndLen % 256;	// LNL Low byte of payload length
-	// set message payload.
-	RtlCopyMemory(pReaderExtension->pSndBuffer + 4, pSnd, sndLen);
 	// set whole message length.
-	pReaderExtension->iSndLen = sndLen + 4;
+	pReaderExtension->iSndLen = (unsigned short)JCOP_MSG_setHeader(pReaderExtension->pSndBuffer, mty, nad, sndLen);
+	// set message payload.
+	RtlCopyMemory(pReaderExtension->pSndBuffer + JCOP_MSG_HEADER_SIZE, pSnd, sndLen);
+	JCOP_PERF_countRequest(&pReaderExtension->perf, pReaderExtension->pSndBuffer);
+
+	// append the timing trailer if there is room for it.
+	LARGE_INTEGER sent = KeQueryPerformanceCounter(NULL);
+	if (pReaderExtension->iSndLen + JCOP_MSG_TIMING_SIZE <= JCOP_PROXY_BUFFER_SIZE) {
+		JCOP_MSG_TIMING timing;
+		timing.magic = JCOP_MSG_TIMING_MAGIC;
+		timing.seq = ++pReaderExtension->seq;
+		timing.sentLow = sent.LowPart;
+		timing.sentHigh = (unsigned int)sent.HighPart;
+		timing.wokenLow = pReaderExtension->lastWoken.LowPart;
+		timing.wokenHigh = (unsigned int)pReaderExtension->lastWoken.HighPart;
+		pReaderExtension->iSndLen = (unsigned short)JCOP_MSG_setTiming(
+		                                pReaderExtension->pSndBuffer, pReaderExtension->iSndLen, &timing);
+	}
+	pReaderExtension->lastWoken.QuadPart = 0;
 
 	// notify to the user-mode application.
 	if (pReaderExtension->hEventSnd == NULL) {
 		status = STATUS_INSUFFICIENT_RESOURCES;
-		dbg_log("pReaderExtension->hEventSnd == NULL");
+		dbg_ipc_err("pReaderExtension->hEventSnd == NULL");
 		return status;
 	}
 	KeSetEvent((PKEVENT)pReaderExtension->hEventSnd, 0, FALSE);
@@ -146,7 +203,7 @@ static int sendMessage(
 
 	if (pReaderExtension->hEventRcv == NULL) {
 		status = STATUS_INSUFFICIENT_RESOURCES;
-		dbg_log("pReaderExtension->hEventRcv == NULL");
+		dbg_ipc_err("pReaderExtension->hEventRcv == NULL");
 		return status;
 	}
 	// wait for event.
@@ -157,45 +214,73 @@ static int sendMessage(
 	             FALSE,
 	             pDueTime
 	         );
+	LARGE_INTEGER woken = KeQueryPerformanceCounter(NULL);
+	JCOP_PERF_UINT64 waitTicks = (JCOP_PERF_UINT64)(woken.QuadPart - sent.QuadPart);
+	if (status == STATUS_SUCCESS) {
+		pReaderExtension->lastWoken = woken;
+	}
 	if (status != STATUS_SUCCESS) {
+		JCOP_PERF_countError(&pReaderExtension->perf, status == STATUS_TIMEOUT, waitTicks);
 		switch (status) {
 			case STATUS_ALERTED :
-				dbg_log("STATUS_ALERTED\r\n");
+				dbg_ipc_err("STATUS_ALERTED\r\n");
 				break;
 			case STATUS_USER_APC :
-				dbg_log("STATUS_USER_APC \r\n");
+				dbg_ipc_err("STATUS_USER_APC \r\n");
 				break;
 			case STATUS_TIMEOUT :
-				dbg_log("STATUS_TIMEOUT \r\n");
+				dbg_ipc_err("STATUS_TIMEOUT \r\n");
 				break;
 			case STATUS_ABANDONED_WAIT_0 :
-				dbg_log("STATUS_ABANDONED_WAIT_0 \r\n");
+				dbg_ipc_err("STATUS_ABANDONED_WAIT_0 \r\n");
 				break;
 			default:
-				dbg_log("STATUS_XXXXX \r\n");
+				dbg_ipc_err("STATUS_XXXXX \r\n");
 				break;
 		}
 		return status;
 	}
 
-	// get data from pReaderExtension->pRcvBuffer.
-	if (rcvLenExp < pReaderExtension->iRcvLen) {
-		dbg_log("STATUS_BUFFER_TOO_SMALL - *pRcvLen: %d", *pRcvLen);
-		return STATUS_BUFFER_TOO_SMALL;
-	}
 	if (pReaderExtension->pRcvBuffer == NULL) {
 		status = STATUS_INSUFFICIENT_RESOURCES;
-		dbg_log("pReaderExtension->pRcvBuffer == NULL");
+		dbg_ipc_err("pReaderExtension->pRcvBuffer == NULL");
+		JCOP_PERF_countError(&pReaderExtension->perf, 0, waitTicks);
 		return status;
 	}
-	*pRcvLen = pReaderExtension->iRcvLen;
-	RtlCopyMemory(pRcv, pReaderExtension->pRcvBuffer, pReaderExtension->iRcvLen);
 
-	dbg_log("pReaderExtension->iRcvLen: %d", pReaderExtension->iRcvLen);
-	dbg_ba2s(pRcv, pReaderExtension->iRcvLen);
+	// check the answer is an error message.
+	unsigned long code;
+	if (JCOP_MSG_decodeError(pReaderExtension->pRcvBuffer, pReaderExtension->iRcvLen, &code)) {
+		status = mapErrorCode(code);
+		JCOP_PERF_countError(&pReaderExtension->perf, code == JCOP_MSG_ERROR_TIMEOUT, waitTicks);
+		dbg_ipc_warn("error message received - code: 0x%08X, status: 0x%08X", code, status);
+		return status;
+	}
+	if (!JCOP_MSG_isValid(pReaderExtension->pRcvBuffer, pReaderExtension->iRcvLen)) {
+		dbg_ipc_err("STATUS_DEVICE_PROTOCOL_ERROR - malformed message: %d bytes", pReaderExtension->iRcvLen);
+		JCOP_PERF_countError(&pReaderExtension->perf, 0, waitTicks);
+		return STATUS_DEVICE_PROTOCOL_ERROR;
+	}
+
+	// get data from pReaderExtension->pRcvBuffer.
+	unsigned short payloadLen = JCOP_MSG_getLength(pReaderExtension->pRcvBuffer);
+	if (rcvLenExp < payloadLen) {
+		dbg_ipc_err("STATUS_BUFFER_TOO_SMALL - payloadLen: %d", payloadLen);
+		JCOP_PERF_countError(&pReaderExtension->perf, 0, waitTicks);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+	*pRcvLen = payloadLen;
+	RtlCopyMemory(pRcv, pReaderExtension->pRcvBuffer + JCOP_MSG_HEADER_SIZE, payloadLen);
+	JCOP_PERF_countAnswer(&pReaderExtension->perf, payloadLen, waitTicks);
+	if (mty == JCOP_MSG_MTY_BATCH) {
+		JCOP_PERF_countBatchAnswer(&pReaderExtension->perf, pRcv, payloadLen);
+	}
+
+	dbg_ipc("pReaderExtension->iRcvLen: %d", pReaderExtension->iRcvLen);
+	dbg_ipc_bytes(pRcv, payloadLen);
 
 	status = STATUS_SUCCESS;
-	dbg_log("sendMessage end - status: 0x%08X", status);
+	dbg_ipc("sendMessage end - status: 0x%08X", status);
 	return status;
 }
 
@@ -210,6 +295,7 @@ static int sendMessage(
  * <br>
  * \param [in] pSmartcardExtension A pointer to the smart card extension,
 		SMARTCARD_EXTENSION, of the device.
+ * \param [in] isWarm true: SCARD_WARM_RESET, false: SCARD_COLD_RESET.
  *
  * \retval STATUS_SUCCESS the routine successfully end.
  * \retval STATUS_IO_TIMEOUT The request timed out.
@@ -217,7 +303,7 @@ static int sendMessage(
  * \retval STATUS_NO_MEDIA Other errors during initalization(No smart card is
 	inserted in the reader).
  */
-static NTSTATUS resetCard(PSMARTCARD_EXTENSION pSmartcardExtension)
+static NTSTATUS resetCard(PSMARTCARD_EXTENSION pSmartcardExtension, bool const isWarm)
 {
 	dbg_log("resetCard start");
 	NTSTATUS status = STATUS_SUCCESS;
@@ -233,10 +319,12 @@ static NTSTATUS resetCard(PSMARTCARD_EXTENSION pSmartcardExtension)
 	PREADER_EXTENSION pReaderExtension = pSmartcardExtension->ReaderExtension;
 
 	// send "Wait for card" message.
-	unsigned char mty = 0x00;	// MTY 0x00(Wait for card)
+	unsigned char mty = JCOP_MSG_MTY_WAIT_FOR_CARD;	// MTY 0x00(Wait for card)
 	unsigned char nad = 0x21;	// NAD
 	char pSnd[4];	// PY0 payload (interpretation depends on message type)
 	RtlZeroMemory(pSnd, 4);
+	// jcop_proxy may answer a warm reset with the cached ATR.
+	pSnd[0] = isWarm ? JCOP_MSG_RESET_WARM : JCOP_MSG_RESET_COLD;
 
 	unsigned short atrLen;
 	char atr[JCOP_PROXY_MAX_ATR_SIZE];
@@ -257,7 +345,7 @@ static NTSTATUS resetCard(PSMARTCARD_EXTENSION pSmartcardExtension)
 	             &dueTime
 	         );
 	if (status != STATUS_SUCCESS) {
-		dbg_log("sendResetMessage failed! - status: 0x%08X", status);
+		dbg_err("sendResetMessage failed! - status: 0x%08X", status);
 		switch (status) {
 			case STATUS_IO_TIMEOUT :
 				return STATUS_IO_TIMEOUT;
@@ -294,7 +382,7 @@ static NTSTATUS resetCard(PSMARTCARD_EXTENSION pSmartcardExtension)
 	pSmartcardExtension->CardCapabilities.ATR.Length = (UCHAR)atrLen;
 	status = SmartcardUpdateCardCapabilities(pSmartcardExtension);
 	if (status != STATUS_SUCCESS) {
-		dbg_log("SmartcardUpdateCardCapabilities failed! - status: 0x%08X", status);
+		dbg_err("SmartcardUpdateCardCapabilities failed! - status: 0x%08X", status);
 		return status;
 	}
 
@@ -322,7 +410,7 @@ static NTSTATUS powerDown(PSMARTCARD_EXTENSION pSmartcardExtension)
 	PREADER_EXTENSION pReaderExtension = pSmartcardExtension->ReaderExtension;
 
 	// send "Close socket" message.
-	unsigned char mty = 0x7F;	// MTY 0x7F(Close socket)
+	unsigned char mty = JCOP_MSG_MTY_CLOSE;	// MTY 0x7F(Close socket)
 	unsigned char nad = 0x21;	// NAD
 	char pSnd[4];	// PY0 payload (interpretation depends on message type)
 	RtlZeroMemory(pSnd, 4);
@@ -346,7 +434,7 @@ static NTSTATUS powerDown(PSMARTCARD_EXTENSION pSmartcardExtension)
 	             &dueTime
 	         );
 	if (status != STATUS_SUCCESS) {
-		dbg_log("sendPowerDownMessage failed! - status: 0x%08X", status);
+		dbg_err("sendPowerDownMessage failed! - status: 0x%08X", status);
 		switch (status) {
 			case STATUS_IO_TIMEOUT :
 				return STATUS_IO_TIMEOUT;
@@ -386,11 +474,11 @@ NTSTATUS VR_RDF_PowerCard(IN PSMARTCARD_EXTENSION pSmartcardExtension)
 			break;
 		case SCARD_COLD_RESET :
 			dbg_log("SCARD_COLD_RESET");
-			status = resetCard(pSmartcardExtension);
+			status = resetCard(pSmartcardExtension, false);
 			break;
 		case SCARD_WARM_RESET :
 			dbg_log("SCARD_WARM_RESET");
-			status = resetCard(pSmartcardExtension);
+			status = resetCard(pSmartcardExtension, true);
 			break;
 		default :
 			dbg_log("SCARD_XXXXX(unknown): 0x%08X", pSmartcardExtension->MinorIoControlCode);
@@ -475,7 +563,7 @@ static NTSTATUS transmitT0(IN PSMARTCARD_EXTENSION pSmartcardExtension)
 
 	status = SmartcardT0Request(pSmartcardExtension);
 	if (status != STATUS_SUCCESS) {
-		dbg_log("SmartcardT0Request failed! - status: 0x%08X", status);
+		dbg_err("SmartcardT0Request failed! - status: 0x%08X", status);
 		return status;
 	}
 	dbg_log("transmitT0 SEND: ");
@@ -488,7 +576,7 @@ static NTSTATUS transmitT0(IN PSMARTCARD_EXTENSION pSmartcardExtension)
 	PREADER_EXTENSION pReaderExtension = pSmartcardExtension->ReaderExtension;
 
 	// send "APDU" meessage.
-	unsigned char mty = 0x01;	// MTY 0x01(APDU)
+	unsigned char mty = JCOP_MSG_MTY_APDU;	// MTY 0x01(APDU)
 	unsigned char nad = 0x00;	// NAD
 
 	status = sendMessage(
@@ -511,13 +599,13 @@ static NTSTATUS transmitT0(IN PSMARTCARD_EXTENSION pSmartcardExtension)
 	    pSmartcardExtension->SmartcardReply.BufferLength
 	);
 	if (status != STATUS_SUCCESS) {
-		dbg_log("sendApduMessage failed! - status: 0x%08X", status);
+		dbg_err("sendApduMessage failed! - status: 0x%08X", status);
 		return status;
 	}
 
 	status = SmartcardT0Reply(pSmartcardExtension);
 	if (status != STATUS_SUCCESS) {
-		dbg_log("SmartcardT0Reply failed! - status: 0x%08X", status);
+		dbg_err("SmartcardT0Reply failed! - status: 0x%08X", status);
 		return status;
 	}
 
@@ -549,7 +637,7 @@ static NTSTATUS transmitT1(IN PSMARTCARD_EXTENSION pSmartcardExtension)
 
 		status = SmartcardT1Request(pSmartcardExtension);
 		if (status != STATUS_SUCCESS) {
-			dbg_log("SmartcardT0Request failed! - status: 0x%08X", status);
+			dbg_err("SmartcardT0Request failed! - status: 0x%08X", status);
 			return status;
 		}
 		dbg_log("transmitT1 SEND: ");
@@ -563,7 +651,7 @@ static NTSTATUS transmitT1(IN PSMARTCARD_EXTENSION pSmartcardExtension)
 		PREADER_EXTENSION pReaderExtension = pSmartcardExtension->ReaderExtension;
 
 		// send "T1" meessage.
-		unsigned char mty = 0x11;	// MTY 0x11(T1 Message)
+		unsigned char mty = JCOP_MSG_MTY_T1;	// MTY 0x11(T1 Message)
 		unsigned char nad = 0x00;	// NAD
 
 		status = sendMessage(
@@ -586,7 +674,7 @@ static NTSTATUS transmitT1(IN PSMARTCARD_EXTENSION pSmartcardExtension)
 		    pSmartcardExtension->SmartcardReply.BufferLength
 		);
 		if (status != STATUS_SUCCESS) {
-			dbg_log("sendApduMessage failed! - status: 0x%08X", status);
+			dbg_err("sendApduMessage failed! - status: 0x%08X", status);
 			return status;
 		}
 
@@ -595,7 +683,7 @@ static NTSTATUS transmitT1(IN PSMARTCARD_EXTENSION pSmartcardExtension)
 
 	} while (status == STATUS_MORE_PROCESSING_REQUIRED);
 	if (status != STATUS_SUCCESS) {
-		dbg_log("SmartcardT0Reply failed! - status: 0x%08X", status);
+		dbg_err("SmartcardT0Reply failed! - status: 0x%08X", status);
 		return status;
 	}
 
@@ -603,6 +691,78 @@ static NTSTATUS transmitT1(IN PSMARTCARD_EXTENSION pSmartcardExtension)
 	return status;
 }
 
+/*!
+ * \brief Function performs data transmissions T=1 at APDU level.<br>
+ * <br>
+ * The whole C-APDU is sent in a MTY 0x12 message and jcop_proxy answers
+ * the whole R-APDU, instead of exchanging every T=1 block made by
+ * SmartcardT1Request and SmartcardT1Reply. The blocks are never seen by the
+ * caller, so the I-block sequence of the smart card library is left as is.
+ * <br>
+ * \param [in] pSmartcardExtension A pointer to the smart card extension,
+		SMARTCARD_EXTENSION, of the device.
+ *
+ * \retval STATUS_SUCCESS the routine successfully end.
+ * \retval STATUS_INVALID_PARAMETER The request has no C-APDU.
+ * \retval STATUS_BUFFER_TOO_SMALL The reply buffer is too small.
+ */
+static NTSTATUS transmitT1Apdu(IN PSMARTCARD_EXTENSION pSmartcardExtension)
+{
+	dbg_log("transmitT1Apdu start");
+	NTSTATUS status = STATUS_SUCCESS;
+
+	// RequestBuffer: SCARD_IO_REQUEST | C-APDU
+	// ReplyBuffer: SCARD_IO_REQUEST | R-APDU
+	ULONG requestLen = pSmartcardExtension->IoRequest.RequestBufferLength;
+	ULONG replyLen = pSmartcardExtension->IoRequest.ReplyBufferLength;
+	if (requestLen <= sizeof(SCARD_IO_REQUEST)) {
+		dbg_err("STATUS_INVALID_PARAMETER - RequestBufferLength: %d", requestLen);
+		return STATUS_INVALID_PARAMETER;
+	}
+	if (replyLen < sizeof(SCARD_IO_REQUEST) + 2) {
+		dbg_err("STATUS_BUFFER_TOO_SMALL - ReplyBufferLength: %d", replyLen);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+	ULONG apduLen = requestLen - sizeof(SCARD_IO_REQUEST);
+	if (apduLen > 0xFFFF) {
+		dbg_err("STATUS_INVALID_BUFFER_SIZE - apduLen: %d", apduLen);
+		return STATUS_INVALID_BUFFER_SIZE;
+	}
+	ULONG rcvLenExp = replyLen - sizeof(SCARD_IO_REQUEST);
+	if (rcvLenExp > 0xFFFF) {
+		rcvLenExp = 0xFFFF;
+	}
+
+	// send "T1 APDU" meessage.
+	unsigned char mty = JCOP_MSG_MTY_T1_APDU;	// MTY 0x12(T1 APDU Message)
+	unsigned char nad = pSmartcardExtension->T1.NAD;	// T=1 NAD, the proxy routes by it.
+	unsigned short rcvLen = 0;
+
+	status = sendMessage(
+	             pSmartcardExtension->ReaderExtension,
+	             mty,
+	             nad,
+	             (char *)pSmartcardExtension->IoRequest.RequestBuffer + sizeof(SCARD_IO_REQUEST),
+	             (unsigned short)apduLen,
+	             (char *)pSmartcardExtension->IoRequest.ReplyBuffer + sizeof(SCARD_IO_REQUEST),
+	             (unsigned short)rcvLenExp,
+	             &rcvLen,
+	             NULL	// wait indefinitely
+	         );
+	if (status != STATUS_SUCCESS) {
+		dbg_err("sendMessage failed! - status: 0x%08X", status);
+		return status;
+	}
+
+	PSCARD_IO_REQUEST pReplyHeader = (PSCARD_IO_REQUEST)pSmartcardExtension->IoRequest.ReplyBuffer;
+	pReplyHeader->dwProtocol = SCARD_PROTOCOL_T1;
+	pReplyHeader->cbPciLength = sizeof(SCARD_IO_REQUEST);
+	*pSmartcardExtension->IoRequest.Information = sizeof(SCARD_IO_REQUEST) + rcvLen;
+
+	dbg_log("transmitT1Apdu end - status: 0x%08X", status);
+	return status;
+}
+
 /*!
  * \brief Entry point for RDF_TRANSMIT.<br>
  * <br>
@@ -651,7 +811,11 @@ NTSTATUS VR_RDF_Transmit(IN PSMARTCARD_EXTENSION pSmartcardExtension)
 			break;
 		case SCARD_PROTOCOL_T1 :
 			dbg_log("SCARD_PROTOCOL_T1");
-			status = transmitT1(pSmartcardExtension);
+			if ((pSmartcardExtension->ReaderExtension->options & JCOP_PROXY_OPTION_APDU_T1) != 0) {
+				status = transmitT1Apdu(pSmartcardExtension);
+			} else {
+				status = transmitT1(pSmartcardExtension);
+			}
 			break;
 		case SCARD_PROTOCOL_RAW :
 			dbg_log("SCARD_PROTOCOL_RAW");
@@ -670,6 +834,69 @@ NTSTATUS VR_RDF_Transmit(IN PSMARTCARD_EXTENSION pSmartcardExtension)
 	return status;
 }
 
+/*!
+ * \brief Entry point for RDF_IOCTL_VENDOR.<br>
+ * <br>
+ * IOCTL_JCOP_VR_TRANSMIT_BATCH sends a batch of C-APDUs to jcop_proxy in
+ * one message (MTY 0x13) and answers their R-APDUs.
+ * <br>
+ * \param [in] pSmartcardExtension A pointer to the smart card extension,
+		SMARTCARD_EXTENSION, of the device.
+ *
+ * \retval STATUS_SUCCESS the routine successfully end.
+ * \retval STATUS_INVALID_DEVICE_REQUEST The IOCTL is not supported.
+ * \retval STATUS_INVALID_DEVICE_STATE The card is not powered.
+ * \retval STATUS_INVALID_PARAMETER The request has no batch header.
+ */
+NTSTATUS VR_RDF_Vendor(IN PSMARTCARD_EXTENSION pSmartcardExtension)
+{
+	dbg_log("VR_RDF_Vendor start");
+	NTSTATUS status;
+
+	if (pSmartcardExtension->MajorIoControlCode != IOCTL_JCOP_VR_TRANSMIT_BATCH) {
+		dbg_log("IOCTL_XXXXX(unknown vendor): 0x%08X", pSmartcardExtension->MajorIoControlCode);
+		return STATUS_INVALID_DEVICE_REQUEST;
+	}
+	if (pSmartcardExtension->ReaderCapabilities.CurrentState < SCARD_NEGOTIABLE) {
+		dbg_err("STATUS_INVALID_DEVICE_STATE - CurrentState: %d", pSmartcardExtension->ReaderCapabilities.CurrentState);
+		return STATUS_INVALID_DEVICE_STATE;
+	}
+	ULONG requestLen = pSmartcardExtension->IoRequest.RequestBufferLength;
+	if (requestLen < JCOP_MSG_BATCH_HEADER_SIZE || requestLen > 0xFFFF) {
+		dbg_err("STATUS_INVALID_PARAMETER - RequestBufferLength: %d", requestLen);
+		return STATUS_INVALID_PARAMETER;
+	}
+	ULONG rcvLenExp = pSmartcardExtension->IoRequest.ReplyBufferLength;
+	if (rcvLenExp > 0xFFFF) {
+		rcvLenExp = 0xFFFF;
+	}
+
+	// send "Batch" message.
+	unsigned char mty = JCOP_MSG_MTY_BATCH;	// MTY 0x13(Batch Message)
+	unsigned char nad = 0x00;	// NAD
+	unsigned short rcvLen = 0;
+
+	status = sendMessage(
+	             pSmartcardExtension->ReaderExtension,
+	             mty,
+	             nad,
+	             (char *)pSmartcardExtension->IoRequest.RequestBuffer,
+	             (unsigned short)requestLen,
+	             (char *)pSmartcardExtension->IoRequest.ReplyBuffer,
+	             (unsigned short)rcvLenExp,
+	             &rcvLen,
+	             NULL	// wait indefinitely
+	         );
+	if (status != STATUS_SUCCESS) {
+		dbg_err("sendMessage failed! - status: 0x%08X", status);
+		return status;
+	}
+	*pSmartcardExtension->IoRequest.Information = rcvLen;
+
+	dbg_log("VR_RDF_Vendor end - status: 0x%08X", status);
+	return status;
+}
+
 /*!
  * \brief Cancel routine for RDF_CARD_TRACKING.<br>
  * <br>
@@ -779,20 +1006,24 @@ static NTSTATUS createReaderDevice(IN PDEVICE_OBJECT pDeviceObject, IN PUNICODE_
 	pReaderExtension = (PREADER_EXTENSION)ExAllocatePool(NonPagedPool, sizeof(READER_EXTENSION));
 	if (pReaderExtension == NULL) {
 		status = STATUS_INSUFFICIENT_RESOURCES;
-		dbg_log("ExAllocatePool failed! - pReaderExtension == NULL");
+		dbg_err("ExAllocatePool failed! - pReaderExtension == NULL");
 		return status;
 	}
+	RtlZeroMemory(pReaderExtension, sizeof(READER_EXTENSION));
+	LARGE_INTEGER freq;
+	KeQueryPerformanceCounter(&freq);
+	JCOP_PERF_reset(&pReaderExtension->perf, (JCOP_PERF_UINT64)freq.QuadPart);
 	pSmartcardExtension->ReaderExtension = pReaderExtension;
 
 	// allocate the send & receive buffer.
 	pReaderExtension->pSndBuffer = (PCHAR)ExAllocatePool(NonPagedPool, JCOP_PROXY_BUFFER_SIZE);
 	if (pReaderExtension->pSndBuffer == NULL) {
-		dbg_log("ExAllocatePoolWithTag Error! pSndBuffer == NULL\r\n");
+		dbg_err("ExAllocatePoolWithTag Error! pSndBuffer == NULL\r\n");
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 	pReaderExtension->pRcvBuffer = (PCHAR)ExAllocatePool(NonPagedPool, JCOP_PROXY_BUFFER_SIZE);
 	if (pReaderExtension->pRcvBuffer == NULL) {
-		dbg_log("ExAllocatePoolWithTag Error! pRcvBuffer == NULL\r\n");
+		dbg_err("ExAllocatePoolWithTag Error! pRcvBuffer == NULL\r\n");
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 
@@ -803,6 +1034,7 @@ static NTSTATUS createReaderDevice(IN PDEVICE_OBJECT pDeviceObject, IN PUNICODE_
 	pSmartcardExtension->ReaderFunction[RDF_SET_PROTOCOL] = VR_RDF_SetProtocol;
 	pSmartcardExtension->ReaderFunction[RDF_TRANSMIT] = VR_RDF_Transmit;
 	pSmartcardExtension->ReaderFunction[RDF_CARD_TRACKING] = VR_RDF_CardTracking;
+	pSmartcardExtension->ReaderFunction[RDF_IOCTL_VENDOR] = VR_RDF_Vendor;
 
 	// setup smartcard extension - vendor attribute
 	RtlCopyMemory(pSmartcardExtension->VendorAttr.VendorName.Buffer,
@@ -844,14 +1076,14 @@ static NTSTATUS createReaderDevice(IN PDEVICE_OBJECT pDeviceObject, IN PUNICODE_
 	pSmartcardExtension->SmartcardReply.BufferSize = MIN_BUFFER_SIZE;
 	status = SmartcardInitialize(pSmartcardExtension);
 	if (status != STATUS_SUCCESS) {
-		dbg_log("SmartcardInitialize failed! - status: 0x%08X", status);
+		dbg_err("SmartcardInitialize failed! - status: 0x%08X", status);
 		return status;
 	}
 
 	// invoke SmartcardCreateLink
 	status = SmartcardCreateLink(&(pDeviceExtension->linkName), pDeviceName);
 	if (status != STATUS_SUCCESS) {
-		dbg_log("SmartcardCreateLink failed! - status: 0x%08X", status);
+		dbg_err("SmartcardCreateLink failed! - status: 0x%08X", status);
 		return status;
 	}
 
@@ -966,7 +1198,7 @@ NTSTATUS VR_IoControl(IN PDEVICE_OBJECT pDeviceObject, IN PIRP pIrp)
 		                                   NULL
 		                                  );
 		if (status != STATUS_SUCCESS) {
-			dbg_log("ObReferenceObjectByHandle failed! - status: 0x%08X", status);
+			dbg_err("ObReferenceObjectByHandle failed! - status: 0x%08X", status);
 			return status;
 		}
 		dbg_log("pReaderExtension->hEventSnd: 0x%08X", pReaderExtension->hEventSnd);
@@ -981,17 +1213,110 @@ NTSTATUS VR_IoControl(IN PDEVICE_OBJECT pDeviceObject, IN PIRP pIrp)
 		                                   NULL
 		                                  );
 		if (status != STATUS_SUCCESS) {
-			dbg_log("ObReferenceObjectByHandle failed! - status: 0x%08X", status);
+			dbg_err("ObReferenceObjectByHandle failed! - status: 0x%08X", status);
 			return status;
 		}
 
 		dbg_log("pReaderExtension->hEventRcv: 0x%08X", pReaderExtension->hEventRcv);
+
+		// a new jcop_proxy exchanges T=1 blocks until it sets its options.
+		pReaderExtension->options = 0;
 		status = STATUS_SUCCESS;
 
 		pIrp->IoStatus.Status = status;
 		pIrp->IoStatus.Information = 0;
 		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
 
+	} else if (pIoStackIrp->Parameters.DeviceIoControl.IoControlCode == IOCTL_JCOP_PROXY_SET_LOG_LEVELS) {
+
+		// set debug output levels IO control code.
+
+		dbg_log("IOCTL_SET_LOG_LEVELS");
+
+		if (pIoStackIrp->Parameters.DeviceIoControl.InputBufferLength < sizeof(JCOP_PROXY_LOG_LEVELS)) {
+			dbg_err("pIoStackIrp->Parameters.DeviceIoControl.InputBufferLength < sizeof(JCOP_PROXY_LOG_LEVELS)");
+			status = STATUS_INVALID_PARAMETER;
+		} else {
+			PJCOP_PROXY_LOG_LEVELS pLevels = (PJCOP_PROXY_LOG_LEVELS)pIrp->AssociatedIrp.SystemBuffer;
+			dbg_setLevels(pLevels->levels);
+			status = STATUS_SUCCESS;
+		}
+
+		pIrp->IoStatus.Status = status;
+		pIrp->IoStatus.Information = 0;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	} else if (pIoStackIrp->Parameters.DeviceIoControl.IoControlCode == IOCTL_JCOP_PROXY_SET_OPTIONS) {
+
+		// set options IO control code.
+
+		dbg_log("IOCTL_SET_OPTIONS");
+
+		if (pIoStackIrp->Parameters.DeviceIoControl.InputBufferLength < sizeof(JCOP_PROXY_OPTIONS)) {
+			dbg_err("pIoStackIrp->Parameters.DeviceIoControl.InputBufferLength < sizeof(JCOP_PROXY_OPTIONS)");
+			status = STATUS_INVALID_PARAMETER;
+		} else {
+			PJCOP_PROXY_OPTIONS pOptions = (PJCOP_PROXY_OPTIONS)pIrp->AssociatedIrp.SystemBuffer;
+			pDeviceExtension->smartcardExtension.ReaderExtension->options = pOptions->flags;
+			dbg_log("options: 0x%08X", pOptions->flags);
+			status = STATUS_SUCCESS;
+		}
+
+		pIrp->IoStatus.Status = status;
+		pIrp->IoStatus.Information = 0;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	} else if (pIoStackIrp->Parameters.DeviceIoControl.IoControlCode == IOCTL_JCOP_PROXY_GET_PERF_COUNTERS) {
+
+		// get every transfer counter IO control code.
+
+		dbg_log("IOCTL_GET_PERF_COUNTERS");
+
+		PREADER_EXTENSION pReaderExtension = pDeviceExtension->smartcardExtension.ReaderExtension;
+		ULONG_PTR information = 0;
+		if (pIoStackIrp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(JCOP_PERF_COUNTERS)) {
+			dbg_err("pIoStackIrp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(JCOP_PERF_COUNTERS)");
+			status = STATUS_BUFFER_TOO_SMALL;
+		} else {
+			RtlCopyMemory(pIrp->AssociatedIrp.SystemBuffer, &pReaderExtension->perf, sizeof(JCOP_PERF_COUNTERS));
+			information = sizeof(JCOP_PERF_COUNTERS);
+			status = STATUS_SUCCESS;
+		}
+
+		pIrp->IoStatus.Status = status;
+		pIrp->IoStatus.Information = information;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+	} else if (pIoStackIrp->Parameters.DeviceIoControl.IoControlCode == IOCTL_SMARTCARD_GET_PERF_CNTR) {
+
+		// smart card performance counters IO control code.
+		// answered from the transfer counters of the driver (smclib does not
+		// count the transfers of a virtual reader).
+
+		dbg_log("IOCTL_SMARTCARD_GET_PERF_CNTR");
+
+		PREADER_EXTENSION pReaderExtension = pDeviceExtension->smartcardExtension.ReaderExtension;
+		ULONG_PTR information = 0;
+		if (pIoStackIrp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(PERF_INFO)) {
+			dbg_err("pIoStackIrp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(PERF_INFO)");
+			status = STATUS_BUFFER_TOO_SMALL;
+		} else {
+			PPERF_INFO pPerfInfo = (PPERF_INFO)pIrp->AssociatedIrp.SystemBuffer;
+			RtlZeroMemory(pPerfInfo, sizeof(PERF_INFO));
+			pPerfInfo->NumTransmissions = (ULONG)pReaderExtension->perf.transmits;
+			pPerfInfo->BytesSent = (ULONG)pReaderExtension->perf.bytesSent;
+			pPerfInfo->BytesReceived = (ULONG)pReaderExtension->perf.bytesReceived;
+			// in system clock ticks as smclib counts it, not performance counter ticks.
+			pPerfInfo->IoTickCount.QuadPart =
+			    (LONGLONG)(JCOP_PERF_getWaitTime(&pReaderExtension->perf) / KeQueryTimeIncrement());
+			information = sizeof(PERF_INFO);
+			status = STATUS_SUCCESS;
+		}
+
+		pIrp->IoStatus.Status = status;
+		pIrp->IoStatus.Information = information;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
 	} else {
 
 		// smart card related IO control code.
@@ -1034,9 +1359,6 @@ NTSTATUS VR_IoControl(IN PDEVICE_OBJECT pDeviceObject, IN PIRP pIrp)
 			case IOCTL_SMARTCARD_GET_LAST_ERROR :
 				dbg_log("IOCTL_SMARTCARD_GET_LAST_ERROR");
 				break;
-			case IOCTL_SMARTCARD_GET_PERF_CNTR :
-				dbg_log("IOCTL_SMARTCARD_GET_PERF_CNTR");
-				break;
 			default :
 				dbg_log("IOCTL_XXXXX(unknown): 0x%08X", pSmartcardExtension->MajorIoControlCode);
 		}
@@ -1049,7 +1371,7 @@ NTSTATUS VR_IoControl(IN PDEVICE_OBJECT pDeviceObject, IN PIRP pIrp)
 		status = STATUS_SUCCESS;
 		status = SmartcardAcquireRemoveLock(pSmartcardExtension);
 		if (status != STATUS_SUCCESS) {
-			dbg_log("SmartcardAcquireRemoveLock failed! - status: 0x%08X", status);
+			dbg_err("SmartcardAcquireRemoveLock failed! - status: 0x%08X", status);
 			pSmartcardExtension->IoRequest.Information = 0;
 			return status;
 		}
@@ -1152,6 +1474,21 @@ NTSTATUS VR_WriteBufferedIO(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 
+	PSMARTCARD_EXTENSION pSmartcardExtension = &pDeviceExtension->smartcardExtension;
+	PREADER_EXTENSION pReaderExtension = pSmartcardExtension->ReaderExtension;
+
+	// no system buffer is allocated for an empty message.
+	// sendMessage rejects it as a malformed message.
+	if (pIoStackIrp->Parameters.Write.Length == 0) {
+		dbg_log("empty message\r\n");
+		pReaderExtension->iRcvLen = 0;
+		status = STATUS_SUCCESS;
+		pIrp->IoStatus.Status = status;
+		pIrp->IoStatus.Information = 0;
+		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+		return status;
+	}
+
 	// use Buffered I/O.
 	PCHAR pWriteDataBuffer = (PCHAR)pIrp->AssociatedIrp.SystemBuffer;
 	if (pWriteDataBuffer == NULL) {
@@ -1165,9 +1502,6 @@ NTSTATUS VR_WriteBufferedIO(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
 		return STATUS_BUFFER_TOO_SMALL;
 	}
 
-	PSMARTCARD_EXTENSION pSmartcardExtension = &pDeviceExtension->smartcardExtension;
-	PREADER_EXTENSION pReaderExtension = pSmartcardExtension->ReaderExtension;
-
 	// copy data from user-mode ap's buffer to pRcvBuffer.
 	RtlCopyMemory(pReaderExtension->pRcvBuffer, pWriteDataBuffer, pIoStackIrp->Parameters.Write.Length);
 	status = STATUS_SUCCESS;
@@ -1238,6 +1572,7 @@ VOID VR_Unload(IN PDRIVER_OBJECT pDriverObject)
 	RtlFreeUnicodeString(&(pDeviceExtension->linkName));
 
 	dbg_log("VR_Unload end");
+	dbg_exit();
 }
 
 /*!
@@ -1272,7 +1607,7 @@ static NTSTATUS addDevice(IN PDRIVER_OBJECT pDriverObject, IN PDEVICE_OBJECT pPh
 	                      &pDeviceObject
 	                  );
 	if (status != STATUS_SUCCESS) {
-		dbg_log("IoCreateDevice failed! - status: 0x%08X", status);
+		dbg_err("IoCreateDevice failed! - status: 0x%08X", status);
 		return status;
 	}
 
@@ -1282,7 +1617,7 @@ static NTSTATUS addDevice(IN PDRIVER_OBJECT pDriverObject, IN PDEVICE_OBJECT pPh
 	// calling createReaderDevice function.
 	status = createReaderDevice(pDeviceObject, &usDeviceName);
 	if (status != STATUS_SUCCESS) {
-		dbg_log("createReaderDevice failed! - status: 0x%08X", status);
+		dbg_err("createReaderDevice failed! - status: 0x%08X", status);
 		// error handling is performed at only this point.
 		VR_Unload(pDriverObject);
 		return status;
@@ -1291,7 +1626,7 @@ static NTSTATUS addDevice(IN PDRIVER_OBJECT pDriverObject, IN PDEVICE_OBJECT pPh
 	// create symblic link.
 	status = IoCreateSymbolicLink(&usDosDeviceName, &usDeviceName);
 	if (status != STATUS_SUCCESS) {
-		dbg_log("IoCreateSymbolicLink failed! - status: 0x%08X", status);
+		dbg_err("IoCreateSymbolicLink failed! - status: 0x%08X", status);
 		// error handling is performed at only this point.
 		VR_Unload(pDriverObject);
 	}
@@ -1317,6 +1652,8 @@ static NTSTATUS addDevice(IN PDRIVER_OBJECT pDriverObject, IN PDEVICE_OBJECT pPh
  */
 NTSTATUS DriverEntry(IN PDRIVER_OBJECT pDriverObject, IN PUNICODE_STRING pRegistryPath)
 {
+	// start the debug output consumer.
+	dbg_init();
 	dbg_log("DriverEntry start");
 
 	// tell the system our entry points
@@ -1335,5 +1672,9 @@ NTSTATUS DriverEntry(IN PDRIVER_OBJECT pDriverObject, IN PUNICODE_STRING pRegist
 	NTSTATUS status = addDevice(pDriverObject, NULL);
 
 	dbg_log("DriverEntry end - status: 0x%08X", status);
+	if (!NT_SUCCESS(status)) {
+		// VR_Unload is not called when DriverEntry fails.
+		dbg_exit();
+	}
 	return status;
 }
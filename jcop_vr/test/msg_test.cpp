@@ -0,0 +1,170 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*!
+ * \file msg_test.cpp
+ * \brief round trip test of the driver/proxy message framing (jcop_msg.h).
+ * \author Kenichi Kanai
+ *
+ * jcop_msg.h depends on no OS header, so the test is built on the host
+ * (see README) and exits with 1 if a check fails.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "jcop_msg.h"
+
+#define CHECK(cond) check((cond) != 0, #cond, __LINE__)
+
+static int g_failures = 0;
+
+static void check(bool const isOk, char const *const pCond, int const line)
+{
+	if (!isOk) {
+		printf("line %d: %s failed\n", line, pCond);
+		g_failures++;
+	}
+}
+
+static unsigned char const g_mtys[] = {
+	JCOP_MSG_MTY_WAIT_FOR_CARD, JCOP_MSG_MTY_APDU, JCOP_MSG_MTY_T1, JCOP_MSG_MTY_T1_APDU,
+	JCOP_MSG_MTY_BATCH, JCOP_MSG_MTY_CLOSE, JCOP_MSG_MTY_ERROR
+};
+
+// payload lengths around the byte boundaries of LNH LNL.
+static unsigned short const g_lengths[] = {
+	0, 1, 4, 255, 256, 257, 4092, 4096, 0x7FFF, 0x8000, 0xFFFE, 0xFFFF
+};
+
+static char g_msg[JCOP_MSG_HEADER_SIZE + 0xFFFF + JCOP_MSG_TIMING_SIZE];
+
+static void test_header(void)
+{
+	for (unsigned int i = 0; i < sizeof(g_mtys); i++) {
+		for (unsigned int j = 0; j < sizeof(g_lengths) / sizeof(g_lengths[0]); j++) {
+			unsigned short len = g_lengths[j];
+			unsigned char nad = (unsigned char)(0x21 + j);
+			unsigned long msgLen = JCOP_MSG_setHeader(g_msg, g_mtys[i], nad, len);
+			CHECK(msgLen == (unsigned long)len + JCOP_MSG_HEADER_SIZE);
+			CHECK((unsigned char)g_msg[0] == g_mtys[i]);
+			CHECK((unsigned char)g_msg[1] == nad);
+			CHECK(JCOP_MSG_getLength(g_msg) == len);
+			CHECK(JCOP_MSG_isValid(g_msg, msgLen) == 1);
+			CHECK(JCOP_MSG_isValid(g_msg, msgLen - 1) == 0);	// truncated.
+			CHECK(JCOP_MSG_isValid(g_msg, msgLen + 1) == 0);	// trailing byte.
+		}
+	}
+	CHECK(JCOP_MSG_isValid(g_msg, JCOP_MSG_HEADER_SIZE - 1) == 0);
+}
+
+static void test_error(void)
+{
+	static unsigned long const codes[] = {
+		JCOP_MSG_ERROR_INITIALIZE, JCOP_MSG_ERROR_TIMEOUT, JCOP_MSG_ERROR_BAD_MESSAGE,
+		JCOP_MSG_ERROR_IO, 0x00000000, 0x80000001, 0xFFFFFFFF
+	};
+	for (unsigned int i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
+		unsigned long msgLen = JCOP_MSG_encodeError(g_msg, 0x12, codes[i]);
+		CHECK(msgLen == JCOP_MSG_HEADER_SIZE + JCOP_MSG_ERROR_PAYLOAD_SIZE);
+		CHECK((unsigned char)g_msg[1] == 0x12);
+		unsigned long code = 0x55555555;
+		CHECK(JCOP_MSG_decodeError(g_msg, msgLen, &code) == 1);
+		CHECK(code == codes[i]);
+	}
+
+	// not an error message: pCode is kept.
+	unsigned long code = 0x55555555;
+	unsigned long msgLen = JCOP_MSG_setHeader(g_msg, JCOP_MSG_MTY_APDU, 0x00, JCOP_MSG_ERROR_PAYLOAD_SIZE);
+	CHECK(JCOP_MSG_decodeError(g_msg, msgLen, &code) == 0);
+	msgLen = JCOP_MSG_setHeader(g_msg, JCOP_MSG_MTY_ERROR, 0x00, JCOP_MSG_ERROR_PAYLOAD_SIZE + 1);
+	CHECK(JCOP_MSG_decodeError(g_msg, msgLen, &code) == 0);
+	msgLen = JCOP_MSG_encodeError(g_msg, 0x00, JCOP_MSG_ERROR_OTHER);
+	CHECK(JCOP_MSG_decodeError(g_msg, msgLen - 1, &code) == 0);
+	CHECK(code == 0x55555555);
+}
+
+static void test_batch(void)
+{
+	// ABORT_MASK ABORT_SW | 01 00 00 05 C-APDU | 01 00 00 00
+	char payload[JCOP_MSG_BATCH_HEADER_SIZE + 9 + 4];
+	memset(payload, 0, sizeof(payload));
+	unsigned long offset = JCOP_MSG_BATCH_HEADER_SIZE;
+	offset += JCOP_MSG_setHeader(payload + offset, JCOP_MSG_MTY_APDU, 0x00, 5);
+	unsigned long last = offset;
+	offset += JCOP_MSG_setHeader(payload + offset, JCOP_MSG_MTY_APDU, 0x00, 0);
+	CHECK(offset == sizeof(payload));
+
+	CHECK(JCOP_MSG_getBatchItem(payload, sizeof(payload), JCOP_MSG_BATCH_HEADER_SIZE) == 9);
+	CHECK(JCOP_MSG_getBatchItem(payload, sizeof(payload), last) == JCOP_MSG_HEADER_SIZE);
+	CHECK(JCOP_MSG_getBatchItem(payload, sizeof(payload), sizeof(payload)) == 0);	// the end.
+	CHECK(JCOP_MSG_getBatchItem(payload, sizeof(payload) - 1, last) == 0);	// truncated header.
+	CHECK(JCOP_MSG_getBatchItem(payload, last - 1, JCOP_MSG_BATCH_HEADER_SIZE) == 0);	// truncated data.
+}
+
+static void test_timing(void)
+{
+	JCOP_MSG_TIMING timing;
+	timing.magic = JCOP_MSG_TIMING_MAGIC;
+	timing.seq = 0x01020304;
+	timing.sentLow = 0xFFFFFFFF;
+	timing.sentHigh = 0x00000001;
+	timing.wokenLow = 0;
+	timing.wokenHigh = 0;
+
+	for (unsigned int j = 0; j < sizeof(g_lengths) / sizeof(g_lengths[0]); j++) {
+		unsigned long msgLen = JCOP_MSG_setHeader(g_msg, JCOP_MSG_MTY_T1_APDU, 0x00, g_lengths[j]);
+		unsigned long totalLen = JCOP_MSG_setTiming(g_msg, msgLen, &timing);
+		CHECK(totalLen == msgLen + JCOP_MSG_TIMING_SIZE);
+		JCOP_MSG_TIMING decoded;
+		memset(&decoded, 0, sizeof(decoded));
+		CHECK(JCOP_MSG_getTiming(g_msg, totalLen, &decoded) == 1);
+		CHECK(memcmp(&decoded, &timing, sizeof(timing)) == 0);
+		CHECK(JCOP_MSG_getTiming(g_msg, msgLen, &decoded) == 0);	// no trailer.
+		CHECK(JCOP_MSG_isValid(g_msg, totalLen - JCOP_MSG_TIMING_SIZE) == 1);
+	}
+
+	// a trailer without the magic is not a trailer.
+	timing.magic = 0;
+	unsigned long msgLen = JCOP_MSG_setHeader(g_msg, JCOP_MSG_MTY_APDU, 0x00, 5);
+	unsigned long totalLen = JCOP_MSG_setTiming(g_msg, msgLen, &timing);
+	JCOP_MSG_TIMING decoded;
+	CHECK(JCOP_MSG_getTiming(g_msg, totalLen, &decoded) == 0);
+}
+
+int main(void)
+{
+	test_header();
+	test_error();
+	test_batch();
+	test_timing();
+	if (g_failures > 0) {
+		printf("%d checks failed\n", g_failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
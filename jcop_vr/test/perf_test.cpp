@@ -0,0 +1,189 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*!
+ * \file perf_test.cpp
+ * \brief test of the transfer counters (perf_cntr.h).
+ * \author Kenichi Kanai
+ *
+ * perf_cntr.h depends on no OS header, so the test is built on the host
+ * (see README) and exits with 1 if a check fails.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "perf_cntr.h"
+
+#define CHECK(cond) check((cond) != 0, #cond, __LINE__)
+
+#define FREQUENCY 3579545	// ACPI PM timer.
+
+static int g_failures = 0;
+
+static void check(bool const isOk, char const *const pCond, int const line)
+{
+	if (!isOk) {
+		printf("line %d: %s failed\n", line, pCond);
+		g_failures++;
+	}
+}
+
+/*!
+ * \brief Function counts a request of the payload given in hex.<br>
+ */
+static void count(JCOP_PERF_COUNTERS *const pCounters, unsigned char const mty, char const *const pHex)
+{
+	char msg[JCOP_MSG_HEADER_SIZE + 256];
+	unsigned short len = 0;
+	for (char const *p = pHex; p[0] != '\0' && p[1] != '\0'; p += 2) {
+		unsigned int b;
+		sscanf(p, "%2x", &b);
+		msg[JCOP_MSG_HEADER_SIZE + len++] = (char)b;
+	}
+	JCOP_MSG_setHeader(msg, mty, 0x00, len);
+	JCOP_PERF_countRequest(pCounters, msg);
+}
+
+static void test_reset(void)
+{
+	JCOP_PERF_COUNTERS counters;
+	memset(&counters, 0xA5, sizeof(counters));
+	JCOP_PERF_reset(&counters, FREQUENCY);
+	CHECK(counters.frequency == FREQUENCY);
+	CHECK(counters.transmits == 0);
+	CHECK(counters.bytesSent == 0);
+	CHECK(counters.waitTicks == 0);
+	CHECK(counters.prefetchTicks == 0);
+	CHECK(counters.laneWaitTicks[JCOP_PERF_LANES - 1] == 0);
+}
+
+static void test_requests(void)
+{
+	JCOP_PERF_COUNTERS c;
+	JCOP_PERF_reset(&c, FREQUENCY);
+
+	count(&c, JCOP_MSG_MTY_WAIT_FOR_CARD, "00000000");
+	CHECK(c.resets == 1);
+	CHECK(c.transmits == 0);
+	CHECK(c.bytesSent == 4);
+
+	count(&c, JCOP_MSG_MTY_APDU, "80CA9F7F00");
+	count(&c, JCOP_MSG_MTY_T1_APDU, "00A4040000");
+	CHECK(c.transmits == 2);
+	CHECK(c.bytesSent == 14);
+
+	// I-block, I-block with M, R-block, S-block (IFS request), and a block too short.
+	count(&c, JCOP_MSG_MTY_T1, "00000580CA9F7F00");
+	count(&c, JCOP_MSG_MTY_T1, "0020020000");
+	count(&c, JCOP_MSG_MTY_T1, "00900000");
+	count(&c, JCOP_MSG_MTY_T1, "00C101FE");
+	count(&c, JCOP_MSG_MTY_T1, "00");
+	CHECK(c.t1Blocks == 5);
+	CHECK(c.transmits == 3);
+	CHECK(c.chainingRounds == 2);
+
+	count(&c, JCOP_MSG_MTY_CLOSE, "");
+	CHECK(c.resets == 1);
+	CHECK(c.transmits == 3);
+	CHECK(c.errors == 0);
+
+	// the C-APDUs of a batch are counted when they are answered.
+	count(&c, JCOP_MSG_MTY_BATCH, "F0006000" "0100000580CA9F7F00" "0100000500A4040000");
+	CHECK(c.transmits == 3);
+}
+
+static void test_batch_answers(void)
+{
+	JCOP_PERF_COUNTERS c;
+	JCOP_PERF_reset(&c, FREQUENCY);
+
+	// two R-APDUs.
+	char const answer[] = { 0x01, 0x00, 0x00, 0x02, (char)0x90, 0x00, 0x01, 0x00, 0x00, 0x02, 0x6A, (char)0x82 };
+	JCOP_PERF_countBatchAnswer(&c, answer, sizeof(answer));
+	CHECK(c.transmits == 2);
+	CHECK(c.errors == 0);
+
+	// one R-APDU, then the second C-APDU failed with a timeout.
+	char partial[JCOP_MSG_HEADER_SIZE + 2 + JCOP_MSG_HEADER_SIZE + JCOP_MSG_ERROR_PAYLOAD_SIZE];
+	memcpy(partial, answer, JCOP_MSG_HEADER_SIZE + 2);
+	JCOP_MSG_encodeError(partial + JCOP_MSG_HEADER_SIZE + 2, 0x00, JCOP_MSG_ERROR_TIMEOUT);
+	JCOP_PERF_countBatchAnswer(&c, partial, sizeof(partial));
+	CHECK(c.transmits == 3);
+	CHECK(c.errors == 1);
+
+	// a truncated item is not counted.
+	JCOP_PERF_countBatchAnswer(&c, answer, sizeof(answer) - 1);
+	CHECK(c.transmits == 4);
+}
+
+static void test_answers(void)
+{
+	JCOP_PERF_COUNTERS c;
+	JCOP_PERF_reset(&c, FREQUENCY);
+	JCOP_PERF_countAnswer(&c, 258, 1000);
+	JCOP_PERF_countAnswer(&c, 2, 500);
+	JCOP_PERF_countError(&c, 1, 250);
+	JCOP_PERF_countError(&c, 0, 0);
+	CHECK(c.bytesReceived == 260);
+	CHECK(c.timeouts == 1);
+	CHECK(c.errors == 1);
+	CHECK(c.waitTicks == 1750);
+}
+
+static void test_wait_time(void)
+{
+	JCOP_PERF_COUNTERS c;
+	JCOP_PERF_reset(&c, FREQUENCY);
+	CHECK(JCOP_PERF_getWaitTime(&c) == 0);
+
+	c.waitTicks = FREQUENCY * 3;	// 3 sec.
+	CHECK(JCOP_PERF_getWaitTime(&c) == 30000000);
+	c.waitTicks = FREQUENCY * 3 + 1;	// a tick is 2.79 units of 100 nsec.
+	CHECK(JCOP_PERF_getWaitTime(&c) == 30000002);
+
+	// 10^9 seconds: waitTicks * 10^7 would overflow 64 bits.
+	c.waitTicks = (JCOP_PERF_UINT64)FREQUENCY * 1000000000;
+	CHECK(JCOP_PERF_getWaitTime(&c) == (JCOP_PERF_UINT64)1000000000 * 10000000);
+
+	c.frequency = 0;	// not known.
+	CHECK(JCOP_PERF_getWaitTime(&c) == 0);
+}
+
+int main(void)
+{
+	test_reset();
+	test_requests();
+	test_answers();
+	test_batch_answers();
+	test_wait_time();
+	if (g_failures > 0) {
+		printf("%d checks failed\n", g_failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*!
+ * \file t1_test.cpp
+ * \brief test of the T=1 engine (t1.cpp) with the mock backend.
+ * \author Kenichi Kanai
+ *
+ * The blocks of a chained exchange are counted after T1_processMsg, as
+ * jcop_proxy does, so the test checks that a request is left unchanged.
+ * It is built on the host with the user mode sources (see README) and exits
+ * with 1 if a check fails.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "osdep.h"
+#include "shared_data.h"
+#include "jcop_simul.h"
+#include "mock.h"
+#include "t1.h"
+
+#define CHECK(cond) check((cond) != 0, #cond, __LINE__)
+
+#define FREQUENCY 3579545	// ACPI PM timer.
+
+static int g_failures = 0;
+
+static void check(bool const isOk, char const *const pCond, int const line)
+{
+	if (!isOk) {
+		printf("line %d: %s failed\n", line, pCond);
+		g_failures++;
+	}
+}
+
+/*!
+ * \brief Function sends a T=1 block as the driver does and counts it after
+ * T1_processMsg as jcop_proxy does.<br>
+ * <br>
+ * \param [in,out] pCounters counters.
+ * \param [in] pcb PCB of the block to send.
+ * \param [in] pInf INF of the block to send.
+ * \param [in] len length of INF.
+ * \param [out] pRcv received block (NAD PCB LEN INF EDC).
+ * \param [out] pRcvLen length of received block.
+ */
+static void exchange(
+    JCOP_PERF_COUNTERS *const pCounters,
+    unsigned char const pcb,
+    char const *const pInf,
+    unsigned char const len,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	char snd[JCOP_MSG_HEADER_SIZE + 3 + 0xFF + 1];
+	char *pBlock = snd + JCOP_MSG_HEADER_SIZE;
+	pBlock[0] = 0x00;	// NAD
+	pBlock[1] = (char)pcb;
+	pBlock[2] = (char)len;
+	if (len != 0) {
+		memcpy(pBlock + 3, pInf, len);	// an R-block has no INF.
+	}
+	pBlock[3 + len] = 0x00;
+	for (int i = 0; i < 3 + len; i++) {
+		pBlock[3 + len] ^= pBlock[i];	// LRC
+	}
+	unsigned long sndLen = JCOP_MSG_setHeader(snd, JCOP_MSG_MTY_T1, 0x00, (unsigned short)(len + 4));
+	char sent[sizeof(snd)];
+	memcpy(sent, snd, sndLen);
+
+	*pRcvLen = JCOP_PROXY_BUFFER_SIZE;
+	CHECK(T1_processMsg(snd, (unsigned short)sndLen, pRcv, pRcvLen) == 0);
+	CHECK(memcmp(snd, sent, sndLen) == 0);
+	JCOP_PERF_countRequest(pCounters, snd);
+}
+
+static void test_chaining(void)
+{
+	JCOP_PERF_COUNTERS c;
+	JCOP_PERF_reset(&c, FREQUENCY);
+	T1_resetSeq();
+
+	// CLA INS P1 P2 Lc(200) Data Le(256): two I-blocks each way.
+	char apdu[5 + 200 + 1];
+	memset(apdu, 0x5A, sizeof(apdu));
+	apdu[0] = (char)0x80;
+	apdu[1] = (char)0xE2;
+	apdu[2] = 0x00;
+	apdu[3] = 0x00;
+	apdu[4] = (char)200;
+	apdu[sizeof(apdu) - 1] = 0x00;
+
+	char rcv[JCOP_PROXY_BUFFER_SIZE];
+	unsigned short rcvLen;
+	char rsp[256 + 2];
+	int rspLen = 0;
+
+	exchange(&c, 0x20, apdu, MAX_IFS, rcv, &rcvLen);	// I(0, M)
+	CHECK(rcvLen == 4);
+	CHECK((unsigned char)rcv[1] == 0x90);	// R(1)
+
+	exchange(&c, 0x40, apdu + MAX_IFS, sizeof(apdu) - MAX_IFS, rcv, &rcvLen);	// I(1)
+	CHECK((unsigned char)rcv[1] == 0x20);	// I(0, M)
+	CHECK((unsigned char)rcv[2] == MAX_IFS);
+	memcpy(rsp, rcv + 3, MAX_IFS);
+	rspLen += MAX_IFS;
+
+	exchange(&c, 0x90, NULL, 0, rcv, &rcvLen);	// R(1)
+	CHECK((unsigned char)rcv[1] == 0x40);	// I(1)
+	CHECK((unsigned char)rcv[2] == sizeof(rsp) - MAX_IFS);
+	memcpy(rsp + rspLen, rcv + 3, (unsigned char)rcv[2]);
+	rspLen += (unsigned char)rcv[2];
+
+	CHECK(rspLen == sizeof(rsp));
+	CHECK((unsigned char)rsp[255] == 0xFF);
+	CHECK((unsigned char)rsp[256] == 0x90 && rsp[257] == 0x00);
+
+	CHECK(c.t1Blocks == 3);
+	CHECK(c.transmits == 1);
+	CHECK(c.chainingRounds == 2);
+	CHECK(c.bytesSent == (4 + MAX_IFS) + (4 + sizeof(apdu) - MAX_IFS) + 4);
+}
+
+static void test_apdu(void)
+{
+	char snd[JCOP_MSG_HEADER_SIZE + 5];
+	unsigned long sndLen = JCOP_MSG_setHeader(snd, JCOP_MSG_MTY_T1_APDU, 0x00, 5);
+	memcpy(snd + JCOP_MSG_HEADER_SIZE, "\x80\xCA\x9F\x7F\x02", 5);
+
+	char rcv[JCOP_PROXY_BUFFER_SIZE];
+	unsigned short rcvLen = sizeof(rcv);
+	CHECK(T1_processApdu(snd, (unsigned short)sndLen, rcv, &rcvLen) == 0);
+	CHECK(rcvLen == 4);
+	CHECK((unsigned char)snd[0] == JCOP_MSG_MTY_T1_APDU);
+}
+
+int main(void)
+{
+	MOCK_open(0);
+	JCOP_SIMUL_setBackend(MOCK_getBackend());
+	char atr[JCOP_PROXY_MAX_ATR_SIZE];
+	unsigned short atrLen = sizeof(atr);
+	CHECK(JCOP_SIMUL_powerUp(atr, &atrLen) == JCOP_SIMUL_NO_ERROR);
+
+	test_chaining();
+	test_apdu();
+	JCOP_SIMUL_close();
+	if (g_failures > 0) {
+		printf("%d checks failed\n", g_failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
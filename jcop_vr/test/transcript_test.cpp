@@ -0,0 +1,269 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*!
+ * \file transcript_test.cpp
+ * \brief test of the transcript recorder (transcript.cpp) and of the replay
+ * backend (replay.cpp) over T=1 traffic.
+ * \author Kenichi Kanai
+ *
+ * T=1 blocks are exchanged through T1_processMsg with the mock backend and
+ * recorded from the request as jcop_proxy does, then exchanged again with
+ * the replay backend. It is built on the host with the user mode sources
+ * (see README) and exits with 1 if a check fails.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "osdep.h"
+#include "shared_data.h"
+#include "jcop_simul.h"
+#include "mock.h"
+#include "t1.h"
+#include "transcript.h"
+#include "replay.h"
+
+#define CHECK(cond) check((cond) != 0, #cond, __LINE__)
+
+#define TRANSCRIPT_PATH "transcript_test.jctr"
+
+static int g_failures = 0;
+
+static void check(bool const isOk, char const *const pCond, int const line)
+{
+	if (!isOk) {
+		printf("line %d: %s failed\n", line, pCond);
+		g_failures++;
+	}
+}
+
+// CLA INS P1 P2 Lc(200) Data Le(256): two I-blocks each way.
+static char g_chained[5 + 200 + 1];
+// CLA INS P1 P2 Le: a single I-block each way.
+static char const g_single[] = { (char)0x80, (char)0xCA, (char)0x9F, 0x7F, 0x02 };
+
+// R-APDUs answered by the mock backend.
+static char g_chainedRsp[256 + 2];
+static char g_singleRsp[2 + 2];
+
+/*!
+ * \brief Function sends a T=1 block as the driver does and records it after
+ * T1_processMsg as jcop_proxy does (if the transcript is open).<br>
+ * <br>
+ * \param [in] pcb PCB of the block to send.
+ * \param [in] pInf INF of the block to send.
+ * \param [in] len length of INF.
+ * \param [out] pRcv received block (NAD PCB LEN INF EDC).
+ * \param [out] pRcvLen length of received block.
+ */
+static void exchange(
+    unsigned char const pcb,
+    char const *const pInf,
+    unsigned char const len,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	char snd[JCOP_MSG_HEADER_SIZE + 3 + 0xFF + 1];
+	char *pBlock = snd + JCOP_MSG_HEADER_SIZE;
+	pBlock[0] = 0x00;	// NAD
+	pBlock[1] = (char)pcb;
+	pBlock[2] = (char)len;
+	if (len != 0) {
+		memcpy(pBlock + 3, pInf, len);	// an R-block has no INF.
+	}
+	pBlock[3 + len] = 0x00;
+	for (int i = 0; i < 3 + len; i++) {
+		pBlock[3 + len] ^= pBlock[i];	// LRC
+	}
+	unsigned long sndLen = JCOP_MSG_setHeader(snd, JCOP_MSG_MTY_T1, 0x00, (unsigned short)(len + 4));
+
+	*pRcvLen = JCOP_PROXY_BUFFER_SIZE;
+	CHECK(T1_processMsg(snd, (unsigned short)sndLen, pRcv, pRcvLen) == 0);
+	if (!TRANSCRIPT_isOpen()) {
+		return;	// replayed.
+	}
+
+	TRANSCRIPT_RECORD record;
+	memset(&record, 0, sizeof(record));
+	record.mty = (unsigned char)snd[0];
+	record.nad = (unsigned char)snd[1];
+	record.cmdLen = JCOP_MSG_getLength(snd);
+	record.rspLen = *pRcvLen;
+	record.stage[TRANSCRIPT_STAGE_PROCESS] = 10;
+	CHECK(TRANSCRIPT_record(&record, snd + JCOP_MSG_HEADER_SIZE, pRcv) == TRANSCRIPT_NO_ERROR);
+}
+
+/*!
+ * \brief Function exchanges a C-APDU in T=1 blocks.<br>
+ *
+ * \retval length of the R-APDU in pRsp.
+ */
+static int transmit(char const *const pApdu, int const apduLen, char *const pRsp)
+{
+	char rcv[JCOP_PROXY_BUFFER_SIZE];
+	unsigned short rcvLen;
+	unsigned char seq = 0x00;
+	int off = 0;
+	while (apduLen - off > MAX_IFS) {
+		exchange(0x20 | seq, pApdu + off, MAX_IFS, rcv, &rcvLen);	// I(M)
+		CHECK((unsigned char)rcv[1] == (0x80 | ((seq ^ 0x40) >> 2)));	// R
+		off += MAX_IFS;
+		seq ^= 0x40;
+	}
+	exchange(seq, pApdu + off, (unsigned char)(apduLen - off), rcv, &rcvLen);
+
+	int rspLen = 0;
+	for (;;) {
+		memcpy(pRsp + rspLen, rcv + 3, (unsigned char)rcv[2]);
+		rspLen += (unsigned char)rcv[2];
+		if ((rcv[1] & 0x20) == 0) {
+			return rspLen;
+		}
+		exchange(0x80 | ((rcv[1] & 0x40) ? 0x00 : 0x10), NULL, 0, rcv, &rcvLen);	// R
+	}
+}
+
+/*!
+ * \brief Function reads the whole transcript file.<br>
+ *
+ * \retval the file contents (free), or NULL.
+ */
+static char *read_file(long *const pSize)
+{
+	FILE *fp = fopen(TRANSCRIPT_PATH, "rb");
+	if (fp == NULL) {
+		return NULL;
+	}
+	fseek(fp, 0, SEEK_END);
+	*pSize = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	char *pData = (char *)malloc(*pSize);
+	if (pData != NULL && fread(pData, 1, *pSize, fp) != (size_t)*pSize) {
+		free(pData);
+		pData = NULL;
+	}
+	fclose(fp);
+	return pData;
+}
+
+static void test_record(void)
+{
+	CHECK(TRANSCRIPT_open(TRANSCRIPT_PATH, 1000000, 0) == TRANSCRIPT_NO_ERROR);
+	T1_resetSeq();
+	CHECK(transmit(g_chained, sizeof(g_chained), g_chainedRsp) == sizeof(g_chainedRsp));
+	CHECK(transmit(g_single, sizeof(g_single), g_singleRsp) == sizeof(g_singleRsp));
+	CHECK(TRANSCRIPT_close() == TRANSCRIPT_NO_ERROR);
+
+	long size = 0;
+	char *pData = read_file(&size);
+	CHECK(pData != NULL);
+	if (pData == NULL) {
+		return;
+	}
+
+	// every block is recorded as it was sent, MTY 0x11.
+	TRANSCRIPT_TRAILER const *pTrailer = (TRANSCRIPT_TRAILER const *)(pData + size - sizeof(TRANSCRIPT_TRAILER));
+	CHECK(pTrailer->magic == TRANSCRIPT_INDEX_MAGIC);
+	unsigned int records = 0;
+	unsigned long offset = sizeof(TRANSCRIPT_FILE_HEADER);
+	while (offset < pTrailer->indexLow) {
+		TRANSCRIPT_RECORD const *pRecord = (TRANSCRIPT_RECORD const *)(pData + offset);
+		char const *pCmd = (char const *)(pRecord + 1);
+		CHECK(pRecord->mty == JCOP_MSG_MTY_T1);
+		CHECK(pRecord->cmdLen == 4 + (unsigned char)pCmd[2]);
+		records++;
+		offset += pRecord->recordSize;
+	}
+	CHECK(offset == pTrailer->indexLow);
+	CHECK(records == 4);	// I(M), I, R, I
+
+	// both commands are indexed; the chained answer has no SW in the first record.
+	CHECK(pTrailer->count == 2);
+	TRANSCRIPT_INDEX_ENTRY const *pIndex = (TRANSCRIPT_INDEX_ENTRY const *)(pData + pTrailer->indexLow);
+	if (pTrailer->count == 2) {
+		CHECK(pIndex[0].cla == 0x80 && pIndex[0].ins == 0xCA);
+		CHECK(pIndex[0].sw1 == 0x90 && pIndex[0].sw2 == 0x00);
+		CHECK(pIndex[1].cla == 0x80 && pIndex[1].ins == 0xE2);
+		CHECK(pIndex[1].sw1 == 0xFF && pIndex[1].sw2 == 0xFF);
+	}
+	free(pData);
+}
+
+static void test_replay(void)
+{
+	CHECK(REPLAY_open(TRANSCRIPT_PATH, REPLAY_TIMING_NONE) == REPLAY_NO_ERROR);
+	JCOP_SIMUL_setBackend(REPLAY_getBackend());
+	T1_resetSeq();
+
+	// the blocks are reassembled to the recorded APDU exchanges.
+	char rsp[JCOP_PROXY_BUFFER_SIZE];
+	CHECK(transmit(g_chained, sizeof(g_chained), rsp) == sizeof(g_chainedRsp));
+	CHECK(memcmp(rsp, g_chainedRsp, sizeof(g_chainedRsp)) == 0);
+	CHECK(transmit(g_single, sizeof(g_single), rsp) == sizeof(g_singleRsp));
+	CHECK(memcmp(rsp, g_singleRsp, sizeof(g_singleRsp)) == 0);
+
+	// MTY 0x12 is answered from the same exchange.
+	char snd[JCOP_MSG_HEADER_SIZE + sizeof(g_single)];
+	unsigned long sndLen = JCOP_MSG_setHeader(snd, JCOP_MSG_MTY_T1_APDU, 0x00, sizeof(g_single));
+	memcpy(snd + JCOP_MSG_HEADER_SIZE, g_single, sizeof(g_single));
+	unsigned short rspLen = sizeof(rsp);
+	CHECK(T1_processApdu(snd, (unsigned short)sndLen, rsp, &rspLen) == 0);
+	CHECK(rspLen == sizeof(g_singleRsp));
+	CHECK(memcmp(rsp, g_singleRsp, sizeof(g_singleRsp)) == 0);
+
+	REPLAY_close();
+}
+
+int main(void)
+{
+	memset(g_chained, 0x5A, sizeof(g_chained));
+	g_chained[0] = (char)0x80;
+	g_chained[1] = (char)0xE2;
+	g_chained[2] = 0x00;
+	g_chained[3] = 0x00;
+	g_chained[4] = (char)200;
+	g_chained[sizeof(g_chained) - 1] = 0x00;
+
+	MOCK_open(0);
+	JCOP_SIMUL_setBackend(MOCK_getBackend());
+	char atr[JCOP_PROXY_MAX_ATR_SIZE];
+	unsigned short atrLen = sizeof(atr);
+	CHECK(JCOP_SIMUL_powerUp(atr, &atrLen) == JCOP_SIMUL_NO_ERROR);
+
+	test_record();
+	JCOP_SIMUL_close();
+	test_replay();
+	remove(TRANSCRIPT_PATH);
+	if (g_failures > 0) {
+		printf("%d checks failed\n", g_failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
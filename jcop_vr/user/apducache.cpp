@@ -0,0 +1,531 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file apducache.cpp
+ * \brief Source file that contains the response cache of idempotent C-APDUs.
+ * \author Kenichi Kanai
+ *
+ * The entries are kept in a hash table and in a list ordered by use; when
+ * the table is full, the least recently used entry is replaced. The key is
+ * the hash of the epoch, the selection and the C-APDU, and an entry also
+ * keeps its C-APDU, so a hash collision is a miss. The entries of an old
+ * epoch are not removed; they are replaced as the least recently used.
+ *
+ * The selection of a logical channel is the hash of the last SELECT by
+ * name (P1 = 04) which succeeded, followed by the SELECT commands sent on
+ * the channel after it. A SELECT by name answered from the cache is sent
+ * before the next C-APDU which goes to the backend; only the last one of
+ * a channel is kept, as it replaces the selection.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "osdep.h"
+#include "shared_data.h"
+#include "jcop_simul.h"
+#include "apducache.h"
+#define DBG_CATEGORY DBG_CAT_TRANSPORT
+#include "dbglog.h"
+
+#define APDUCACHE_NONE 0xFFFFFFFF
+
+#define INS_SELECT		0xA4
+#define INS_GET_RESPONSE	0xC0
+#define P1_SELECT_BY_NAME	0x04
+
+// logical channels: 0 to 3 (first interindustry CLA), 4 to 19 (further).
+#define APDUCACHE_CHANNELS 20
+// a longer SELECT command is always sent.
+#define APDUCACHE_MAX_SELECT_SIZE 64
+
+typedef struct _APDUCACHE_ENTRY {
+	unsigned long hash;
+	unsigned long epoch;
+	unsigned long context;	// selection when the C-APDU was answered.
+	unsigned short cmdLen;
+	unsigned short rspLen;
+	unsigned long dataSize;	// allocated size of pData.
+	char *pData;		// C-APDU followed by R-APDU.
+	unsigned int next;	// next entry in the same bucket.
+	unsigned int newer;	// more recently used entry.
+	unsigned int older;	// less recently used entry.
+} APDUCACHE_ENTRY;
+
+typedef struct _APDUCACHE_TABLE {
+	APDUCACHE_ENTRY *pEntries;
+	unsigned int *pBuckets;
+	unsigned int bucketMask;
+	unsigned int count;	// entries in use.
+	unsigned int newest;
+	unsigned int oldest;
+	unsigned long epoch;
+	unsigned long context;	// hash of selected.
+	unsigned long selected[APDUCACHE_CHANNELS];	// selection of each channel, 0: not known.
+	// SELECT by name answered from the cache and not sent yet, 0: none.
+	unsigned short pendingLen[APDUCACHE_CHANNELS];
+	char pending[APDUCACHE_CHANNELS][JCOP_MSG_HEADER_SIZE + APDUCACHE_MAX_SELECT_SIZE];
+	unsigned long hits;
+	unsigned long misses;
+} APDUCACHE_TABLE;
+
+// set before the threads start.
+static unsigned int g_entries = 0;	// 0: the cache is off.
+static bool g_isWhitelisted[256];
+
+static OSDEP_THREAD_LOCAL APDUCACHE_TABLE *g_pTable = NULL;
+
+static unsigned long hash_bytes(unsigned long hash, char const *const pData, unsigned long const len)
+{
+	// FNV-1a
+	for (unsigned long i = 0; i < len; i++) {
+		hash ^= (unsigned char)pData[i];
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+static unsigned long hash_key(APDUCACHE_TABLE const *const pTable, char const *const pApdu, unsigned short const apduLen)
+{
+	unsigned long hash = 2166136261UL;
+	hash = hash_bytes(hash, (char const *)&pTable->epoch, sizeof(pTable->epoch));
+	hash = hash_bytes(hash, (char const *)&pTable->context, sizeof(pTable->context));
+	return hash_bytes(hash, pApdu, apduLen);
+}
+
+static unsigned int get_channel(char const cla)
+{
+	if ((cla & 0x40) != 0) {
+		return 4 + (cla & 0x0F);	// further interindustry: channel 4 to 19.
+	}
+	return cla & 0x03;	// first interindustry: channel 0 to 3.
+}
+
+/*!
+ * \brief Function changes the selection by a SELECT command.<br>
+ */
+static void select(
+    APDUCACHE_TABLE *const pTable,
+    char const *const pApdu,
+    unsigned short const apduLen,
+    bool const isSuccess
+)
+{
+	unsigned int channel = get_channel(pApdu[0]);
+	if (isSuccess && (unsigned char)pApdu[2] == P1_SELECT_BY_NAME) {
+		pTable->selected[channel] = hash_bytes(2166136261UL, pApdu, apduLen);
+	} else {
+		// the result depends on the previous selection (e.g. a file of the current DF).
+		pTable->selected[channel] = hash_bytes(pTable->selected[channel], pApdu, apduLen);
+	}
+	pTable->context = hash_bytes(2166136261UL, (char const *)pTable->selected, sizeof(pTable->selected));
+}
+
+static APDUCACHE_TABLE *get_table(void)
+{
+	if (g_pTable != NULL) {
+		return g_pTable;
+	}
+	unsigned int buckets = 1;
+	while (buckets < g_entries) {
+		buckets *= 2;
+	}
+	APDUCACHE_TABLE *pTable = (APDUCACHE_TABLE *)calloc(1, sizeof(APDUCACHE_TABLE));
+	if (pTable == NULL) {
+		return NULL;
+	}
+	pTable->pEntries = (APDUCACHE_ENTRY *)calloc(g_entries, sizeof(APDUCACHE_ENTRY));
+	pTable->pBuckets = (unsigned int *)malloc(buckets * sizeof(unsigned int));
+	if (pTable->pEntries == NULL || pTable->pBuckets == NULL) {
+		free(pTable->pEntries);
+		free(pTable->pBuckets);
+		free(pTable);
+		return NULL;
+	}
+	for (unsigned int i = 0; i < buckets; i++) {
+		pTable->pBuckets[i] = APDUCACHE_NONE;
+	}
+	pTable->bucketMask = buckets - 1;
+	pTable->newest = APDUCACHE_NONE;
+	pTable->oldest = APDUCACHE_NONE;
+	g_pTable = pTable;
+	return pTable;
+}
+
+static void unlink_use(APDUCACHE_TABLE *const pTable, unsigned int const index)
+{
+	APDUCACHE_ENTRY *pEntry = &pTable->pEntries[index];
+	if (pEntry->newer != APDUCACHE_NONE) {
+		pTable->pEntries[pEntry->newer].older = pEntry->older;
+	} else {
+		pTable->newest = pEntry->older;
+	}
+	if (pEntry->older != APDUCACHE_NONE) {
+		pTable->pEntries[pEntry->older].newer = pEntry->newer;
+	} else {
+		pTable->oldest = pEntry->newer;
+	}
+}
+
+static void link_newest(APDUCACHE_TABLE *const pTable, unsigned int const index)
+{
+	APDUCACHE_ENTRY *pEntry = &pTable->pEntries[index];
+	pEntry->newer = APDUCACHE_NONE;
+	pEntry->older = pTable->newest;
+	if (pTable->newest != APDUCACHE_NONE) {
+		pTable->pEntries[pTable->newest].newer = index;
+	} else {
+		pTable->oldest = index;
+	}
+	pTable->newest = index;
+}
+
+static void link_oldest(APDUCACHE_TABLE *const pTable, unsigned int const index)
+{
+	APDUCACHE_ENTRY *pEntry = &pTable->pEntries[index];
+	pEntry->older = APDUCACHE_NONE;
+	pEntry->newer = pTable->oldest;
+	if (pTable->oldest != APDUCACHE_NONE) {
+		pTable->pEntries[pTable->oldest].older = index;
+	} else {
+		pTable->newest = index;
+	}
+	pTable->oldest = index;
+}
+
+static void link_bucket(APDUCACHE_TABLE *const pTable, unsigned int const index)
+{
+	APDUCACHE_ENTRY *pEntry = &pTable->pEntries[index];
+	unsigned int *pBucket = &pTable->pBuckets[pEntry->hash & pTable->bucketMask];
+	pEntry->next = *pBucket;
+	*pBucket = index;
+}
+
+static unsigned int lookup(
+    APDUCACHE_TABLE const *const pTable,
+    unsigned long const hash,
+    char const *const pApdu,
+    unsigned short const apduLen
+)
+{
+	unsigned int index = pTable->pBuckets[hash & pTable->bucketMask];
+	while (index != APDUCACHE_NONE) {
+		APDUCACHE_ENTRY const *pEntry = &pTable->pEntries[index];
+		if (pEntry->hash == hash
+		        && pEntry->epoch == pTable->epoch
+		        && pEntry->context == pTable->context
+		        && pEntry->cmdLen == apduLen
+		        && memcmp(pEntry->pData, pApdu, apduLen) == 0) {
+			return index;
+		}
+		index = pEntry->next;
+	}
+	return APDUCACHE_NONE;
+}
+
+/*!
+ * \brief Function stores an answer, replacing the least recently used entry
+ * if the table is full.<br>
+ */
+static void store(
+    APDUCACHE_TABLE *const pTable,
+    unsigned long const hash,
+    char const *const pApdu,
+    unsigned short const apduLen,
+    char const *const pRsp,
+    unsigned short const rspLen
+)
+{
+	unsigned int index;
+	if (pTable->count < g_entries) {
+		index = pTable->count++;
+	} else {
+		// remove the least recently used entry from its bucket.
+		index = pTable->oldest;
+		unlink_use(pTable, index);
+		unsigned int *pLink = &pTable->pBuckets[pTable->pEntries[index].hash & pTable->bucketMask];
+		while (*pLink != index) {
+			pLink = &pTable->pEntries[*pLink].next;
+		}
+		*pLink = pTable->pEntries[index].next;
+	}
+
+	APDUCACHE_ENTRY *pEntry = &pTable->pEntries[index];
+	unsigned long size = (unsigned long)apduLen + rspLen;
+	if (pEntry->dataSize < size) {
+		char *pData = (char *)realloc(pEntry->pData, size);
+		if (pData == NULL) {
+			// keep the entry as the first to be replaced; it matches no C-APDU.
+			pEntry->cmdLen = 0;
+			link_bucket(pTable, index);
+			link_oldest(pTable, index);
+			return;
+		}
+		pEntry->pData = pData;
+		pEntry->dataSize = size;
+	}
+	memcpy(pEntry->pData, pApdu, apduLen);
+	memcpy(pEntry->pData + apduLen, pRsp, rspLen);
+	pEntry->hash = hash;
+	pEntry->epoch = pTable->epoch;
+	pEntry->context = pTable->context;
+	pEntry->cmdLen = apduLen;
+	pEntry->rspLen = rspLen;
+	link_bucket(pTable, index);
+	link_newest(pTable, index);
+}
+
+static void new_epoch(APDUCACHE_TABLE *const pTable)
+{
+	pTable->epoch++;
+	pTable->context = 0;
+	memset(pTable->selected, 0, sizeof(pTable->selected));
+	memset(pTable->pendingLen, 0, sizeof(pTable->pendingLen));
+}
+
+/*!
+ * \brief Function sends the SELECT commands which were answered from the
+ * cache to the backend.<br>
+ */
+static int send_pending(APDUCACHE_TABLE *const pTable)
+{
+	for (unsigned int i = 0; i < APDUCACHE_CHANNELS; i++) {
+		if (pTable->pendingLen[i] == 0) {
+			continue;
+		}
+		char rsp[JCOP_PROXY_BUFFER_SIZE];
+		unsigned short rspLen = sizeof(rsp);
+		int status = JCOP_SIMUL_transmit(pTable->pending[i], pTable->pendingLen[i], rsp, &rspLen);
+		pTable->pendingLen[i] = 0;
+		if (status != JCOP_SIMUL_NO_ERROR) {
+			new_epoch(pTable);
+			return status;
+		}
+		if (rspLen < 2 || rsp[rspLen - 2] != (char)0x90 || rsp[rspLen - 1] != 0x00) {
+			// the backend is not in the state the cached answers were given in.
+			dbg_warn("deferred SELECT failed! - %d bytes", rspLen);
+			new_epoch(pTable);
+			break;
+		}
+	}
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+/*!
+ * \brief Function sends a C-APDU to the backend, after the SELECT commands
+ * which were answered from the cache.<br>
+ */
+static int send(
+    APDUCACHE_TABLE *const pTable,
+    char const *const pSnd,
+    const unsigned short sndLen,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	int status = send_pending(pTable);
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		return status;
+	}
+	return JCOP_SIMUL_transmit(pSnd, sndLen, pRcv, pRcvLen);
+}
+
+/*!
+ * \brief Function sets the size of the cache and the INS whitelist.<br>
+ * <br>
+ * Call it before the threads which transmit start.
+ * <br>
+ * \param [in] entries number of answers kept by a thread, 0: the cache is off.
+ * \param [in] pInsList INS in hex separated by ',', NULL: APDUCACHE_DEFAULT_INS.
+ *
+ * \retval 0 success.
+ * \retval -1 entries is too large, or pInsList is malformed or has GET RESPONSE.
+ */
+int APDUCACHE_setConfig(unsigned int const entries, char const *const pInsList)
+{
+	if (entries > APDUCACHE_MAX_ENTRIES) {
+		return -1;
+	}
+	bool isWhitelisted[256];
+	memset(isWhitelisted, 0, sizeof(isWhitelisted));
+	char const *p = (pInsList != NULL) ? pInsList : APDUCACHE_DEFAULT_INS;
+	while (*p != '\0') {
+		char *pEnd;
+		unsigned long ins = strtoul(p, &pEnd, 16);
+		if (pEnd == p || ins > 0xFF || ins == INS_GET_RESPONSE) {
+			return -1;
+		}
+		isWhitelisted[ins] = true;
+		p = pEnd;
+		if (*p == ',') {
+			p++;
+		} else if (*p != '\0') {
+			return -1;
+		}
+	}
+	memcpy(g_isWhitelisted, isWhitelisted, sizeof(g_isWhitelisted));
+	g_entries = entries;
+	return 0;
+}
+
+/*!
+ * \brief Function transmits a C-APDU, or answers it from the cache.<br>
+ * <br>
+ * Same as JCOP_SIMUL_transmit if the cache is off.
+ * <br>
+ * \param [in] pSnd A pointer to first byte of message (MTY NAD LNH LNL | C-APDU).
+ * \param [in] sndLen length of message.
+ * \param [out] pRcv A pointer to buffer of received payload data.
+ * \param [in][out] pRcvLen [in]length of pRcv. [out]actual length of
+ *		received payload data.
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL
+ * \retval status of JCOP_SIMUL_transmit.
+ */
+int APDUCACHE_transmit(
+    char const *const pSnd,
+    const unsigned short sndLen,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	APDUCACHE_TABLE *pTable = (g_entries != 0) ? get_table() : NULL;
+	if (pTable == NULL) {
+		return JCOP_SIMUL_transmit(pSnd, sndLen, pRcv, pRcvLen);
+	}
+
+	char const *pApdu = pSnd + JCOP_MSG_HEADER_SIZE;
+	unsigned short apduLen = (sndLen > JCOP_MSG_HEADER_SIZE) ? sndLen - JCOP_MSG_HEADER_SIZE : 0;
+	if (apduLen < 4 || !g_isWhitelisted[(unsigned char)pApdu[1]]) {
+		// the command may change the card.
+		int status = send(pTable, pSnd, sndLen, pRcv, pRcvLen);
+		new_epoch(pTable);
+		return status;
+	}
+
+	bool isSelect = ((unsigned char)pApdu[1] == INS_SELECT);
+	unsigned long hash = hash_key(pTable, pApdu, apduLen);
+	unsigned int index = lookup(pTable, hash, pApdu, apduLen);
+	if (index != APDUCACHE_NONE && isSelect
+	        && ((unsigned char)pApdu[2] != P1_SELECT_BY_NAME || sndLen > sizeof(pTable->pending[0]))) {
+		index = APDUCACHE_NONE;	// the SELECT can't be deferred.
+	}
+
+	if (index != APDUCACHE_NONE) {
+		APDUCACHE_ENTRY *pEntry = &pTable->pEntries[index];
+		if (*pRcvLen < pEntry->rspLen) {
+			*pRcvLen = 0;
+			return JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL;
+		}
+		memcpy(pRcv, pEntry->pData + pEntry->cmdLen, pEntry->rspLen);
+		*pRcvLen = pEntry->rspLen;
+		unlink_use(pTable, index);
+		link_newest(pTable, index);
+		pTable->hits++;
+		if (isSelect) {
+			unsigned int channel = get_channel(pApdu[0]);
+			memcpy(pTable->pending[channel], pSnd, sndLen);
+			pTable->pendingLen[channel] = sndLen;
+			select(pTable, pApdu, apduLen, true);
+		}
+		return JCOP_SIMUL_NO_ERROR;
+	}
+
+	pTable->misses++;
+	int status = send(pTable, pSnd, sndLen, pRcv, pRcvLen);
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		new_epoch(pTable);
+		return status;
+	}
+	bool isSuccess = (*pRcvLen >= 2 && pRcv[*pRcvLen - 2] == (char)0x90 && pRcv[*pRcvLen - 1] == 0x00);
+	if (isSuccess) {
+		// the key is taken again: the deferred SELECT commands may have started an epoch.
+		store(pTable, hash_key(pTable, pApdu, apduLen), pApdu, apduLen, pRcv, *pRcvLen);
+	}
+	if (isSelect) {
+		select(pTable, pApdu, apduLen, isSuccess);
+	}
+	return status;
+}
+
+/*!
+ * \brief Function starts a new epoch of the card state (e.g. the card is
+ * reset).<br>
+ * <br>
+ * SELECT commands answered from the cache are not sent; the reset selects
+ * the default applet anyway.
+ */
+void APDUCACHE_invalidate(void)
+{
+	if (g_pTable != NULL) {
+		new_epoch(g_pTable);
+	}
+}
+
+/*!
+ * \brief Function brings the backend to the state of the cache and starts a
+ * new epoch, before C-APDUs which bypass the cache (e.g. a batch).<br>
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval status of JCOP_SIMUL_transmit of a deferred SELECT.
+ */
+int APDUCACHE_flush(void)
+{
+	if (g_pTable == NULL) {
+		return JCOP_SIMUL_NO_ERROR;
+	}
+	int status = send_pending(g_pTable);
+	new_epoch(g_pTable);
+	return status;
+}
+
+/*!
+ * \brief Function returns the number of C-APDUs of the whitelist answered
+ * from the cache and sent to the backend by the calling thread.<br>
+ */
+void APDUCACHE_getCounts(unsigned long *const pHits, unsigned long *const pMisses)
+{
+	*pHits = (g_pTable != NULL) ? g_pTable->hits : 0;
+	*pMisses = (g_pTable != NULL) ? g_pTable->misses : 0;
+}
+
+/*!
+ * \brief Function frees the cache of the calling thread.<br>
+ */
+void APDUCACHE_free(void)
+{
+	if (g_pTable == NULL) {
+		return;
+	}
+	for (unsigned int i = 0; i < g_entries; i++) {
+		free(g_pTable->pEntries[i].pData);
+	}
+	free(g_pTable->pEntries);
+	free(g_pTable->pBuckets);
+	free(g_pTable);
+	g_pTable = NULL;
+}
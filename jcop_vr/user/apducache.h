@@ -0,0 +1,57 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file apducache.h
+ * \brief prototypes for the response cache of idempotent C-APDUs.
+ * \author Kenichi Kanai
+ *
+ * A C-APDU whose INS is in the whitelist is answered from the cache if the
+ * same bytes were answered with SW 9000 in the same card state. The card
+ * state is an epoch, which a reset or a C-APDU with another INS starts
+ * again, and the applet (or file) selected on each logical channel.
+ * A cached answer never reaches the backend; a SELECT answered from the
+ * cache is sent before the next C-APDU which does, so the selection of the
+ * backend follows.
+ *
+ * The cache belongs to the calling thread, as the backend connection does.
+ * INS whose answer changes without a command of another INS (e.g. GET
+ * CHALLENGE, GET RESPONSE) must not be in the whitelist.
+ */
+#ifndef __APDUCACHE__
+#define __APDUCACHE__
+
+#define APDUCACHE_DEFAULT_INS	"A4,CA,F2"	// SELECT, GET DATA, GET STATUS.
+#define APDUCACHE_MAX_ENTRIES	65536
+
+int APDUCACHE_setConfig(unsigned int const entries, char const *const pInsList);
+int APDUCACHE_transmit(char const *const pSnd, const unsigned short sndLen, char *const pRcv, unsigned short *const pRcvLen);
+void APDUCACHE_invalidate(void);
+int APDUCACHE_flush(void);
+void APDUCACHE_getCounts(unsigned long *const pHits, unsigned long *const pMisses);
+void APDUCACHE_free(void);
+
+#endif // __APDUCACHE__
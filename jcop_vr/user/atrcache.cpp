@@ -0,0 +1,154 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*!
+ * \file atrcache.cpp
+ * \brief Source file that contains the cached ATR of warm resets.
+ * \author Kenichi Kanai
+ */
+#include <string.h>
+
+#include "osdep.h"
+#include "shared_data.h"
+#include "jcop_simul.h"
+#include "simpool.h"
+#include "atrcache.h"
+#define DBG_CATEGORY DBG_CAT_TRANSPORT
+#include "dbglog.h"
+
+static OSDEP_THREAD_LOCAL char g_atr[JCOP_PROXY_MAX_ATR_SIZE];
+static OSDEP_THREAD_LOCAL unsigned short g_atrLen = 0;	// 0: no ATR is cached.
+static OSDEP_THREAD_LOCAL bool g_isPending = false;	// the session is not reset yet.
+static OSDEP_THREAD_LOCAL unsigned long g_hits = 0;
+
+/*!
+ * \brief Function powers up the card and caches its ATR.<br>
+ * <br>
+ * A pending reset is dropped: this power up resets the session anyway.
+ * The session is taken from the session pool if it is open (SIMPOOL).
+ * <br>
+ * \param [out] pAtr A pointer to buffer of ATR.
+ * \param [in][out] pAtrLen [in]length of pAtr. [out]actual length of ATR.
+ *
+ * \retval status of SIMPOOL_powerUp.
+ */
+int ATRCACHE_powerUp(char *const pAtr, unsigned short *const pAtrLen)
+{
+	g_isPending = false;
+	int status = SIMPOOL_powerUp(pAtr, pAtrLen);
+	if (status != JCOP_SIMUL_NO_ERROR || *pAtrLen > JCOP_PROXY_MAX_ATR_SIZE) {
+		g_atrLen = 0;
+		return status;
+	}
+	memcpy(g_atr, pAtr, *pAtrLen);
+	g_atrLen = *pAtrLen;
+	return status;
+}
+
+/*!
+ * \brief Function answers a warm reset.<br>
+ * <br>
+ * The cached ATR is returned at once and the session is reset by the next
+ * ATRCACHE_flush. Without a cached ATR, the card is powered up as
+ * ATRCACHE_powerUp does.
+ * <br>
+ * \param [out] pAtr A pointer to buffer of ATR.
+ * \param [in][out] pAtrLen [in]length of pAtr. [out]actual length of ATR.
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL
+ * \retval status of SIMPOOL_powerUp.
+ */
+int ATRCACHE_warmReset(char *const pAtr, unsigned short *const pAtrLen)
+{
+	if (g_atrLen == 0) {
+		return ATRCACHE_powerUp(pAtr, pAtrLen);
+	}
+	if (*pAtrLen < g_atrLen) {
+		return JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL;
+	}
+	memcpy(pAtr, g_atr, g_atrLen);
+	*pAtrLen = g_atrLen;
+	g_isPending = true;
+	g_hits++;
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+/*!
+ * \brief Function resets the session answered by ATRCACHE_warmReset.<br>
+ * <br>
+ * Does nothing if no reset is pending. If the power up fails, the cache is
+ * dropped so the next reset goes to the backend and reports the error, and
+ * the reset stays pending: the next flush retries it, so a C-APDU never
+ * goes to a card which was not reset. If the card answers another ATR, the
+ * next reset returns the new one.
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval status of SIMPOOL_powerUp.
+ */
+int ATRCACHE_flush(void)
+{
+	if (!g_isPending) {
+		return JCOP_SIMUL_NO_ERROR;
+	}
+	g_isPending = false;
+
+	char atr[JCOP_PROXY_MAX_ATR_SIZE];
+	unsigned short atrLen = sizeof(atr);
+	int status = SIMPOOL_powerUp(atr, &atrLen);
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		dbg_warn("deferred power up failed! - status: 0x%08X", status);
+		g_atrLen = 0;
+		g_isPending = true;
+		return status;
+	}
+	if (atrLen != g_atrLen || memcmp(atr, g_atr, atrLen) != 0) {
+		dbg_warn("the ATR is changed: %d bytes", atrLen);
+		memcpy(g_atr, atr, atrLen);
+		g_atrLen = atrLen;
+	}
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+/*!
+ * \brief Function drops the cached ATR (e.g. the backend is closed).<br>
+ * <br>
+ * A pending reset is dropped as well; the next power up resets the session.
+ */
+void ATRCACHE_invalidate(void)
+{
+	g_atrLen = 0;
+	g_isPending = false;
+}
+
+/*!
+ * \brief Function returns the number of warm resets answered from the cache.<br>
+ */
+unsigned long ATRCACHE_getHits(void)
+{
+	return g_hits;
+}
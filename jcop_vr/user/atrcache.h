@@ -0,0 +1,49 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*!
+ * \file atrcache.h
+ * \brief prototypes for the cached ATR of warm resets.
+ * \author Kenichi Kanai
+ *
+ * A warm reset can be answered with the ATR of the previous power up at
+ * once. The simulator session is reset afterwards by ATRCACHE_flush, which
+ * the caller runs after the answer is sent and before the next command
+ * reaches the backend, so the order of the commands is kept.
+ *
+ * The cache belongs to the calling thread, as the backend connection does.
+ */
+#ifndef __ATRCACHE__
+#define __ATRCACHE__
+
+int ATRCACHE_powerUp(char *const pAtr, unsigned short *const pAtrLen);
+int ATRCACHE_warmReset(char *const pAtr, unsigned short *const pAtrLen);
+int ATRCACHE_flush(void);
+void ATRCACHE_invalidate(void);
+unsigned long ATRCACHE_getHits(void);
+
+#endif // __ATRCACHE__
@@ -0,0 +1,513 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*!
+ * \file capload.cpp
+ * \brief Source file that loads CAP files by INSTALL [for load] and LOAD.
+ * \author Kenichi Kanai
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "osdep.h"
+#include "shared_data.h"
+#include "jcop_msg.h"
+#include "jcop_simul.h"
+#include "capload.h"
+#define DBG_CATEGORY DBG_CAT_GENERAL
+#include "dbglog.h"
+
+// component tags in the order of the Load File Data Block. Descriptor (11)
+// and Debug (12) are not loaded.
+static unsigned char const g_loadOrder[] = {1, 2, 4, 3, 6, 7, 8, 10, 5, 9};
+#define COMPONENT_HEADER	1
+#define COMPONENT_COUNT		12	// tags 1 to 12.
+
+// ZIP records.
+#define ZIP_LOCAL_HEADER	0x04034b50
+#define ZIP_CENTRAL_HEADER	0x02014b50
+#define ZIP_END_OF_CENTRAL	0x06054b50
+#define ZIP_STORED		0
+
+// largest LOAD block of extended length: CLA INS P1 P2 00 LcH LcL Data.
+#define EXTENDED_BLOCK (JCOP_PROXY_BUFFER_SIZE - JCOP_MSG_HEADER_SIZE - 7)
+#define MAX_BLOCKS 256	// P2 is the block number.
+
+static unsigned long get_u16(char const *const p)
+{
+	return (unsigned long)(p[0] & 0xff) | ((unsigned long)(p[1] & 0xff) << 8);
+}
+
+static unsigned long get_u32(char const *const p)
+{
+	return get_u16(p) | (get_u16(p + 2) << 16);
+}
+
+/*!
+ * \brief Function finds the components of a JAR in its central
+ * directory.<br>
+ *
+ * \param [out] ppComponents components by tag - 1, NULL if absent.
+ * \param [out] pLens length of each component.
+ *
+ * \retval CAPLOAD_NO_ERROR
+ * \retval CAPLOAD_ERROR_FORMAT
+ * \retval CAPLOAD_ERROR_COMPRESSED
+ */
+static int find_zip_components(
+    char const *const pView,
+    unsigned long const size,
+    char const **const ppComponents,
+    unsigned long *const pLens
+)
+{
+	// End of Central Directory is 22 bytes and a comment of up to 64KB.
+	long end = (long)size - 22;
+	long last = (end > 0xFFFF) ? end - 0xFFFF : 0;
+	while (end >= last && get_u32(pView + end) != ZIP_END_OF_CENTRAL) {
+		end--;
+	}
+	if (end < last) {
+		return CAPLOAD_ERROR_FORMAT;
+	}
+	unsigned long entries = get_u16(pView + end + 10);
+	unsigned long offset = get_u32(pView + end + 16);
+
+	for (unsigned long i = 0; i < entries; i++) {
+		if (offset + 46 > size || get_u32(pView + offset) != ZIP_CENTRAL_HEADER) {
+			return CAPLOAD_ERROR_FORMAT;
+		}
+		char const *pEntry = pView + offset;
+		unsigned long method = get_u16(pEntry + 10);
+		unsigned long compressedLen = get_u32(pEntry + 20);
+		unsigned long len = get_u32(pEntry + 24);
+		unsigned long nameLen = get_u16(pEntry + 28);
+		unsigned long local = get_u32(pEntry + 42);
+		offset += 46 + nameLen + get_u16(pEntry + 30) + get_u16(pEntry + 32);
+		if (offset > size) {
+			return CAPLOAD_ERROR_FORMAT;
+		}
+		char const *pName = pEntry + 46;
+		if (nameLen < 4 || memcmp(pName + nameLen - 4, ".cap", 4) != 0 || len == 0) {
+			continue;	// the manifest, or a directory.
+		}
+		if (method != ZIP_STORED || compressedLen != len) {
+			dbg_warn("%.*s is compressed", (int)nameLen, pName);
+			return CAPLOAD_ERROR_COMPRESSED;
+		}
+		if (local + 30 > size || get_u32(pView + local) != ZIP_LOCAL_HEADER) {
+			return CAPLOAD_ERROR_FORMAT;
+		}
+		unsigned long data = local + 30 + get_u16(pView + local + 26) + get_u16(pView + local + 28);
+		if (data + len > size) {
+			return CAPLOAD_ERROR_FORMAT;
+		}
+		int tag = pView[data] & 0xff;
+		if (tag < 1 || tag > COMPONENT_COUNT || ppComponents[tag - 1] != NULL) {
+			return CAPLOAD_ERROR_FORMAT;	// unknown, or a second package.
+		}
+		ppComponents[tag - 1] = pView + data;
+		pLens[tag - 1] = len;
+	}
+	return CAPLOAD_NO_ERROR;
+}
+
+/*!
+ * \brief Function splits an IJC file, the components one after another.<br>
+ *
+ * \retval CAPLOAD_NO_ERROR
+ * \retval CAPLOAD_ERROR_FORMAT
+ */
+static int find_ijc_components(
+    char const *const pView,
+    unsigned long const size,
+    char const **const ppComponents,
+    unsigned long *const pLens
+)
+{
+	unsigned long offset = 0;
+	while (offset < size) {
+		if (offset + 3 > size) {
+			return CAPLOAD_ERROR_FORMAT;
+		}
+		int tag = pView[offset] & 0xff;
+		unsigned long len = 3 + (((pView[offset + 1] & 0xff) << 8) | (pView[offset + 2] & 0xff));
+		if (tag < 1 || tag > COMPONENT_COUNT || ppComponents[tag - 1] != NULL || offset + len > size) {
+			return CAPLOAD_ERROR_FORMAT;
+		}
+		ppComponents[tag - 1] = pView + offset;
+		pLens[tag - 1] = len;
+		offset += len;
+	}
+	return CAPLOAD_NO_ERROR;
+}
+
+/*!
+ * \brief Function maps a CAP or IJC file and finds its components.<br>
+ *
+ * \retval CAPLOAD_NO_ERROR
+ * \retval CAPLOAD_ERROR_OPEN
+ * \retval CAPLOAD_ERROR_FORMAT
+ * \retval CAPLOAD_ERROR_COMPRESSED
+ */
+int CAPLOAD_open(char const *const pPath, CAPLOAD_FILE *const pFile)
+{
+	memset(pFile, 0, sizeof(CAPLOAD_FILE));
+	if (OSDEP_mapFile(pPath, &pFile->mapping) != 0) {
+		return CAPLOAD_ERROR_OPEN;
+	}
+	char const *pView = pFile->mapping.pView;
+	unsigned long size = pFile->mapping.size;
+
+	char const *pComponents[COMPONENT_COUNT];
+	unsigned long lens[COMPONENT_COUNT];
+	memset(pComponents, 0, sizeof(pComponents));
+	memset(lens, 0, sizeof(lens));
+	int status;
+	if (size >= 4 && get_u32(pView) == ZIP_LOCAL_HEADER) {
+		status = find_zip_components(pView, size, pComponents, lens);
+	} else {
+		status = find_ijc_components(pView, size, pComponents, lens);
+	}
+
+	// Header: tag size(2) magic(4) minor major flags | package minor major AID_length AID.
+	char const *pHeader = pComponents[COMPONENT_HEADER - 1];
+	if (status == CAPLOAD_NO_ERROR
+	    && (pHeader == NULL || lens[COMPONENT_HEADER - 1] < 13
+	        || (pHeader[12] & 0xff) < 5 || (pHeader[12] & 0xff) > 16
+	        || lens[COMPONENT_HEADER - 1] < 13 + (unsigned long)(pHeader[12] & 0xff))) {
+		status = CAPLOAD_ERROR_FORMAT;
+	}
+	if (status != CAPLOAD_NO_ERROR) {
+		CAPLOAD_close(pFile);
+		return status;
+	}
+	pFile->aidLen = (unsigned char)pHeader[12];
+	memcpy(pFile->aid, pHeader + 13, pFile->aidLen);
+
+	unsigned long dataLen = 0;
+	pFile->segmentCount = 1;	// C4 Length.
+	for (unsigned int i = 0; i < sizeof(g_loadOrder); i++) {
+		int tag = g_loadOrder[i];
+		if (pComponents[tag - 1] != NULL) {
+			pFile->pSegments[pFile->segmentCount] = pComponents[tag - 1];
+			pFile->segmentLens[pFile->segmentCount] = lens[tag - 1];
+			pFile->segmentCount++;
+			dataLen += lens[tag - 1];
+		}
+	}
+
+	// C4 and the length in BER.
+	unsigned long prefixLen = 0;
+	pFile->prefix[prefixLen++] = (char)0xC4;
+	if (dataLen >= 0x10000) {
+		pFile->prefix[prefixLen++] = (char)0x83;
+		pFile->prefix[prefixLen++] = (char)(dataLen >> 16);
+	}
+	if (dataLen >= 0x100) {
+		if (dataLen < 0x10000) {
+			pFile->prefix[prefixLen++] = (char)0x82;
+		}
+		pFile->prefix[prefixLen++] = (char)(dataLen >> 8);
+	} else if (dataLen >= 0x80) {
+		pFile->prefix[prefixLen++] = (char)0x81;
+	}
+	pFile->prefix[prefixLen++] = (char)dataLen;
+	pFile->pSegments[0] = pFile->prefix;
+	pFile->segmentLens[0] = prefixLen;
+	pFile->size = prefixLen + dataLen;
+	dbg_info("%s: %lu bytes to load, %d components", pPath, pFile->size, pFile->segmentCount - 1);
+	return CAPLOAD_NO_ERROR;
+}
+
+/*!
+ * \brief Function unmaps a file of CAPLOAD_open.<br>
+ */
+void CAPLOAD_close(CAPLOAD_FILE *const pFile)
+{
+	if (pFile->mapping.pView != NULL) {
+		OSDEP_unmapFile(&pFile->mapping);
+	}
+	pFile->segmentCount = 0;
+	pFile->size = 0;
+}
+
+/*!
+ * \brief Function decides the LOAD block size by the card capabilities in
+ * the historical bytes of the ATR (ISO/IEC 7816-4 compact-TLV, tag 7).<br>
+ *
+ * \retval the largest block the card and the transport take.
+ */
+unsigned int CAPLOAD_getMaxBlockSize(char const *const pAtr, unsigned short const atrLen)
+{
+	if (atrLen < 2) {
+		return CAPLOAD_SHORT_BLOCK;
+	}
+	// skip TS, T0 and the interface bytes.
+	unsigned int k = pAtr[1] & 0x0F;
+	unsigned int y = (pAtr[1] >> 4) & 0x0F;
+	unsigned int i = 2;
+	while (y != 0) {
+		i += ((y & 0x1) ? 1 : 0) + ((y & 0x2) ? 1 : 0) + ((y & 0x4) ? 1 : 0);
+		if ((y & 0x8) == 0 || i >= atrLen) {
+			break;
+		}
+		y = (pAtr[i++] >> 4) & 0x0F;	// TDi.
+	}
+	if (i + k > atrLen || k == 0) {
+		return CAPLOAD_SHORT_BLOCK;
+	}
+
+	// category 80: compact-TLV objects; 00: followed by 3 status bytes.
+	unsigned int end = i + k;
+	if ((pAtr[i] & 0xff) == 0x00 && k >= 4) {
+		end -= 3;
+	} else if ((pAtr[i] & 0xff) != 0x80) {
+		return CAPLOAD_SHORT_BLOCK;
+	}
+	for (i++; i < end; ) {
+		unsigned int tag = (pAtr[i] >> 4) & 0x0F;
+		unsigned int len = pAtr[i] & 0x0F;
+		if (i + 1 + len > end) {
+			break;
+		}
+		if (tag == 7 && len >= 3) {
+			// third software function table: b7 is extended Lc and Le.
+			return ((pAtr[i + 3] & 0x40) != 0) ? EXTENDED_BLOCK : CAPLOAD_SHORT_BLOCK;
+		}
+		i += 1 + len;
+	}
+	return CAPLOAD_SHORT_BLOCK;
+}
+
+/*!
+ * \brief Function copies a part of the Load File Data Block.<br>
+ */
+static void copy_data(CAPLOAD_FILE const *const pFile, unsigned long offset, char *pBuf, unsigned long len)
+{
+	for (int i = 0; i < pFile->segmentCount && len > 0; i++) {
+		unsigned long segmentLen = pFile->segmentLens[i];
+		if (offset >= segmentLen) {
+			offset -= segmentLen;
+			continue;
+		}
+		unsigned long n = (segmentLen - offset < len) ? segmentLen - offset : len;
+		memcpy(pBuf, pFile->pSegments[i] + offset, n);
+		pBuf += n;
+		len -= n;
+		offset = 0;
+	}
+}
+
+static unsigned short get_sw(char const *const pRsp, unsigned short const rspLen)
+{
+	if (rspLen < 2) {
+		return 0;
+	}
+	return (unsigned short)(((pRsp[rspLen - 2] & 0xff) << 8) | (pRsp[rspLen - 1] & 0xff));
+}
+
+/*!
+ * \brief Function writes a LOAD command as a MTY 0x01 message.<br>
+ *
+ * \retval length of the message.
+ */
+static unsigned short set_load(
+    CAPLOAD_FILE const *const pFile,
+    unsigned int const blockSize,
+    unsigned int const block,
+    unsigned int const blocks,
+    char *const pMsg
+)
+{
+	unsigned long offset = (unsigned long)block * blockSize;
+	unsigned long len = (pFile->size - offset < blockSize) ? pFile->size - offset : blockSize;
+	char *pApdu = pMsg + JCOP_MSG_HEADER_SIZE;
+	unsigned short apduLen = 0;
+	pApdu[apduLen++] = (char)0x80;
+	pApdu[apduLen++] = (char)0xE8;
+	pApdu[apduLen++] = (char)((block + 1 == blocks) ? 0x80 : 0x00);	// last block.
+	pApdu[apduLen++] = (char)block;
+	if (blockSize > CAPLOAD_SHORT_BLOCK) {
+		pApdu[apduLen++] = 0x00;
+		pApdu[apduLen++] = (char)(len >> 8);
+	}
+	pApdu[apduLen++] = (char)len;
+	copy_data(pFile, offset, pApdu + apduLen, len);
+	apduLen += (unsigned short)len;
+	return (unsigned short)JCOP_MSG_setHeader(pMsg, JCOP_MSG_MTY_APDU, 0x00, apduLen);
+}
+
+/*!
+ * \brief Function sends INSTALL [for load] to the Issuer Security Domain.<br>
+ */
+static int install_for_load(CAPLOAD_FILE const *const pFile, CAPLOAD_STATS *const pStats)
+{
+	char snd[JCOP_MSG_HEADER_SIZE + 5 + 5 + sizeof(pFile->aid) + 1];
+	char rcv[JCOP_PROXY_BUFFER_SIZE];
+	char *pApdu = snd + JCOP_MSG_HEADER_SIZE;
+	unsigned short apduLen = 0;
+	pApdu[apduLen++] = (char)0x80;
+	pApdu[apduLen++] = (char)0xE6;
+	pApdu[apduLen++] = 0x02;	// for load.
+	pApdu[apduLen++] = 0x00;
+	pApdu[apduLen++] = (char)(pFile->aidLen + 5);
+	pApdu[apduLen++] = (char)pFile->aidLen;
+	memcpy(pApdu + apduLen, pFile->aid, pFile->aidLen);
+	apduLen += pFile->aidLen;
+	pApdu[apduLen++] = 0x00;	// the Issuer Security Domain.
+	pApdu[apduLen++] = 0x00;	// no Load File Data Block Hash.
+	pApdu[apduLen++] = 0x00;	// no Load Parameters.
+	pApdu[apduLen++] = 0x00;	// no Load Token.
+	pApdu[apduLen++] = 0x00;	// Le.
+	unsigned short sndLen = (unsigned short)JCOP_MSG_setHeader(snd, JCOP_MSG_MTY_APDU, 0x00, apduLen);
+
+	unsigned short rcvLen = sizeof(rcv);
+	int status = JCOP_SIMUL_transmit(snd, sndLen, rcv, &rcvLen);
+	pStats->exchanges++;
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		pStats->transmitStatus = status;
+		pStats->ins = 0xE6;
+		return CAPLOAD_ERROR_TRANSMIT;
+	}
+	pStats->sw = get_sw(rcv, rcvLen);
+	if (pStats->sw != 0x9000) {
+		pStats->ins = 0xE6;
+		return CAPLOAD_ERROR_SW;
+	}
+	return CAPLOAD_NO_ERROR;
+}
+
+/*!
+ * \brief Function loads a file by INSTALL [for load] and LOAD.<br>
+ * <br>
+ * \param [in] pFile a file of CAPLOAD_open.
+ * \param [in] blockSize LOAD block size (CAPLOAD_getMaxBlockSize or less).
+ * \param [in] window LOADs sent before the answers are read, 1: one by one.
+ * \param [out] pStats the result, filled even if failed.
+ *
+ * \retval CAPLOAD_NO_ERROR
+ * \retval CAPLOAD_ERROR_TOO_LARGE
+ * \retval CAPLOAD_ERROR_TRANSMIT
+ * \retval CAPLOAD_ERROR_SW
+ */
+int CAPLOAD_load(
+    CAPLOAD_FILE const *const pFile,
+    unsigned int const blockSize,
+    unsigned int const window,
+    CAPLOAD_STATS *const pStats
+)
+{
+	memset(pStats, 0, sizeof(CAPLOAD_STATS));
+	pStats->blockSize = blockSize;
+	if (blockSize == 0 || blockSize > EXTENDED_BLOCK || window == 0 || window > CAPLOAD_MAX_WINDOW) {
+		return CAPLOAD_ERROR_TOO_LARGE;
+	}
+	unsigned int blocks = (unsigned int)((pFile->size + blockSize - 1) / blockSize);
+	if (blocks > MAX_BLOCKS) {
+		dbg_warn("%u LOAD blocks of %u bytes needed", blocks, blockSize);
+		return CAPLOAD_ERROR_TOO_LARGE;
+	}
+	char *pSnd = (char *)malloc(window * JCOP_PROXY_BUFFER_SIZE);
+	if (pSnd == NULL) {
+		pStats->transmitStatus = JCOP_SIMUL_ERROR_OTHER;
+		return CAPLOAD_ERROR_TRANSMIT;
+	}
+
+	OSDEP_INT64 start = OSDEP_now();
+	int status = install_for_load(pFile, pStats);
+
+	JCOP_SIMUL_BATCH_CMD cmds[CAPLOAD_MAX_WINDOW];
+	JCOP_SIMUL_BATCH_RESULT results[CAPLOAD_MAX_WINDOW];
+	char rcv[JCOP_PROXY_BUFFER_SIZE];
+	for (unsigned int block = 0; block < blocks && status == CAPLOAD_NO_ERROR; ) {
+		unsigned int n = (blocks - block < window) ? blocks - block : window;
+		for (unsigned int i = 0; i < n; i++) {
+			cmds[i].pSnd = pSnd + i * JCOP_PROXY_BUFFER_SIZE;
+			cmds[i].sndLen = set_load(pFile, blockSize, block + i, blocks, pSnd + i * JCOP_PROXY_BUFFER_SIZE);
+		}
+
+		unsigned short rcvLen = sizeof(rcv);
+		unsigned int done = 0;
+		int transmitStatus;
+		if (n == 1) {
+			transmitStatus = JCOP_SIMUL_transmit(cmds[0].pSnd, cmds[0].sndLen, rcv, &rcvLen);
+			results[0].pRsp = rcv;
+			results[0].rspLen = rcvLen;
+			done = (transmitStatus == JCOP_SIMUL_NO_ERROR) ? 1 : 0;
+		} else {
+			transmitStatus = JCOP_SIMUL_transmitPipelined(cmds, n, results, &done, rcv, &rcvLen);
+		}
+		pStats->exchanges++;
+
+		for (unsigned int i = 0; i < done; i++) {
+			pStats->sw = get_sw(results[i].pRsp, results[i].rspLen);
+			if (pStats->sw != 0x9000) {
+				dbg_warn("LOAD %u/%u failed - SW: %04X", block + i + 1, blocks, pStats->sw);
+				status = CAPLOAD_ERROR_SW;
+				break;
+			}
+			unsigned long offset = (unsigned long)(block + i) * blockSize;
+			pStats->blocks++;
+			pStats->bytes += (pFile->size - offset < blockSize) ? pFile->size - offset : blockSize;
+		}
+		if (status == CAPLOAD_NO_ERROR && (transmitStatus != JCOP_SIMUL_NO_ERROR || done < n)) {
+			pStats->transmitStatus = (transmitStatus != JCOP_SIMUL_NO_ERROR) ? transmitStatus : JCOP_SIMUL_ERROR_OTHER;
+			status = CAPLOAD_ERROR_TRANSMIT;
+		}
+		if (status != CAPLOAD_NO_ERROR) {
+			pStats->ins = 0xE8;
+		}
+		block += n;
+	}
+	pStats->ticks = OSDEP_now() - start;
+	free(pSnd);
+	return status;
+}
+
+/*!
+ * \brief Function describes a CAPLOAD_ERROR_XXX.<br>
+ */
+char const *CAPLOAD_getErrorText(int const status)
+{
+	switch (status) {
+		case CAPLOAD_NO_ERROR :
+			return "no error";
+		case CAPLOAD_ERROR_OPEN :
+			return "can't open";
+		case CAPLOAD_ERROR_FORMAT :
+			return "not a CAP or IJC file";
+		case CAPLOAD_ERROR_COMPRESSED :
+			return "compressed CAP file (store the components, or use the IJC file)";
+		case CAPLOAD_ERROR_TOO_LARGE :
+			return "more than 256 LOAD blocks";
+		case CAPLOAD_ERROR_TRANSMIT :
+			return "transmit failed";
+		default :
+			return "unexpected SW";
+	}
+}
@@ -0,0 +1,103 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*!
+ * \file capload.h
+ * \brief prototypes for the loader of CAP files.
+ * \author Kenichi Kanai
+ *
+ * The Load File Data Block (C4 Length, then the components in the order of
+ * GlobalPlatform) is read from a memory-mapped CAP file (a JAR whose
+ * components are stored, not compressed) or IJC file (the components one
+ * after another), and sent by INSTALL [for load] and LOAD commands.
+ *
+ * A LOAD block is as large as the card takes: 255 bytes, or what fits the
+ * transport buffer if the ATR announces extended Lc and Le. LOADs are sent
+ * a window at a time by JCOP_SIMUL_transmitPipelined, so the blocks after a
+ * failed one are sent as well; the card rejects them by the block number.
+ *
+ * The commands are sent as they are (no C-MAC); the card must accept them,
+ * e.g. by a secure channel the caller opened before.
+ */
+#ifndef __CAPLOAD__
+#define __CAPLOAD__
+
+#include "osdep.h"
+
+#define CAPLOAD_NO_ERROR		0x00
+#define CAPLOAD_ERROR_OPEN		0x01	// can't map the file.
+#define CAPLOAD_ERROR_FORMAT		0x02	// not a CAP or IJC file.
+#define CAPLOAD_ERROR_COMPRESSED	0x03	// a component is deflated.
+#define CAPLOAD_ERROR_TOO_LARGE		0x04	// more than 256 LOAD blocks.
+#define CAPLOAD_ERROR_TRANSMIT		0x05	// see transmitStatus.
+#define CAPLOAD_ERROR_SW		0x06	// see sw.
+
+#define CAPLOAD_SHORT_BLOCK	255	// Lc of a short C-APDU.
+#define CAPLOAD_DEFAULT_WINDOW	8	// LOADs sent before the answers are read.
+#define CAPLOAD_MAX_WINDOW	16
+#define CAPLOAD_MAX_SEGMENTS	11	// C4 Length and 10 components.
+
+/*!
+ * \brief a mapped CAP or IJC file.<br>
+ */
+typedef struct _CAPLOAD_FILE {
+	OSDEP_MAPPING mapping;
+	char prefix[5];			// C4 Length.
+	int segmentCount;
+	char const *pSegments[CAPLOAD_MAX_SEGMENTS];	// in the order of LOAD.
+	unsigned long segmentLens[CAPLOAD_MAX_SEGMENTS];
+	unsigned long size;		// Load File Data Block including C4 Length.
+	unsigned char aidLen;		// package AID (Header component).
+	char aid[16];
+} CAPLOAD_FILE;
+
+/*!
+ * \brief the result of CAPLOAD_load.<br>
+ */
+typedef struct _CAPLOAD_STATS {
+	unsigned long bytes;		// Load File Data Block sent.
+	unsigned int blocks;		// LOAD commands.
+	unsigned int blockSize;
+	unsigned int exchanges;		// transport calls (INSTALL and the windows of LOAD).
+	OSDEP_INT64 ticks;		// INSTALL [for load] to the last LOAD.
+	int transmitStatus;		// JCOP_SIMUL_XXX of a failed transmit.
+	unsigned char ins;		// INS of the command which failed (E6 or E8).
+	unsigned short sw;		// SW of the command which failed.
+} CAPLOAD_STATS;
+
+int CAPLOAD_open(char const *const pPath, CAPLOAD_FILE *const pFile);
+void CAPLOAD_close(CAPLOAD_FILE *const pFile);
+unsigned int CAPLOAD_getMaxBlockSize(char const *const pAtr, unsigned short const atrLen);
+int CAPLOAD_load(
+    CAPLOAD_FILE const *const pFile,
+    unsigned int const blockSize,
+    unsigned int const window,
+    CAPLOAD_STATS *const pStats
+);
+char const *CAPLOAD_getErrorText(int const status);
+
+#endif // __CAPLOAD__
@@ -0,0 +1,670 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*!
+ * \file chanmux.cpp
+ * \brief Source file that shares one simulator session by logical channels.
+ * \author Kenichi Kanai
+ */
+#include <string.h>
+
+#include "osdep.h"
+#include "shared_data.h"
+#include "jcop_msg.h"
+#include "jcop_simul.h"
+#include "chanmux.h"
+#define DBG_CATEGORY DBG_CAT_TRANSPORT
+#include "dbglog.h"
+
+#define INS_MANAGE_CHANNEL	0x70
+#define INS_GET_RESPONSE	0xC0
+#define MAX_CHANNEL		19	// further interindustry CLA: 4 to 19.
+
+static JCOP_SIMUL_BACKEND const *g_pBase = NULL;
+
+// the shared session, detached while no client uses it.
+static void *g_pSession = NULL;
+static long g_generation = 0;	// incremented when the session is lost.
+static char g_atr[JCOP_PROXY_MAX_ATR_SIZE];
+static unsigned short g_atrLen = 0;
+
+// a client of the scheduler: a channel, used by one thread at a time.
+typedef struct _CLIENT {
+	long volatile inUse;
+	long volatile isGranted;	// its command may use the session.
+	OSDEP_EVENT granted;	// set when isGranted is set by another thread.
+	bool hasEvent;		// granted is created, kept for the next user of the slot.
+	int channel;		// 0: no channel.
+	long generation;	// g_generation when the channel was opened.
+	bool isWaiting;
+	int lane;
+	OSDEP_INT64 deficit;	// session time left in this round (ticks).
+	OSDEP_INT64 queued;	// when the waiting command was queued.
+	OSDEP_INT64 started;	// when the command got the session.
+} CLIENT;
+
+#define MAX_CLIENTS 256
+
+// the scheduler state is guarded by g_schedLock.
+static long volatile g_schedLock = 0;
+static CLIENT g_clients[MAX_CLIENTS];
+static int g_clientCount = 0;	// slots used so far.
+static bool g_isBusy = false;	// a client uses the session.
+static unsigned int g_queued[CHANMUX_LANES];
+static int g_next[CHANMUX_LANES];	// round robin position.
+static unsigned int g_shortRun = 0;	// short commands served in a row.
+static unsigned int g_maxQueued = 0;	// 0: no limit.
+static OSDEP_INT64 g_quantum = 0;
+static CHANMUX_STATS g_stats;
+
+// the client slot attached to the calling thread, -1: none.
+static OSDEP_THREAD_LOCAL int g_client = -1;
+
+static void sched_lock(void)
+{
+	while (OSDEP_atomicCompareExchange(&g_schedLock, 1, 0) != 0) {
+		OSDEP_sleep(0);
+	}
+}
+
+static void sched_unlock(void)
+{
+	OSDEP_atomicRelease(&g_schedLock, 0);
+}
+
+/*!
+ * \brief Function picks the next client of a lane by deficit round robin
+ * (scheduler locked).<br>
+ * <br>
+ * A client is picked in turn if it has session time left; when no waiting
+ * client has any, the clients of the lane get quanta for as many rounds
+ * as the first of them needs.
+ */
+static int pick(int const lane)
+{
+	for (;;) {
+		OSDEP_INT64 rounds = 0;
+		for (int n = 0; n < g_clientCount; n++) {
+			int i = (g_next[lane] + n) % g_clientCount;
+			CLIENT *pClient = &g_clients[i];
+			if (!pClient->isWaiting || pClient->lane != lane) {
+				continue;
+			}
+			if (pClient->deficit > 0) {
+				g_next[lane] = (i + 1) % g_clientCount;
+				return i;
+			}
+			OSDEP_INT64 needed = (g_quantum - pClient->deficit) / g_quantum;
+			if (rounds == 0 || needed < rounds) {
+				rounds = needed;
+			}
+		}
+		for (int i = 0; i < g_clientCount; i++) {
+			CLIENT *pClient = &g_clients[i];
+			if (pClient->isWaiting && pClient->lane == lane) {
+				pClient->deficit += g_quantum * rounds;
+			}
+		}
+	}
+}
+
+/*!
+ * \brief Function hands the session to the next waiting command (scheduler
+ * locked).<br>
+ * <br>
+ * \retval the client of the command, to be woken by grant.
+ * \retval NULL no command is waiting.
+ */
+static CLIENT *dispatch(void)
+{
+	int lane = CHANMUX_LANE_SHORT;
+	if (g_queued[CHANMUX_LANE_SHORT] == 0
+	        || (g_queued[CHANMUX_LANE_BULK] > 0 && g_shortRun >= CHANMUX_SHORT_BURST)) {
+		lane = CHANMUX_LANE_BULK;
+	}
+	if (g_queued[lane] == 0) {
+		return NULL;
+	}
+	g_shortRun = (lane == CHANMUX_LANE_SHORT) ? g_shortRun + 1 : 0;
+
+	CLIENT *pClient = &g_clients[pick(lane)];
+	pClient->isWaiting = false;
+	g_queued[lane]--;
+	OSDEP_INT64 waited = OSDEP_now() - pClient->queued;
+	g_stats.lanes[lane].commands++;
+	g_stats.lanes[lane].waitTicks += waited;
+	HISTOGRAM_record(&g_stats.lanes[lane].wait, OSDEP_toNsec(waited));
+	return pClient;
+}
+
+/*!
+ * \brief Function wakes the client picked by dispatch (not locked).<br>
+ */
+static void grant(CLIENT *const pClient)
+{
+	OSDEP_atomicExchange(&pClient->isGranted, 1);
+	OSDEP_setEvent(&pClient->granted);
+}
+
+/*!
+ * \brief Function returns the client slot of the calling thread.<br>
+ */
+static CLIENT *get_client(void)
+{
+	if (g_client >= 0) {
+		return &g_clients[g_client];
+	}
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		CLIENT *pClient = &g_clients[i];
+		if (OSDEP_atomicCompareExchange(&pClient->inUse, 1, 0) == 0) {
+			if (!pClient->hasEvent) {
+				if (OSDEP_createEvent(&pClient->granted) != 0) {
+					OSDEP_atomicExchange(&pClient->inUse, 0);
+					return NULL;
+				}
+				pClient->hasEvent = true;
+			}
+			sched_lock();
+			pClient->isWaiting = false;
+			pClient->deficit = g_quantum;
+			pClient->channel = 0;
+			if (g_clientCount <= i) {
+				g_clientCount = i + 1;
+			}
+			sched_unlock();
+			g_client = i;
+			return pClient;
+		}
+	}
+	return NULL;
+}
+
+/*!
+ * \brief Function releases the client slot of the calling thread.<br>
+ */
+static void put_client(void)
+{
+	if (g_client >= 0) {
+		OSDEP_atomicExchange(&g_clients[g_client].inUse, 0);
+		g_client = -1;
+	}
+}
+
+/*!
+ * \brief Function waits until the scheduler gives the session to the
+ * calling client.<br>
+ * <br>
+ * \param [in] lane CHANMUX_LANE_XXX.
+ * \param [in] canRefuse the command may be refused when the lane is full.
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval JCOP_SIMUL_ERROR_BUSY the lane is full.
+ * \retval JCOP_SIMUL_ERROR_OTHER too many clients (or no event for one).
+ */
+static int acquire(int const lane, bool const canRefuse)
+{
+	CLIENT *pClient = get_client();
+	if (pClient == NULL) {
+		dbg_err("too many clients");
+		return JCOP_SIMUL_ERROR_OTHER;
+	}
+	sched_lock();
+	if (canRefuse && g_maxQueued != 0 && g_queued[lane] >= g_maxQueued) {
+		g_stats.lanes[lane].rejected++;
+		sched_unlock();
+		return JCOP_SIMUL_ERROR_BUSY;
+	}
+	pClient->isWaiting = true;
+	pClient->lane = lane;
+	pClient->queued = OSDEP_now();
+	OSDEP_atomicExchange(&pClient->isGranted, 0);
+	g_queued[lane]++;
+	bool isGranted = false;
+	if (!g_isBusy) {
+		isGranted = (dispatch() != NULL);	// the calling client, the only one waiting.
+		g_isBusy = isGranted;
+	}
+	sched_unlock();
+
+	if (!isGranted) {
+		// the client using the session grants it in release.
+		while (OSDEP_atomicRead(&pClient->isGranted) == 0) {
+			OSDEP_waitEvent(&pClient->granted);
+		}
+	}
+	pClient->started = OSDEP_now();
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+/*!
+ * \brief Function charges the client for the session time and hands the
+ * session over.<br>
+ */
+static void release(void)
+{
+	CLIENT *pClient = &g_clients[g_client];
+	OSDEP_INT64 used = OSDEP_now() - pClient->started;
+	sched_lock();
+	pClient->deficit -= used;
+	CLIENT *pNext = dispatch();
+	g_isBusy = (pNext != NULL);
+	sched_unlock();
+	if (pNext != NULL) {
+		grant(pNext);
+	}
+}
+
+/*!
+ * \brief Function exchanges a message on the shared session (locked).<br>
+ */
+static int exchange(char const *const pSnd, unsigned short const sndLen, char *const pRcv, unsigned short *const pRcvLen)
+{
+	if (g_pSession == NULL) {
+		return JCOP_SIMUL_ERROR_INITIALIZE;
+	}
+	g_pBase->attach(g_pSession);
+	int status = g_pBase->transmit(pSnd, sndLen, pRcv, pRcvLen);
+	g_pSession = g_pBase->detach();
+	if (g_pSession == NULL) {
+		dbg_warn("the shared session is lost");
+		g_generation++;	// every channel is gone with it.
+		g_atrLen = 0;
+	}
+	sched_lock();	// CHANMUX_getStats may read the stats.
+	g_stats.commands++;
+	sched_unlock();
+	return status;
+}
+
+/*!
+ * \brief Function powers up the shared session if there is none (locked).<br>
+ */
+static int open_session(void)
+{
+	if (g_pSession != NULL) {
+		return JCOP_SIMUL_NO_ERROR;
+	}
+	unsigned short atrLen = sizeof(g_atr);
+	int status = g_pBase->powerUp(g_atr, &atrLen);
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		g_pBase->close();
+		return status;
+	}
+	g_pSession = g_pBase->detach();
+	if (g_pSession == NULL) {
+		return JCOP_SIMUL_ERROR_OTHER;
+	}
+	g_atrLen = atrLen;
+	g_generation++;
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+/*!
+ * \brief Function sends MANAGE CHANNEL (locked).<br>
+ * <br>
+ * \param [in] p1 00: open (a channel is assigned), 80: close.
+ * \param [in,out] pChannel channel to close, or the channel opened.
+ */
+static int manage_channel(unsigned char const p1, int *const pChannel)
+{
+	char snd[JCOP_MSG_HEADER_SIZE + 5];
+	char rcv[16];
+	unsigned short sndLen = (unsigned short)JCOP_MSG_setHeader(snd, JCOP_MSG_MTY_APDU, 0x00, (p1 == 0x00) ? 5 : 4);
+	snd[JCOP_MSG_HEADER_SIZE + 0] = 0x00;
+	snd[JCOP_MSG_HEADER_SIZE + 1] = INS_MANAGE_CHANNEL;
+	snd[JCOP_MSG_HEADER_SIZE + 2] = (char)p1;
+	snd[JCOP_MSG_HEADER_SIZE + 3] = (p1 == 0x00) ? 0x00 : (char)*pChannel;
+	snd[JCOP_MSG_HEADER_SIZE + 4] = 0x01;	// Le of open.
+	unsigned short rcvLen = sizeof(rcv);
+	int status = exchange(snd, sndLen, rcv, &rcvLen);
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		return status;
+	}
+	if (rcvLen < 2 || rcv[rcvLen - 2] != (char)0x90 || rcv[rcvLen - 1] != 0x00) {
+		dbg_warn("MANAGE CHANNEL %02X failed - SW: %02X%02X", p1, rcv[rcvLen - 2] & 0xff, rcv[rcvLen - 1] & 0xff);
+		return JCOP_SIMUL_ERROR_OTHER;
+	}
+	if (p1 == 0x00) {
+		if (rcvLen != 3 || rcv[0] < 1 || rcv[0] > MAX_CHANNEL) {
+			return JCOP_SIMUL_ERROR_OTHER;
+		}
+		*pChannel = rcv[0];
+		sched_lock();
+		g_stats.channels++;
+		sched_unlock();
+	}
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+/*!
+ * \brief Function rewrites the logical channel of an interindustry CLA.<br>
+ * <br>
+ * The chaining bit, the secure messaging indication and b8 (proprietary
+ * class, e.g. GlobalPlatform 80 and 84) are kept.
+ */
+static unsigned char set_channel(unsigned char const cla, int const channel)
+{
+	if (cla == 0xFF) {
+		return cla;	// invalid (PPS).
+	}
+	unsigned char kept = cla & 0x90;	// b8 and chaining.
+	bool isFirst = ((cla & 0x40) == 0);
+	unsigned char sm = isFirst ? (cla & 0x0C) : (unsigned char)(((cla & 0x20) != 0) ? 0x08 : 0x00);
+	if (channel <= 3) {
+		return kept | sm | (unsigned char)channel;
+	}
+	return kept | 0x40 | ((sm != 0) ? 0x20 : 0x00) | (unsigned char)(channel - 4);
+}
+
+static bool has_channel(CLIENT const *const pClient)
+{
+	return pClient->channel != 0 && pClient->generation == g_generation;
+}
+
+/*!
+ * \brief Function fetches the response data announced by SW 61xx on the
+ * channel of the client before the session is handed over (locked).<br>
+ * <br>
+ * A command of another client would end the GET RESPONSE chain, so the
+ * whole chain is sent in one turn: the client gets the data of every GET
+ * RESPONSE and the last SW. Only when pRcv is full is 61xx left to the
+ * client.
+ * <br>
+ * \param [in] pClient the client.
+ * \param [in] nad NAD of the C-APDU.
+ * \param [in,out] pRcv R-APDU of the C-APDU, then with the response data.
+ * \param [in] rcvSize size of pRcv.
+ * \param [in,out] pRcvLen length of the R-APDU.
+ */
+static int get_responses(
+    CLIENT const *const pClient,
+    char const nad,
+    char *const pRcv,
+    unsigned short const rcvSize,
+    unsigned short *const pRcvLen
+)
+{
+	unsigned short dataLen = *pRcvLen - 2;
+	while ((unsigned char)pRcv[dataLen] == 0x61 && dataLen + 2 < rcvSize) {
+		unsigned short avail = (unsigned char)pRcv[dataLen + 1];
+		if (avail == 0) {
+			avail = 256;
+		}
+		unsigned short room = rcvSize - dataLen - 2;
+		unsigned short le = (avail < room) ? avail : room;
+
+		char snd[JCOP_MSG_HEADER_SIZE + 5];
+		JCOP_MSG_setHeader(snd, JCOP_MSG_MTY_APDU, (unsigned char)nad, 5);
+		snd[JCOP_MSG_HEADER_SIZE + 0] = (char)set_channel(0x00, pClient->channel);
+		snd[JCOP_MSG_HEADER_SIZE + 1] = (char)INS_GET_RESPONSE;
+		snd[JCOP_MSG_HEADER_SIZE + 2] = 0x00;
+		snd[JCOP_MSG_HEADER_SIZE + 3] = 0x00;
+		snd[JCOP_MSG_HEADER_SIZE + 4] = (char)(le & 0xff);
+		unsigned short len = rcvSize - dataLen;
+		int status = exchange(snd, sizeof(snd), pRcv + dataLen, &len);
+		if (status != JCOP_SIMUL_NO_ERROR) {
+			return status;
+		}
+		if (len < 2) {
+			return JCOP_SIMUL_ERROR_OTHER;
+		}
+		dataLen += len - 2;
+		if (len == 2) {
+			break;	// no data, e.g. 6F00.
+		}
+	}
+	*pRcvLen = dataLen + 2;
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+/*!
+ * \brief Function opens a new channel for the calling client; the channel
+ * used so far is closed. The card itself is powered up only once (see
+ * chanmux.h).<br>
+ */
+static int mux_powerUp(char *const pAtr, unsigned short *const pAtrLen)
+{
+	int status = acquire(CHANMUX_LANE_SHORT, false);	// C-APDUs are refused, not clients.
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		*pAtrLen = 0;
+		return status;
+	}
+	CLIENT *pClient = &g_clients[g_client];
+	status = open_session();
+	if (status == JCOP_SIMUL_NO_ERROR && *pAtrLen < g_atrLen) {
+		status = JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL;
+	}
+	if (status == JCOP_SIMUL_NO_ERROR) {
+		if (has_channel(pClient)) {
+			manage_channel(0x80, &pClient->channel);
+		}
+		pClient->channel = 0;
+		status = manage_channel(0x00, &pClient->channel);
+		pClient->generation = g_generation;
+	}
+	if (status == JCOP_SIMUL_NO_ERROR) {
+		memcpy(pAtr, g_atr, g_atrLen);
+		*pAtrLen = g_atrLen;
+	} else {
+		*pAtrLen = 0;
+	}
+	int channel = pClient->channel;
+	release();
+	dbg_log("channel %d opened", channel);
+	return status;
+}
+
+static int mux_transmit(
+    char const *const pSnd,
+    const unsigned short sndLen,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	if (sndLen < JCOP_MSG_HEADER_SIZE + 4 || sndLen > JCOP_PROXY_BUFFER_SIZE) {
+		return JCOP_SIMUL_ERROR_OTHER;
+	}
+	if (pSnd[JCOP_MSG_HEADER_SIZE + 1] == INS_MANAGE_CHANNEL) {
+		if (*pRcvLen < 2) {
+			return JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL;
+		}
+		pRcv[0] = (char)0x68;	// 6881: logical channel not supported.
+		pRcv[1] = (char)0x81;
+		*pRcvLen = 2;
+		return JCOP_SIMUL_NO_ERROR;
+	}
+	unsigned short const rcvSize = *pRcvLen;
+	char snd[JCOP_PROXY_BUFFER_SIZE];
+	memcpy(snd, pSnd, sndLen);
+
+	int lane = (sndLen - JCOP_MSG_HEADER_SIZE <= CHANMUX_SHORT_APDU_SIZE) ? CHANMUX_LANE_SHORT : CHANMUX_LANE_BULK;
+	int status = acquire(lane, true);
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		return status;
+	}
+	CLIENT *pClient = &g_clients[g_client];
+	status = JCOP_SIMUL_ERROR_INITIALIZE;	// power up first.
+	if (has_channel(pClient)) {
+		snd[JCOP_MSG_HEADER_SIZE] = (char)set_channel((unsigned char)pSnd[JCOP_MSG_HEADER_SIZE], pClient->channel);
+		status = exchange(snd, sndLen, pRcv, pRcvLen);
+		if (status == JCOP_SIMUL_NO_ERROR && *pRcvLen >= 2) {
+			status = get_responses(pClient, pSnd[1], pRcv, rcvSize, pRcvLen);
+		}
+	}
+	release();
+	return status;
+}
+
+static void mux_close()
+{
+	if (g_client < 0) {
+		return;
+	}
+	CLIENT *pClient = &g_clients[g_client];
+	if (pClient->channel != 0 && acquire(CHANMUX_LANE_SHORT, false) == JCOP_SIMUL_NO_ERROR) {
+		if (has_channel(pClient)) {
+			manage_channel(0x80, &pClient->channel);
+		}
+		release();
+	}
+	pClient->channel = 0;
+	put_client();
+}
+
+/*!
+ * \brief Function hands the channel of the calling thread over, e.g. to the
+ * route of another NAD or from a pool thread.<br>
+ * <br>
+ * \retval client for mux_attach, or NULL if there is no channel.
+ */
+static void *mux_detach()
+{
+	if (g_client < 0 || g_clients[g_client].channel == 0) {
+		return NULL;
+	}
+	CLIENT *pClient = &g_clients[g_client];
+	g_client = -1;
+	return pClient;
+}
+
+/*!
+ * \brief Function closes the channel of the calling thread and uses the
+ * client detached by mux_detach instead.<br>
+ */
+static void mux_attach(void *const pSession)
+{
+	mux_close();
+	g_client = (int)((CLIENT *)pSession - g_clients);
+}
+
+static void mux_discard(void *const pSession)
+{
+	int client = g_client;
+	g_client = (int)((CLIENT *)pSession - g_clients);
+	mux_close();
+	g_client = client;
+}
+
+static JCOP_SIMUL_BACKEND const g_muxBackend = {
+	mux_powerUp,
+	mux_transmit,
+	mux_close,
+	mux_detach,
+	mux_attach,
+	mux_discard,
+	NULL
+};
+
+/*!
+ * \brief Function shares a session of a backend.<br>
+ * <br>
+ * \param [in] pBase the backend (JCOP_SIMUL_getBackend), which must be able
+ *		to detach sessions.
+ * \param [in] maxQueued commands which may wait in a lane, 0: no limit.
+ *
+ * \retval CHANMUX_NO_ERROR
+ * \retval CHANMUX_ERROR_BACKEND
+ */
+int CHANMUX_open(JCOP_SIMUL_BACKEND const *const pBase, unsigned int const maxQueued)
+{
+	if (pBase->detach == NULL || pBase->attach == NULL) {
+		return CHANMUX_ERROR_BACKEND;
+	}
+	g_pBase = pBase;
+	g_pSession = NULL;
+	g_atrLen = 0;
+	g_maxQueued = maxQueued;
+	g_quantum = OSDEP_fromUsec(CHANMUX_QUANTUM_USEC);
+	g_isBusy = false;
+	g_shortRun = 0;
+	for (int lane = 0; lane < CHANMUX_LANES; lane++) {
+		g_queued[lane] = 0;
+		g_next[lane] = 0;
+		g_stats.lanes[lane].commands = 0;
+		g_stats.lanes[lane].rejected = 0;
+		g_stats.lanes[lane].waitTicks = 0;
+		HISTOGRAM_reset(&g_stats.lanes[lane].wait);
+	}
+	g_stats.commands = 0;
+	g_stats.channels = 0;
+	return CHANMUX_NO_ERROR;
+}
+
+/*!
+ * \brief Function closes the shared session after the clients closed.<br>
+ */
+void CHANMUX_close(void)
+{
+	if (g_pSession != NULL) {
+		g_pBase->attach(g_pSession);
+		g_pBase->close();
+		g_pSession = NULL;
+	}
+	g_generation++;
+}
+
+/*!
+ * \brief Function returns the backend to be set by JCOP_SIMUL_setBackend.<br>
+ */
+JCOP_SIMUL_BACKEND const *CHANMUX_getBackend(void)
+{
+	return &g_muxBackend;
+}
+
+/*!
+ * \brief Function returns the commands sent to the shared session and the
+ * queueing of each lane.<br>
+ */
+void CHANMUX_getStats(CHANMUX_STATS *const pStats)
+{
+	sched_lock();
+	*pStats = g_stats;
+	sched_unlock();
+}
+
+/*!
+ * \brief Function returns the counts of a lane, without the copy of the
+ * histograms made by CHANMUX_getStats.<br>
+ * <br>
+ * \param [in] lane CHANMUX_LANE_XXX.
+ * \param [out] pCommands commands which got the session.
+ * \param [out] pRejected commands refused, the lane was full.
+ * \param [out] pWaitTicks total time the commands waited.
+ */
+void CHANMUX_getCounts(
+    int const lane,
+    unsigned long *const pCommands,
+    unsigned long *const pRejected,
+    OSDEP_INT64 *const pWaitTicks
+)
+{
+	sched_lock();
+	*pCommands = g_stats.lanes[lane].commands;
+	*pRejected = g_stats.lanes[lane].rejected;
+	*pWaitTicks = g_stats.lanes[lane].waitTicks;
+	sched_unlock();
+}
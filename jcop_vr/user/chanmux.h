@@ -0,0 +1,104 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*!
+ * \file chanmux.h
+ * \brief prototypes for the backend which shares one simulator session by
+ * logical channels.
+ * \author Kenichi Kanai
+ *
+ * Every client of the backend (a thread, or a session detached from one
+ * thread and attached to another) gets a logical channel of one card
+ * instead of its own simulator session, and the CLA of each C-APDU is
+ * rewritten to the channel. A client sees the card as if it had the basic
+ * channel; it can't manage channels itself (SW 6881).
+ *
+ * A power up of a client does not reset the card. The shared session is
+ * powered up once, by the first client, and every client gets its ATR. A
+ * later power up only closes the channel of the client and opens a new
+ * one by MANAGE CHANNEL: the new channel starts with the default applet
+ * selected and no security state, but the applets keep their persistent
+ * data and the transient data not cleared on deselect, and the channels of
+ * the other clients stay open. They are not told about it. A client which
+ * needs a fresh card needs its own session, not the backend.
+ *
+ * SW 61xx is answered by GET RESPONSE on the channel in the same turn, so
+ * the chain of one client is not broken by the commands of another; the
+ * client gets the data of the whole chain.
+ *
+ * The commands of the clients go to the shared session one at a time. A
+ * scheduler picks the next one by deficit round robin: every client earns
+ * a quantum of session time per round and pays the time its commands
+ * took, so a client sending long LOADs or generating keys gets the same
+ * share as one sending SELECTs, not more. Short C-APDUs have their own
+ * lane which is served first (but bulk commands get a turn after
+ * CHANMUX_SHORT_BURST short ones), and a lane can admit a limited number of
+ * waiting commands; a command over the limit fails at once.
+ */
+#ifndef __CHANMUX__
+#define __CHANMUX__
+
+#include "osdep.h"
+#include "jcop_simul.h"
+#include "histogram.h"
+
+#define CHANMUX_NO_ERROR	0x00
+#define CHANMUX_ERROR_BACKEND	0x01	// the backend can't detach sessions.
+
+#define CHANMUX_LANE_SHORT	0
+#define CHANMUX_LANE_BULK	1
+#define CHANMUX_LANES		2
+
+#define CHANMUX_SHORT_APDU_SIZE	64	// longer C-APDUs go to the bulk lane.
+#define CHANMUX_SHORT_BURST	4	// short commands served while bulk ones wait.
+#define CHANMUX_QUANTUM_USEC	100	// session time earned per round.
+
+typedef struct _CHANMUX_LANE_STATS {
+	unsigned long commands;
+	unsigned long rejected;	// over the queue depth.
+	OSDEP_INT64 waitTicks;	// total time queued.
+	HISTOGRAM wait;	// time queued (nsec).
+} CHANMUX_LANE_STATS;
+
+typedef struct _CHANMUX_STATS {
+	unsigned long commands;	// sent to the shared session, MANAGE CHANNEL included.
+	unsigned long channels;	// channels opened.
+	CHANMUX_LANE_STATS lanes[CHANMUX_LANES];
+} CHANMUX_STATS;
+
+int CHANMUX_open(JCOP_SIMUL_BACKEND const *const pBase, unsigned int const maxQueued);
+void CHANMUX_close(void);
+JCOP_SIMUL_BACKEND const *CHANMUX_getBackend(void);
+void CHANMUX_getStats(CHANMUX_STATS *const pStats);
+void CHANMUX_getCounts(
+    int const lane,
+    unsigned long *const pCommands,
+    unsigned long *const pRejected,
+    OSDEP_INT64 *const pWaitTicks
+);
+
+#endif // __CHANMUX__
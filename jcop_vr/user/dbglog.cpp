@@ -38,34 +38,271 @@ extern "C"
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 
 #ifdef __cplusplus
 }
 #endif
 
+#include "osdep.h"
+
 #ifdef MY_DEBUG
 
-static char g_buf[8192];
+#include "dbgring.h"
+#include "hexfmt.h"
+
+unsigned char g_dbgLevel[DBG_CAT_COUNT] = {
+	DBG_LVL_DEFAULT, DBG_LVL_DEFAULT, DBG_LVL_DEFAULT, DBG_LVL_DEFAULT, DBG_LVL_DEFAULT
+};
+
+#define DBG_RING_ENTRIES 1024	// must be a power of 2.
+// prefix + formatted entry + "...(N bytes)".
+#define DBG_BUF_SIZE (64 + DBG_RING_DATA_SIZE * HEXFMT_CHARS_PER_BYTE)
+#define DBG_CONSUMER_INTERVAL 10	// msec.
+#define DBG_LEVEL_ENV "JCOP_PROXY_LOG"
+
+static DBG_RING_ENTRY g_ring[DBG_RING_ENTRIES];
+static volatile long g_head = 0;	// index of the next entry to write.
+static volatile long g_tail = 0;	// index of the next entry to print (advanced by the consumer).
+static volatile long g_lost = 0;	// number of entries dropped, the ring being full.
+
+static OSDEP_THREAD g_consumer;
+static bool g_consumerStarted = false;
+static volatile long g_stop = 0;
+
+static char g_buf[DBG_BUF_SIZE];
+
+/*!
+ * \brief Function claims a ring entry and stamps it.<br>
+ * <br>
+ * \param [in] event event id, DBG_EV_XXX.
+ * \param [in] len original length of data.
+ * \param [out] pIdx index of the claimed entry.
+ *
+ * \retval A pointer to the claimed entry.
+ * \retval NULL the ring is full; the entry is dropped and counted as lost.
+ */
+static DBG_RING_ENTRY *reserve(unsigned short const event, int const len, long *const pIdx)
+{
+	long idx;
+	do {
+		idx = OSDEP_atomicRead(&g_head);
+		if (idx - OSDEP_atomicRead(&g_tail) >= DBG_RING_ENTRIES) {
+			// an entry is never overwritten before the consumer printed it.
+			OSDEP_atomicIncrement(&g_lost);
+			return NULL;
+		}
+	} while (OSDEP_atomicCompareExchange(&g_head, idx + 1, idx) != idx);
+	DBG_RING_ENTRY *pEntry = &g_ring[idx & (DBG_RING_ENTRIES - 1)];
+	OSDEP_atomicExchange(&pEntry->seq, 0);	// the entry is being written.
+	pEntry->event = event;
+	pEntry->len = (unsigned short)((len > 0xFFFF) ? 0xFFFF : len);
+	OSDEP_INT64 ts = OSDEP_now();
+	pEntry->tsLow = (unsigned long)(ts & 0xFFFFFFFF);
+	pEntry->tsHigh = (unsigned long)(ts >> 32);
+	*pIdx = idx;
+	return pEntry;
+}
 
-void dbg_ba2s(char const *const cp, int const cnt)
+/*!
+ * \brief Function publishes a ring entry to the consumer.<br>
+ */
+static void commit(DBG_RING_ENTRY *const pEntry, long const idx)
+{
+	OSDEP_atomicExchange(&pEntry->seq, idx + 1);
+}
+
+/*!
+ * \brief Function formats a ring entry to the output.<br>
+ */
+static void print_entry(DBG_RING_ENTRY const *const pEntry)
 {
 	int n = sprintf(g_buf, "%s", "[jcop_proxy] ");
-	for (int i = 0; i < cnt; i++) {
-		n += sprintf(g_buf + n, "0x%02X:", cp[i] & 0xff);
+	int cnt = (pEntry->len > DBG_RING_DATA_SIZE) ? DBG_RING_DATA_SIZE : pEntry->len;
+	switch (pEntry->event) {
+		case DBG_EV_TEXT :
+			memcpy(g_buf + n, pEntry->data, cnt);
+			n += cnt;
+			break;
+		case DBG_EV_BYTES :
+			n += HEXFMT_encode(g_buf + n, sizeof(g_buf) - n, pEntry->data, cnt);
+			break;
+		default :
+			n += sprintf(g_buf + n, "event 0x%04X", pEntry->event);
+			break;
+	}
+	if (pEntry->len > cnt) {
+		n += sprintf(g_buf + n, "...(%d bytes)", pEntry->len);
 	}
-	printf(g_buf);
-	printf("\n");
+	g_buf[n] = '\0';
+	printf("%s\n", g_buf);
 }
 
-void dbg_log(char const *const pFmt, ...)
+/*!
+ * \brief Function prints all published entries.<br>
+ * <br>
+ * Only the consumer thread (or dbg_exit after it stopped) calls this.
+ */
+static void drain(void)
 {
-	int n = sprintf(g_buf, "%s", "[jcop_proxy] ");
+	long head = OSDEP_atomicRead(&g_head);
+	while (g_tail != head) {
+		DBG_RING_ENTRY *pEntry = &g_ring[g_tail & (DBG_RING_ENTRIES - 1)];
+		if (OSDEP_atomicRead(&pEntry->seq) != g_tail + 1) {
+			// the entry is still being written. retry later.
+			break;
+		}
+		print_entry(pEntry);
+		// the entry may be written again.
+		OSDEP_atomicRelease(&g_tail, g_tail + 1);
+	}
+}
+
+static void consumer(void *pParam)
+{
+	while (OSDEP_atomicRead(&g_stop) == 0) {
+		OSDEP_sleep(DBG_CONSUMER_INTERVAL);
+		drain();
+	}
+}
+
+void dbg_init(void)
+{
+	if (g_consumerStarted) {
+		return;
+	}
+
+	// levels are given by the environment variable.
+	char const *pSpec = getenv(DBG_LEVEL_ENV);
+	if (pSpec != NULL) {
+		unsigned char levels[DBG_CAT_COUNT];
+		memcpy(levels, g_dbgLevel, sizeof(levels));
+		if (dbg_parseLevels(pSpec, levels) == 0) {
+			dbg_setLevels(levels);
+		}
+	}
+
+	g_stop = 0;
+	if (OSDEP_createThread(&g_consumer, consumer, NULL, 1) == 0) {
+		g_consumerStarted = true;
+	}
+}
+
+void dbg_exit(void)
+{
+	if (g_consumerStarted) {
+		OSDEP_atomicExchange(&g_stop, 1);
+		OSDEP_joinThread(g_consumer);
+		g_consumerStarted = false;
+	}
+	drain();
+	if (g_lost > 0) {
+		printf("[jcop_proxy] %ld debug entries lost\n", g_lost);
+	}
+}
+
+/*!
+ * \brief Function sets the level of every category.<br>
+ * <br>
+ * \param [in] pLevels DBG_CAT_COUNT levels, DBG_LVL_XXX.
+ */
+void dbg_setLevels(unsigned char const *const pLevels)
+{
+	for (int i = 0; i < DBG_CAT_COUNT; i++) {
+		g_dbgLevel[i] = (pLevels[i] > DBG_LVL_DEBUG) ? DBG_LVL_DEBUG : pLevels[i];
+	}
+}
+
+/*!
+ * \brief Function returns the index of a name in a table.<br>
+ *
+ * \retval index of the name, or -1 if it is not found.
+ */
+static int find_name(char const *const p, int const len, char const *const *const pNames, int const count)
+{
+	for (int i = 0; i < count; i++) {
+		if ((int)strlen(pNames[i]) == len && strncmp(p, pNames[i], len) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*!
+ * \brief Function parses a level specification.<br>
+ * <br>
+ * The specification is a comma separated list of "[category=]level".
+ * A level without category applies to every category, e.g.
+ * "warn,t1=debug,ipc=info".
+ * <br>
+ * \param [in] pSpec level specification.
+ * \param [in][out] pLevels DBG_CAT_COUNT levels to update.
+ *
+ * \retval 0 the specification is valid.
+ * \retval -1 the specification is invalid (pLevels may be partly updated).
+ */
+int dbg_parseLevels(char const *const pSpec, unsigned char *const pLevels)
+{
+	static char const *const levelNames[] = { "off", "err", "warn", "info", "debug" };
+	static char const *const categoryNames[DBG_CAT_COUNT] = {
+		"general", "transport", "t1", "ipc", "dispatch"
+	};
+
+	char const *p = pSpec;
+	while (*p != '\0') {
+		char const *pEnd = strchr(p, ',');
+		if (pEnd == NULL) {
+			pEnd = p + strlen(p);
+		}
+		char const *pLevel = p;
+		int cat = -1;	// all categories.
+		char const *pEq = (char const *)memchr(p, '=', pEnd - p);
+		if (pEq != NULL) {
+			cat = find_name(p, (int)(pEq - p), categoryNames, DBG_CAT_COUNT);
+			if (cat < 0) {
+				return -1;
+			}
+			pLevel = pEq + 1;
+		}
+		int lvl = find_name(pLevel, (int)(pEnd - pLevel), levelNames, DBG_LVL_DEBUG + 1);
+		if (lvl < 0) {
+			return -1;
+		}
+		for (int i = 0; i < DBG_CAT_COUNT; i++) {
+			if (cat < 0 || cat == i) {
+				pLevels[i] = (unsigned char)lvl;
+			}
+		}
+		p = (*pEnd == ',') ? pEnd + 1 : pEnd;
+	}
+	return 0;
+}
+
+void dbg_bytes(char const *const cp, int const cnt)
+{
+	long idx;
+	DBG_RING_ENTRY *pEntry = reserve(DBG_EV_BYTES, cnt, &idx);
+	if (pEntry == NULL) {
+		return;
+	}
+	memcpy(pEntry->data, cp, (cnt > DBG_RING_DATA_SIZE) ? DBG_RING_DATA_SIZE : cnt);
+	commit(pEntry, idx);
+}
+
+void dbg_printf(char const *const pFmt, ...)
+{
+	long idx;
+	DBG_RING_ENTRY *pEntry = reserve(DBG_EV_TEXT, 0, &idx);
+	if (pEntry == NULL) {
+		return;
+	}
 	va_list marker;
 	va_start(marker, pFmt);
-	vsprintf(g_buf + n, pFmt, marker);
+	int n = _vsnprintf(pEntry->data, DBG_RING_DATA_SIZE, pFmt, marker);
 	va_end(marker);
-	printf(g_buf);
-	printf("\n");
+	pEntry->len = (unsigned short)((n < 0) ? DBG_RING_DATA_SIZE : n);
+	commit(pEntry, idx);
 }
 
 #endif
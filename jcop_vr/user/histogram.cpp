@@ -0,0 +1,134 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file histogram.cpp
+ * \brief Source file that contains the latency histogram.
+ * \author Kenichi Kanai
+ */
+#include <string.h>
+
+#include "histogram.h"
+
+#define HALF_BUCKETS (HISTOGRAM_SUB_BUCKETS / 2)
+
+static int index_of(OSDEP_INT64 const value)
+{
+	if (value < HISTOGRAM_SUB_BUCKETS) {
+		return (value < 0) ? 0 : (int)value;
+	}
+	// value >> shift is in [HALF_BUCKETS, HISTOGRAM_SUB_BUCKETS).
+	int shift = 0;
+	while ((value >> shift) >= HISTOGRAM_SUB_BUCKETS) {
+		shift++;
+	}
+	return HISTOGRAM_SUB_BUCKETS + (shift - 1) * HALF_BUCKETS + (int)((value >> shift) - HALF_BUCKETS);
+}
+
+/*!
+ * \brief Function returns the highest value counted in a bucket.<br>
+ */
+static OSDEP_INT64 value_of(int const index)
+{
+	if (index < HISTOGRAM_SUB_BUCKETS) {
+		return index;
+	}
+	int shift = (index - HISTOGRAM_SUB_BUCKETS) / HALF_BUCKETS + 1;
+	OSDEP_INT64 sub = (index - HISTOGRAM_SUB_BUCKETS) % HALF_BUCKETS + HALF_BUCKETS;
+	return ((sub + 1) << shift) - 1;
+}
+
+void HISTOGRAM_reset(HISTOGRAM *const pHistogram)
+{
+	memset(pHistogram, 0, sizeof(HISTOGRAM));
+}
+
+void HISTOGRAM_record(HISTOGRAM *const pHistogram, OSDEP_INT64 const value)
+{
+	pHistogram->counts[index_of(value)]++;
+	if (pHistogram->total == 0 || value < pHistogram->min) {
+		pHistogram->min = value;
+	}
+	if (pHistogram->total == 0 || value > pHistogram->max) {
+		pHistogram->max = value;
+	}
+	pHistogram->total++;
+	pHistogram->sum += (double)value;
+}
+
+void HISTOGRAM_merge(HISTOGRAM *const pDst, HISTOGRAM const *const pSrc)
+{
+	if (pSrc->total == 0) {
+		return;
+	}
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		pDst->counts[i] += pSrc->counts[i];
+	}
+	if (pDst->total == 0 || pSrc->min < pDst->min) {
+		pDst->min = pSrc->min;
+	}
+	if (pDst->total == 0 || pSrc->max > pDst->max) {
+		pDst->max = pSrc->max;
+	}
+	pDst->total += pSrc->total;
+	pDst->sum += pSrc->sum;
+}
+
+/*!
+ * \brief Function returns the value at a percentile.<br>
+ * <br>
+ * \param [in] pHistogram histogram.
+ * \param [in] percentile percentile (0 - 100), e.g. 99.9.
+ *
+ * \retval the highest value counted with the percentile, or 0 if empty.
+ */
+OSDEP_INT64 HISTOGRAM_percentile(HISTOGRAM const *const pHistogram, double const percentile)
+{
+	if (pHistogram->total == 0) {
+		return 0;
+	}
+	OSDEP_INT64 target = (OSDEP_INT64)((double)pHistogram->total * percentile / 100 + 0.5);
+	if (target < 1) {
+		target = 1;
+	}
+	OSDEP_INT64 count = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		count += pHistogram->counts[i];
+		if (count >= target) {
+			OSDEP_INT64 value = value_of(i);
+			return (value > pHistogram->max) ? pHistogram->max : value;
+		}
+	}
+	return pHistogram->max;
+}
+
+double HISTOGRAM_mean(HISTOGRAM const *const pHistogram)
+{
+	if (pHistogram->total == 0) {
+		return 0;
+	}
+	return pHistogram->sum / (double)pHistogram->total;
+}
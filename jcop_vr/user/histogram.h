@@ -0,0 +1,60 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file histogram.h
+ * \brief latency histogram with bounded relative error (HDR histogram).
+ * \author Kenichi Kanai
+ *
+ * Values below HISTOGRAM_SUB_BUCKETS are counted exactly. Larger values
+ * are counted in buckets whose width is 1/64 of the value, so any
+ * percentile is reported within 1.6% of the recorded value. A histogram
+ * has a fixed size and can be merged with another one.
+ */
+#ifndef __HISTOGRAM__
+#define __HISTOGRAM__
+
+#include "osdep.h"
+
+#define HISTOGRAM_SUB_BUCKETS 128
+// 56 doublings cover every positive OSDEP_INT64.
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS + 56 * (HISTOGRAM_SUB_BUCKETS / 2))
+
+typedef struct _HISTOGRAM {
+	unsigned int counts[HISTOGRAM_BUCKETS];
+	OSDEP_INT64 total;	// number of recorded values.
+	OSDEP_INT64 min;
+	OSDEP_INT64 max;
+	double sum;
+} HISTOGRAM;
+
+void HISTOGRAM_reset(HISTOGRAM *const pHistogram);
+void HISTOGRAM_record(HISTOGRAM *const pHistogram, OSDEP_INT64 const value);
+void HISTOGRAM_merge(HISTOGRAM *const pDst, HISTOGRAM const *const pSrc);
+OSDEP_INT64 HISTOGRAM_percentile(HISTOGRAM const *const pHistogram, double const percentile);
+double HISTOGRAM_mean(HISTOGRAM const *const pHistogram);
+
+#endif // __HISTOGRAM__
@@ -0,0 +1,895 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file jcop_load.cpp
+ * \brief APDU load generator for the JCOP simulator transport and the T=1 engine.
+ * \author Kenichi Kanai
+ *
+ * jcop_load sends the C-APDUs of a script over several connections at the
+ * same time and reports the latency percentiles and the throughput of each
+ * message path:
+ *
+ *   T=0 (MTY 0x01): the C-APDU is passed to JCOP_SIMUL_transmit as
+ *                   jcop_proxy does (with -apducache, through the cache).
+ *   T=1 (MTY 0x11): the C-APDU is sent in T=1 blocks through T1_processMsg,
+ *                   with the chaining the smart card library would do.
+ *   T=1 APDU (MTY 0x12): the C-APDU is sent whole through T1_processApdu,
+ *                   as the driver does with jcop_proxy -apdut1.
+ *   reset (MTY 0x00): the card is reset instead of sending a command, as
+ *                   jcop_proxy does (with -fastreset, from the cached ATR).
+ *   batch (MTY 0x13): the next C-APDUs of the script which fit a request of
+ *                   the driver are sent through JCOP_SIMUL_transmitBatch;
+ *                   a batch counts as one command of the report.
+ *
+ * Closed loop: every connection sends the next command as soon as the
+ * previous one is answered. Open loop (-rate): the commands are sent at a
+ * fixed total rate and the latency is measured from the scheduled time, so
+ * a slow answer also counts for the commands queued behind it.
+ *
+ * Every call of T1_processMsg, T1_processApdu, JCOP_SIMUL_transmit or
+ * JCOP_SIMUL_transmitBatch stands for a message between the driver and jcop_proxy, so the messages per
+ * command are reported with the latency.
+ *
+ * The backend is JCOP simulator, the mock backend or a recorded transcript,
+ * so jcop_load also runs on Linux (see README). With -mux the connections
+ * share one session of the backend, each by a logical channel.
+ *
+ * -hexbench compares the hex dump of the debug log (HEXFMT_encode) with the
+ * sprintf per byte it replaced, on 1 KB and 64 KB buffers.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "osdep.h"
+#include "shared_data.h"
+#include "jcop_simul.h"
+#include "t1.h"
+#include "mock.h"
+#include "replay.h"
+#include "histogram.h"
+#include "atrcache.h"
+#include "simpool.h"
+#include "apducache.h"
+#include "chanmux.h"
+#include "hexfmt.h"
+#define DBG_CATEGORY DBG_CAT_GENERAL
+#include "dbglog.h"
+
+#define MAX_APDU_SIZE (JCOP_PROXY_BUFFER_SIZE - JCOP_MSG_HEADER_SIZE)
+#define MAX_LINE_SIZE (MAX_APDU_SIZE * 3 + 2)
+#define MAX_WORKERS 256
+
+#define PATH_COUNT 5
+#define PATH_T0 0	// MTY 0x01
+#define PATH_T1 1	// MTY 0x11
+#define PATH_RESET 2	// MTY 0x00
+#define PATH_T1_APDU 3	// MTY 0x12
+#define PATH_BATCH 4	// MTY 0x13
+
+typedef struct _COMMAND {
+	unsigned short len;
+	char apdu[MAX_APDU_SIZE];
+} COMMAND;
+
+typedef struct _WORKER {
+	int id;
+	int path;		// PATH_XXX
+	unsigned char t1Seq;	// N(S) of the next I-block sent (0x00 or 0x40).
+	OSDEP_THREAD thread;
+	HISTOGRAM histogram;	// latency (nsec).
+	OSDEP_INT64 errors;
+	OSDEP_INT64 messages;	// driver/proxy messages of the measured commands.
+	unsigned long atrHits;	// resets answered from the cached ATR.
+	unsigned long cacheHits;	// C-APDUs answered from the response cache.
+	unsigned long cacheMisses;	// whitelisted C-APDUs sent to the backend.
+} WORKER;
+
+static char const *const g_pathNames[PATH_COUNT] = {
+	"T=0 (MTY 0x01)", "T=1 (MTY 0x11)", "reset (MTY 0x00)", "T=1 APDU (0x12)", "batch (MTY 0x13)"
+};
+static char const *const g_pathOptions[PATH_COUNT] = { "t0", "t1", "reset", "t1apdu", "batch" };
+
+// script.
+static COMMAND *g_pCommands = NULL;
+static int g_commandCount = 0;
+
+// run configuration.
+static int g_concurrency = 1;
+static unsigned int g_duration = 10;	// sec.
+static unsigned int g_warmup = 2;	// sec.
+static double g_rate = 0;		// total commands per sec, 0: closed loop.
+static int g_paths[PATH_COUNT];		// paths used by the workers in turn.
+static int g_pathCount = 0;
+static bool g_fastReset = false;	// answer resets from the cached ATR.
+
+// schedule (ticks).
+static OSDEP_INT64 g_start;
+static OSDEP_INT64 g_warmupEnd;
+static OSDEP_INT64 g_end;
+static OSDEP_INT64 g_interval;	// per worker, open loop only.
+
+static WORKER g_workers[MAX_WORKERS];
+
+/*!
+ * \brief Function parses a line of hex digits.<br>
+ * <br>
+ * Spaces are ignored and '#' starts a comment.
+ *
+ * \retval number of bytes, or -1 if the line is invalid.
+ */
+static int parse_hex(char const *const pLine, char *const pBuf, int const bufSize)
+{
+	int len = 0;
+	int high = -1;
+	for (char const *p = pLine; *p != '\0' && *p != '#'; p++) {
+		if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+			continue;
+		}
+		int v = HEXFMT_decodeDigit(*p);
+		if (v < 0) {
+			return -1;
+		}
+		if (high < 0) {
+			high = v;
+			continue;
+		}
+		if (len == bufSize) {
+			return -1;
+		}
+		pBuf[len++] = (char)((high << 4) | v);
+		high = -1;
+	}
+	return (high < 0) ? len : -1;
+}
+
+/*!
+ * \brief Function loads a script: a C-APDU in hex per line.<br>
+ *
+ * \retval 0 the script is loaded.
+ * \retval -1 failed.
+ */
+static int load_script(char const *const pPath)
+{
+	FILE *fp = fopen(pPath, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "can't open %s\n", pPath);
+		return -1;
+	}
+
+	static char line[MAX_LINE_SIZE];
+	int max = 0;
+	int lineNo = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineNo++;
+		if (g_commandCount == max) {
+			max = (max == 0) ? 64 : max * 2;
+			COMMAND *pCommands = (COMMAND *)realloc(g_pCommands, max * sizeof(COMMAND));
+			if (pCommands == NULL) {
+				fclose(fp);
+				return -1;
+			}
+			g_pCommands = pCommands;
+		}
+		COMMAND *pCommand = &g_pCommands[g_commandCount];
+		int len = parse_hex(line, pCommand->apdu, MAX_APDU_SIZE);
+		if (len < 0 || (len > 0 && len < 4)) {
+			fprintf(stderr, "%s(%d): invalid C-APDU\n", pPath, lineNo);
+			fclose(fp);
+			return -1;
+		}
+		if (len == 0) {
+			continue;	// empty line or comment.
+		}
+		pCommand->len = (unsigned short)len;
+		g_commandCount++;
+	}
+	fclose(fp);
+
+	if (g_commandCount == 0) {
+		fprintf(stderr, "%s: no C-APDU\n", pPath);
+		return -1;
+	}
+	return 0;
+}
+
+static int transmit_t0(char const *const pApdu, unsigned short const apduLen)
+{
+	char snd[JCOP_PROXY_BUFFER_SIZE];
+	char rcv[JCOP_PROXY_BUFFER_SIZE];
+	unsigned long sndLen = JCOP_MSG_setHeader(snd, JCOP_MSG_MTY_APDU, 0x00, apduLen);
+	memcpy(snd + JCOP_MSG_HEADER_SIZE, pApdu, apduLen);
+	unsigned short rcvLen = sizeof(rcv);
+	return APDUCACHE_transmit(snd, (unsigned short)sndLen, rcv, &rcvLen);
+}
+
+/*!
+ * \brief Function exchanges a T=1 block with T1_processMsg.<br>
+ * <br>
+ * \param [in] pcb PCB of the block to send.
+ * \param [in] pInf INF of the block to send.
+ * \param [in] len length of INF.
+ * \param [out] pRcv received block (NAD PCB LEN INF EDC).
+ * \param [out] pRcvLen length of received block.
+ */
+static int exchange_t1(
+    unsigned char const pcb,
+    char const *const pInf,
+    unsigned char const len,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	char snd[JCOP_PROXY_BUFFER_SIZE];
+	char *pBlock = snd + JCOP_MSG_HEADER_SIZE;
+	pBlock[0] = 0x00;	// NAD
+	pBlock[1] = (char)pcb;
+	pBlock[2] = (char)len;
+	if (len != 0) {
+		memcpy(pBlock + 3, pInf, len);	// an R-block has no INF.
+	}
+	pBlock[3 + len] = 0x00;
+	for (int i = 0; i < 3 + len; i++) {
+		pBlock[3 + len] ^= pBlock[i];	// LRC
+	}
+	unsigned long sndLen = JCOP_MSG_setHeader(snd, JCOP_MSG_MTY_T1, 0x00, (unsigned short)(len + 4));
+
+	*pRcvLen = JCOP_PROXY_BUFFER_SIZE;
+	int status = T1_processMsg(snd, (unsigned short)sndLen, pRcv, pRcvLen);
+	if (status != 0) {
+		return status;
+	}
+	if (*pRcvLen < 4 || *pRcvLen < 4 + (pRcv[2] & 0xff)) {
+		return JCOP_SIMUL_ERROR_OTHER;
+	}
+	return 0;
+}
+
+static int transmit_t1(
+    WORKER *const pWorker,
+    char const *const pApdu,
+    unsigned short const apduLen,
+    unsigned int *const pMessages
+)
+{
+	char rcv[JCOP_PROXY_BUFFER_SIZE];
+	unsigned short rcvLen;
+	int status;
+
+	// send the command in I-blocks of at most MAX_IFS bytes.
+	unsigned short off = 0;
+	while (true) {
+		unsigned short len = apduLen - off;
+		bool more = false;
+		if (len > MAX_IFS) {
+			len = MAX_IFS;
+			more = true;
+		}
+		unsigned char pcb = pWorker->t1Seq | (more ? 0x20 : 0x00);
+		pWorker->t1Seq ^= 0x40;
+		(*pMessages)++;
+		status = exchange_t1(pcb, pApdu + off, (unsigned char)len, rcv, &rcvLen);
+		if (status != 0) {
+			return status;
+		}
+		if (!more) {
+			break;
+		}
+		if ((rcv[1] & 0xC0) != 0x80) {
+			return JCOP_SIMUL_ERROR_OTHER;	// not acknowledged by R-block.
+		}
+		off += len;
+	}
+
+	// receive the answer, chained I-blocks are requested by R-blocks.
+	unsigned long rspLen = 0;
+	while (true) {
+		unsigned char pcb = (unsigned char)rcv[1];
+		if ((pcb & 0x80) != 0) {
+			return JCOP_SIMUL_ERROR_OTHER;	// not an I-block.
+		}
+		rspLen += rcv[2] & 0xff;
+		if ((pcb & 0x20) == 0) {
+			break;
+		}
+		unsigned char nr = (pcb & 0x40) ? 0x00 : 0x10;
+		(*pMessages)++;
+		status = exchange_t1((unsigned char)(0x80 | nr), NULL, 0, rcv, &rcvLen);
+		if (status != 0) {
+			return status;
+		}
+	}
+	return (rspLen >= 2) ? 0 : JCOP_SIMUL_ERROR_OTHER;
+}
+
+static int transmit_t1_apdu(char const *const pApdu, unsigned short const apduLen)
+{
+	char snd[JCOP_PROXY_BUFFER_SIZE];
+	char rcv[JCOP_PROXY_BUFFER_SIZE];
+	unsigned long sndLen = JCOP_MSG_setHeader(snd, JCOP_MSG_MTY_T1_APDU, 0x00, apduLen);
+	memcpy(snd + JCOP_MSG_HEADER_SIZE, pApdu, apduLen);
+	unsigned short rcvLen = sizeof(rcv);
+	int status = T1_processApdu(snd, (unsigned short)sndLen, rcv, &rcvLen);
+	if (status != 0) {
+		return status;
+	}
+	return (rcvLen >= 2) ? 0 : JCOP_SIMUL_ERROR_OTHER;
+}
+
+/*!
+ * \brief Function sends the C-APDUs from a command of the script as a batch,
+ * as jcop_proxy does for MTY 0x13.<br>
+ * <br>
+ * \param [in] first index of the first command.
+ * \param [out] pCount number of commands in the batch.
+ */
+static int transmit_batch(int const first, int *const pCount)
+{
+	JCOP_SIMUL_BATCH_CMD cmds[JCOP_MSG_BATCH_MAX_CMDS];
+	JCOP_SIMUL_BATCH_RESULT results[JCOP_MSG_BATCH_MAX_CMDS];
+	char snd[JCOP_PROXY_BUFFER_SIZE];
+	char rcv[JCOP_PROXY_BUFFER_SIZE];
+
+	// the messages are laid out as in the request of the driver, so a batch
+	// holds what one request can.
+	unsigned long sndLen = JCOP_MSG_HEADER_SIZE + JCOP_MSG_BATCH_HEADER_SIZE;
+	int n = 0;
+	int i = first;
+	while (n < JCOP_MSG_BATCH_MAX_CMDS && n < g_commandCount) {
+		COMMAND const *pCommand = &g_pCommands[i];
+		if (sndLen + JCOP_MSG_HEADER_SIZE + pCommand->len > sizeof(snd)) {
+			break;
+		}
+		cmds[n].pSnd = snd + sndLen;
+		cmds[n].sndLen = (unsigned short)JCOP_MSG_setHeader(snd + sndLen, JCOP_MSG_MTY_APDU, 0x00, pCommand->len);
+		memcpy(snd + sndLen + JCOP_MSG_HEADER_SIZE, pCommand->apdu, pCommand->len);
+		sndLen += cmds[n].sndLen;
+		n++;
+		i = (i + 1) % g_commandCount;
+	}
+	*pCount = (n > 0) ? n : 1;
+	if (n == 0) {
+		return JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL;
+	}
+
+	int status = APDUCACHE_flush();
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		return status;
+	}
+	unsigned int done = 0;
+	unsigned short rcvLen = sizeof(rcv) - JCOP_MSG_HEADER_SIZE;
+	status = JCOP_SIMUL_transmitBatch(cmds, (unsigned int)n, results, &done, 0x0000, 0x0000, rcv, &rcvLen);
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		return status;
+	}
+	return (done == (unsigned int)n) ? 0 : JCOP_SIMUL_ERROR_OTHER;
+}
+
+/*!
+ * \brief Function resets the card as jcop_proxy does for MTY 0x00.<br>
+ * <br>
+ * With -fastreset, the cached ATR is returned and the session is reset by
+ * ATRCACHE_flush after the latency is measured.
+ */
+static int reset_card(WORKER *const pWorker)
+{
+	char atr[JCOP_PROXY_MAX_ATR_SIZE];
+	unsigned short atrLen = sizeof(atr);
+	int status;
+	if (g_fastReset) {
+		status = ATRCACHE_warmReset(atr, &atrLen);
+	} else {
+		status = ATRCACHE_powerUp(atr, &atrLen);
+	}
+	T1_resetSeq();
+	APDUCACHE_invalidate();
+	pWorker->t1Seq = 0x00;
+	return status;
+}
+
+static void worker(void *pParam)
+{
+	WORKER *pWorker = (WORKER *)pParam;
+
+	char atr[JCOP_PROXY_MAX_ATR_SIZE + 1];
+	unsigned short atrLen = sizeof(atr);
+	if (ATRCACHE_powerUp(atr, &atrLen) != JCOP_SIMUL_NO_ERROR) {
+		fprintf(stderr, "worker %d: power up failed\n", pWorker->id);
+		pWorker->errors++;
+		return;
+	}
+	T1_resetSeq();
+	pWorker->t1Seq = 0x00;
+
+	// workers start at different commands of the script.
+	int i = (g_commandCount > 0) ? pWorker->id % g_commandCount : 0;
+	OSDEP_INT64 next = g_start + (g_interval * pWorker->id) / g_concurrency;
+	while (true) {
+		OSDEP_INT64 start;
+		if (g_interval != 0) {
+			// open loop: latency counts from the scheduled time.
+			start = next;
+			if (start >= g_end) {
+				break;
+			}
+			OSDEP_waitUntil(start);
+			next += g_interval;
+		} else {
+			start = OSDEP_now();
+			if (start >= g_end) {
+				break;
+			}
+		}
+
+		int status;
+		unsigned int messages = 1;
+		int commands = 1;
+		if (pWorker->path == PATH_RESET) {
+			unsigned long atrHits = ATRCACHE_getHits();
+			status = reset_card(pWorker);
+			if (start >= g_warmupEnd) {
+				pWorker->atrHits += ATRCACHE_getHits() - atrHits;
+			}
+		} else if (pWorker->path == PATH_T1) {
+			messages = 0;
+			status = transmit_t1(pWorker, g_pCommands[i].apdu, g_pCommands[i].len, &messages);
+		} else if (pWorker->path == PATH_T1_APDU) {
+			status = transmit_t1_apdu(g_pCommands[i].apdu, g_pCommands[i].len);
+		} else if (pWorker->path == PATH_BATCH) {
+			status = transmit_batch(i, &commands);
+		} else {
+			status = transmit_t0(g_pCommands[i].apdu, g_pCommands[i].len);
+		}
+		OSDEP_INT64 end = OSDEP_now();
+
+		if (start >= g_warmupEnd) {
+			if (status == 0) {
+				HISTOGRAM_record(&pWorker->histogram, OSDEP_toNsec(end - start));
+				pWorker->messages += messages;
+			} else {
+				pWorker->errors++;
+			}
+		}
+		if (status == 0) {
+			// the deferred reset delays the next command, as in jcop_proxy.
+			status = ATRCACHE_flush();
+			if (status != 0 && start >= g_warmupEnd) {
+				pWorker->errors++;
+			}
+		}
+		if (status != 0) {
+			dbg_warn("worker %d: command %d failed - status: 0x%08X", pWorker->id, i, status);
+			// a T=1 error leaves the block sequence unknown; start again.
+			ATRCACHE_invalidate();
+			APDUCACHE_invalidate();
+			JCOP_SIMUL_close();
+			atrLen = sizeof(atr);
+			if (ATRCACHE_powerUp(atr, &atrLen) != JCOP_SIMUL_NO_ERROR) {
+				pWorker->errors++;
+				return;
+			}
+			T1_resetSeq();
+			pWorker->t1Seq = 0x00;
+		}
+		if (g_commandCount > 0) {
+			i = (i + commands) % g_commandCount;
+		}
+	}
+
+	APDUCACHE_getCounts(&pWorker->cacheHits, &pWorker->cacheMisses);
+	APDUCACHE_free();
+	JCOP_SIMUL_close();
+}
+
+static void print_row(
+    char const *const pName,
+    HISTOGRAM const *const pHistogram,
+    OSDEP_INT64 const errors,
+    OSDEP_INT64 const messages,
+    double const seconds
+)
+{
+	double total = (double)pHistogram->total;
+	printf("%-16s %10.0f %8.0f %8.2f %10.1f %10.1f %10.1f %10.1f %10.1f %8ld\n",
+	       pName,
+	       total,
+	       total / seconds,
+	       (total > 0) ? (double)messages / total : 0.0,
+	       HISTOGRAM_mean(pHistogram) / 1000,
+	       (double)HISTOGRAM_percentile(pHistogram, 50) / 1000,
+	       (double)HISTOGRAM_percentile(pHistogram, 99) / 1000,
+	       (double)HISTOGRAM_percentile(pHistogram, 99.9) / 1000,
+	       (double)pHistogram->max / 1000,
+	       (long)errors);
+}
+
+static void report(void)
+{
+	HISTOGRAM *pTotal = (HISTOGRAM *)malloc(sizeof(HISTOGRAM) * (PATH_COUNT + 1));
+	if (pTotal == NULL) {
+		return;
+	}
+	OSDEP_INT64 errors[PATH_COUNT + 1];
+	OSDEP_INT64 messages[PATH_COUNT + 1];
+	unsigned long atrHits = 0;
+	unsigned long cacheHits = 0;
+	unsigned long cacheMisses = 0;
+	for (int p = 0; p <= PATH_COUNT; p++) {
+		HISTOGRAM_reset(&pTotal[p]);
+		errors[p] = 0;
+		messages[p] = 0;
+	}
+	for (int i = 0; i < g_concurrency; i++) {
+		WORKER *pWorker = &g_workers[i];
+		HISTOGRAM_merge(&pTotal[pWorker->path], &pWorker->histogram);
+		HISTOGRAM_merge(&pTotal[PATH_COUNT], &pWorker->histogram);
+		errors[pWorker->path] += pWorker->errors;
+		errors[PATH_COUNT] += pWorker->errors;
+		messages[pWorker->path] += pWorker->messages;
+		messages[PATH_COUNT] += pWorker->messages;
+		atrHits += pWorker->atrHits;
+		cacheHits += pWorker->cacheHits;
+		cacheMisses += pWorker->cacheMisses;
+	}
+
+	double seconds = (double)(g_duration - g_warmup);
+	printf("%d connections, %s, %u sec (+%u sec warmup), latency in usec\n",
+	       g_concurrency, (g_rate > 0) ? "open loop" : "closed loop", g_duration - g_warmup, g_warmup);
+	printf("%-16s %10s %8s %8s %10s %10s %10s %10s %10s %8s\n",
+	       "path", "commands", "cmd/s", "msg/cmd", "mean", "p50", "p99", "p99.9", "max", "errors");
+	for (int p = 0; p < PATH_COUNT; p++) {
+		if (pTotal[p].total != 0 || errors[p] != 0) {
+			print_row(g_pathNames[p], &pTotal[p], errors[p], messages[p], seconds);
+		}
+	}
+	print_row("total", &pTotal[PATH_COUNT], errors[PATH_COUNT], messages[PATH_COUNT], seconds);
+	if (g_fastReset) {
+		printf("%lu resets answered from the cached ATR\n", atrHits);
+	}
+	if (cacheHits != 0 || cacheMisses != 0) {
+		printf("%lu commands answered from the response cache, %lu whitelisted commands sent\n",
+		       cacheHits, cacheMisses);
+	}
+	free(pTotal);
+}
+
+static int parse_paths(char const *const pArg)
+{
+	g_pathCount = 0;
+	char const *p = pArg;
+	while (*p != '\0') {
+		if (g_pathCount == PATH_COUNT) {
+			return -1;
+		}
+		size_t len = strcspn(p, ",");
+		int path;
+		for (path = 0; path < PATH_COUNT; path++) {
+			if (strlen(g_pathOptions[path]) == len && strncmp(p, g_pathOptions[path], len) == 0) {
+				break;
+			}
+		}
+		if (path == PATH_COUNT) {
+			return -1;
+		}
+		g_paths[g_pathCount++] = path;
+		p += len;
+		if (*p == ',') {
+			p++;
+		} else if (*p != '\0') {
+			return -1;
+		}
+	}
+	return (g_pathCount > 0) ? 0 : -1;
+}
+
+#define HEXBENCH_MAX_SIZE 65536
+#define HEXBENCH_DURATION 500	// msec per encoder and size.
+
+static char g_hexSrc[HEXBENCH_MAX_SIZE];
+static char g_hexDst[HEXBENCH_MAX_SIZE * HEXFMT_CHARS_PER_BYTE + 1];
+static char g_hexRef[HEXBENCH_MAX_SIZE * HEXFMT_CHARS_PER_BYTE + 1];
+
+// the dump of dbg_ba2s before HEXFMT_encode.
+static unsigned long hex_sprintf(char *const pDst, char const *const pSrc, unsigned long const cnt)
+{
+	int n = 0;
+	for (unsigned long i = 0; i < cnt; i++) {
+		n += sprintf(pDst + n, "0x%02X:", pSrc[i] & 0xff);
+	}
+	return (unsigned long)n;
+}
+
+/*!
+ * \brief Function measures an encoder on a buffer.<br>
+ * <br>
+ * \retval nanoseconds per byte.
+ */
+static double hex_measure(bool const isSprintf, unsigned long const size)
+{
+	OSDEP_INT64 start = OSDEP_now();
+	OSDEP_INT64 end = start + OSDEP_fromUsec(HEXBENCH_DURATION * 1000);
+	OSDEP_INT64 now;
+	unsigned long rounds = 0;
+	do {
+		for (int i = 0; i < 16; i++) {
+			if (isSprintf) {
+				hex_sprintf(g_hexDst, g_hexSrc, size);
+			} else {
+				HEXFMT_encode(g_hexDst, sizeof(g_hexDst), g_hexSrc, size);
+			}
+		}
+		rounds += 16;
+		now = OSDEP_now();
+	} while (now < end);
+	return (double)OSDEP_toNsec(now - start) / ((double)rounds * size);
+}
+
+static int hex_bench(void)
+{
+	for (int i = 0; i < HEXBENCH_MAX_SIZE; i++) {
+		g_hexSrc[i] = (char)(i * 7);
+	}
+	static unsigned long const sizes[] = { 1024, HEXBENCH_MAX_SIZE };
+	printf("bytes     sprintf (ns/byte)  HEXFMT (ns/byte)   speedup\n");
+	for (int i = 0; i < 2; i++) {
+		// both write the same dump.
+		unsigned long refLen = hex_sprintf(g_hexRef, g_hexSrc, sizes[i]);
+		unsigned long len = HEXFMT_encode(g_hexDst, sizeof(g_hexDst), g_hexSrc, sizes[i]);
+		if (len != refLen || memcmp(g_hexDst, g_hexRef, len) != 0) {
+			fprintf(stderr, "the dumps of %lu bytes differ\n", sizes[i]);
+			return 1;
+		}
+		double old = hex_measure(true, sizes[i]);
+		double now = hex_measure(false, sizes[i]);
+		printf("%-9lu %17.2f %17.2f %8.1fx\n", sizes[i], old, now, old / now);
+	}
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+	        "usage: jcop_load -script <file> [options]\n"
+	        "       jcop_load -hexbench\n"
+	        "  -script <file>     C-APDUs in hex, one per line ('#' starts a comment),\n"
+	        "                     not needed for -path reset\n"
+	        "  -path <t0|t1|t1apdu|batch|reset>[,...] message paths, used by the connections in turn (t0)\n"
+	        "  -fastreset         answer resets with the cached ATR (as jcop_proxy -fastreset)\n"
+	        "  -pool <n>          keep <n> sessions powered up for resets (as jcop_proxy -pool)\n"
+	        "  -refill <n>        threads which power up the sessions of the pool (1)\n"
+	        "  -mux               share one session by logical channels, one per connection\n"
+	        "  -muxdepth <n>      commands which may wait for the shared session per lane\n"
+	        "                     (short/bulk), 0: no limit (0)\n"
+	        "  -apducache <n>     answer whitelisted C-APDUs from a cache of <n> answers\n"
+	        "                     per connection (as jcop_proxy -apducache)\n"
+	        "  -cacheins <list>   INS of the whitelist in hex, e.g. A4,CA (" APDUCACHE_DEFAULT_INS ")\n"
+	        "  -c <n>             number of connections (1)\n"
+	        "  -d <sec>           duration including warmup (10)\n"
+	        "  -w <sec>           warmup, not measured (2)\n"
+	        "  -rate <n>          open loop: total commands per second (closed loop)\n"
+	        "  -host <ip>         JCOP simulator address (127.0.0.1)\n"
+	        "  -port <n>          JCOP simulator port (8050)\n"
+	        "  -mock <usec>       answer by the mock backend with the latency\n"
+	        "  -replay <file>     answer from a transcript recorded by jcop_proxy\n"
+	        "  -timing <percent>  replay timing, 0: no delay (100)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	char const *pScript = NULL;
+	char const *pReplay = NULL;
+	unsigned int timing = REPLAY_TIMING_ORIGINAL;
+	int mockLatency = -1;
+	unsigned int poolSize = 0;
+	unsigned int poolThreads = 1;
+	unsigned int cacheSize = 0;
+	char const *pCacheIns = NULL;
+	char const *pHost = NULL;
+	int port = 0;
+	bool isMux = false;
+	unsigned int muxDepth = 0;
+
+	g_paths[0] = PATH_T0;
+	g_pathCount = 1;
+
+	for (int i = 1; i < argc; i++) {
+		char const *pOpt = argv[i];
+		if (strcmp(pOpt, "-fastreset") == 0) {
+			g_fastReset = true;
+			continue;
+		}
+		if (strcmp(pOpt, "-mux") == 0) {
+			isMux = true;
+			continue;
+		}
+		if (strcmp(pOpt, "-hexbench") == 0) {
+			return hex_bench();
+		}
+		char const *pArg = (i + 1 < argc) ? argv[i + 1] : NULL;
+		if (pArg == NULL) {
+			usage();
+			return 1;
+		}
+		i++;
+		if (strcmp(pOpt, "-script") == 0) {
+			pScript = pArg;
+		} else if (strcmp(pOpt, "-path") == 0) {
+			if (parse_paths(pArg) != 0) {
+				usage();
+				return 1;
+			}
+		} else if (strcmp(pOpt, "-c") == 0) {
+			g_concurrency = atoi(pArg);
+		} else if (strcmp(pOpt, "-d") == 0) {
+			g_duration = (unsigned int)atoi(pArg);
+		} else if (strcmp(pOpt, "-w") == 0) {
+			g_warmup = (unsigned int)atoi(pArg);
+		} else if (strcmp(pOpt, "-rate") == 0) {
+			g_rate = atof(pArg);
+		} else if (strcmp(pOpt, "-host") == 0) {
+			pHost = pArg;
+		} else if (strcmp(pOpt, "-port") == 0) {
+			port = atoi(pArg);
+		} else if (strcmp(pOpt, "-mock") == 0) {
+			mockLatency = atoi(pArg);
+		} else if (strcmp(pOpt, "-pool") == 0) {
+			poolSize = (unsigned int)atoi(pArg);
+		} else if (strcmp(pOpt, "-muxdepth") == 0) {
+			muxDepth = (unsigned int)atoi(pArg);
+		} else if (strcmp(pOpt, "-refill") == 0) {
+			poolThreads = (unsigned int)atoi(pArg);
+		} else if (strcmp(pOpt, "-apducache") == 0) {
+			cacheSize = (unsigned int)atoi(pArg);
+		} else if (strcmp(pOpt, "-cacheins") == 0) {
+			pCacheIns = pArg;
+		} else if (strcmp(pOpt, "-replay") == 0) {
+			pReplay = pArg;
+		} else if (strcmp(pOpt, "-timing") == 0) {
+			timing = (unsigned int)atoi(pArg);
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	bool needsScript = false;
+	for (int i = 0; i < g_pathCount; i++) {
+		if (g_paths[i] != PATH_RESET) {
+			needsScript = true;
+		}
+	}
+	if ((pScript == NULL && needsScript) || g_concurrency < 1 || g_concurrency > MAX_WORKERS
+	        || g_duration <= g_warmup || g_rate < 0 || (isMux && poolSize > 0) || APDUCACHE_setConfig(cacheSize, pCacheIns) != 0) {
+		usage();
+		return 1;
+	}
+
+	if (pScript != NULL && load_script(pScript) != 0) {
+		return 1;
+	}
+
+	dbg_init();
+	if (JCOP_SIMUL_startup() != JCOP_SIMUL_NO_ERROR) {
+		fprintf(stderr, "can't initialize the transport\n");
+		dbg_exit();
+		return 1;
+	}
+	if (pReplay != NULL) {
+		if (REPLAY_open(pReplay, timing) != REPLAY_NO_ERROR) {
+			fprintf(stderr, "can't replay %s\n", pReplay);
+			dbg_exit();
+			return 1;
+		}
+		JCOP_SIMUL_setBackend(REPLAY_getBackend());
+	} else if (mockLatency >= 0) {
+		MOCK_open((unsigned int)mockLatency);
+		JCOP_SIMUL_setBackend(MOCK_getBackend());
+	} else if (pHost != NULL || port != 0) {
+		JCOP_SIMUL_setServer((pHost != NULL) ? pHost : JCOP_SIMUL_DEFAULT_HOST,
+		                     (unsigned short)((port != 0) ? port : JCOP_SIMUL_DEFAULT_PORT));
+	}
+
+	if (isMux) {
+		if (CHANMUX_open(JCOP_SIMUL_getBackend(), muxDepth) != CHANMUX_NO_ERROR) {
+			fprintf(stderr, "can't share sessions of the backend\n");
+			REPLAY_close();
+			JCOP_SIMUL_cleanup();
+			dbg_exit();
+			return 1;
+		}
+		JCOP_SIMUL_setBackend(CHANMUX_getBackend());
+	}
+	if (poolSize > 0) {
+		int status = SIMPOOL_open(poolSize, poolThreads);
+		if (status != SIMPOOL_NO_ERROR) {
+			fprintf(stderr, "can't open the session pool - status: 0x%08X\n", status);
+			REPLAY_close();
+			JCOP_SIMUL_cleanup();
+			dbg_exit();
+			return 1;
+		}
+	}
+
+	OSDEP_INT64 freq = OSDEP_frequency();
+	g_interval = (g_rate > 0) ? (OSDEP_INT64)((double)freq * g_concurrency / g_rate) : 0;
+	g_start = OSDEP_now();
+	g_warmupEnd = g_start + freq * g_warmup;
+	g_end = g_start + freq * g_duration;
+
+	int started = 0;
+	for (int i = 0; i < g_concurrency; i++) {
+		WORKER *pWorker = &g_workers[i];
+		pWorker->id = i;
+		pWorker->path = g_paths[i % g_pathCount];
+		pWorker->errors = 0;
+		pWorker->messages = 0;
+		pWorker->atrHits = 0;
+		pWorker->cacheHits = 0;
+		pWorker->cacheMisses = 0;
+		HISTOGRAM_reset(&pWorker->histogram);
+		if (OSDEP_createThread(&pWorker->thread, worker, pWorker, 0) != 0) {
+			fprintf(stderr, "can't create worker %d\n", i);
+			break;
+		}
+		started++;
+	}
+	for (int i = 0; i < started; i++) {
+		OSDEP_joinThread(g_workers[i].thread);
+	}
+	g_concurrency = started;
+
+	report();
+	if (poolSize > 0) {
+		unsigned long hits;
+		unsigned long misses;
+		SIMPOOL_getCounts(&hits, &misses);
+		printf("%lu power ups from the session pool, %lu without a ready session\n", hits, misses);
+		SIMPOOL_close();
+	}
+	if (isMux) {
+		static CHANMUX_STATS stats;
+		CHANMUX_getStats(&stats);
+		printf("%lu commands on the shared session by %lu channels, wait in usec\n", stats.commands, stats.channels);
+		printf("lane         commands   refused       mean        p50        p99        max\n");
+		for (int lane = 0; lane < CHANMUX_LANES; lane++) {
+			HISTOGRAM const *pWait = &stats.lanes[lane].wait;
+			printf("%-10s %10lu %9lu %10.1f %10.1f %10.1f %10.1f\n",
+			       (lane == CHANMUX_LANE_SHORT) ? "short" : "bulk",
+			       stats.lanes[lane].commands,
+			       stats.lanes[lane].rejected,
+			       HISTOGRAM_mean(pWait) / 1000,
+			       (double)HISTOGRAM_percentile(pWait, 50) / 1000,
+			       (double)HISTOGRAM_percentile(pWait, 99) / 1000,
+			       (double)pWait->max / 1000);
+		}
+		CHANMUX_close();
+	}
+
+	REPLAY_close();
+	JCOP_SIMUL_cleanup();
+	dbg_exit();
+	return 0;
+}
@@ -32,10 +32,22 @@
 #include <windows.h>
 #include <tchar.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "shared_data.h"
 #include "jcop_simul.h"
+#include "t0.h"
 #include "t1.h"
+#include "transcript.h"
+#include "replay.h"
+#include "stats.h"
+#include "trace.h"
+#include "atrcache.h"
+#include "simpool.h"
+#include "apducache.h"
+#include "nadroute.h"
+#include "chanmux.h"
+#define DBG_CATEGORY DBG_CAT_DISPATCH
 #include "dbglog.h"
 
 static char g_snd[JCOP_PROXY_BUFFER_SIZE];
@@ -44,13 +56,182 @@ static JCOP_PROXY_SHARED_EVENTS g_events;
 static HANDLE g_hFile;
 static HANDLE g_eventStop = NULL;
 
+// debug output levels set by "jcop_proxy loglevel <spec>".
+#define JCOP_PROXY_LOG_LEVELS_MAPPING "JCopProxyLogLevels"
+#define JCOP_PROXY_LOG_LEVELS_EVENT "JCopProxyLogLevelsChanged"
+static HANDLE g_hLogLevelsMapping = NULL;
+static PJCOP_PROXY_LOG_LEVELS g_pLogLevels = NULL;
+static HANDLE g_eventLogLevels = NULL;
+
+// headless mode: never pop up a MessageBox, errors go to the error log only.
+static bool g_headless = false;
+
+// transcript of the handled frames ("jcop_proxy start -record <file>").
+static TCHAR const *g_pTranscriptPath = NULL;
+
+// replay a transcript instead of JCOP simulator ("-replay <file> [-timing <percent>]").
+static TCHAR const *g_pReplayPath = NULL;
+static unsigned int g_replayTiming = REPLAY_TIMING_ORIGINAL;
+static unsigned int g_session = 0;
+static LARGE_INTEGER g_freq;
+
+// answer warm resets with the cached ATR and reset the session after the
+// answer ("-fastreset").
+static bool g_fastReset = false;
+
+// connection to JCOP simulator: closed at every power down ("-reconnect"),
+// and connected again in the background ("-standby").
+static bool g_reconnect = false;
+static bool g_standby = false;
+
+// sessions powered up in the background for resets ("-pool <n> [-refill <n>]").
+static unsigned int g_poolSize = 0;
+static unsigned int g_poolThreads = 1;
+
+// T=0: resolve SW 61xx and 6Cxx without the host ("-getresponse").
+static bool g_getResponse = false;
+
+// T=0: send GET RESPONSE of 61xx before the host asks ("-prefetch").
+static bool g_prefetch = false;
+
+// T=1: the driver sends whole C-APDUs instead of T=1 blocks ("-apdut1").
+static bool g_apduT1 = false;
+
+// answers of the whitelisted C-APDUs kept ("-apducache <n> [-cacheins <list>]").
+static unsigned int g_cacheSize = 0;
+static TCHAR const *g_pCacheIns = NULL;
+
+// T=1: NADs served by their own simulator sessions ("-route <list>", see nadroute.h).
+static TCHAR const *g_pRoutes = NULL;
+
+// the routed NADs share the default session by logical channels ("-mux", see chanmux.h).
+static bool g_mux = false;
+
+// per-stage latency statistics, saved when the proxy stops ("-stats <file>").
+static TCHAR const *g_pStatsPath = NULL;
+
+// the statistics are published for "jcop_proxy stats" while the proxy runs.
+#define JCOP_PROXY_STATS_MAPPING "JCopProxyStats"
+static HANDLE g_hStatsMapping = NULL;
+static STATS_DATA *g_pStatsData = NULL;
+
+// trace of the handled frames ("-trace <file>"), one track per session.
+static TCHAR const *g_pTracePath = NULL;
+static OSDEP_INT64 g_t1ApduStart = 0;	// T=1: the first block of the current C-APDU, 0 if none.
+static unsigned char g_t1Cla = 0;
+static unsigned char g_t1Ins = 0;
+
+// the last request with a timing trailer. its answer woke up the driver at
+// the time carried by the next request.
+typedef struct _LAST_REQUEST {
+	bool isValid;
+	unsigned int seq;
+	LARGE_INTEGER sent;
+	LARGE_INTEGER replied;
+} LAST_REQUEST;
+static LAST_REQUEST g_lastRequest;
+
+// timestamps of a frame.
+#define TS_SIGNALLED	0	// hEventSnd is signalled.
+#define TS_READ		1	// the request is read.
+#define TS_PROCESSED	2	// the request is processed.
+#define TS_REPLIED	3	// the answer is written.
+#define TS_COUNT	4
+
+// error log, written to JCOP_PROXY_ERR_LOG_FILE when the proxy stops.
+#define JCOP_PROXY_ERR_LOG_FILE "jcop_proxy.log"
+#define ERR_LOG_ENTRIES 64	// must be a power of 2.
+#define ERR_LOG_MSG_SIZE 128
+#define ERR_LOG_WRITING (-1)	// seq of an entry being written.
+
+typedef struct _ERR_LOG_ENTRY {
+	volatile LONG seq;	// number of the error (1, 2, ...), 0: none, ERR_LOG_WRITING.
+	DWORD tick;
+	char msg[ERR_LOG_MSG_SIZE];
+} ERR_LOG_ENTRY;
+
+static ERR_LOG_ENTRY g_errLog[ERR_LOG_ENTRIES];
+static volatile LONG g_errCount = 0;
+static volatile LONG g_errDropped = 0;	// messages not stored, their entry being written.
+
+/*!
+ * \brief Function records an error message.<br>
+ * <br>
+ * The message is stored in the error log ring without taking any lock, so
+ * it can be called from the message loop (or any thread) without stalling.
+ * Old entries are overwritten when more than ERR_LOG_ENTRIES errors occur.
+ * An entry is claimed by its seq, so two threads never write it at once: a
+ * message whose entry is being written, or already holds a newer error, is
+ * dropped (and counted).
+ * <br>
+ * \param [in] pFmt format string (printf style).
+ */
+static void err_log(char const *const pFmt, ...)
+{
+	char msg[ERR_LOG_MSG_SIZE];
+	va_list argList;
+	va_start(argList, pFmt);
+	_vsnprintf(msg, ERR_LOG_MSG_SIZE - 1, pFmt, argList);
+	va_end(argList);
+	msg[ERR_LOG_MSG_SIZE - 1] = '\0';
+	dbg_err("%s", msg);
+
+	// claim a slot.
+	LONG n = InterlockedIncrement(&g_errCount);
+	ERR_LOG_ENTRY *pEntry = &g_errLog[(n - 1) & (ERR_LOG_ENTRIES - 1)];
+	LONG seq = pEntry->seq;
+	if (seq == ERR_LOG_WRITING || seq > n
+	        || InterlockedCompareExchange(&pEntry->seq, ERR_LOG_WRITING, seq) != seq) {
+		InterlockedIncrement(&g_errDropped);
+		return;
+	}
+	memcpy(pEntry->msg, msg, ERR_LOG_MSG_SIZE);
+	pEntry->tick = GetTickCount();
+	InterlockedExchange(&pEntry->seq, n);	// publish.
+}
+
+/*!
+ * \brief Function writes the error log to JCOP_PROXY_ERR_LOG_FILE.<br>
+ */
+static void flush_err_log(void)
+{
+	LONG count = g_errCount;
+	if (count == 0) {
+		return;
+	}
+
+	FILE *fp = fopen(JCOP_PROXY_ERR_LOG_FILE, "a");
+	if (fp == NULL) {
+		return;
+	}
+	fprintf(fp, "%ld error(s)\n", count);
+	if (g_errDropped > 0) {
+		fprintf(fp, "%ld message(s) dropped\n", g_errDropped);
+	}
+	LONG first = (count > ERR_LOG_ENTRIES) ? (count - ERR_LOG_ENTRIES) : 0;
+	for (LONG i = first; i < count; i++) {
+		ERR_LOG_ENTRY *pEntry = &g_errLog[i & (ERR_LOG_ENTRIES - 1)];
+		if (pEntry->seq != i + 1) {
+			continue;	// dropped, or still being written.
+		}
+		fprintf(fp, "[%10lu] %s\n", pEntry->tick, pEntry->msg);
+	}
+	fclose(fp);
+}
+
 static void err_msg(char const *const pFmt, ...)
 {
 	va_list argList;
 	va_start(argList, pFmt);
 	TCHAR sz[1024];
-	_vstprintf(sz, pFmt, argList);
+	_vsntprintf(sz, (sizeof(sz) / sizeof(TCHAR)) - 1, pFmt, argList);
 	va_end(argList);
+	sz[(sizeof(sz) / sizeof(TCHAR)) - 1] = _T('\0');
+
+	if (g_headless) {
+		err_log("%s", sz);
+		return;
+	}
 
 	MessageBox(
 	    NULL,
@@ -60,6 +241,20 @@ static void err_msg(char const *const pFmt, ...)
 	);
 }
 
+static void info_msg(char const *const pMsg)
+{
+	if (g_headless) {
+		return;
+	}
+
+	MessageBox(
+	    NULL,
+	    pMsg,
+	    _T("jcop_proxy"),
+	    (MB_OK | MB_ICONINFORMATION)
+	);
+}
+
 static void finalize_driver(void)
 {
 	if (g_events.hEventRcv != NULL) {
@@ -79,6 +274,35 @@ static void finalize_driver(void)
 	dbg_log("CloseHandle(g_hFile): end");
 }
 
+static void finalize_log_levels(void)
+{
+	if (g_eventLogLevels != NULL) {
+		CloseHandle(g_eventLogLevels);
+		g_eventLogLevels = NULL;
+	}
+	if (g_pLogLevels != NULL) {
+		UnmapViewOfFile(g_pLogLevels);
+		g_pLogLevels = NULL;
+	}
+	if (g_hLogLevelsMapping != NULL) {
+		CloseHandle(g_hLogLevelsMapping);
+		g_hLogLevelsMapping = NULL;
+	}
+}
+
+static void finalize_stats(void)
+{
+	STATS_setStorage(NULL);
+	if (g_pStatsData != NULL) {
+		UnmapViewOfFile(g_pStatsData);
+		g_pStatsData = NULL;
+	}
+	if (g_hStatsMapping != NULL) {
+		CloseHandle(g_hStatsMapping);
+		g_hStatsMapping = NULL;
+	}
+}
+
 static void finalize(void)
 {
 	// set event receiving data completed.
@@ -88,126 +312,765 @@ static void finalize(void)
 		g_eventStop = NULL;
 	}
 
+	finalize_log_levels();
+
+	NADROUTE_close();
+	SIMPOOL_close();
+	APDUCACHE_free();
 	dbg_log("JCOP_SIMUL_close()");
 	JCOP_SIMUL_close();
+	if (g_mux) {
+		CHANMUX_close();
+	}
+	JCOP_SIMUL_cleanup();
 
 	finalize_driver();
 }
 
+/*!
+ * \brief Function answers the pending request of the driver with an error message.<br>
+ * <br>
+ * Used when a request could not be processed. The driver returns at once
+ * with the NTSTATUS mapped from the status code instead of waiting until it
+ * times out.
+ * <br>
+ * \param [in] code status code, JCOP_MSG_ERROR_XXX.
+ */
+static void reply_error(unsigned long const code)
+{
+	unsigned long msgLen = JCOP_MSG_encodeError(g_rcv, (unsigned char)g_snd[1], code);
+	DWORD dwWritten = 0;
+	BOOL bStatus = WriteFile(g_hFile, g_rcv, msgLen, &dwWritten, NULL);
+	if (!bStatus) {
+		err_log("WriteFile failed! - status: 0x%08X", GetLastError());
+	}
+	bStatus = SetEvent(g_events.hEventRcv);
+	if (!bStatus) {
+		err_log("SetEvent failed! - status: 0x%08X", GetLastError());
+	}
+}
+
+/*!
+ * \brief Function applies the levels set by "jcop_proxy loglevel" to
+ * jcop_proxy and the driver.<br>
+ */
+static void apply_log_levels(void)
+{
+	JCOP_PROXY_LOG_LEVELS levels;
+	memcpy(&levels, g_pLogLevels, sizeof(levels));
+	dbg_setLevels(levels.levels);
+
+	DWORD dwReturn;
+	BOOL bStatus = DeviceIoControl(
+	                   g_hFile,					// Handle to device
+	                   IOCTL_JCOP_PROXY_SET_LOG_LEVELS,	// IO Control code
+	                   &levels,					// Input Buffer to driver.
+	                   sizeof(JCOP_PROXY_LOG_LEVELS),		// Length of input buffer in bytes.
+	                   NULL,					// Output Buffer from driver.
+	                   0,						// Length of output buffer in bytes.
+	                   &dwReturn,				// Bytes placed in buffer.
+	                   NULL					// synchronous call
+	               );
+	if (!bStatus) {
+		err_log("Ioctl failed! - status: 0x%08X", GetLastError());
+	}
+}
+
+/*!
+ * \brief Function answers the pending request of the driver.<br>
+ * <br>
+ * \param [in] mty MTY of the request.
+ * \param [in] nad NAD of the request.
+ * \param [in] rcvLen length of the payload already set in g_rcv.
+ */
+static void reply(unsigned char const mty, unsigned char const nad, unsigned short const rcvLen)
+{
+	// write received data to kernel-mode driver.
+	unsigned long msgLen = JCOP_MSG_setHeader(g_rcv, mty, nad, rcvLen);
+	dbg_ba2s(g_rcv, msgLen);
+	DWORD dwWritten = 0;
+	BOOL bStatus = WriteFile(g_hFile, g_rcv, msgLen, &dwWritten, NULL);
+	if (!bStatus) {
+		err_log("WriteFile failed! - status: 0x%08X", GetLastError());
+		reply_error(JCOP_MSG_ERROR_IO);
+		return;
+	}
+	dbg_log("%d bytes written", dwWritten);
+
+	// set event receiving data completed.
+	bStatus = SetEvent(g_events.hEventRcv);
+	if (!bStatus) {
+		err_log("SetEvent failed! - status: 0x%08X", GetLastError());
+		return;
+	}
+	dbg_log("hEventRcv set.");
+}
+
+/*!
+ * \brief Function completes a warm reset answered from the cached ATR
+ * before a C-APDU is sent.<br>
+ * <br>
+ * The reset is normally done after the previous request is answered; if it
+ * failed there, it is retried and the request fails instead of running on
+ * a card which was not reset.
+ *
+ * \retval 0 the session is reset (or no reset is pending).
+ * \retval status of the power up.
+ */
+static unsigned long finish_reset(void)
+{
+	int status = ATRCACHE_flush();
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		err_log("deferred JCOP_SIMUL_powerUp failed again! - status: 0x%08X", status);
+	}
+	return (unsigned long)status;
+}
+
+static unsigned int elapsed_usec(LARGE_INTEGER const *const pFrom, LARGE_INTEGER const *const pTo)
+{
+	if (g_freq.QuadPart == 0) {
+		return 0;
+	}
+	return (unsigned int)(((pTo->QuadPart - pFrom->QuadPart) * 1000000) / g_freq.QuadPart);
+}
+
+/*!
+ * \brief Function measures the latency of each stage of the handled frame.<br>
+ * <br>
+ * STATS_STAGE_RETURN and STATS_STAGE_TOTAL are measured for the previous
+ * request, as the driver reports its wake up time with the next request.
+ * <br>
+ * \param [in] pTs timestamps of the frame, TS_XXX.
+ * \param [in] pTiming timing trailer of the request, or NULL.
+ * \param [in] simulator time spent in JCOP simulator.
+ * \param [out] pStages latency of each stage (ticks), -1 if not measured.
+ */
+static void measure_stages(
+    LARGE_INTEGER const *const pTs,
+    JCOP_MSG_TIMING const *const pTiming,
+    OSDEP_INT64 const simulator,
+    OSDEP_INT64 *const pStages
+)
+{
+	for (int i = 0; i < STATS_STAGES; i++) {
+		pStages[i] = -1;
+	}
+	OSDEP_INT64 process = pTs[TS_PROCESSED].QuadPart - pTs[TS_READ].QuadPart;
+	pStages[STATS_STAGE_READ] = pTs[TS_READ].QuadPart - pTs[TS_SIGNALLED].QuadPart;
+	pStages[STATS_STAGE_PROTOCOL] = process - simulator;
+	if (simulator != 0) {
+		pStages[STATS_STAGE_SIMULATOR] = simulator;
+	}
+	pStages[STATS_STAGE_REPLY] = pTs[TS_REPLIED].QuadPart - pTs[TS_PROCESSED].QuadPart;
+
+	if (pTiming == NULL) {
+		g_lastRequest.isValid = false;
+		return;
+	}
+	LARGE_INTEGER sent;
+	sent.LowPart = pTiming->sentLow;
+	sent.HighPart = (LONG)pTiming->sentHigh;
+	pStages[STATS_STAGE_WAKE] = pTs[TS_SIGNALLED].QuadPart - sent.QuadPart;
+
+	LARGE_INTEGER woken;
+	woken.LowPart = pTiming->wokenLow;
+	woken.HighPart = (LONG)pTiming->wokenHigh;
+	if (g_lastRequest.isValid && woken.QuadPart != 0 && pTiming->seq == g_lastRequest.seq + 1) {
+		pStages[STATS_STAGE_RETURN] = woken.QuadPart - g_lastRequest.replied.QuadPart;
+		pStages[STATS_STAGE_TOTAL] = woken.QuadPart - g_lastRequest.sent.QuadPart;
+	}
+	g_lastRequest.isValid = true;
+	g_lastRequest.seq = pTiming->seq;
+	g_lastRequest.sent = sent;
+	g_lastRequest.replied = pTs[TS_REPLIED];
+}
+
+static unsigned int stage_usec(OSDEP_INT64 const ticks)
+{
+	return (ticks > 0) ? (unsigned int)OSDEP_toUsec(ticks) : 0;
+}
+
+/*!
+ * \brief Function records the handled frame to the transcript.<br>
+ * <br>
+ * \param [in] mty MTY of the request.
+ * \param [in] nad NAD of the request.
+ * \param [in] pTs timestamps of the frame, TS_XXX.
+ * \param [in] pStages latency of each stage, STATS_STAGE_XXX.
+ * \param [in] status 0, or status code of the error answer.
+ * \param [in] rcvLen length of the answer payload in g_rcv.
+ */
+static void record_frame(
+    unsigned char const mty,
+    unsigned char const nad,
+    LARGE_INTEGER const *const pTs,
+    OSDEP_INT64 const *const pStages,
+    unsigned short const status,
+    unsigned short const rcvLen
+)
+{
+	TRANSCRIPT_RECORD record;
+	memset(&record, 0, sizeof(record));
+	record.session = g_session;
+	record.tsLow = pTs[TS_SIGNALLED].LowPart;
+	record.tsHigh = (unsigned int)pTs[TS_SIGNALLED].HighPart;
+	record.mty = mty;
+	record.nad = nad;
+	record.status = status;
+	record.cmdLen = JCOP_MSG_getLength(g_snd);
+	record.rspLen = rcvLen;
+	record.stage[TRANSCRIPT_STAGE_READ] = elapsed_usec(&pTs[TS_SIGNALLED], &pTs[TS_READ]);
+	record.stage[TRANSCRIPT_STAGE_PROCESS] = elapsed_usec(&pTs[TS_READ], &pTs[TS_PROCESSED]);
+	record.stage[TRANSCRIPT_STAGE_REPLY] = elapsed_usec(&pTs[TS_PROCESSED], &pTs[TS_REPLIED]);
+	record.stage[TRANSCRIPT_STAGE_WAKE] = stage_usec(pStages[STATS_STAGE_WAKE]);
+	record.stage[TRANSCRIPT_STAGE_SIMULATOR] = stage_usec(pStages[STATS_STAGE_SIMULATOR]);
+
+	int ret = TRANSCRIPT_record(&record, g_snd + JCOP_MSG_HEADER_SIZE, g_rcv + JCOP_MSG_HEADER_SIZE);
+	if (ret != TRANSCRIPT_NO_ERROR) {
+		// stop recording rather than failing every frame.
+		err_log("TRANSCRIPT_record failed! - status: 0x%08X", ret);
+		TRANSCRIPT_close();
+	}
+}
+
+/*!
+ * \brief Function formats the trace args of a C-APDU.<br>
+ * <br>
+ * \param [out] pArgs args, at least 64 bytes.
+ * \param [in] pSw status word of the answer, or NULL.
+ * \param [in] errCode 0, or status code of the error answer.
+ */
+static void format_apdu_args(
+    char *const pArgs,
+    unsigned char const cla,
+    unsigned char const ins,
+    char const *const pSw,
+    unsigned long const errCode
+)
+{
+	int len = sprintf(pArgs, "\"cla\":\"%02X\",\"ins\":\"%02X\"", cla, ins);
+	if (errCode != 0) {
+		sprintf(pArgs + len, ",\"error\":\"0x%02X\"", (unsigned int)errCode);
+	} else if (pSw != NULL) {
+		sprintf(pArgs + len, ",\"sw\":\"%02X%02X\"", pSw[0] & 0xff, pSw[1] & 0xff);
+	}
+}
+
+/*!
+ * \brief Function writes the spans of the handled frame to the trace.<br>
+ * <br>
+ * A C-APDU is a span on the track of its session. The IPC waits, ReadFile,
+ * JCOP simulator, WriteFile and (T=1) the blocks of the C-APDU are nested
+ * spans.
+ * <br>
+ * \param [in] mty MTY of the request.
+ * \param [in] pTs timestamps of the frame, TS_XXX.
+ * \param [in] pTiming timing trailer of the request, or NULL.
+ * \param [in] pStages latency of each stage, STATS_STAGE_XXX.
+ * \param [in] simulatorStart JCOP simulator was called, 0 if not.
+ * \param [in] errCode 0, or status code of the error answer.
+ * \param [in] rcvLen length of the answer payload in g_rcv.
+ */
+static void trace_frame(
+    unsigned char const mty,
+    LARGE_INTEGER const *const pTs,
+    JCOP_MSG_TIMING const *const pTiming,
+    OSDEP_INT64 const *const pStages,
+    OSDEP_INT64 const simulatorStart,
+    unsigned long const errCode,
+    unsigned short const rcvLen
+)
+{
+	static unsigned int lastTrack = 0;
+	unsigned int track = g_session;
+	char args[64];
+
+	// the answer of the previous request woke up the driver.
+	if (pStages[STATS_STAGE_RETURN] >= 0) {
+		LARGE_INTEGER woken;
+		woken.LowPart = pTiming->wokenLow;
+		woken.HighPart = (LONG)pTiming->wokenHigh;
+		TRACE_span(lastTrack, "ipc return", "ipc", woken.QuadPart - pStages[STATS_STAGE_RETURN], woken.QuadPart, NULL);
+	}
+	lastTrack = track;
+
+	OSDEP_INT64 start = pTs[TS_SIGNALLED].QuadPart;
+	OSDEP_INT64 end = pTs[TS_REPLIED].QuadPart;
+	if (pStages[STATS_STAGE_WAKE] >= 0) {
+		start -= pStages[STATS_STAGE_WAKE];
+		TRACE_span(track, "ipc wait", "ipc", start, pTs[TS_SIGNALLED].QuadPart, NULL);
+	}
+	TRACE_span(track, "read", "ipc", pTs[TS_SIGNALLED].QuadPart, pTs[TS_READ].QuadPart, NULL);
+	if (pStages[STATS_STAGE_SIMULATOR] >= 0) {
+		TRACE_span(track, "simulator", "simulator", simulatorStart, simulatorStart + pStages[STATS_STAGE_SIMULATOR], NULL);
+	}
+	TRACE_span(track, "reply", "ipc", pTs[TS_PROCESSED].QuadPart, end, NULL);
+
+	char const *pCmd = g_snd + JCOP_MSG_HEADER_SIZE;
+	unsigned short cmdLen = JCOP_MSG_getLength(g_snd);
+	char const *pRsp = g_rcv + JCOP_MSG_HEADER_SIZE;
+	switch (mty) {
+		case JCOP_MSG_MTY_WAIT_FOR_CARD :
+			_snprintf(args, sizeof(args), "session %u", track);
+			args[sizeof(args) - 1] = '\0';
+			TRACE_nameTrack(track, args);
+			TRACE_span(track, "power up", "apdu", start, end, NULL);
+			g_t1ApduStart = 0;
+			break;
+		case JCOP_MSG_MTY_APDU :
+		case JCOP_MSG_MTY_T1_APDU :
+			if (mty == JCOP_MSG_MTY_T1_APDU) {
+				g_t1ApduStart = 0;	// T1_processApdu drops the chain.
+			}
+			if (cmdLen >= 4) {
+				format_apdu_args(args, (unsigned char)pCmd[0], (unsigned char)pCmd[1],
+				                 (rcvLen >= 2) ? pRsp + rcvLen - 2 : NULL, errCode);
+				TRACE_span(track, "APDU", "apdu", start, end, args);
+			}
+			break;
+		case JCOP_MSG_MTY_T1 : {
+			// block: NAD PCB LEN | INF... | EDC
+			if (cmdLen < 4) {
+				break;
+			}
+			sprintf(args, "\"pcb\":\"%02X\"", pCmd[1] & 0xff);
+			TRACE_span(track, "T=1 block", "t1", start, end, args);
+			if ((pCmd[1] & 0x80) == 0 && g_t1ApduStart == 0 && cmdLen >= 6) {
+				// the first I-block of a C-APDU.
+				g_t1ApduStart = start;
+				g_t1Cla = (unsigned char)pCmd[3];
+				g_t1Ins = (unsigned char)pCmd[4];
+			}
+			if (g_t1ApduStart == 0) {
+				break;
+			}
+			char const *pSw = NULL;
+			if (errCode == 0) {
+				if (rcvLen < 4 || (pRsp[1] & 0xA0) != 0) {
+					break;	// the answer is not the last I-block.
+				}
+				unsigned short infLen = (unsigned short)(pRsp[2] & 0xff);
+				if (infLen >= 2 && 3 + infLen <= rcvLen) {
+					pSw = pRsp + 3 + infLen - 2;
+				}
+			}
+			format_apdu_args(args, g_t1Cla, g_t1Ins, pSw, errCode);
+			TRACE_span(track, "APDU", "apdu", g_t1ApduStart, end, args);
+			g_t1ApduStart = 0;
+			break;
+		}
+		case JCOP_MSG_MTY_BATCH : {
+			unsigned int answers = 0;
+			unsigned long offset = 0;
+			unsigned long itemLen;
+			while ((itemLen = JCOP_MSG_getBatchItem(pRsp, rcvLen, offset)) != 0) {
+				answers++;
+				offset += itemLen;
+			}
+			sprintf(args, "\"answers\":%u", answers);
+			TRACE_span(track, "batch", "apdu", start, end, args);
+			break;
+		}
+		case JCOP_MSG_MTY_CLOSE :
+			TRACE_span(track, "close", "apdu", start, end, NULL);
+			g_t1ApduStart = 0;
+			break;
+		default:
+			break;
+	}
+}
+
+/*!
+ * \brief Function gets the transfer counters of the driver.<br>
+ * <br>
+ * \param [out] pCounters counters.
+ *
+ * \retval true the counters are got.
+ * \retval false failed.
+ */
+static bool get_driver_counters(JCOP_PERF_COUNTERS *const pCounters)
+{
+	DWORD dwReturn = 0;
+	BOOL bStatus = DeviceIoControl(
+	                   g_hFile,					// Handle to device
+	                   IOCTL_JCOP_PROXY_GET_PERF_COUNTERS,	// IO Control code
+	                   NULL,					// Input Buffer to driver.
+	                   0,						// Length of input buffer in bytes.
+	                   pCounters,				// Output Buffer from driver.
+	                   sizeof(JCOP_PERF_COUNTERS),		// Length of output buffer in bytes.
+	                   &dwReturn,				// Bytes placed in buffer.
+	                   NULL					// synchronous call
+	               );
+	if (!bStatus || dwReturn != sizeof(JCOP_PERF_COUNTERS)) {
+		err_log("Ioctl failed! - status: 0x%08X", GetLastError());
+		return false;
+	}
+	return true;
+}
+
+/*!
+ * \brief Function transmits the C-APDUs of a batch (MTY 0x13).<br>
+ * <br>
+ * The batch bypasses the response cache and the prefetch of GET RESPONSE,
+ * so the deferred SELECT commands are sent first and the card state of
+ * the cache starts again. If a C-APDU fails after others were answered,
+ * their R-APDUs are answered followed by an error message of the failure.
+ * <br>
+ * \param [in] pPayload payload of the request.
+ * \param [in] payloadLen length of the payload.
+ * \param [out] pRcv A pointer to buffer of the answer payload.
+ * \param [in][out] pRcvLen [in]length of pRcv. [out]actual length of the answer payload.
+ *
+ * \retval 0 success, or a C-APDU failed after others were answered.
+ * \retval JCOP_MSG_ERROR_BAD_MESSAGE the batch is malformed.
+ * \retval status of JCOP_SIMUL_transmitBatch (no C-APDU was answered).
+ */
+static unsigned long transmit_batch(
+    char const *const pPayload,
+    unsigned short const payloadLen,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	if (payloadLen < JCOP_MSG_BATCH_HEADER_SIZE) {
+		return JCOP_MSG_ERROR_BAD_MESSAGE;
+	}
+	unsigned short abortMask = (unsigned short)(((pPayload[0] & 0xff) << 8) | (pPayload[1] & 0xff));
+	unsigned short abortSw = (unsigned short)(((pPayload[2] & 0xff) << 8) | (pPayload[3] & 0xff));
+
+	JCOP_SIMUL_BATCH_CMD cmds[JCOP_MSG_BATCH_MAX_CMDS];
+	JCOP_SIMUL_BATCH_RESULT results[JCOP_MSG_BATCH_MAX_CMDS];
+	unsigned int n = 0;
+	unsigned long offset = JCOP_MSG_BATCH_HEADER_SIZE;
+	unsigned long itemLen;
+	while ((itemLen = JCOP_MSG_getBatchItem(pPayload, payloadLen, offset)) != 0) {
+		if (n == JCOP_MSG_BATCH_MAX_CMDS || (unsigned char)pPayload[offset] != JCOP_MSG_MTY_APDU
+		        || itemLen < JCOP_MSG_HEADER_SIZE + 4) {
+			return JCOP_MSG_ERROR_BAD_MESSAGE;
+		}
+		cmds[n].pSnd = pPayload + offset;
+		cmds[n].sndLen = (unsigned short)itemLen;
+		n++;
+		offset += itemLen;
+	}
+	if (offset != payloadLen) {
+		return JCOP_MSG_ERROR_BAD_MESSAGE;	// a truncated message.
+	}
+
+	T0_discardPrefetch();
+	int status = APDUCACHE_flush();
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		return status;
+	}
+	if (*pRcvLen < JCOP_MSG_HEADER_SIZE + JCOP_MSG_ERROR_PAYLOAD_SIZE) {
+		return JCOP_MSG_ERROR_BUFFER_TOO_SMALL;
+	}
+	unsigned int done = 0;
+	unsigned short rcvLen = *pRcvLen - (JCOP_MSG_HEADER_SIZE + JCOP_MSG_ERROR_PAYLOAD_SIZE);	// room for the error.
+	status = JCOP_SIMUL_transmitBatch(cmds, n, results, &done, abortMask, abortSw, pRcv, &rcvLen);
+	dbg_log("JCOP_SIMUL_transmitBatch end with code %d - %u/%u C-APDUs", status, done, n);
+	if (status != JCOP_SIMUL_NO_ERROR && done == 0) {
+		return status;
+	}
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		err_log("C-APDU %u/%u of the batch failed! - status: 0x%08X", done + 1, n, status);
+		rcvLen += (unsigned short)JCOP_MSG_encodeError(pRcv + rcvLen, (unsigned char)cmds[done].pSnd[1], status);
+	}
+	*pRcvLen = rcvLen;
+	return 0;
+}
+
 static int loop(void)
 {
+	// received data is set after the message header.
+	char *const pRcvPayload = g_rcv + JCOP_MSG_HEADER_SIZE;
 
 	while (true) {
 		// wait for event.
 		dbg_log("waiting for sending data event...");
-		HANDLE handles[2];
+		HANDLE handles[3];
 		handles[0] = g_events.hEventSnd;	// WAIT_OBJECT_0
 		handles[1] = g_eventStop;	// WAIT_OBJECT_0 + 1
-		DWORD status = WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+		handles[2] = g_eventLogLevels;	// WAIT_OBJECT_0 + 2
+		DWORD status = WaitForMultipleObjects(3, handles, FALSE, INFINITE);
 		if (status != WAIT_OBJECT_0) {
 			switch (status) {
 				case WAIT_OBJECT_0 + 1 :
 					// Stoping thread event is set.
 					dbg_log("WAIT_OBJECT_0 + 1");
 					return 0;
+				case WAIT_OBJECT_0 + 2 :
+					// log levels are changed.
+					dbg_log("WAIT_OBJECT_0 + 2");
+					apply_log_levels();
+					break;
 				case WAIT_ABANDONED :
-					dbg_log("WAIT_ABANDONED");
+					dbg_warn("WAIT_ABANDONED");
 					break;
 				case WAIT_TIMEOUT :
-					dbg_log("WAIT_TIMEOUT");
+					dbg_warn("WAIT_TIMEOUT");
 					break;
 				default:
-					dbg_log("WAIT_XXXXX");
+					dbg_warn("WAIT_XXXXX");
 					break;
 			}
 			continue;
 		}
 		dbg_log("hEventSnd signalled.");
+		LARGE_INTEGER ts[TS_COUNT];
+		QueryPerformanceCounter(&ts[TS_SIGNALLED]);
 
 		// read sending data from kernel-mode driver.
 		memset(g_snd, 0, sizeof(g_snd));
 		unsigned long dwRead = 0;
 		BOOL bStatus = ReadFile(g_hFile, g_snd, sizeof(g_snd), &dwRead, NULL);
 		if (!bStatus) {
-			err_msg("ReadFile failed! - status: 0x%08X", GetLastError());
+			err_log("ReadFile failed! - status: 0x%08X", GetLastError());
+			reply_error(JCOP_MSG_ERROR_IO);
 			continue;
 		}
 		dbg_log("%d bytes read", dwRead);
 		dbg_ba2s(g_snd, dwRead);
-		if (dwRead > 0xFFFF) {
-			err_msg("dwRead > 0xFFFF");
+		QueryPerformanceCounter(&ts[TS_READ]);
+		JCOP_MSG_TIMING timing;
+		bool hasTiming = (JCOP_MSG_getTiming(g_snd, dwRead, &timing) != 0);
+		if (hasTiming) {
+			dwRead -= JCOP_MSG_TIMING_SIZE;	// the trailer is not a part of the frame.
+		}
+		if (!JCOP_MSG_isValid(g_snd, dwRead)) {
+			err_log("malformed message: %d bytes", dwRead);
+			reply_error(JCOP_MSG_ERROR_BAD_MESSAGE);
 			continue;
 		}
 
 		// check MTY and dispatch process.
-		int mty = g_snd[0];
-		unsigned short rcvLen;
+		unsigned char mty = (unsigned char)g_snd[0];
+		unsigned char nad = (unsigned char)g_snd[1];
+		unsigned short rcvLen = 0;
+		unsigned long errCode = 0;
+		unsigned int savedRoundTrips = 0;
+		JCOP_SIMUL_takeElapsed(NULL);
 		switch (mty) {
-			case 0x00 :
+			case JCOP_MSG_MTY_WAIT_FOR_CARD :
 				dbg_log("MTY=0x00: Wait for card");
+				if (NADROUTE_isEnabled()) {
+					status = NADROUTE_reset();
+					if (status != JCOP_SIMUL_NO_ERROR) {
+						err_log("NADROUTE_reset failed! - status: 0x%08X", status);
+						errCode = status;
+						break;
+					}
+				}
 				memset(g_rcv, 0, sizeof(g_rcv));
-				rcvLen = sizeof(g_rcv);	// expected length
-				status = JCOP_SIMUL_powerUp(g_rcv, &rcvLen);
+				rcvLen = sizeof(g_rcv) - JCOP_MSG_HEADER_SIZE;	// expected length
+				if (g_fastReset && JCOP_MSG_getLength(g_snd) > 0
+				        && g_snd[JCOP_MSG_HEADER_SIZE] == JCOP_MSG_RESET_WARM) {
+					status = ATRCACHE_warmReset(pRcvPayload, &rcvLen);
+				} else {
+					status = ATRCACHE_powerUp(pRcvPayload, &rcvLen);
+				}
 				dbg_log("JCOP_SIMUL_powerUp end with code %d", status);
 				if (status != JCOP_SIMUL_NO_ERROR) {
-					err_msg("JCOP_SIMUL_powerUp failed! - status: 0x%08X", GetLastError());
-					continue;
+					err_log("JCOP_SIMUL_powerUp failed! - status: 0x%08X", status);
+					errCode = status;
+					break;
 				}
 				// reset Card sequence No.
 				T1_resetSeq();
+				APDUCACHE_invalidate();
+				T0_discardPrefetch();
+				g_session++;
 				break;
-			case 0x01 :
+			case JCOP_MSG_MTY_APDU :
 				dbg_log("MTY=0x01: T=0 Transmit APDU");
+				if (NADROUTE_isEnabled()) {
+					status = NADROUTE_selectDefault();
+					if (status != JCOP_SIMUL_NO_ERROR) {
+						err_log("NADROUTE_selectDefault failed! - status: 0x%08X", status);
+						errCode = status;
+						break;
+					}
+				}
+				errCode = finish_reset();
+				if (errCode != 0) {
+					break;
+				}
 				memset(g_rcv, 0, sizeof(g_rcv));
-				rcvLen = sizeof(g_rcv);	// expected length
-				status = JCOP_SIMUL_transmit(g_snd, (unsigned short)dwRead, g_rcv, &rcvLen);
+				rcvLen = sizeof(g_rcv) - JCOP_MSG_HEADER_SIZE;	// expected length
+				if (g_getResponse) {
+					status = T0_transmit(g_snd, (unsigned short)dwRead, pRcvPayload, &rcvLen, &savedRoundTrips);
+				} else if (g_prefetch) {
+					status = T0_transmitPrefetched(g_snd, (unsigned short)dwRead, pRcvPayload, &rcvLen);
+				} else {
+					status = APDUCACHE_transmit(g_snd, (unsigned short)dwRead, pRcvPayload, &rcvLen);
+				}
 				dbg_log("JCOP_SIMUL_transmit end with code %d", status);
 				if (status != JCOP_SIMUL_NO_ERROR) {
-					err_msg("JCOP_SIMUL_transmit failed! - status: 0x%08X", status);
-					continue;
+					err_log("JCOP_SIMUL_transmit failed! - status: 0x%08X", status);
+					errCode = status;
 				}
 				break;
-			case 0x11 :
+			case JCOP_MSG_MTY_T1 :
 				// This is the original MTY used only for this proxy application.
 				dbg_log("MTY=0x11: T=1 Message");
+				if (NADROUTE_isEnabled() && dwRead > JCOP_MSG_HEADER_SIZE) {
+					// the NAD of the block: MTY NAD LNH LNL | NAD PCB LEN ...
+					status = NADROUTE_select((unsigned char)g_snd[JCOP_MSG_HEADER_SIZE]);
+					if (status != JCOP_SIMUL_NO_ERROR) {
+						err_log("NADROUTE_select failed! - status: 0x%08X", status);
+						errCode = status;
+						break;
+					}
+				}
+				errCode = finish_reset();
+				if (errCode != 0) {
+					break;
+				}
 				memset(g_rcv, 0, sizeof(g_rcv));
-				rcvLen = sizeof(g_rcv);	// expected length
-				status = T1_processMsg(g_snd, (unsigned short)dwRead, g_rcv, &rcvLen);
+				rcvLen = sizeof(g_rcv) - JCOP_MSG_HEADER_SIZE;	// expected length
+				status = T1_processMsg(g_snd, (unsigned short)dwRead, pRcvPayload, &rcvLen);
 				dbg_log("T1_processMsg end with code %d", status);
 				if (status != 0) {
-					err_msg("T1_processMsg failed! - status: 0x%08X", status);
-					continue;
+					err_log("T1_processMsg failed! - status: 0x%08X", status);
+					errCode = status;
 				}
 				break;
-			case 0x7F :
+			case JCOP_MSG_MTY_T1_APDU :
 				// This is the original MTY used only for this proxy application.
-				dbg_log("MTY=0x7F: Close socket");
-				JCOP_SIMUL_close();
-				rcvLen = (unsigned short)dwRead;
-				memcpy(g_rcv, g_snd, rcvLen);
+				dbg_log("MTY=0x12: T=1 Transmit APDU");
+				if (NADROUTE_isEnabled()) {
+					status = NADROUTE_select(nad);	// the driver sends the T=1 NAD.
+					if (status != JCOP_SIMUL_NO_ERROR) {
+						err_log("NADROUTE_select failed! - status: 0x%08X", status);
+						errCode = status;
+						break;
+					}
+				}
+				errCode = finish_reset();
+				if (errCode != 0) {
+					break;
+				}
+				memset(g_rcv, 0, sizeof(g_rcv));
+				rcvLen = sizeof(g_rcv) - JCOP_MSG_HEADER_SIZE;	// expected length
+				status = T1_processApdu(g_snd, (unsigned short)dwRead, pRcvPayload, &rcvLen);
+				dbg_log("T1_processApdu end with code %d", status);
+				if (status != 0) {
+					err_log("T1_processApdu failed! - status: 0x%08X", status);
+					errCode = status;
+				}
+				break;
+			case JCOP_MSG_MTY_BATCH :
+				// This is the original MTY used only for this proxy application.
+				dbg_log("MTY=0x13: Transmit batch");
+				if (NADROUTE_isEnabled()) {
+					status = NADROUTE_selectDefault();
+					if (status != JCOP_SIMUL_NO_ERROR) {
+						err_log("NADROUTE_selectDefault failed! - status: 0x%08X", status);
+						errCode = status;
+						break;
+					}
+				}
+				errCode = finish_reset();
+				if (errCode != 0) {
+					break;
+				}
+				memset(g_rcv, 0, sizeof(g_rcv));
+				rcvLen = sizeof(g_rcv) - JCOP_MSG_HEADER_SIZE;	// expected length
+				errCode = transmit_batch(g_snd + JCOP_MSG_HEADER_SIZE, JCOP_MSG_getLength(g_snd), pRcvPayload, &rcvLen);
+				if (errCode != 0) {
+					err_log("transmit_batch failed! - status: 0x%08X", errCode);
+				}
+				break;
+			case JCOP_MSG_MTY_CLOSE :
+				// This is the original MTY used only for this proxy application.
+				dbg_log("MTY=0x7F: Power down");
+				if (NADROUTE_isEnabled() && NADROUTE_reset() != JCOP_SIMUL_NO_ERROR) {
+					err_log("NADROUTE_reset failed!");	// powered down all the same.
+				}
+				ATRCACHE_invalidate();
+				APDUCACHE_invalidate();
+				T0_discardPrefetch();
+				JCOP_SIMUL_powerDown();
+				// echo the payload.
+				rcvLen = JCOP_MSG_getLength(g_snd);
+				memcpy(pRcvPayload, g_snd + JCOP_MSG_HEADER_SIZE, rcvLen);
 				break;
 			default:
-				dbg_log("MTY UNKNOWN");
-				continue;
+				err_log("MTY UNKNOWN: 0x%02X", mty);
+				errCode = JCOP_MSG_ERROR_UNKNOWN_MTY;
+				break;
 		}
+		QueryPerformanceCounter(&ts[TS_PROCESSED]);
+		OSDEP_INT64 simulatorStart;
+		OSDEP_INT64 simulator = JCOP_SIMUL_takeElapsed(&simulatorStart);
 
-		// write received data to kernel-mode driver.
-		dbg_ba2s(g_rcv, rcvLen);
-		DWORD dwWritten = 0;
-		bStatus = WriteFile(g_hFile, g_rcv, rcvLen, &dwWritten, NULL);
-		if (!bStatus) {
-			err_msg("WriteFile failed! - status: 0x%08X", GetLastError());
-			continue;
+		if (errCode != 0) {
+			reply_error(errCode);
+			rcvLen = 0;
+		} else {
+			reply(mty, nad, rcvLen);
 		}
-		dbg_log("%d bytes written", dwWritten);
+		QueryPerformanceCounter(&ts[TS_REPLIED]);
 
-		// set event receiving data completed.
-		bStatus = SetEvent(g_events.hEventRcv);
-		if (!bStatus) {
-			err_msg("SetEvent failed! - status: 0x%08X", GetLastError());
-			continue;
+		OSDEP_INT64 stages[STATS_STAGES];
+		measure_stages(ts, hasTiming ? &timing : NULL, simulator, stages);
+		// "jcop_proxy stats" may read the statistics at any time.
+		STATS_beginUpdate();
+		JCOP_PERF_countRequest(STATS_getCounters(), g_snd);	// the dispatch leaves the request unchanged.
+		if (errCode != 0) {
+			JCOP_PERF_countError(STATS_getCounters(), errCode == JCOP_MSG_ERROR_TIMEOUT, simulator);
+		} else {
+			JCOP_PERF_countAnswer(STATS_getCounters(), rcvLen, simulator);
+			if (mty == JCOP_MSG_MTY_BATCH) {
+				JCOP_PERF_countBatchAnswer(STATS_getCounters(), pRcvPayload, rcvLen);
+			}
+		}
+		STATS_getCounters()->savedRoundTrips += savedRoundTrips;
+		unsigned long cacheHits;
+		unsigned long cacheMisses;
+		APDUCACHE_getCounts(&cacheHits, &cacheMisses);
+		STATS_getCounters()->cacheHits = cacheHits;
+		STATS_getCounters()->cacheMisses = cacheMisses;
+		unsigned long prefetchHits;
+		unsigned long prefetchMisses;
+		OSDEP_INT64 prefetchTicks;
+		T0_getPrefetchCounts(&prefetchHits, &prefetchMisses, &prefetchTicks);
+		STATS_getCounters()->prefetchHits = prefetchHits;
+		STATS_getCounters()->prefetchMisses = prefetchMisses;
+		STATS_getCounters()->prefetchTicks = (JCOP_PERF_UINT64)prefetchTicks;
+		for (int lane = 0; g_mux && lane < JCOP_PERF_LANES; lane++) {
+			unsigned long laneCommands;
+			unsigned long laneRefused;
+			OSDEP_INT64 laneWaitTicks;
+			CHANMUX_getCounts(lane, &laneCommands, &laneRefused, &laneWaitTicks);
+			STATS_getCounters()->laneCommands[lane] = laneCommands;
+			STATS_getCounters()->laneRefused[lane] = laneRefused;
+			STATS_getCounters()->laneWaitTicks[lane] = (JCOP_PERF_UINT64)laneWaitTicks;
+		}
+		for (int i = 0; i < STATS_STAGES; i++) {
+			STATS_record(i, stages[i]);
+		}
+		STATS_endUpdate();
+		if (TRANSCRIPT_isOpen()) {
+			record_frame(mty, nad, ts, stages, (unsigned short)errCode, rcvLen);
+		}
+		if (TRACE_isOpen()) {
+			trace_frame(mty, ts, hasTiming ? &timing : NULL, stages, simulatorStart, errCode, rcvLen);
+		}
+
+		// reset the session of a warm reset answered with the cached ATR,
+		// while the driver goes on.
+		// on failure the reset stays pending and the next request retries it.
+		status = ATRCACHE_flush();
+		if (status != JCOP_SIMUL_NO_ERROR) {
+			err_log("deferred JCOP_SIMUL_powerUp failed! - status: 0x%08X", status);
+		}
+
+		// send GET RESPONSE of 61xx, while the driver delivers 61xx.
+		status = T0_prefetch();
+		if (status != JCOP_SIMUL_NO_ERROR) {
+			err_log("prefetch of GET RESPONSE failed! - status: 0x%08X", status);
 		}
-		dbg_log("hEventRcv set.");
 	}
 
 	return 0;
@@ -215,16 +1078,43 @@ static int loop(void)
 
 static int initialize_jcop(void)
 {
+	if (JCOP_SIMUL_startup() != JCOP_SIMUL_NO_ERROR) {
+		return -1;
+	}
+	JCOP_SIMUL_setConnection(!g_reconnect, g_standby);
+	if (g_mux) {
+		if (CHANMUX_open(JCOP_SIMUL_getBackend(), 0) == CHANMUX_NO_ERROR) {
+			JCOP_SIMUL_setBackend(CHANMUX_getBackend());
+		} else {
+			err_log("can't share the session by logical channels.");
+			g_mux = false;
+		}
+	}
+
 	memset(g_rcv, 0, sizeof(g_rcv));
 	unsigned short rcvLen = sizeof(g_rcv);	// expected length
-	int status = JCOP_SIMUL_powerUp(g_rcv, &rcvLen);
+	int status = ATRCACHE_powerUp(g_rcv, &rcvLen);
 	dbg_log("JCOP_SIMUL_powerUp end with code %d", status);
 	if (status != JCOP_SIMUL_NO_ERROR) {
 		JCOP_SIMUL_close();
-		dbg_log("JCOP_SIMUL_powerUp failed! - status: 0x%08X", status);
+		JCOP_SIMUL_cleanup();
+		dbg_err("JCOP_SIMUL_powerUp failed! - status: 0x%08X", status);
 		return -1;
 	}
 
+	if (g_poolSize > 0) {
+		status = SIMPOOL_open(g_poolSize, g_poolThreads);
+		if (status != SIMPOOL_NO_ERROR) {
+			err_log("can't open the session pool - status: 0x%08X", status);
+		}
+	}
+	if (g_pRoutes != NULL) {
+		status = NADROUTE_open();
+		if (status != NADROUTE_NO_ERROR) {
+			err_log("can't route by NAD: %s - status: 0x%08X", g_pRoutes, status);
+		}
+	}
+
 	return 0;
 }
 
@@ -233,14 +1123,14 @@ static int initialize_driver(void)
 	// create event for sending data.
 	g_events.hEventSnd = CreateEvent(NULL, FALSE, FALSE, "JCopVRSnd");
 	if (g_events.hEventSnd == NULL) {
-		dbg_log("CreateEvent failed! - status: 0x%08X", GetLastError());
+		dbg_err("CreateEvent failed! - status: 0x%08X", GetLastError());
 		return -1;
 	}
 
 	// create event for receiving data.
 	g_events.hEventRcv = CreateEvent(NULL, FALSE, FALSE, "JCopVRRcv");
 	if (g_events.hEventRcv == NULL) {
-		dbg_log("CreateEvent failed! - status: 0x%08X", GetLastError());
+		dbg_err("CreateEvent failed! - status: 0x%08X", GetLastError());
 		finalize_driver();
 		return -1;
 	}
@@ -249,7 +1139,7 @@ static int initialize_driver(void)
 	g_hFile = CreateFile("\\\\.\\JCopVirtualReader",
 	                     GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
 	if (g_hFile == INVALID_HANDLE_VALUE) {
-		dbg_log("CreateFile failed! - status: 0x%08X", GetLastError());
+		dbg_err("CreateFile failed! - status: 0x%08X", GetLastError());
 		finalize_driver();
 		return -1;
 	}
@@ -267,11 +1157,215 @@ static int initialize_driver(void)
 	                   NULL					// synchronous call
 	               );
 	if (!bStatus) {
-		dbg_log("Ioctl failed! - status: 0x%08X", GetLastError());
+		dbg_err("Ioctl failed! - status: 0x%08X", GetLastError());
 		finalize_driver();
 		return -1;
 	}
 
+	if (g_apduT1) {
+		// send IOCTL_SET_OPTIONS IO control code.
+		JCOP_PROXY_OPTIONS options;
+		options.flags = JCOP_PROXY_OPTION_APDU_T1;
+		bStatus = DeviceIoControl(
+		              g_hFile,
+		              IOCTL_JCOP_PROXY_SET_OPTIONS,
+		              &options,
+		              sizeof(JCOP_PROXY_OPTIONS),
+		              NULL,
+		              0,
+		              &dwReturn,
+		              NULL
+		          );
+		if (!bStatus) {
+			// an older driver keeps exchanging T=1 blocks.
+			err_log("IOCTL_JCOP_PROXY_SET_OPTIONS failed! - status: 0x%08X", GetLastError());
+		}
+	}
+
+	return 0;
+}
+
+static int initialize_log_levels(void)
+{
+	// shared with "jcop_proxy loglevel <spec>".
+	g_hLogLevelsMapping = CreateFileMapping(
+	                          INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+	                          0, sizeof(JCOP_PROXY_LOG_LEVELS), JCOP_PROXY_LOG_LEVELS_MAPPING);
+	if (g_hLogLevelsMapping == NULL) {
+		dbg_err("CreateFileMapping failed! - status: 0x%08X", GetLastError());
+		return -1;
+	}
+	g_pLogLevels = (PJCOP_PROXY_LOG_LEVELS)MapViewOfFile(
+	                   g_hLogLevelsMapping, FILE_MAP_WRITE, 0, 0, sizeof(JCOP_PROXY_LOG_LEVELS));
+	if (g_pLogLevels == NULL) {
+		dbg_err("MapViewOfFile failed! - status: 0x%08X", GetLastError());
+		finalize_log_levels();
+		return -1;
+	}
+	memset(g_pLogLevels, 0, sizeof(JCOP_PROXY_LOG_LEVELS));
+#ifdef MY_DEBUG
+	memcpy(g_pLogLevels->levels, g_dbgLevel, DBG_CAT_COUNT);
+#endif
+
+	g_eventLogLevels = CreateEvent(NULL, FALSE, FALSE, JCOP_PROXY_LOG_LEVELS_EVENT);
+	if (g_eventLogLevels == NULL) {
+		dbg_err("CreateEvent failed! - status: 0x%08X", GetLastError());
+		finalize_log_levels();
+		return -1;
+	}
+
+	return 0;
+}
+
+static int initialize_stats(void)
+{
+	// read by "jcop_proxy stats".
+	g_hStatsMapping = CreateFileMapping(
+	                      INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+	                      0, sizeof(STATS_DATA), JCOP_PROXY_STATS_MAPPING);
+	if (g_hStatsMapping == NULL) {
+		dbg_err("CreateFileMapping failed! - status: 0x%08X", GetLastError());
+		return -1;
+	}
+	g_pStatsData = (STATS_DATA *)MapViewOfFile(
+	                   g_hStatsMapping, FILE_MAP_WRITE, 0, 0, sizeof(STATS_DATA));
+	if (g_pStatsData == NULL) {
+		dbg_err("MapViewOfFile failed! - status: 0x%08X", GetLastError());
+		finalize_stats();
+		return -1;
+	}
+	STATS_setStorage(g_pStatsData);
+	return 0;
+}
+
+/*!
+ * \brief Function writes the statistics of the running jcop_proxy.<br>
+ * <br>
+ * The statistics are copied from the shared memory without stopping the
+ * proxy. A Prometheus file is written to "<file>.tmp" and renamed, so a
+ * scraper never reads a partial file.
+ * <br>
+ * \param [in] pPath output file, or NULL to show the statistics.
+ * \param [in] prometheus true: Prometheus text format, false: text table.
+ *
+ * \retval 0 the statistics are written.
+ * \retval -1 jcop_proxy is not started or the file could not be written.
+ */
+static int show_stats(TCHAR const *const pPath, bool const prometheus)
+{
+	HANDLE hMapping = OpenFileMapping(FILE_MAP_READ, FALSE, JCOP_PROXY_STATS_MAPPING);
+	if (hMapping == NULL) {
+		err_msg("jcop_proxy is not started!");
+		return -1;
+	}
+	STATS_DATA const *pShared = (STATS_DATA const *)MapViewOfFile(
+	                                hMapping, FILE_MAP_READ, 0, 0, sizeof(STATS_DATA));
+	if (pShared == NULL) {
+		CloseHandle(hMapping);
+		err_msg("MapViewOfFile failed! - status: 0x%08X", GetLastError());
+		return -1;
+	}
+	// too large for the stack.
+	STATS_DATA *pData = (STATS_DATA *)malloc(sizeof(STATS_DATA));
+	int status = (pData != NULL) ? STATS_snapshot(pShared, pData) : -1;
+	UnmapViewOfFile(pShared);
+	CloseHandle(hMapping);
+	if (status != 0) {
+		free(pData);
+		err_msg("can't read the statistics of jcop_proxy!");
+		return -1;
+	}
+
+	if (pPath == NULL) {
+		char msg[2048];
+		size_t len = 0;
+		FILE *fp = tmpfile();
+		if (fp != NULL) {
+			STATS_write(fp, pData, NULL);
+			rewind(fp);
+			len = fread(msg, 1, sizeof(msg) - 1, fp);
+			fclose(fp);
+		}
+		msg[len] = '\0';
+		free(pData);
+		info_msg(msg);
+		return 0;
+	}
+
+	char tmpPath[MAX_PATH];
+	_snprintf(tmpPath, sizeof(tmpPath), prometheus ? "%s.tmp" : "%s", pPath);
+	tmpPath[sizeof(tmpPath) - 1] = '\0';
+	FILE *fp = fopen(tmpPath, "w");
+	if (fp == NULL) {
+		free(pData);
+		err_msg("can't create the stats file: %s", tmpPath);
+		return -1;
+	}
+	if (prometheus) {
+		STATS_writePrometheus(fp, pData);
+	} else {
+		STATS_write(fp, pData, NULL);
+	}
+	free(pData);
+	status = ferror(fp) ? -1 : 0;
+	if (fclose(fp) != 0) {
+		status = -1;
+	}
+	if (status == 0 && prometheus
+	        && !MoveFileEx(tmpPath, pPath, MOVEFILE_REPLACE_EXISTING)) {
+		status = -1;
+	}
+	if (status != 0) {
+		err_msg("can't write the stats file: %s", pPath);
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * \brief Function changes the debug output levels of the running jcop_proxy.<br>
+ * <br>
+ * \param [in] pSpec level specification (see dbg_parseLevels).
+ *
+ * \retval 0 the levels are changed.
+ * \retval -1 jcop_proxy is not started or pSpec is invalid.
+ */
+static int set_log_levels(char const *const pSpec)
+{
+	HANDLE hMapping = OpenFileMapping(FILE_MAP_WRITE, FALSE, JCOP_PROXY_LOG_LEVELS_MAPPING);
+	if (hMapping == NULL) {
+		err_msg("jcop_proxy is not started!");
+		return -1;
+	}
+	PJCOP_PROXY_LOG_LEVELS pLevels = (PJCOP_PROXY_LOG_LEVELS)MapViewOfFile(
+	                                     hMapping, FILE_MAP_WRITE, 0, 0, sizeof(JCOP_PROXY_LOG_LEVELS));
+	if (pLevels == NULL) {
+		CloseHandle(hMapping);
+		err_msg("MapViewOfFile failed! - status: 0x%08X", GetLastError());
+		return -1;
+	}
+
+	// levels not given by pSpec keep their current value.
+	JCOP_PROXY_LOG_LEVELS levels;
+	memcpy(&levels, pLevels, sizeof(levels));
+	int status = dbg_parseLevels(pSpec, levels.levels);
+	if (status == 0) {
+		memcpy(pLevels, &levels, sizeof(levels));
+	}
+	UnmapViewOfFile(pLevels);
+	CloseHandle(hMapping);
+	if (status != 0) {
+		err_msg("invalid log level: %s\nformat: [category=]level[,...]\nlevel: off, err, warn, info, debug\ncategory: general, transport, t1, ipc, dispatch", pSpec);
+		return -1;
+	}
+
+	HANDLE ev = OpenEvent(EVENT_MODIFY_STATE, FALSE, JCOP_PROXY_LOG_LEVELS_EVENT);
+	if (ev == NULL) {
+		err_msg("jcop_proxy is not started!");
+		return -1;
+	}
+	SetEvent(ev);
+	CloseHandle(ev);
 	return 0;
 }
 
@@ -279,19 +1373,27 @@ static int initialize(void)
 {
 	g_eventStop = CreateEvent(NULL, FALSE, FALSE, "JCopProxyStopThread");
 	if (g_eventStop == INVALID_HANDLE_VALUE) {
-		dbg_log("CreateEvent failed! - status: 0x%08X", GetLastError());
+		dbg_err("CreateEvent failed! - status: 0x%08X", GetLastError());
 		err_msg("CreateEvent failed!");
 		return -1;
 	}
 
 	int status;
 
+	// Log levels
+	status = initialize_log_levels();
+	if (status != 0) {
+		err_msg("CreateFileMapping failed!");
+		return -1;
+	}
+
 	// Driver File
 	status = initialize_driver();
 	if (status != 0) {
 		err_msg("the driver file (jcop_vr.sys) is not installed properly.");
 		return -1;
 	}
+	apply_log_levels();
 
 	// JCOP Simulator
 	status = initialize_jcop();
@@ -303,44 +1405,213 @@ static int initialize(void)
 	return 0;
 }
 
+/*!
+ * \brief Function parses the options following the sub command.<br>
+ * <br>
+ * \param [in] pOpt first option token, or NULL if there is none.
+ *
+ * \retval 0 all options are valid.
+ * \retval -1 unknown option, -getresponse with -prefetch, or bad -apducache,
+ *		-cacheins, -route or -mux.
+ */
+static int parse_options(TCHAR *pOpt)
+{
+	for (; pOpt != NULL; pOpt = _tcstok(NULL, _T(" \t"))) {
+		if (_tcscmp(pOpt, _T("-headless")) == 0) {
+			g_headless = true;
+		} else if (_tcscmp(pOpt, _T("-fastreset")) == 0) {
+			g_fastReset = true;
+		} else if (_tcscmp(pOpt, _T("-reconnect")) == 0) {
+			g_reconnect = true;
+		} else if (_tcscmp(pOpt, _T("-standby")) == 0) {
+			g_standby = true;
+		} else if (_tcscmp(pOpt, _T("-getresponse")) == 0) {
+			g_getResponse = true;
+		} else if (_tcscmp(pOpt, _T("-prefetch")) == 0) {
+			g_prefetch = true;
+		} else if (_tcscmp(pOpt, _T("-apdut1")) == 0) {
+			g_apduT1 = true;
+		} else if (_tcscmp(pOpt, _T("-apducache")) == 0) {
+			pOpt = _tcstok(NULL, _T(" \t"));
+			if (pOpt == NULL) {
+				return -1;
+			}
+			g_cacheSize = (unsigned int)_ttoi(pOpt);
+		} else if (_tcscmp(pOpt, _T("-cacheins")) == 0) {
+			pOpt = _tcstok(NULL, _T(" \t"));
+			if (pOpt == NULL) {
+				return -1;
+			}
+			g_pCacheIns = pOpt;
+		} else if (_tcscmp(pOpt, _T("-route")) == 0) {
+			pOpt = _tcstok(NULL, _T(" \t"));
+			if (pOpt == NULL || NADROUTE_setConfig(pOpt) != NADROUTE_NO_ERROR) {
+				return -1;
+			}
+			g_pRoutes = pOpt;
+		} else if (_tcscmp(pOpt, _T("-mux")) == 0) {
+			g_mux = true;
+		} else if (_tcscmp(pOpt, _T("-pool")) == 0) {
+			pOpt = _tcstok(NULL, _T(" \t"));
+			if (pOpt == NULL) {
+				return -1;
+			}
+			g_poolSize = (unsigned int)_ttoi(pOpt);
+		} else if (_tcscmp(pOpt, _T("-refill")) == 0) {
+			pOpt = _tcstok(NULL, _T(" \t"));
+			if (pOpt == NULL) {
+				return -1;
+			}
+			g_poolThreads = (unsigned int)_ttoi(pOpt);
+		} else if (_tcscmp(pOpt, _T("-record")) == 0) {
+			pOpt = _tcstok(NULL, _T(" \t"));
+			if (pOpt == NULL) {
+				return -1;
+			}
+			g_pTranscriptPath = pOpt;
+		} else if (_tcscmp(pOpt, _T("-stats")) == 0) {
+			pOpt = _tcstok(NULL, _T(" \t"));
+			if (pOpt == NULL) {
+				return -1;
+			}
+			g_pStatsPath = pOpt;
+		} else if (_tcscmp(pOpt, _T("-trace")) == 0) {
+			pOpt = _tcstok(NULL, _T(" \t"));
+			if (pOpt == NULL) {
+				return -1;
+			}
+			g_pTracePath = pOpt;
+		} else if (_tcscmp(pOpt, _T("-replay")) == 0) {
+			pOpt = _tcstok(NULL, _T(" \t"));
+			if (pOpt == NULL) {
+				return -1;
+			}
+			g_pReplayPath = pOpt;
+		} else if (_tcscmp(pOpt, _T("-timing")) == 0) {
+			pOpt = _tcstok(NULL, _T(" \t"));
+			if (pOpt == NULL) {
+				return -1;
+			}
+			g_replayTiming = (unsigned int)_ttoi(pOpt);
+		} else {
+			return -1;
+		}
+	}
+	// -getresponse answers 61xx itself, so there is nothing to prefetch.
+	if (g_getResponse && g_prefetch) {
+		return -1;
+	}
+	// the channels of -mux are on the default simulator, and none is a fresh card for the pool.
+	if (g_mux && (g_pRoutes == NULL || _tcschr(g_pRoutes, _T('=')) != NULL || g_poolSize > 0)) {
+		return -1;
+	}
+	// the whitelist is checked here, so a bad one is reported with the usage.
+	return APDUCACHE_setConfig(g_cacheSize, g_pCacheIns);
+}
+
 int APIENTRY _tWinMain(HINSTANCE hInstance,
                        HINSTANCE hPrevInstance,
                        LPTSTR    lpCmdLine,
                        int       nCmdShow)
 {
+	TCHAR *pCmd = _tcstok(lpCmdLine, _T(" \t"));
+	TCHAR *pArg = NULL;
+	bool prometheus = false;
+	if (pCmd != NULL && _tcscmp(pCmd, _T("loglevel")) == 0) {
+		pArg = _tcstok(NULL, _T(" \t"));
+		if (pArg == NULL) {
+			pCmd = _T("");
+		}
+	} else if (pCmd != NULL && _tcscmp(pCmd, _T("stats")) == 0) {
+		// stats [-prometheus] [<file>]
+		TCHAR *pOpt;
+		while ((pOpt = _tcstok(NULL, _T(" \t"))) != NULL) {
+			if (_tcscmp(pOpt, _T("-prometheus")) == 0) {
+				prometheus = true;
+			} else if (pArg == NULL && pOpt[0] != _T('-')) {
+				pArg = pOpt;
+			} else {
+				pCmd = _T("");
+				break;
+			}
+		}
+		if (prometheus && pArg == NULL) {
+			pCmd = _T("");
+		}
+	}
+	if (pCmd == NULL || parse_options(_tcstok(NULL, _T(" \t"))) != 0) {
+		pCmd = _T("");
+	}
 
-	if (_tcscmp(lpCmdLine, _T("start")) == 0) {
+	if (_tcscmp(pCmd, _T("start")) == 0) {
 
 		HANDLE ev = OpenEvent(EVENT_MODIFY_STATE, FALSE, "JCopProxyStopThread");
 		if (ev != NULL) {
 			err_msg("jcop_proxy is already started!");
+			flush_err_log();
 			return -1;
 		}
+		dbg_init();
+		if (g_pReplayPath != NULL) {
+			if (REPLAY_open(g_pReplayPath, g_replayTiming) != REPLAY_NO_ERROR) {
+				err_msg("can't replay the transcript file: %s", g_pReplayPath);
+				dbg_exit();
+				flush_err_log();
+				return -1;
+			}
+			JCOP_SIMUL_setBackend(REPLAY_getBackend());
+		}
 		int status = initialize();
 		if (status != 0) {
+			REPLAY_close();
+			dbg_exit();
+			flush_err_log();
 			return status;
 		}
-		MessageBox(
-		    NULL,
-		    _T("jcop_proxy is successfully invoked.\ndon't forget to restart 'Smart Card' service."),
-		    _T("jcop_proxy"),
-		    (MB_OK | MB_ICONINFORMATION)
-		);
+		QueryPerformanceFrequency(&g_freq);
+		if (initialize_stats() != 0) {
+			err_log("can't publish the statistics.");
+		}
+		STATS_reset();
+		if (g_pTranscriptPath != NULL) {
+			int ret = TRANSCRIPT_open(g_pTranscriptPath, g_freq.LowPart, (unsigned int)g_freq.HighPart);
+			if (ret != TRANSCRIPT_NO_ERROR) {
+				err_msg("can't create the transcript file: %s", g_pTranscriptPath);
+			}
+		}
+		if (g_pTracePath != NULL) {
+			if (TRACE_open(g_pTracePath) != TRACE_NO_ERROR) {
+				err_msg("can't create the trace file: %s", g_pTracePath);
+			} else {
+				TRACE_nameTrack(0, "no session");
+			}
+		}
+		info_msg(_T("jcop_proxy is successfully invoked.\ndon't forget to restart 'Smart Card' service."));
 		status = loop();
+		JCOP_PERF_COUNTERS driverCounters;
+		bool hasDriverCounters = (g_pStatsPath != NULL) && get_driver_counters(&driverCounters);
 		finalize();
+		if (TRANSCRIPT_isOpen()) {
+			TRANSCRIPT_close();
+		}
+		TRACE_close();
+		if (g_pStatsPath != NULL
+		        && STATS_save(g_pStatsPath, hasDriverCounters ? &driverCounters : NULL) != 0) {
+			err_log("can't write the stats file: %s", g_pStatsPath);
+		}
+		finalize_stats();
+		REPLAY_close();
+		dbg_exit();
 		if (status != 0) {
 			err_msg("loop() failed! - status: 0x%08X", status);
+			flush_err_log();
 			return status;
 		}
-		MessageBox(
-		    NULL,
-		    _T("jcop_proxy is successfully stopped."),
-		    _T("jcop_proxy"),
-		    (MB_OK | MB_ICONINFORMATION)
-		);
+		flush_err_log();
+		info_msg(_T("jcop_proxy is successfully stopped."));
 		return 0;
 
-	} else if (_tcscmp(lpCmdLine, _T("stop")) == 0) {
+	} else if (_tcscmp(pCmd, _T("stop")) == 0) {
 
 		HANDLE ev = OpenEvent(EVENT_MODIFY_STATE, FALSE, "JCopProxyStopThread");
 		if (ev == NULL) {
@@ -350,9 +1621,17 @@ int APIENTRY _tWinMain(HINSTANCE hInstance,
 		SetEvent(ev);
 		return 0;
 
+	} else if (_tcscmp(pCmd, _T("loglevel")) == 0) {
+
+		return set_log_levels(pArg);
+
+	} else if (_tcscmp(pCmd, _T("stats")) == 0) {
+
+		return show_stats(pArg, prometheus);
+
 	} else {
 
-		err_msg("usage: jcop_proxy <start|stop>");
+		err_msg("usage: jcop_proxy <start [-headless] [-fastreset] [-reconnect] [-standby] [-pool <n> [-refill <n>]] [-getresponse|-prefetch] [-apdut1] [-apducache <n> [-cacheins <list>]] [-route <nad>[=<host>:<port>][,...] [-mux]] [-record <file>] [-stats <file>] [-trace <file>] [-replay <file> [-timing <percent>]]|stop|loglevel <[category=]level[,...]>|stats [-prometheus] [<file>]>");
 		return -1;
 	
 	}
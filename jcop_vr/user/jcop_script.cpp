@@ -0,0 +1,969 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*!
+ * \file jcop_script.cpp
+ * \brief runner of JCShell-style APDU scripts over several JCOP simulator sessions.
+ * \author Kenichi Kanai
+ *
+ * jcop_script runs each script on a freshly powered up card and checks the
+ * SW of every C-APDU against the expected ones. A script stops at the first
+ * unexpected SW. Supported commands:
+ *
+ *   /send <C-APDU> [<SW>...]   send a C-APDU.
+ *   <hex digits>               send a C-APDU (spaces allowed) and expect 9000.
+ *   /select <AID> [<SW>...]    SELECT by name (00 A4 04 00 Lc AID 00).
+ *   /card, /reset, /atr        power up the card again.
+ *   /close                     power down the card.
+ *   /upload [-b <block size>] [-w <window>] <CAP or IJC file>
+ *                              INSTALL [for load] and LOAD (see capload.h).
+ *   /echo <text>               ignored.
+ *
+ * <SW> is 4 hex digits, where X matches any digit (e.g. 61XX), optionally
+ * followed by "/<mask>" (e.g. 9000/F000), or "*" for any SW; the default is
+ * 9000. SW 61xx and 6Cxx are resolved as jcop_proxy -getresponse does.
+ * '#' and "//" start a comment.
+ *
+ * The scripts are independent of each other, so they run on several
+ * sessions at the same time. Each session (worker) owns a range of the
+ * scripts, dealt largest first; a worker whose range is empty steals the
+ * back half of the fullest range. The head and the tail of a range share a
+ * word, so the owner and the thieves take scripts by compare-and-exchange.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "osdep.h"
+#include "shared_data.h"
+#include "jcop_simul.h"
+#include "t0.h"
+#include "apducache.h"
+#include "capload.h"
+#include "mock.h"
+#include "hexfmt.h"
+#define DBG_CATEGORY DBG_CAT_GENERAL
+#include "dbglog.h"
+
+#define MAX_APDU_SIZE (JCOP_PROXY_BUFFER_SIZE - JCOP_MSG_HEADER_SIZE)
+#define MAX_LINE_SIZE (MAX_APDU_SIZE * 3 + 256)
+#define MAX_WORKERS 256
+#define MAX_SCRIPTS 32767	// a range holds two 15 bit indexes.
+#define MAX_EXPECTED 8		// expected SW of a step.
+
+#define STEP_SEND 0	// /send, /select or a line of hex digits.
+#define STEP_RESET 1	// /card, /reset or /atr.
+#define STEP_CLOSE 2	// /close.
+#define STEP_UPLOAD 3	// /upload.
+
+typedef struct _STEP {
+	int op;			// STEP_XXX
+	int lineNo;
+	unsigned short len;	// length of C-APDU.
+	char *pApdu;
+	int swCount;
+	unsigned short sw[MAX_EXPECTED];
+	unsigned short mask[MAX_EXPECTED];
+	char const *pCapPath;	// /upload
+	CAPLOAD_FILE *pCap;
+	unsigned int blockSize;	// 0: as large as the card takes.
+	unsigned int window;
+	CAPLOAD_STATS load;
+} STEP;
+
+typedef struct _SCRIPT {
+	char const *pPath;
+	STEP *pSteps;
+	int stepCount;
+	int apduCount;		// C-APDUs, the estimated cost.
+	bool isPassed;
+	int worker;		// worker which ran the script.
+	OSDEP_INT64 elapsed;	// ticks.
+	char message[160];	// why the script failed.
+} SCRIPT;
+
+typedef struct _WORKER {
+	int id;
+	OSDEP_THREAD thread;
+	long volatile range;	// (head << 16) | tail: positions of g_pOrder still queued.
+	long steals;		// ranges stolen from other workers.
+	int scripts;		// scripts run.
+} WORKER;
+
+static SCRIPT *g_pScripts = NULL;
+static int g_scriptCount = 0;
+static int *g_pOrder = NULL;	// script indexes in the order of the ranges.
+
+static int g_concurrency = 1;
+static WORKER g_workers[MAX_WORKERS];
+
+/*!
+ * \brief Function parses hex digits; spaces are ignored.<br>
+ *
+ * \retval number of bytes, or -1 if the text is invalid.
+ */
+static int parse_hex(char const *const pText, char *const pBuf, int const bufSize)
+{
+	int len = 0;
+	int high = -1;
+	for (char const *p = pText; *p != '\0'; p++) {
+		if (*p == ' ' || *p == '\t') {
+			continue;
+		}
+		int v = HEXFMT_decodeDigit(*p);
+		if (v < 0) {
+			return -1;
+		}
+		if (high < 0) {
+			high = v;
+			continue;
+		}
+		if (len == bufSize) {
+			return -1;
+		}
+		pBuf[len++] = (char)((high << 4) | v);
+		high = -1;
+	}
+	return (high < 0) ? len : -1;
+}
+
+/*!
+ * \brief Function cuts the next token of a line; a token in double quotes
+ * may have spaces.<br>
+ *
+ * \retval A pointer to the token, or NULL at the end of the line.
+ */
+static char *next_token(char **const ppLine)
+{
+	char *p = *ppLine;
+	while (*p == ' ' || *p == '\t') {
+		p++;
+	}
+	if (*p == '\0') {
+		*ppLine = p;
+		return NULL;
+	}
+	char const *pEnds = " \t";
+	if (*p == '"') {
+		p++;
+		pEnds = "\"";
+	}
+	char *pToken = p;
+	p += strcspn(p, pEnds);
+	if (*p != '\0') {
+		*p++ = '\0';
+	}
+	*ppLine = p;
+	return pToken;
+}
+
+/*!
+ * \brief Function parses an expected SW: "9000", "61XX", "9000/F000" or "*".<br>
+ *
+ * \retval 0 success.
+ * \retval -1 the text is invalid.
+ */
+static int parse_sw(char const *const pText, unsigned short *const pSw, unsigned short *const pMask)
+{
+	*pSw = 0;
+	*pMask = 0;
+	if (strcmp(pText, "*") == 0) {
+		return 0;
+	}
+	char const *p = pText;
+	for (int i = 0; i < 4; i++, p++) {
+		*pSw <<= 4;
+		*pMask <<= 4;
+		if (*p == 'X' || *p == 'x') {
+			continue;
+		}
+		int v = HEXFMT_decodeDigit(*p);
+		if (v < 0) {
+			return -1;
+		}
+		*pSw |= (unsigned short)v;
+		*pMask |= 0xF;
+	}
+	if (*p == '/') {
+		char *pEnd;
+		unsigned long mask = strtoul(p + 1, &pEnd, 16);
+		if (pEnd != p + 5 || *pEnd != '\0') {
+			return -1;
+		}
+		*pMask &= (unsigned short)mask;
+		*pSw &= *pMask;
+		return 0;
+	}
+	return (*p == '\0') ? 0 : -1;
+}
+
+/*!
+ * \brief Function adds a step to a script.<br>
+ */
+static STEP *add_step(SCRIPT *const pScript, int *const pMax, int const op, int const lineNo)
+{
+	if (pScript->stepCount == *pMax) {
+		int max = (*pMax == 0) ? 64 : *pMax * 2;
+		STEP *pSteps = (STEP *)realloc(pScript->pSteps, max * sizeof(STEP));
+		if (pSteps == NULL) {
+			return NULL;
+		}
+		pScript->pSteps = pSteps;
+		*pMax = max;
+	}
+	STEP *pStep = &pScript->pSteps[pScript->stepCount++];
+	memset(pStep, 0, sizeof(STEP));
+	pStep->op = op;
+	pStep->lineNo = lineNo;
+	return pStep;
+}
+
+/*!
+ * \brief Function sets the C-APDU of a step; SW 9000 is expected unless
+ * the step sets others.<br>
+ */
+static int set_apdu(STEP *const pStep, char const *const pApdu, int const len)
+{
+	pStep->pApdu = (char *)malloc(len);
+	if (pStep->pApdu == NULL) {
+		return -1;
+	}
+	memcpy(pStep->pApdu, pApdu, len);
+	pStep->len = (unsigned short)len;
+	pStep->sw[0] = 0x9000;
+	pStep->mask[0] = 0xFFFF;
+	return 0;
+}
+
+/*!
+ * \brief Function parses a line of hex digits as a C-APDU step.<br>
+ */
+static int parse_apdu(STEP *const pStep, char const *const pLine)
+{
+	char apdu[MAX_APDU_SIZE];
+	int len = parse_hex(pLine, apdu, sizeof(apdu));
+	if (len < 4) {
+		return -1;
+	}
+	pStep->swCount = 1;
+	return set_apdu(pStep, apdu, len);
+}
+
+/*!
+ * \brief Function parses a C-APDU step: the C-APDU (or the AID of
+ * /select) and the expected SW.<br>
+ *
+ * \retval 0 success.
+ * \retval -1 the step is invalid.
+ */
+static int parse_send(STEP *const pStep, char *pArgs, bool const isSelect)
+{
+	char *pToken = next_token(&pArgs);
+	if (pToken == NULL) {
+		return -1;
+	}
+	char apdu[MAX_APDU_SIZE];
+	int len;
+	if (isSelect) {
+		len = parse_hex(pToken, apdu + 5, 255);
+		if (len < 0) {
+			return -1;
+		}
+		apdu[0] = 0x00;
+		apdu[1] = (char)0xA4;	// SELECT
+		apdu[2] = 0x04;		// by name
+		apdu[3] = 0x00;
+		apdu[4] = (char)len;
+		apdu[5 + len] = 0x00;	// Le
+		len += 6;
+	} else {
+		len = parse_hex(pToken, apdu, sizeof(apdu));
+		if (len < 4) {
+			return -1;
+		}
+	}
+	if (set_apdu(pStep, apdu, len) != 0) {
+		return -1;
+	}
+
+	while ((pToken = next_token(&pArgs)) != NULL) {
+		if (pStep->swCount == MAX_EXPECTED
+		        || parse_sw(pToken, &pStep->sw[pStep->swCount], &pStep->mask[pStep->swCount]) != 0) {
+			return -1;
+		}
+		pStep->swCount++;
+	}
+	if (pStep->swCount == 0) {
+		pStep->swCount = 1;	// 9000
+	}
+	return 0;
+}
+
+/*!
+ * \brief Function parses /upload and maps the file.<br>
+ *
+ * \retval 0 success.
+ * \retval -1 the step is invalid.
+ */
+static int parse_upload(STEP *const pStep, char *pArgs, SCRIPT const *const pScript)
+{
+	pStep->window = CAPLOAD_DEFAULT_WINDOW;
+	char *pToken;
+	while ((pToken = next_token(&pArgs)) != NULL && pToken[0] == '-') {
+		char *pValue = next_token(&pArgs);
+		if (pValue == NULL) {
+			return -1;
+		}
+		if (strcmp(pToken, "-b") == 0) {
+			pStep->blockSize = (unsigned int)atoi(pValue);
+		} else if (strcmp(pToken, "-w") == 0) {
+			pStep->window = (unsigned int)atoi(pValue);
+		} else {
+			return -1;
+		}
+	}
+	if (pToken == NULL || next_token(&pArgs) != NULL
+	    || pStep->window < 1 || pStep->window > CAPLOAD_MAX_WINDOW) {
+		return -1;
+	}
+
+	char *pPath = (char *)malloc(strlen(pToken) + 1);
+	pStep->pCap = (CAPLOAD_FILE *)malloc(sizeof(CAPLOAD_FILE));
+	if (pPath == NULL || pStep->pCap == NULL) {
+		free(pPath);
+		return -1;
+	}
+	strcpy(pPath, pToken);
+	pStep->pCapPath = pPath;
+	int status = CAPLOAD_open(pPath, pStep->pCap);
+	if (status != CAPLOAD_NO_ERROR) {
+		fprintf(stderr, "%s(%d): %s: %s\n", pScript->pPath, pStep->lineNo, pPath, CAPLOAD_getErrorText(status));
+		free(pStep->pCap);
+		pStep->pCap = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * \brief Function loads a script.<br>
+ *
+ * \retval 0 the script is loaded.
+ * \retval -1 failed.
+ */
+static int load_script(SCRIPT *const pScript)
+{
+	FILE *fp = fopen(pScript->pPath, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "can't open %s\n", pScript->pPath);
+		return -1;
+	}
+
+	static char line[MAX_LINE_SIZE];
+	int max = 0;
+	int lineNo = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineNo++;
+		line[strcspn(line, "#\r\n")] = '\0';
+		char *pComment = strstr(line, "//");
+		if (pComment != NULL) {
+			*pComment = '\0';
+		}
+		char *pArgs = line + strspn(line, " \t");
+		if (*pArgs == '\0') {
+			continue;	// empty line or comment.
+		}
+
+		int status = 0;
+		char *pCommand = pArgs;
+		if (strspn(pArgs, "0123456789ABCDEFabcdef \t") == strlen(pArgs)) {
+			// a line of hex digits is a C-APDU (as a script of jcop_load) answered with 9000.
+			STEP *pStep = add_step(pScript, &max, STEP_SEND, lineNo);
+			status = (pStep != NULL) ? parse_apdu(pStep, pArgs) : -1;
+			pScript->apduCount++;
+		} else if ((pCommand = next_token(&pArgs)) == NULL) {
+			continue;
+		} else if (strcmp(pCommand, "/send") == 0 || strcmp(pCommand, "/select") == 0) {
+			STEP *pStep = add_step(pScript, &max, STEP_SEND, lineNo);
+			status = (pStep != NULL) ? parse_send(pStep, pArgs, strcmp(pCommand, "/select") == 0) : -1;
+			pScript->apduCount++;
+		} else if (strcmp(pCommand, "/card") == 0 || strcmp(pCommand, "/reset") == 0
+		           || strcmp(pCommand, "/atr") == 0) {
+			status = (add_step(pScript, &max, STEP_RESET, lineNo) != NULL) ? 0 : -1;
+		} else if (strcmp(pCommand, "/upload") == 0) {
+			STEP *pStep = add_step(pScript, &max, STEP_UPLOAD, lineNo);
+			status = (pStep != NULL) ? parse_upload(pStep, pArgs, pScript) : -1;
+			if (status == 0) {
+				// INSTALL and a LOAD per short block, the estimated cost.
+				pScript->apduCount += 2 + (int)(pStep->pCap->size / CAPLOAD_SHORT_BLOCK);
+			}
+		} else if (strcmp(pCommand, "/close") == 0) {
+			status = (add_step(pScript, &max, STEP_CLOSE, lineNo) != NULL) ? 0 : -1;
+		} else if (strcmp(pCommand, "/echo") != 0) {
+			fprintf(stderr, "%s(%d): unsupported command %s\n", pScript->pPath, lineNo, pCommand);
+			fclose(fp);
+			return -1;
+		}
+		if (status != 0) {
+			fprintf(stderr, "%s(%d): invalid %s\n", pScript->pPath, lineNo, pCommand);
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+/*!
+ * \brief Function formats an expected SW as parse_sw reads it.<br>
+ */
+static void format_sw(char *const pBuf, unsigned short const sw, unsigned short const mask)
+{
+	if (mask == 0) {
+		strcpy(pBuf, "*");
+		return;
+	}
+	static char const digits[] = "0123456789ABCDEF";
+	int i;
+	for (i = 0; i < 4; i++) {
+		int shift = 12 - i * 4;
+		pBuf[i] = (((mask >> shift) & 0xF) == 0) ? 'X' : digits[(sw >> shift) & 0xF];
+	}
+	pBuf[i] = '\0';
+	unsigned short nibbles = 0;
+	for (i = 0; i < 4; i++) {
+		int shift = 12 - i * 4;
+		nibbles |= (((mask >> shift) & 0xF) != 0) ? (unsigned short)(0xF << shift) : 0;
+	}
+	if (mask != nibbles) {
+		sprintf(pBuf + 4, "/%04X", mask);
+	}
+}
+
+/*!
+ * \brief Function powers up the card of the calling worker.<br>
+ */
+static int power_up(char *const pAtr, unsigned short *const pAtrLen)
+{
+	*pAtrLen = JCOP_PROXY_MAX_ATR_SIZE + 1;
+	return JCOP_SIMUL_powerUp(pAtr, pAtrLen);
+}
+
+/*!
+ * \brief Function runs /upload with LOAD blocks as large as the card takes
+ * (or the block size of the step if it is smaller).<br>
+ */
+static bool run_upload(SCRIPT *const pScript, STEP *const pStep, char const *const pAtr, unsigned short const atrLen)
+{
+	unsigned int blockSize = CAPLOAD_getMaxBlockSize(pAtr, atrLen);
+	if (pStep->blockSize != 0 && pStep->blockSize < blockSize) {
+		blockSize = pStep->blockSize;
+	}
+	APDUCACHE_flush();	// the LOADs don't go through the cache; a new epoch follows them.
+	int status = CAPLOAD_load(pStep->pCap, blockSize, pStep->window, &pStep->load);
+	if (status == CAPLOAD_ERROR_SW) {
+		_snprintf(pScript->message, sizeof(pScript->message), "line %d: %s SW %04X after %u blocks",
+		          pStep->lineNo, (pStep->load.ins == 0xE6) ? "INSTALL [for load]" : "LOAD",
+		          pStep->load.sw, pStep->load.blocks);
+	} else if (status == CAPLOAD_ERROR_TRANSMIT) {
+		_snprintf(pScript->message, sizeof(pScript->message), "line %d: transmit failed - status: 0x%08X",
+		          pStep->lineNo, pStep->load.transmitStatus);
+	} else if (status != CAPLOAD_NO_ERROR) {
+		_snprintf(pScript->message, sizeof(pScript->message), "line %d: %s (block size %u)",
+		          pStep->lineNo, CAPLOAD_getErrorText(status), blockSize);
+	}
+	pScript->message[sizeof(pScript->message) - 1] = '\0';
+	return status == CAPLOAD_NO_ERROR;
+}
+
+/*!
+ * \brief Function runs the steps of a script on a freshly powered up card.<br>
+ *
+ * \retval true every SW was expected.
+ * \retval false the script failed (see message).
+ */
+static bool run_steps(SCRIPT *const pScript)
+{
+	char atr[JCOP_PROXY_MAX_ATR_SIZE + 1];
+	unsigned short atrLen;
+	int status = power_up(atr, &atrLen);
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		_snprintf(pScript->message, sizeof(pScript->message), "power up failed - status: 0x%08X", status);
+		return false;
+	}
+
+	char snd[JCOP_PROXY_BUFFER_SIZE];
+	char rcv[JCOP_PROXY_BUFFER_SIZE];
+	for (int i = 0; i < pScript->stepCount; i++) {
+		STEP *pStep = &pScript->pSteps[i];
+		if (pStep->op == STEP_RESET) {
+			status = power_up(atr, &atrLen);
+			if (status != JCOP_SIMUL_NO_ERROR) {
+				_snprintf(pScript->message, sizeof(pScript->message),
+				          "line %d: power up failed - status: 0x%08X", pStep->lineNo, status);
+				return false;
+			}
+			continue;
+		}
+		if (pStep->op == STEP_CLOSE) {
+			JCOP_SIMUL_powerDown();
+			continue;
+		}
+		if (pStep->op == STEP_UPLOAD) {
+			if (!run_upload(pScript, pStep, atr, atrLen)) {
+				return false;
+			}
+			continue;
+		}
+
+		unsigned long sndLen = JCOP_MSG_setHeader(snd, JCOP_MSG_MTY_APDU, 0x00, pStep->len);
+		memcpy(snd + JCOP_MSG_HEADER_SIZE, pStep->pApdu, pStep->len);
+		unsigned short rcvLen = sizeof(rcv);
+		unsigned int roundTrips;
+		status = T0_transmit(snd, (unsigned short)sndLen, rcv, &rcvLen, &roundTrips);
+		if (status != JCOP_SIMUL_NO_ERROR || rcvLen < 2) {
+			_snprintf(pScript->message, sizeof(pScript->message),
+			          "line %d: transmit failed - status: 0x%08X", pStep->lineNo, status);
+			return false;
+		}
+		unsigned short sw = (unsigned short)(((rcv[rcvLen - 2] & 0xff) << 8) | (rcv[rcvLen - 1] & 0xff));
+		bool isExpected = false;
+		for (int j = 0; j < pStep->swCount && !isExpected; j++) {
+			isExpected = ((sw & pStep->mask[j]) == pStep->sw[j]);
+		}
+		if (!isExpected) {
+			char expected[16];
+			format_sw(expected, pStep->sw[0], pStep->mask[0]);
+			_snprintf(pScript->message, sizeof(pScript->message),
+			          "line %d: SW %04X, expected %s%s", pStep->lineNo, sw, expected,
+			          (pStep->swCount > 1) ? " or others" : "");
+			pScript->message[sizeof(pScript->message) - 1] = '\0';
+			return false;
+		}
+	}
+	return true;
+}
+
+/*!
+ * \brief Function takes the script at the head of the own range.<br>
+ *
+ * \retval position in g_pOrder, or -1 if the range is empty.
+ */
+static int take_own(WORKER *const pWorker)
+{
+	while (true) {
+		long range = OSDEP_atomicRead(&pWorker->range);
+		long head = range >> 16;
+		long tail = range & 0xFFFF;
+		if (head >= tail) {
+			return -1;
+		}
+		if (OSDEP_atomicCompareExchange(&pWorker->range, ((head + 1) << 16) | tail, range) == range) {
+			return (int)head;
+		}
+	}
+}
+
+/*!
+ * \brief Function steals the back half of the fullest range of the other
+ * workers; the first script stolen is returned and the rest become the own
+ * range.<br>
+ *
+ * \retval position in g_pOrder, or -1 if every range is empty.
+ */
+static int steal(WORKER *const pThief)
+{
+	while (true) {
+		WORKER *pVictim = NULL;
+		long victimRange = 0;
+		long most = 0;
+		for (int i = 0; i < g_concurrency; i++) {
+			if (i == pThief->id) {
+				continue;
+			}
+			long range = OSDEP_atomicRead(&g_workers[i].range);
+			long queued = (range & 0xFFFF) - (range >> 16);
+			if (queued > most) {
+				most = queued;
+				pVictim = &g_workers[i];
+				victimRange = range;
+			}
+		}
+		if (pVictim == NULL) {
+			return -1;
+		}
+
+		long head = victimRange >> 16;
+		long tail = victimRange & 0xFFFF;
+		long mid = tail - (tail - head + 1) / 2;
+		if (OSDEP_atomicCompareExchange(&pVictim->range, (head << 16) | mid, victimRange) != victimRange) {
+			continue;	// the victim or another thief took some; look again.
+		}
+		OSDEP_atomicExchange(&pThief->range, ((mid + 1) << 16) | tail);
+		pThief->steals++;
+		dbg_log("worker %d: stole %ld scripts from worker %d", pThief->id, tail - mid, pVictim->id);
+		return (int)mid;
+	}
+}
+
+static void worker(void *pParam)
+{
+	WORKER *pWorker = (WORKER *)pParam;
+	while (true) {
+		int position = take_own(pWorker);
+		if (position < 0) {
+			position = steal(pWorker);
+		}
+		if (position < 0) {
+			break;
+		}
+		SCRIPT *pScript = &g_pScripts[g_pOrder[position]];
+		OSDEP_INT64 start = OSDEP_now();
+		pScript->isPassed = run_steps(pScript);
+		pScript->elapsed = OSDEP_now() - start;
+		pScript->worker = pWorker->id;
+		pWorker->scripts++;
+		if (!pScript->isPassed) {
+			// the session may be broken; start the next script on a new one.
+			JCOP_SIMUL_close();
+		}
+	}
+	JCOP_SIMUL_close();
+}
+
+static int compare_cost(void const *pA, void const *pB)
+{
+	int a = g_pScripts[*(int const *)pA].apduCount;
+	int b = g_pScripts[*(int const *)pB].apduCount;
+	return (a != b) ? b - a : *(int const *)pA - *(int const *)pB;
+}
+
+/*!
+ * \brief Function deals the scripts to the workers, largest first, so
+ * every worker starts with one of the longest scripts.<br>
+ *
+ * \retval 0 success.
+ * \retval -1 out of memory.
+ */
+static int deal(void)
+{
+	int *pSorted = (int *)malloc(g_scriptCount * sizeof(int));
+	g_pOrder = (int *)malloc(g_scriptCount * sizeof(int));
+	if (pSorted == NULL || g_pOrder == NULL) {
+		free(pSorted);
+		return -1;
+	}
+	for (int i = 0; i < g_scriptCount; i++) {
+		pSorted[i] = i;
+	}
+	qsort(pSorted, g_scriptCount, sizeof(int), compare_cost);
+
+	int position = 0;
+	for (int w = 0; w < g_concurrency; w++) {
+		int head = position;
+		for (int i = w; i < g_scriptCount; i += g_concurrency) {
+			g_pOrder[position++] = pSorted[i];
+		}
+		g_workers[w].range = ((long)head << 16) | position;
+	}
+	free(pSorted);
+	return 0;
+}
+
+/*!
+ * \brief Function runs every script one after another on one session, to
+ * measure the time the scripts take without the parallel run.<br>
+ *
+ * \param [out] pFailed scripts failed in the serial run.
+ *
+ * \retval seconds.
+ */
+static double run_serial(int *const pFailed)
+{
+	*pFailed = 0;
+	OSDEP_INT64 start = OSDEP_now();
+	for (int i = 0; i < g_scriptCount; i++) {
+		if (!run_steps(&g_pScripts[i])) {
+			(*pFailed)++;
+			JCOP_SIMUL_close();
+		}
+	}
+	JCOP_SIMUL_close();
+	double seconds = (double)(OSDEP_now() - start) / (double)OSDEP_frequency();
+	for (int i = 0; i < g_scriptCount; i++) {
+		g_pScripts[i].message[0] = '\0';	// the parallel run is reported.
+	}
+	return seconds;
+}
+
+/*!
+ * \brief Function prints the result of every script and the speedup.<br>
+ * <br>
+ * \param [in] wallSeconds time of the parallel run.
+ * \param [in] serialSeconds time of the serial run, or a negative value if
+ *		it was not run; the sum of the scripts timed in the parallel run
+ *		is then reported as an estimate, which includes the contention of
+ *		the parallel run.
+ * \param [in] serialFailed scripts failed in the serial run.
+ */
+static void report(double const wallSeconds, double const serialSeconds, int const serialFailed)
+{
+	int passed = 0;
+	long steals = 0;
+	double sumSeconds = 0;
+	double freq = (double)OSDEP_frequency();
+	for (int i = 0; i < g_scriptCount; i++) {
+		SCRIPT const *pScript = &g_pScripts[i];
+		double msec = (double)pScript->elapsed * 1000 / freq;
+		sumSeconds += msec / 1000;
+		if (pScript->isPassed) {
+			passed++;
+			printf("PASS %-40s %6d APDUs %10.1f ms  session %d\n",
+			       pScript->pPath, pScript->apduCount, msec, pScript->worker);
+		} else {
+			printf("FAIL %-40s %6d APDUs %10.1f ms  session %d: %s\n",
+			       pScript->pPath, pScript->apduCount, msec, pScript->worker, pScript->message);
+		}
+		for (int j = 0; j < pScript->stepCount; j++) {
+			CAPLOAD_STATS const *pLoad = &pScript->pSteps[j].load;
+			if (pScript->pSteps[j].op != STEP_UPLOAD || pLoad->exchanges == 0) {
+				continue;
+			}
+			double loadMsec = (double)pLoad->ticks * 1000 / freq;
+			printf("     upload %s: %lu bytes, %u LOADs of %u bytes, %u exchanges, %.1f ms, %.1f KB/s\n",
+			       pScript->pSteps[j].pCapPath, pLoad->bytes, pLoad->blocks, pLoad->blockSize,
+			       pLoad->exchanges, loadMsec, (loadMsec > 0) ? pLoad->bytes / loadMsec * 1000 / 1024 : 0.0);
+		}
+	}
+	for (int i = 0; i < g_concurrency; i++) {
+		steals += g_workers[i].steals;
+	}
+	printf("%d scripts: %d passed, %d failed; %d sessions, %ld steals\n",
+	       g_scriptCount, passed, g_scriptCount - passed, g_concurrency, steals);
+	if (serialSeconds >= 0) {
+		printf("serial %.2f sec (measured, %d failed), wall %.2f sec, speedup %.2fx\n",
+		       serialSeconds, serialFailed, wallSeconds, (wallSeconds > 0) ? serialSeconds / wallSeconds : 0.0);
+	} else {
+		printf("serial %.2f sec (estimate: sum of the scripts in parallel), wall %.2f sec, "
+		       "speedup %.2fx (estimate, -baseline measures it)\n",
+		       sumSeconds, wallSeconds, (wallSeconds > 0) ? sumSeconds / wallSeconds : 0.0);
+	}
+}
+
+/*!
+ * \brief Function adds a script to run.<br>
+ *
+ * \retval 0 success.
+ * \retval -1 failed.
+ */
+static int add_script(char const *const pPath, int *const pMax)
+{
+	if (g_scriptCount >= MAX_SCRIPTS) {
+		fprintf(stderr, "too many scripts (max %d)\n", MAX_SCRIPTS);
+		return -1;
+	}
+	if (g_scriptCount >= *pMax) {
+		int max = (*pMax == 0) ? 16 : *pMax * 2;
+		SCRIPT *pScripts = (SCRIPT *)realloc(g_pScripts, max * sizeof(SCRIPT));
+		if (pScripts == NULL) {
+			fprintf(stderr, "out of memory\n");
+			return -1;
+		}
+		g_pScripts = pScripts;
+		*pMax = max;
+	}
+	SCRIPT *pScript = &g_pScripts[g_scriptCount++];
+	memset(pScript, 0, sizeof(SCRIPT));
+	pScript->pPath = pPath;
+	pScript->worker = -1;
+	return 0;
+}
+
+/*!
+ * \brief Function adds the scripts listed in a file, a path per line.<br>
+ *
+ * \retval 0 success.
+ * \retval -1 failed.
+ */
+static int add_list(char const *const pPath, int *const pMax)
+{
+	FILE *fp = fopen(pPath, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "can't open %s\n", pPath);
+		return -1;
+	}
+	char line[1024];
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line[strcspn(line, "#\r\n")] = '\0';
+		char *pArgs = line;
+		char *pScriptPath = next_token(&pArgs);
+		if (pScriptPath == NULL) {
+			continue;
+		}
+		char *pCopy = (char *)malloc(strlen(pScriptPath) + 1);
+		if (pCopy == NULL) {
+			fclose(fp);
+			return -1;
+		}
+		strcpy(pCopy, pScriptPath);
+		if (add_script(pCopy, pMax) != 0) {
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+	        "usage: jcop_script [options] <script>...\n"
+	        "  <script>           JCShell-style APDU script: /send, /select, /card, /reset,\n"
+	        "                     /atr, /close, /echo, or a C-APDU in hex per line\n"
+	        "  -list <file>       more scripts, a path per line\n"
+	        "  -c <n>             number of JCOP simulator sessions (1)\n"
+	        "  -baseline          run the scripts one by one first, to measure the speedup\n"
+	        "                     (the scripts run twice)\n"
+	        "  -host <ip>         JCOP simulator address (127.0.0.1)\n"
+	        "  -port <n>          JCOP simulator port (8050)\n"
+	        "  -mock <usec>       answer by the mock backend with the latency\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int mockLatency = -1;
+	char const *pHost = NULL;
+	int port = 0;
+	int max = 0;
+	bool isBaseline = false;
+
+	for (int i = 1; i < argc; i++) {
+		char const *pOpt = argv[i];
+		if (pOpt[0] != '-') {
+			if (add_script(pOpt, &max) != 0) {
+				return 1;
+			}
+			continue;
+		}
+		if (strcmp(pOpt, "-baseline") == 0) {
+			isBaseline = true;
+			continue;
+		}
+		char const *pArg = (i + 1 < argc) ? argv[i + 1] : NULL;
+		if (pArg == NULL) {
+			usage();
+			return 1;
+		}
+		i++;
+		if (strcmp(pOpt, "-list") == 0) {
+			if (add_list(pArg, &max) != 0) {
+				return 1;
+			}
+		} else if (strcmp(pOpt, "-c") == 0) {
+			g_concurrency = atoi(pArg);
+		} else if (strcmp(pOpt, "-host") == 0) {
+			pHost = pArg;
+		} else if (strcmp(pOpt, "-port") == 0) {
+			port = atoi(pArg);
+		} else if (strcmp(pOpt, "-mock") == 0) {
+			mockLatency = atoi(pArg);
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	if (g_scriptCount == 0 || g_concurrency < 1 || g_concurrency > MAX_WORKERS) {
+		usage();
+		return 1;
+	}
+	for (int i = 0; i < g_scriptCount; i++) {
+		if (load_script(&g_pScripts[i]) != 0) {
+			return 1;
+		}
+	}
+	if (g_concurrency > g_scriptCount) {
+		g_concurrency = g_scriptCount;
+	}
+	if (deal() != 0) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	dbg_init();
+	if (JCOP_SIMUL_startup() != JCOP_SIMUL_NO_ERROR) {
+		fprintf(stderr, "can't initialize the transport\n");
+		dbg_exit();
+		return 1;
+	}
+	if (mockLatency >= 0) {
+		MOCK_open((unsigned int)mockLatency);
+		JCOP_SIMUL_setBackend(MOCK_getBackend());
+	} else if (pHost != NULL || port != 0) {
+		JCOP_SIMUL_setServer((pHost != NULL) ? pHost : JCOP_SIMUL_DEFAULT_HOST,
+		                     (unsigned short)((port != 0) ? port : JCOP_SIMUL_DEFAULT_PORT));
+	}
+
+	double serialSeconds = -1;
+	int serialFailed = 0;
+	if (isBaseline) {
+		serialSeconds = run_serial(&serialFailed);
+	}
+
+	OSDEP_INT64 start = OSDEP_now();
+	int started = 0;
+	for (int i = 0; i < g_concurrency; i++) {
+		WORKER *pWorker = &g_workers[i];
+		pWorker->id = i;
+		pWorker->steals = 0;
+		pWorker->scripts = 0;
+		if (OSDEP_createThread(&pWorker->thread, worker, pWorker, 0) != 0) {
+			fprintf(stderr, "can't create worker %d\n", i);
+			break;
+		}
+		started++;
+	}
+	if (started == 0) {
+		JCOP_SIMUL_cleanup();
+		dbg_exit();
+		return 1;
+	}
+	for (int i = 0; i < started; i++) {
+		OSDEP_joinThread(g_workers[i].thread);
+	}
+	double wallSeconds = (double)(OSDEP_now() - start) / (double)OSDEP_frequency();
+
+	report(wallSeconds, serialSeconds, serialFailed);
+	int failed = 0;
+	for (int i = 0; i < g_scriptCount; i++) {
+		failed += g_pScripts[i].isPassed ? 0 : 1;
+	}
+
+	JCOP_SIMUL_cleanup();
+	dbg_exit();
+	return (failed == 0) ? 0 : 1;
+}
@@ -29,6 +29,8 @@
  * \brief Source file that contains the functions which communicate with JCOP Simulator.
  * \author Kenichi Kanai
  */
+#ifdef _WIN32
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -40,60 +42,213 @@ extern "C"
 }
 #endif
 
+typedef int socklen_t;
+
+#else // _WIN32
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#define WSAGetLastError() errno
+
+#endif // _WIN32
+
+#include <stdlib.h>
+#include <string.h>
+
 #include "jcop_simul.h"
+#define DBG_CATEGORY DBG_CAT_TRANSPORT
 #include "dbglog.h"
+#include "osdep.h"
 #include "shared_data.h"
 
-#define JCOP_PORT 8050
-#define JCOP_HOST "127.0.0.1"
 #define JCOP_BUF_SIZE JCOP_PROXY_BUFFER_SIZE
 #define MAX_ATR_SIZE JCOP_PROXY_MAX_ATR_SIZE
 
-static SOCKET g_socket = INVALID_SOCKET;
-static char g_rcv[JCOP_BUF_SIZE];
+static char const *g_pHost = JCOP_SIMUL_DEFAULT_HOST;
+static unsigned short g_port = JCOP_SIMUL_DEFAULT_PORT;
+
+// connection policy (JCOP_SIMUL_setConnection).
+static bool g_isPersistent = true;	// keep the connection over power down.
+static bool g_hasStandby = false;	// reconnect in the background.
+
+// a thread has its own connection (jcop_load runs several).
+static OSDEP_THREAD_LOCAL SOCKET g_socket = INVALID_SOCKET;
+static OSDEP_THREAD_LOCAL SOCKET g_standby = INVALID_SOCKET;	// connecting in the background.
+static OSDEP_THREAD_LOCAL char g_rcv[JCOP_BUF_SIZE];
+static OSDEP_THREAD_LOCAL OSDEP_INT64 g_elapsed = 0;	// ticks spent in the backend.
+static OSDEP_THREAD_LOCAL OSDEP_INT64 g_firstStart = 0;	// the first backend call started.
 
 /*!
  * \brief Close socket function.<br>
  */
 static void close_socket()
 {
-	closesocket(g_socket);
-	g_socket = INVALID_SOCKET;
-	WSACleanup();
+	if (g_socket != INVALID_SOCKET) {
+		closesocket(g_socket);
+		g_socket = INVALID_SOCKET;
+	}
+}
+
+static void set_blocking(SOCKET const s, bool const isBlocking)
+{
+#ifdef _WIN32
+	u_long mode = isBlocking ? 0 : 1;
+	ioctlsocket(s, FIONBIO, &mode);
+#else
+	int flags = fcntl(s, F_GETFL, 0);
+	fcntl(s, F_SETFL, isBlocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
+#endif
+}
+
+static void set_server(sockaddr_in *const pServer)
+{
+	memset(pServer, 0, sizeof(sockaddr_in));
+	pServer->sin_family = AF_INET;
+	pServer->sin_port = htons(g_port);
+	pServer->sin_addr.s_addr = inet_addr(g_pHost);
+}
+
+/*!
+ * \brief Function creates a socket for JCOP simulator.<br>
+ *
+ * \retval socket, or INVALID_SOCKET.
+ */
+static SOCKET new_socket()
+{
+	SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s == INVALID_SOCKET) {
+		dbg_err("socket : %d", WSAGetLastError());
+		return INVALID_SOCKET;
+	}
+	// a message is sent by one send(); never hold it back until the
+	// previous segment is acknowledged.
+	int noDelay = 1;
+	if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char const *)&noDelay, sizeof(noDelay)) != 0) {
+		dbg_warn("setsockopt(TCP_NODELAY) : %d", WSAGetLastError());
+	}
+	return s;
+}
+
+/*!
+ * \brief Function starts to connect the standby socket in the background.<br>
+ * <br>
+ * Does nothing unless the standby socket is enabled.
+ */
+static void start_standby()
+{
+	if (!g_hasStandby || g_standby != INVALID_SOCKET) {
+		return;
+	}
+	SOCKET s = new_socket();
+	if (s == INVALID_SOCKET) {
+		return;
+	}
+	set_blocking(s, false);
+	sockaddr_in server;
+	set_server(&server);
+	if (connect(s, (sockaddr *)&server, sizeof(server)) != 0) {
+#ifdef _WIN32
+		bool isPending = (WSAGetLastError() == WSAEWOULDBLOCK);
+#else
+		bool isPending = (errno == EINPROGRESS);
+#endif
+		if (!isPending) {
+			dbg_warn("connect (standby) : %d", WSAGetLastError());
+			closesocket(s);
+			return;
+		}
+	}
+	g_standby = s;
+}
+
+/*!
+ * \brief Function takes the standby socket once it is connected.<br>
+ *
+ * \retval connected socket, or INVALID_SOCKET if there is no standby socket
+ *		or it failed to connect.
+ */
+static SOCKET take_standby()
+{
+	SOCKET s = g_standby;
+	if (s == INVALID_SOCKET) {
+		return INVALID_SOCKET;
+	}
+	g_standby = INVALID_SOCKET;
+
+	// usually connected long ago; wait as long as a power up may take.
+	fd_set writeFds;
+	fd_set errorFds;
+	FD_ZERO(&writeFds);
+	FD_SET(s, &writeFds);
+	FD_ZERO(&errorFds);
+	FD_SET(s, &errorFds);
+	timeval tv;
+	tv.tv_sec = 0;
+	tv.tv_usec = 500000;	// 500msec.
+	int error = 0;
+	socklen_t len = sizeof(error);
+	int n = select((int)s + 1, NULL, &writeFds, &errorFds, &tv);
+	if (n <= 0 || !FD_ISSET(s, &writeFds)
+	        || getsockopt(s, SOL_SOCKET, SO_ERROR, (char *)&error, &len) != 0 || error != 0) {
+		dbg_warn("standby socket is not connected : %d", error);
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+	set_blocking(s, true);
+	return s;
+}
+
+/*!
+ * \brief Function closes the connection after an error or a power down.<br>
+ * <br>
+ * The next connection is prepared in the background if the standby socket
+ * is enabled.
+ */
+static void drop_socket()
+{
+	close_socket();
+	start_standby();
 }
 
 /*!
  * \brief This function opens and connects to JCOP simulation server.<br>
+ * <br>
+ * The standby socket is used if it is connected.
  *
  * \retval JCOP_SIMUL_NO_ERROR
  * \retval JCOP_SIMUL_ERROR_INITIALIZE
  */
 static int open_socket()
 {
-	WSADATA wsaData;
-	int status;
-	status = WSAStartup(MAKEWORD(2, 0), &wsaData);
-	if (status != 0) {
-		dbg_log("WSAStartup failed");
-		return JCOP_SIMUL_ERROR_INITIALIZE;
+	g_socket = take_standby();
+	if (g_socket != INVALID_SOCKET) {
+		dbg_log("standby socket is used.");
+		return JCOP_SIMUL_NO_ERROR;
 	}
 
-	g_socket = socket(AF_INET, SOCK_STREAM, 0);
+	g_socket = new_socket();
 	if (g_socket == INVALID_SOCKET) {
-		dbg_log("socket : %d", WSAGetLastError());
-		close_socket();
 		return JCOP_SIMUL_ERROR_INITIALIZE;
 	}
 
 	sockaddr_in server;
-	server.sin_family = AF_INET;
-	server.sin_port = htons(JCOP_PORT);
-	server.sin_addr.S_un.S_addr = inet_addr(JCOP_HOST);
+	set_server(&server);
 
 	// connect to JCOP simulator.
-	status = connect(g_socket, (sockaddr *) & server, sizeof(server));
+	int status = connect(g_socket, (sockaddr *) & server, sizeof(server));
 	if (status != 0) {
-		dbg_log("connect : %d", WSAGetLastError());
+		dbg_err("connect : %d", WSAGetLastError());
 		close_socket();
 		return JCOP_SIMUL_ERROR_INITIALIZE;
 	}
@@ -132,16 +287,16 @@ static int send_receive(
 	FD_ZERO(&fds);
 	FD_SET(g_socket, &fds);
 
-	int n = select(0, &fds, NULL, NULL, pDueTime);
+	int n = select((int)g_socket + 1, &fds, NULL, NULL, pDueTime);
 	if (n == 0) {
-		dbg_log("timeout");
-		close_socket();
+		dbg_warn("timeout");
+		drop_socket();
 		return JCOP_SIMUL_ERROR_TIMEOUT;
 	}
 	// check if fd is set.
 	if (!FD_ISSET(g_socket, &fds)) {
 		dbg_log("fd is not set");
-		close_socket();
+		drop_socket();
 		return JCOP_SIMUL_ERROR_OTHER;
 	}
 
@@ -150,8 +305,8 @@ static int send_receive(
 	memset(pRcv, 0, expectedLen);
 	n = recv(g_socket, pRcv, expectedLen, 0);
 	if (n < 0) {
-		dbg_log("recv failed!: 0x%08X", WSAGetLastError());
-		close_socket();
+		dbg_err("recv failed!: 0x%08X", WSAGetLastError());
+		drop_socket();
 		return JCOP_SIMUL_ERROR_OTHER;
 	}
 	dbg_log("%d bytes Received.", n);
@@ -164,8 +319,8 @@ static int send_receive(
 		expectedLen = total - receivedLen;
 		n = recv(g_socket, pRcv + receivedLen, expectedLen, 0);
 		if (n < 0) {
-			dbg_log("recv failed!: 0x%08X", WSAGetLastError());
-			close_socket();
+			dbg_err("recv failed!: 0x%08X", WSAGetLastError());
+			drop_socket();
 			return JCOP_SIMUL_ERROR_OTHER;
 		}
 		if (n == 0) {
@@ -189,7 +344,7 @@ static int send_receive(
  * \retval JCOP_SIMUL_NO_ERROR
  * \retval JCOP_SIMUL_ERROR_INITIALIZE
  */
-int JCOP_SIMUL_powerUp(char *const pAtr, unsigned short *const pAtrLen)
+static int socket_powerUp(char *const pAtr, unsigned short *const pAtrLen)
 {
 	int status;
 
@@ -219,8 +374,8 @@ int JCOP_SIMUL_powerUp(char *const pAtr, unsigned short *const pAtrLen)
 	status = send_receive(pSnd, sizeof(pSnd), g_rcv, pAtrLen, &tv);
 	if (status != 0) {
 		*pAtrLen = 0;
-		dbg_log("send_receive failed! : 0x%X", status);
-		close_socket();
+		dbg_err("send_receive failed! : 0x%X", status);
+		drop_socket();
 		return status;
 	}
 	dbg_log("*pAtrLen: %d", *pAtrLen);
@@ -248,7 +403,7 @@ int JCOP_SIMUL_powerUp(char *const pAtr, unsigned short *const pAtrLen)
  * \retval JCOP_SIMUL_ERROR_TIMEOUT
  * \retval JCOP_SIMUL_ERROR_OTHER
  */
-int JCOP_SIMUL_transmit(
+static int socket_transmit(
     char const *const pSnd,
     const unsigned short sndLen,
     char *const pRcv,
@@ -265,8 +420,8 @@ int JCOP_SIMUL_transmit(
 	dbg_log("*pRcvLen: %d", *pRcvLen);
 	dbg_ba2s(g_rcv, *pRcvLen);
 	if (status != 0) {
-		dbg_log("send_receive failed! : 0x%X", status);
-		close_socket();
+		dbg_err("send_receive failed! : 0x%X", status);
+		drop_socket();
 		return status;
 	}
 
@@ -279,10 +434,474 @@ int JCOP_SIMUL_transmit(
 	return JCOP_SIMUL_NO_ERROR;
 }
 
+/*!
+ * \brief Function closes the connection and the standby socket.<br>
+ */
+static void socket_close()
+{
+	close_socket();
+	if (g_standby != INVALID_SOCKET) {
+		closesocket(g_standby);
+		g_standby = INVALID_SOCKET;
+	}
+}
+
+/*!
+ * \brief Function hands the connection of the calling thread over.<br>
+ *
+ * \retval session for socket_attach, or NULL if there is no connection.
+ */
+static void *socket_detach()
+{
+	if (g_socket == INVALID_SOCKET) {
+		return NULL;
+	}
+	SOCKET *pSocket = (SOCKET *)malloc(sizeof(SOCKET));
+	if (pSocket == NULL) {
+		return NULL;
+	}
+	*pSocket = g_socket;
+	g_socket = INVALID_SOCKET;
+	return pSocket;
+}
+
+/*!
+ * \brief Function closes the connection of the calling thread and uses the
+ * connection detached by socket_detach instead.<br>
+ */
+static void socket_attach(void *const pSession)
+{
+	SOCKET *pSocket = (SOCKET *)pSession;
+	close_socket();
+	g_socket = *pSocket;
+	free(pSocket);
+}
+
+static void socket_discard(void *const pSession)
+{
+	SOCKET *pSocket = (SOCKET *)pSession;
+	closesocket(*pSocket);
+	free(pSocket);
+}
+
+/*!
+ * \brief Function receives exactly one message.<br>
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL
+ * \retval JCOP_SIMUL_ERROR_OTHER
+ */
+static int receive_message(char *const pMsg, unsigned short const size, unsigned short *const pLen)
+{
+	int total = JCOP_MSG_HEADER_SIZE;
+	int received = 0;
+	bool hasHeader = false;
+	while (received < total) {
+		int n = recv(g_socket, pMsg + received, total - received, 0);
+		if (n <= 0) {
+			dbg_err("recv failed!: 0x%08X", WSAGetLastError());
+			return JCOP_SIMUL_ERROR_OTHER;
+		}
+		received += n;
+		if (!hasHeader && received == JCOP_MSG_HEADER_SIZE) {
+			hasHeader = true;
+			total += JCOP_MSG_getLength(pMsg);
+			if (total > size) {
+				return JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL;
+			}
+		}
+	}
+	dbg_log("%d bytes Received.", received);
+	dbg_ba2s(pMsg, received);
+	*pLen = (unsigned short)received;
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+/*!
+ * \brief Function sends all C-APDUs and then reads their answers, so the
+ * simulator works on the next one while the previous answer travels.<br>
+ * <br>
+ * Each answer is read whole (not by a recv of the buffer size as
+ * send_receive does) as the next one may follow it in the stream. If an
+ * answer can't be read, the connection is dropped, as the stream is out of
+ * step.
+ */
+static int socket_pipeline(
+    JCOP_SIMUL_BATCH_CMD const *const pCmds,
+    unsigned int const n,
+    JCOP_SIMUL_BATCH_RESULT *const pResults,
+    unsigned int *const pDone,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	unsigned short const rcvSize = *pRcvLen;
+	*pDone = 0;
+	*pRcvLen = 0;
+	if (g_socket == INVALID_SOCKET) {
+		return JCOP_SIMUL_ERROR_INITIALIZE;
+	}
+	for (unsigned int i = 0; i < n; i++) {
+		dbg_ba2s(pCmds[i].pSnd, pCmds[i].sndLen);
+		if (send(g_socket, pCmds[i].pSnd, pCmds[i].sndLen, 0) != pCmds[i].sndLen) {
+			dbg_err("send failed!: 0x%08X", WSAGetLastError());
+			drop_socket();
+			return JCOP_SIMUL_ERROR_OTHER;
+		}
+	}
+
+	unsigned short used = 0;
+	for (unsigned int i = 0; i < n; i++) {
+		unsigned short len;
+		int status = receive_message(pRcv + used, rcvSize - used, &len);
+		if (status != JCOP_SIMUL_NO_ERROR) {
+			drop_socket();
+			*pRcvLen = used;
+			return status;
+		}
+		pResults[i].pRsp = pRcv + used + JCOP_MSG_HEADER_SIZE;
+		pResults[i].rspLen = len - JCOP_MSG_HEADER_SIZE;
+		used += len;
+		(*pDone)++;
+	}
+	*pRcvLen = used;
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+static JCOP_SIMUL_BACKEND const g_socketBackend = {
+	socket_powerUp,
+	socket_transmit,
+	socket_close,
+	socket_detach,
+	socket_attach,
+	socket_discard,
+	socket_pipeline
+};
+
+static JCOP_SIMUL_BACKEND const *g_pBackend = &g_socketBackend;
+
+/*!
+ * \brief Function sets the address of JCOP simulator.<br>
+ * <br>
+ * Used by the connections opened after the call.
+ * <br>
+ * \param [in] pHost IP address (the string is not copied).
+ * \param [in] port port number.
+ */
+void JCOP_SIMUL_setServer(char const *const pHost, unsigned short const port)
+{
+	g_pHost = pHost;
+	g_port = port;
+}
+
+/*!
+ * \brief Function sets how long a connection to JCOP simulator lives.<br>
+ * <br>
+ * \param [in] isPersistent true: JCOP_SIMUL_powerDown keeps the connection;
+ *		the next power up resets the card on it. false: the connection is
+ *		closed at every power down, so JCOP Shell can connect in between.
+ * \param [in] hasStandby true: when a connection is closed by a power down or
+ *		an error, the next one is connected at once in the background.
+ */
+void JCOP_SIMUL_setConnection(bool const isPersistent, bool const hasStandby)
+{
+	g_isPersistent = isPersistent;
+	g_hasStandby = hasStandby;
+}
+
+/*!
+ * \brief Function initializes the transport once per process.<br>
+ * <br>
+ * Call before the first JCOP_SIMUL_powerUp.
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval JCOP_SIMUL_ERROR_INITIALIZE
+ */
+int JCOP_SIMUL_startup()
+{
+#ifdef _WIN32
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 0), &wsaData) != 0) {
+		dbg_err("WSAStartup failed");
+		return JCOP_SIMUL_ERROR_INITIALIZE;
+	}
+#endif
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+/*!
+ * \brief Function releases the transport initialized by JCOP_SIMUL_startup.<br>
+ */
+void JCOP_SIMUL_cleanup()
+{
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+/*!
+ * \brief Function sets the backend of JCOP_SIMUL_XXX functions.<br>
+ * <br>
+ * \param [in] pBackend backend, or NULL to communicate with JCOP simulator.
+ */
+void JCOP_SIMUL_setBackend(JCOP_SIMUL_BACKEND const *const pBackend)
+{
+	g_pBackend = (pBackend != NULL) ? pBackend : &g_socketBackend;
+}
+
+/*!
+ * \brief Function returns the backend of JCOP_SIMUL_XXX functions, e.g. to
+ * be wrapped by another backend.<br>
+ */
+JCOP_SIMUL_BACKEND const *JCOP_SIMUL_getBackend()
+{
+	return g_pBackend;
+}
+
+/*!
+ * \brief Function turn on a smart card and return ATR.<br>
+ * <br>
+ * \param [out] pAtr A pointer to buffer of ATR.
+ * \param [in][out] pAtrLen length of ATR.
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval JCOP_SIMUL_ERROR_INITIALIZE
+ */
+int JCOP_SIMUL_powerUp(char *const pAtr, unsigned short *const pAtrLen)
+{
+	OSDEP_INT64 start = OSDEP_now();
+	if (g_firstStart == 0) {
+		g_firstStart = start;
+	}
+	int status = g_pBackend->powerUp(pAtr, pAtrLen);
+	g_elapsed += OSDEP_now() - start;
+	return status;
+}
+
+/*!
+ * \brief Function transmits C-APDU to a smart card and return R-APDU.<br>
+ * <br>
+ * \param [in] pSnd A pointer to first byte of message (MTY NAD LNH LNL | C-APDU).
+ * \param [in] iSndLen length of message.
+ * \param [out] pRcv A pointer to buffer of received payload data.
+ * \param [in][out] pRcvLen [in]length of pRcv. [out]actual lengh of received payload data.
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval JCOP_SIMUL_ERROR_INITIALIZE
+ * \retval JCOP_SIMUL_ERROR_TIMEOUT
+ * \retval JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL
+ * \retval JCOP_SIMUL_ERROR_OTHER
+ */
+int JCOP_SIMUL_transmit(
+    char const *const pSnd,
+    const unsigned short sndLen,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	OSDEP_INT64 start = OSDEP_now();
+	if (g_firstStart == 0) {
+		g_firstStart = start;
+	}
+	int status = g_pBackend->transmit(pSnd, sndLen, pRcv, pRcvLen);
+	g_elapsed += OSDEP_now() - start;
+	return status;
+}
+
+/*!
+ * \brief Function transmits C-APDUs back to back, until an SW matches the
+ * abort mask.<br>
+ * <br>
+ * The R-APDUs are stored in pRcv as MTY 0x01 messages, one after another,
+ * i.e. as the payload of the answer of JCOP_MSG_MTY_BATCH.
+ * <br>
+ * \param [in] pCmds C-APDUs.
+ * \param [in] n number of C-APDUs.
+ * \param [out] pResults R-APDU of each C-APDU sent.
+ * \param [out] pDone number of C-APDUs answered (the last one may have
+ *		matched the abort mask).
+ * \param [in] abortMask bits of SW compared with abortSw, 0: never stop.
+ * \param [in] abortSw SW which stops the batch.
+ * \param [out] pRcv A pointer to buffer of the answer messages.
+ * \param [in][out] pRcvLen [in]length of pRcv. [out]actual length of the answer messages.
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL
+ * \retval status of JCOP_SIMUL_transmit (*pDone C-APDUs were answered).
+ */
+int JCOP_SIMUL_transmitBatch(
+    JCOP_SIMUL_BATCH_CMD const *const pCmds,
+    unsigned int const n,
+    JCOP_SIMUL_BATCH_RESULT *const pResults,
+    unsigned int *const pDone,
+    unsigned short const abortMask,
+    unsigned short const abortSw,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	OSDEP_INT64 start = OSDEP_now();
+	if (g_firstStart == 0) {
+		g_firstStart = start;
+	}
+	unsigned short const rcvSize = *pRcvLen;
+	unsigned short used = 0;
+	int status = JCOP_SIMUL_NO_ERROR;
+	*pDone = 0;
+	for (unsigned int i = 0; i < n; i++) {
+		if (rcvSize - used < JCOP_MSG_HEADER_SIZE + 2) {
+			status = JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL;
+			break;
+		}
+		char *pMsg = pRcv + used;
+		unsigned short len = rcvSize - used - JCOP_MSG_HEADER_SIZE;
+		status = g_pBackend->transmit(pCmds[i].pSnd, pCmds[i].sndLen, pMsg + JCOP_MSG_HEADER_SIZE, &len);
+		if (status != JCOP_SIMUL_NO_ERROR) {
+			break;
+		}
+		used += (unsigned short)JCOP_MSG_setHeader(pMsg, JCOP_MSG_MTY_APDU, (unsigned char)pCmds[i].pSnd[1], len);
+		pResults[i].pRsp = pMsg + JCOP_MSG_HEADER_SIZE;
+		pResults[i].rspLen = len;
+		(*pDone)++;
+		if (abortMask != 0 && len >= 2) {
+			unsigned short sw = (unsigned short)(((pMsg[JCOP_MSG_HEADER_SIZE + len - 2] & 0xff) << 8)
+			                                     | (pMsg[JCOP_MSG_HEADER_SIZE + len - 1] & 0xff));
+			if ((sw & abortMask) == (abortSw & abortMask)) {
+				dbg_log("batch stopped at %u/%u - SW: %04X", i + 1, n, sw);
+				break;
+			}
+		}
+	}
+	*pRcvLen = used;
+	g_elapsed += OSDEP_now() - start;
+	return status;
+}
+
+/*!
+ * \brief Function transmits C-APDUs without waiting for each answer.<br>
+ * <br>
+ * A backend which can't pipeline answers them one by one, as
+ * JCOP_SIMUL_transmitBatch does. Every C-APDU is sent even if an earlier
+ * one fails; the caller checks the SW of each answer.
+ * <br>
+ * \param [in] pCmds C-APDUs.
+ * \param [in] n number of C-APDUs.
+ * \param [out] pResults R-APDU of each C-APDU answered.
+ * \param [out] pDone number of C-APDUs answered.
+ * \param [out] pRcv A pointer to buffer of the answer messages.
+ * \param [in][out] pRcvLen [in]length of pRcv. [out]actual length of the answer messages.
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL
+ * \retval status of JCOP_SIMUL_transmit (*pDone C-APDUs were answered).
+ */
+int JCOP_SIMUL_transmitPipelined(
+    JCOP_SIMUL_BATCH_CMD const *const pCmds,
+    unsigned int const n,
+    JCOP_SIMUL_BATCH_RESULT *const pResults,
+    unsigned int *const pDone,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	if (g_pBackend->pipeline == NULL) {
+		return JCOP_SIMUL_transmitBatch(pCmds, n, pResults, pDone, 0x0000, 0x0000, pRcv, pRcvLen);
+	}
+	OSDEP_INT64 start = OSDEP_now();
+	if (g_firstStart == 0) {
+		g_firstStart = start;
+	}
+	int status = g_pBackend->pipeline(pCmds, n, pResults, pDone, pRcv, pRcvLen);
+	g_elapsed += OSDEP_now() - start;
+	return status;
+}
+
 /*!
  * \brief Function turn off a smart card.<br>
+ * <br>
+ * The connection to JCOP simulator is kept unless it is set otherwise by
+ * JCOP_SIMUL_setConnection; another backend is closed.
+ */
+void JCOP_SIMUL_powerDown()
+{
+	if (g_pBackend != &g_socketBackend) {
+		g_pBackend->close();
+		return;
+	}
+	if (g_isPersistent) {
+		dbg_log("power down: the connection is kept.");
+		return;
+	}
+	drop_socket();
+}
+
+/*!
+ * \brief Function closes the backend (the connection to JCOP simulator).<br>
  */
 void JCOP_SIMUL_close()
 {
-	close_socket();
+	g_pBackend->close();
+}
+
+/*!
+ * \brief Function checks the backend can hand a session over to another
+ * thread.<br>
+ */
+bool JCOP_SIMUL_canDetach()
+{
+	return g_pBackend->detach != NULL;
+}
+
+/*!
+ * \brief Function hands the powered up session of the calling thread over.<br>
+ * <br>
+ * The calling thread has no session afterwards.
+ *
+ * \retval session for JCOP_SIMUL_attach or JCOP_SIMUL_discard, or NULL if
+ *		the thread has no session or the backend does not support it.
+ */
+void *JCOP_SIMUL_detach()
+{
+	return (g_pBackend->detach != NULL) ? g_pBackend->detach() : NULL;
+}
+
+/*!
+ * \brief Function closes the session of the calling thread and uses a
+ * session detached by another thread instead.<br>
+ */
+void JCOP_SIMUL_attach(void *const pSession)
+{
+	g_pBackend->attach(pSession);
+}
+
+/*!
+ * \brief Function closes a detached session.<br>
+ */
+void JCOP_SIMUL_discard(void *const pSession)
+{
+	g_pBackend->discard(pSession);
+}
+
+/*!
+ * \brief Function returns the time spent in the backend (JCOP simulator)
+ * by the calling thread since the last call.<br>
+ * <br>
+ * A T=1 block may not reach the backend at all, or a request may reach it
+ * more than once; the caller subtracts this time from its processing time
+ * to get its own share.
+ * <br>
+ * \param [out] pStart start time of the first backend call, 0 if none.
+ *		may be NULL.
+ *
+ * \retval elapsed time (OSDEP_now ticks).
+ */
+OSDEP_INT64 JCOP_SIMUL_takeElapsed(OSDEP_INT64 *const pStart)
+{
+	OSDEP_INT64 elapsed = g_elapsed;
+	if (pStart != NULL) {
+		*pStart = g_firstStart;
+	}
+	g_elapsed = 0;
+	g_firstStart = 0;
+	return elapsed;
 }
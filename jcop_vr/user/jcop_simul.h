@@ -32,14 +32,95 @@
 #ifndef __JCOP_SIMUL__
 #define __JCOP_SIMUL__
 
+#include "osdep.h"
+
 #define JCOP_SIMUL_NO_ERROR		0x00
 #define JCOP_SIMUL_ERROR_INITIALIZE		0x01
 #define JCOP_SIMUL_ERROR_TIMEOUT		0x02
 #define JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL	0x03
 #define JCOP_SIMUL_ERROR_OTHER			0x04
+#define JCOP_SIMUL_ERROR_BUSY			0x05	// refused, too many commands waiting.
+
+// default address of JCOP simulator.
+#define JCOP_SIMUL_DEFAULT_HOST "127.0.0.1"
+#define JCOP_SIMUL_DEFAULT_PORT 8050
+
+struct _JCOP_SIMUL_BATCH_CMD;
+struct _JCOP_SIMUL_BATCH_RESULT;
+
+/*!
+ * \brief functions which answer JCOP_SIMUL_XXX.<br>
+ * <br>
+ * The default backend communicates with JCOP simulator; another backend
+ * (e.g. the transcript replay) can be set by JCOP_SIMUL_setBackend.
+ */
+typedef struct _JCOP_SIMUL_BACKEND {
+	int (*powerUp)(char *const pAtr, unsigned short *const pAtrLen);
+	int (*transmit)(char const *const pSnd, const unsigned short sndLen, char *const pRcv, unsigned short *const pRcvLen);
+	void (*close)();
+	// optional (NULL): hand a powered up session over to another thread.
+	void *(*detach)();
+	void (*attach)(void *const pSession);
+	void (*discard)(void *const pSession);
+	// optional (NULL): send C-APDUs before their answers are read.
+	int (*pipeline)(
+	    struct _JCOP_SIMUL_BATCH_CMD const *const pCmds,
+	    unsigned int const n,
+	    struct _JCOP_SIMUL_BATCH_RESULT *const pResults,
+	    unsigned int *const pDone,
+	    char *const pRcv,
+	    unsigned short *const pRcvLen
+	);
+} JCOP_SIMUL_BACKEND;
+
+/*!
+ * \brief a C-APDU of JCOP_SIMUL_transmitBatch.<br>
+ */
+typedef struct _JCOP_SIMUL_BATCH_CMD {
+	char const *pSnd;	// message (MTY NAD LNH LNL | C-APDU).
+	unsigned short sndLen;	// length of message.
+} JCOP_SIMUL_BATCH_CMD;
+
+/*!
+ * \brief the R-APDU of a JCOP_SIMUL_BATCH_CMD.<br>
+ */
+typedef struct _JCOP_SIMUL_BATCH_RESULT {
+	char const *pRsp;	// R-APDU inside the buffer of JCOP_SIMUL_transmitBatch.
+	unsigned short rspLen;	// length of R-APDU.
+} JCOP_SIMUL_BATCH_RESULT;
 
+int JCOP_SIMUL_startup();
+void JCOP_SIMUL_cleanup();
+void JCOP_SIMUL_setServer(char const *const pHost, unsigned short const port);
+void JCOP_SIMUL_setConnection(bool const isPersistent, bool const hasStandby);
+void JCOP_SIMUL_setBackend(JCOP_SIMUL_BACKEND const *const pBackend);
+JCOP_SIMUL_BACKEND const *JCOP_SIMUL_getBackend();
 int JCOP_SIMUL_powerUp(char *const pAtr, unsigned short *const pAtrLen);
 int JCOP_SIMUL_transmit(char const *const pSnd, const unsigned short sndLen, char *const pRcv, unsigned short *const pRcvLen);
+int JCOP_SIMUL_transmitBatch(
+    JCOP_SIMUL_BATCH_CMD const *const pCmds,
+    unsigned int const n,
+    JCOP_SIMUL_BATCH_RESULT *const pResults,
+    unsigned int *const pDone,
+    unsigned short const abortMask,
+    unsigned short const abortSw,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+);
+int JCOP_SIMUL_transmitPipelined(
+    JCOP_SIMUL_BATCH_CMD const *const pCmds,
+    unsigned int const n,
+    JCOP_SIMUL_BATCH_RESULT *const pResults,
+    unsigned int *const pDone,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+);
+void JCOP_SIMUL_powerDown();
 void JCOP_SIMUL_close();
+bool JCOP_SIMUL_canDetach();
+void *JCOP_SIMUL_detach();
+void JCOP_SIMUL_attach(void *const pSession);
+void JCOP_SIMUL_discard(void *const pSession);
+OSDEP_INT64 JCOP_SIMUL_takeElapsed(OSDEP_INT64 *const pStart);
 
 #endif // __JCOP_SIMUL__
@@ -0,0 +1,219 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file mock.cpp
+ * \brief Source file that emulates a card without JCOP simulator.
+ * \author Kenichi Kanai
+ */
+#include <string.h>
+
+#include "osdep.h"
+#include "mock.h"
+#include "jcop_msg.h"
+#define DBG_CATEGORY DBG_CAT_TRANSPORT
+#include "dbglog.h"
+
+static unsigned int g_latency = 0;	// usec.
+static long volatile g_channels = 0;	// MANAGE CHANNEL open so far.
+
+// ATR of JCOP simulator.
+static char const g_atr[] = {
+	0x3B, (char)0xE6, 0x00, (char)0xFF, (char)0x81, 0x31, (char)0xFE, 0x45,
+	0x4A, 0x43, 0x4F, 0x50, 0x32, 0x30, 0x06
+};
+
+static void wait_latency(void)
+{
+	if (g_latency != 0) {
+		OSDEP_waitUntil(OSDEP_now() + OSDEP_fromUsec(g_latency));
+	}
+}
+
+static int mock_powerUp(char *const pAtr, unsigned short *const pAtrLen)
+{
+	if (*pAtrLen < sizeof(g_atr)) {
+		*pAtrLen = 0;
+		return JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL;
+	}
+	wait_latency();
+	memcpy(pAtr, g_atr, sizeof(g_atr));
+	*pAtrLen = sizeof(g_atr);
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+/*!
+ * \brief Function answers a C-APDU with Le bytes and 9000 at once.<br>
+ */
+static int answer(
+    char const *const pSnd,
+    const unsigned short sndLen,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	if (sndLen < JCOP_MSG_HEADER_SIZE + 4) {
+		return JCOP_SIMUL_ERROR_OTHER;
+	}
+	unsigned short apduLen = sndLen - JCOP_MSG_HEADER_SIZE;
+	char const *pApdu = pSnd + JCOP_MSG_HEADER_SIZE;
+
+	// short Le: CLA INS P1 P2 Le, or CLA INS P1 P2 Lc Data Le.
+	bool hasLe = false;
+	unsigned long le = 0;
+	unsigned long leMax = 256;
+	if (apduLen == 5) {
+		hasLe = true;
+		le = (unsigned char)pApdu[4];
+	} else if (apduLen > 5 && apduLen == 6 + (unsigned char)pApdu[4]) {
+		hasLe = true;
+		le = (unsigned char)pApdu[apduLen - 1];
+	}
+	// extended Le: CLA INS P1 P2 00 LeH LeL, or CLA INS P1 P2 00 LcH LcL Data LeH LeL.
+	if (!hasLe && apduLen >= 7 && pApdu[4] == 0x00) {
+		unsigned long lc = ((unsigned long)(pApdu[5] & 0xff) << 8) | (unsigned long)(pApdu[6] & 0xff);
+		if (apduLen == 7 || apduLen == 9 + lc) {
+			hasLe = true;
+			le = ((unsigned long)(pApdu[apduLen - 2] & 0xff) << 8) | (unsigned long)(pApdu[apduLen - 1] & 0xff);
+			leMax = 65536;
+		}
+	}
+	if (hasLe && le == 0) {
+		le = leMax;
+	}
+
+	if (*pRcvLen < le + 2) {
+		*pRcvLen = 0;
+		return JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL;
+	}
+	for (unsigned long i = 0; i < le; i++) {
+		pRcv[i] = (char)i;
+	}
+	if (pApdu[1] == 0x70 && pApdu[2] == 0x00 && le == 1) {
+		// MANAGE CHANNEL open: channels 1 to 19 in turn.
+		pRcv[0] = (char)(1 + (OSDEP_atomicIncrement(&g_channels) - 1) % 19);
+	}
+	pRcv[le] = (char)0x90;
+	pRcv[le + 1] = 0x00;
+	*pRcvLen = (unsigned short)(le + 2);
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+static int mock_transmit(
+    char const *const pSnd,
+    const unsigned short sndLen,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	int status = answer(pSnd, sndLen, pRcv, pRcvLen);
+	if (status == JCOP_SIMUL_NO_ERROR) {
+		wait_latency();
+	}
+	return status;
+}
+
+// the round trips of pipelined C-APDUs overlap; the mock waits once.
+static int mock_pipeline(
+    JCOP_SIMUL_BATCH_CMD const *const pCmds,
+    unsigned int const n,
+    JCOP_SIMUL_BATCH_RESULT *const pResults,
+    unsigned int *const pDone,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	unsigned short const rcvSize = *pRcvLen;
+	unsigned short used = 0;
+	int status = JCOP_SIMUL_NO_ERROR;
+	*pDone = 0;
+	wait_latency();
+	for (unsigned int i = 0; i < n; i++) {
+		if (rcvSize - used < JCOP_MSG_HEADER_SIZE + 2) {
+			status = JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL;
+			break;
+		}
+		char *pMsg = pRcv + used;
+		unsigned short len = rcvSize - used - JCOP_MSG_HEADER_SIZE;
+		status = answer(pCmds[i].pSnd, pCmds[i].sndLen, pMsg + JCOP_MSG_HEADER_SIZE, &len);
+		if (status != JCOP_SIMUL_NO_ERROR) {
+			break;
+		}
+		used += (unsigned short)JCOP_MSG_setHeader(pMsg, JCOP_MSG_MTY_APDU, 0x00, len);
+		pResults[i].pRsp = pMsg + JCOP_MSG_HEADER_SIZE;
+		pResults[i].rspLen = len;
+		(*pDone)++;
+	}
+	*pRcvLen = used;
+	return status;
+}
+
+static void mock_close()
+{
+}
+
+// the mock card has no state; any non-NULL value is a session.
+static void *mock_detach()
+{
+	return (void *)g_atr;
+}
+
+static void mock_attach(void *const pSession)
+{
+}
+
+static void mock_discard(void *const pSession)
+{
+}
+
+static JCOP_SIMUL_BACKEND const g_mockBackend = {
+	mock_powerUp,
+	mock_transmit,
+	mock_close,
+	mock_detach,
+	mock_attach,
+	mock_discard,
+	mock_pipeline
+};
+
+/*!
+ * \brief Function sets the latency of the mock backend.<br>
+ * <br>
+ * \param [in] latencyUsec latency of every answer (usec); pipelined
+ *		C-APDUs share one.
+ */
+void MOCK_open(unsigned int const latencyUsec)
+{
+	g_latency = latencyUsec;
+}
+
+/*!
+ * \brief Function returns the backend to be set by JCOP_SIMUL_setBackend.<br>
+ */
+JCOP_SIMUL_BACKEND const *MOCK_getBackend(void)
+{
+	return &g_mockBackend;
+}
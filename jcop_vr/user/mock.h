@@ -0,0 +1,44 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file mock.h
+ * \brief prototypes for the backend which emulates a card without JCOP simulator.
+ * \author Kenichi Kanai
+ *
+ * The mock backend answers every C-APDU with Le bytes of data (if any) and
+ * SW 9000 after a fixed latency. It is used to measure jcop_proxy, the T=1
+ * engine and the host tools without JCOP simulator.
+ */
+#ifndef __MOCK__
+#define __MOCK__
+
+#include "jcop_simul.h"
+
+void MOCK_open(unsigned int const latencyUsec);
+JCOP_SIMUL_BACKEND const *MOCK_getBackend(void);
+
+#endif // __MOCK__
@@ -0,0 +1,297 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*!
+ * \file nadroute.cpp
+ * \brief Source file that routes T=1 traffic to simulator sessions by NAD.
+ * \author Kenichi Kanai
+ *
+ * The routes are used by one thread (the request loop of jcop_proxy).
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "osdep.h"
+#include "shared_data.h"
+#include "jcop_simul.h"
+#include "t0.h"
+#include "t1.h"
+#include "apducache.h"
+#include "atrcache.h"
+#include "nadroute.h"
+#include "hexfmt.h"
+#define DBG_CATEGORY DBG_CAT_DISPATCH
+#include "dbglog.h"
+
+#define MAX_HOST_SIZE 64
+
+typedef struct _ROUTE {
+	unsigned char nad;		// NAD & NADROUTE_NAD_MASK.
+	char host[MAX_HOST_SIZE];
+	unsigned short port;
+	T1_CONTEXT *pT1;		// NULL: the default T=1 state.
+	void *pSession;			// detached while another route is used.
+	bool isStale;			// powered up again before use.
+} ROUTE;
+
+// g_routes[0] is the default route of the NADs not configured.
+static ROUTE g_routes[NADROUTE_MAX_ROUTES + 1];
+static int g_routeCount = 0;		// 0: routing is off.
+static ROUTE *g_pCurrent = &g_routes[0];
+static unsigned long g_switches = 0;
+
+/*!
+ * \brief Function sets the routes.<br>
+ * <br>
+ * \param [in] pSpec comma separated "<NAD>[=[<host>][:<port>]]", NAD in 2
+ *		hex digits, e.g. "12=127.0.0.1:8051,13". The host and port
+ *		default to those of JCOP simulator.
+ *
+ * \retval NADROUTE_NO_ERROR
+ * \retval NADROUTE_ERROR_CONFIG
+ */
+int NADROUTE_setConfig(char const *const pSpec)
+{
+	ROUTE routes[NADROUTE_MAX_ROUTES + 1];
+	memset(routes, 0, sizeof(routes));
+	strcpy(routes[0].host, JCOP_SIMUL_DEFAULT_HOST);
+	routes[0].port = JCOP_SIMUL_DEFAULT_PORT;
+	int count = 1;
+
+	char const *p = pSpec;
+	while (*p != '\0') {
+		if (count > NADROUTE_MAX_ROUTES || HEXFMT_decodeDigit(p[0]) < 0 || HEXFMT_decodeDigit(p[1]) < 0) {
+			return NADROUTE_ERROR_CONFIG;
+		}
+		ROUTE *pRoute = &routes[count];
+		pRoute->nad = (unsigned char)((HEXFMT_decodeDigit(p[0]) << 4) | HEXFMT_decodeDigit(p[1])) & NADROUTE_NAD_MASK;
+		for (int i = 1; i < count; i++) {
+			if (routes[i].nad == pRoute->nad) {
+				return NADROUTE_ERROR_CONFIG;
+			}
+		}
+		strcpy(pRoute->host, JCOP_SIMUL_DEFAULT_HOST);
+		pRoute->port = JCOP_SIMUL_DEFAULT_PORT;
+		p += 2;
+		if (*p == '=') {
+			p++;
+			size_t hostLen = strcspn(p, ":,");
+			if (hostLen >= MAX_HOST_SIZE) {
+				return NADROUTE_ERROR_CONFIG;
+			}
+			if (hostLen > 0) {
+				memcpy(pRoute->host, p, hostLen);
+				pRoute->host[hostLen] = '\0';
+			}
+			p += hostLen;
+			if (*p == ':') {
+				char *pEnd;
+				unsigned long port = strtoul(p + 1, &pEnd, 10);
+				if (pEnd == p + 1 || port == 0 || port > 0xFFFF) {
+					return NADROUTE_ERROR_CONFIG;
+				}
+				pRoute->port = (unsigned short)port;
+				p = pEnd;
+			}
+		}
+		if (*p == ',') {
+			p++;
+		} else if (*p != '\0') {
+			return NADROUTE_ERROR_CONFIG;
+		}
+		count++;
+	}
+	memcpy(g_routes, routes, sizeof(g_routes));
+	g_routeCount = (count > 1) ? count : 0;
+	return NADROUTE_NO_ERROR;
+}
+
+/*!
+ * \brief Function prepares the routes after the default session is powered
+ * up. The sessions of the other routes are opened when they are used.<br>
+ *
+ * \retval NADROUTE_NO_ERROR
+ * \retval NADROUTE_ERROR_BACKEND
+ * \retval NADROUTE_ERROR_MEMORY
+ */
+int NADROUTE_open(void)
+{
+	if (g_routeCount == 0) {
+		return NADROUTE_NO_ERROR;
+	}
+	if (!JCOP_SIMUL_canDetach()) {
+		g_routeCount = 0;
+		return NADROUTE_ERROR_BACKEND;
+	}
+	for (int i = 1; i < g_routeCount; i++) {
+		g_routes[i].pT1 = T1_newContext();
+		if (g_routes[i].pT1 == NULL) {
+			NADROUTE_close();
+			return NADROUTE_ERROR_MEMORY;
+		}
+		g_routes[i].isStale = true;
+		dbg_info("route NAD %02X to %s:%u", g_routes[i].nad, g_routes[i].host, g_routes[i].port);
+	}
+	g_pCurrent = &g_routes[0];
+	return NADROUTE_NO_ERROR;
+}
+
+/*!
+ * \brief Function goes back to the default session and closes the others.<br>
+ */
+void NADROUTE_close(void)
+{
+	if (g_routeCount != 0) {
+		dbg_info("%lu session switches", g_switches);
+	}
+	if (g_pCurrent != &g_routes[0]) {
+		JCOP_SIMUL_close();
+		if (g_routes[0].pSession != NULL) {
+			JCOP_SIMUL_attach(g_routes[0].pSession);
+		}
+	}
+	g_routes[0].pSession = NULL;
+	JCOP_SIMUL_setServer(g_routes[0].host, g_routes[0].port);
+	T1_setContext(NULL);
+	for (int i = 1; i < g_routeCount; i++) {
+		if (g_routes[i].pSession != NULL) {
+			JCOP_SIMUL_discard(g_routes[i].pSession);
+			g_routes[i].pSession = NULL;
+		}
+		T1_freeContext(g_routes[i].pT1);
+		g_routes[i].pT1 = NULL;
+	}
+	g_pCurrent = &g_routes[0];
+	g_routeCount = 0;
+}
+
+bool NADROUTE_isEnabled(void)
+{
+	return g_routeCount != 0;
+}
+
+/*!
+ * \brief Function attaches the session of a route to the calling thread.<br>
+ * <br>
+ * The deferred reset and SELECT of the session used so far are sent to it
+ * first. If they fail, the session is not switched: a reset still pending
+ * would otherwise go to the session of the route.
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval status of ATRCACHE_flush or APDUCACHE_flush (not switched).
+ * \retval status of JCOP_SIMUL_powerUp (switched, the session is stale).
+ */
+static int switch_to(ROUTE *const pRoute)
+{
+	if (pRoute == g_pCurrent) {
+		return JCOP_SIMUL_NO_ERROR;
+	}
+	// the state kept for the session used so far goes to its backend first.
+	int status = ATRCACHE_flush();
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		dbg_err("NAD %02X: deferred reset failed! - status: 0x%08X", g_pCurrent->nad, status);
+		return status;
+	}
+	status = APDUCACHE_flush();
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		dbg_err("NAD %02X: deferred SELECT failed! - status: 0x%08X", g_pCurrent->nad, status);
+		return status;
+	}
+	T0_discardPrefetch();
+	g_pCurrent->pSession = JCOP_SIMUL_detach();
+
+	JCOP_SIMUL_setServer(pRoute->host, pRoute->port);
+	if (pRoute->pSession != NULL) {
+		JCOP_SIMUL_attach(pRoute->pSession);
+		pRoute->pSession = NULL;
+	}
+	T1_setContext(pRoute->pT1);
+	g_pCurrent = pRoute;
+	g_switches++;
+	dbg_log("NAD %02X: session switched", pRoute->nad);
+
+	if (pRoute->isStale) {
+		char atr[JCOP_PROXY_MAX_ATR_SIZE];
+		unsigned short atrLen = sizeof(atr);
+		status = JCOP_SIMUL_powerUp(atr, &atrLen);
+		if (status != JCOP_SIMUL_NO_ERROR) {
+			dbg_err("NAD %02X: power up failed! - status: 0x%08X", pRoute->nad, status);
+			return status;	// tried again by the next request of the NAD.
+		}
+		pRoute->isStale = false;
+		T1_resetSeq();
+	}
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+/*!
+ * \brief Function sets the session and T=1 state of a NAD to the calling
+ * thread.<br>
+ * <br>
+ * \param [in] nad NAD of the T=1 block (or of the MTY 0x12 message).
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval status of switch_to.
+ */
+int NADROUTE_select(unsigned char const nad)
+{
+	ROUTE *pRoute = &g_routes[0];
+	for (int i = 1; i < g_routeCount; i++) {
+		if (g_routes[i].nad == (nad & NADROUTE_NAD_MASK)) {
+			pRoute = &g_routes[i];
+			break;
+		}
+	}
+	return switch_to(pRoute);
+}
+
+/*!
+ * \brief Function sets the default session to the calling thread (e.g.
+ * for T=0 requests).<br>
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval status of switch_to.
+ */
+int NADROUTE_selectDefault(void)
+{
+	return switch_to(&g_routes[0]);
+}
+
+/*!
+ * \brief Function goes back to the default session before the reader is
+ * reset; the other sessions are reset when they are next used.<br>
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval status of switch_to.
+ */
+int NADROUTE_reset(void)
+{
+	for (int i = 1; i < g_routeCount; i++) {
+		g_routes[i].isStale = true;
+	}
+	return NADROUTE_selectDefault();	// the default session is never stale.
+}
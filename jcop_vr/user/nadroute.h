@@ -0,0 +1,65 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*!
+ * \file nadroute.h
+ * \brief prototypes for the routing of T=1 traffic by NAD.
+ * \author Kenichi Kanai
+ *
+ * Each routed NAD (DAD and SAD, the VPP bits are ignored) has its own
+ * simulator session, optionally on another simulator (an applet host), and
+ * its own T=1 state; the other NADs share the default session. Before a
+ * T=1 request is processed, NADROUTE_select attaches the session of its
+ * NAD to the calling thread and detaches the one used so far, so the
+ * applications behind one reader keep their cards apart. T=0 requests
+ * carry no NAD; they go to the default session. With the chanmux backend
+ * (jcop_proxy -mux) the session of a NAD is a logical channel of the
+ * default one.
+ *
+ * A reset of the reader goes to the default session; the session of
+ * every other NAD is powered up again when its NAD is next used.
+ */
+#ifndef __NADROUTE__
+#define __NADROUTE__
+
+#define NADROUTE_NO_ERROR		0x00
+#define NADROUTE_ERROR_CONFIG		0x01	// a bad route.
+#define NADROUTE_ERROR_BACKEND		0x02	// the backend can't detach sessions.
+#define NADROUTE_ERROR_MEMORY		0x03
+
+#define NADROUTE_MAX_ROUTES	8
+#define NADROUTE_NAD_MASK	0x77	// DAD and SAD.
+
+int NADROUTE_setConfig(char const *const pSpec);
+int NADROUTE_open(void);
+void NADROUTE_close(void);
+bool NADROUTE_isEnabled(void);
+int NADROUTE_select(unsigned char const nad);
+int NADROUTE_selectDefault(void);
+int NADROUTE_reset(void);
+
+#endif // __NADROUTE__
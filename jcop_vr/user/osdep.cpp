@@ -0,0 +1,431 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file osdep.cpp
+ * \brief Source file that contains the OS dependent functions.
+ * \author Kenichi Kanai
+ */
+#include <stdlib.h>
+
+#include "osdep.h"
+
+#ifndef _WIN32
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+typedef struct _OSDEP_THREAD_START {
+	OSDEP_THREAD_FUNC func;
+	void *pArg;
+} OSDEP_THREAD_START;
+
+#ifdef _WIN32
+
+/*!
+ * \brief Function returns the monotonic clock in ticks.<br>
+ */
+OSDEP_INT64 OSDEP_now(void)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+/*!
+ * \brief Function returns the number of ticks per second.<br>
+ */
+OSDEP_INT64 OSDEP_frequency(void)
+{
+	static OSDEP_INT64 freq = 0;
+	if (freq == 0) {
+		LARGE_INTEGER f;
+		QueryPerformanceFrequency(&f);
+		freq = f.QuadPart;
+	}
+	return freq;
+}
+
+void OSDEP_sleep(unsigned int const msec)
+{
+	Sleep(msec);
+}
+
+static void yield(void)
+{
+	Sleep(0);
+}
+
+long OSDEP_atomicIncrement(long volatile *const p)
+{
+	return InterlockedIncrement((LONG volatile *)p);
+}
+
+long OSDEP_atomicExchange(long volatile *const p, long const value)
+{
+	return InterlockedExchange((LONG volatile *)p, value);
+}
+
+// p may be in a read-only view, so it is not read by an interlocked operation.
+// an aligned long is read at once, and x86 does not reorder loads.
+long OSDEP_atomicRead(long volatile const *const p)
+{
+	return *p;
+}
+
+// a volatile store has release semantics on Visual C++.
+void OSDEP_atomicRelease(long volatile *const p, long const value)
+{
+	*p = value;
+}
+
+long OSDEP_atomicCompareExchange(long volatile *const p, long const value, long const comparand)
+{
+	return InterlockedCompareExchange((LONG volatile *)p, value, comparand);
+}
+
+static DWORD WINAPI thread_start(LPVOID pParam)
+{
+	OSDEP_THREAD_START start = *(OSDEP_THREAD_START *)pParam;
+	free(pParam);
+	start.func(start.pArg);
+	return 0;
+}
+
+/*!
+ * \brief Function creates a thread.<br>
+ * <br>
+ * \param [out] pThread created thread.
+ * \param [in] func thread function.
+ * \param [in] pArg argument of func.
+ * \param [in] lowPriority non-zero to run below normal priority.
+ *
+ * \retval 0 the thread is created.
+ * \retval -1 failed.
+ */
+int OSDEP_createThread(OSDEP_THREAD *const pThread, OSDEP_THREAD_FUNC const func, void *const pArg, int const lowPriority)
+{
+	OSDEP_THREAD_START *pStart = (OSDEP_THREAD_START *)malloc(sizeof(OSDEP_THREAD_START));
+	if (pStart == NULL) {
+		return -1;
+	}
+	pStart->func = func;
+	pStart->pArg = pArg;
+	*pThread = CreateThread(NULL, 0, thread_start, pStart, 0, NULL);
+	if (*pThread == NULL) {
+		free(pStart);
+		return -1;
+	}
+	if (lowPriority) {
+		SetThreadPriority(*pThread, THREAD_PRIORITY_BELOW_NORMAL);
+	}
+	return 0;
+}
+
+/*!
+ * \brief Function waits for a thread to end and releases it.<br>
+ */
+void OSDEP_joinThread(OSDEP_THREAD const thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+/*!
+ * \brief Function creates an auto-reset event, not set.<br>
+ * <br>
+ * OSDEP_setEvent wakes one OSDEP_waitEvent, or the next one if no thread
+ * waits. The event lives as long as the process.
+ *
+ * \retval 0 the event is created.
+ * \retval -1 failed.
+ */
+int OSDEP_createEvent(OSDEP_EVENT *const pEvent)
+{
+	*pEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	return (*pEvent != NULL) ? 0 : -1;
+}
+
+void OSDEP_setEvent(OSDEP_EVENT *const pEvent)
+{
+	SetEvent(*pEvent);
+}
+
+void OSDEP_waitEvent(OSDEP_EVENT *const pEvent)
+{
+	WaitForSingleObject(*pEvent, INFINITE);
+}
+
+/*!
+ * \brief Function maps a whole file read-only.<br>
+ *
+ * \retval 0 the file is mapped.
+ * \retval -1 failed.
+ */
+int OSDEP_mapFile(char const *const pPath, OSDEP_MAPPING *const pMapping)
+{
+	pMapping->pView = NULL;
+	pMapping->size = 0;
+	pMapping->hMapping = NULL;
+	pMapping->hFile = CreateFile(pPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (pMapping->hFile == INVALID_HANDLE_VALUE) {
+		return -1;
+	}
+	DWORD sizeHigh = 0;
+	pMapping->size = GetFileSize(pMapping->hFile, &sizeHigh);
+	if (sizeHigh != 0 || pMapping->size == 0) {
+		// a 32 bit process can't map it.
+		OSDEP_unmapFile(pMapping);
+		return -1;
+	}
+	pMapping->hMapping = CreateFileMapping(pMapping->hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (pMapping->hMapping == NULL) {
+		OSDEP_unmapFile(pMapping);
+		return -1;
+	}
+	pMapping->pView = (char const *)MapViewOfFile(pMapping->hMapping, FILE_MAP_READ, 0, 0, 0);
+	if (pMapping->pView == NULL) {
+		OSDEP_unmapFile(pMapping);
+		return -1;
+	}
+	return 0;
+}
+
+void OSDEP_unmapFile(OSDEP_MAPPING *const pMapping)
+{
+	if (pMapping->pView != NULL) {
+		UnmapViewOfFile(pMapping->pView);
+		pMapping->pView = NULL;
+	}
+	if (pMapping->hMapping != NULL) {
+		CloseHandle(pMapping->hMapping);
+		pMapping->hMapping = NULL;
+	}
+	if (pMapping->hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(pMapping->hFile);
+		pMapping->hFile = INVALID_HANDLE_VALUE;
+	}
+	pMapping->size = 0;
+}
+
+#else // _WIN32
+
+OSDEP_INT64 OSDEP_now(void)
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (OSDEP_INT64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+OSDEP_INT64 OSDEP_frequency(void)
+{
+	return 1000000000;	// nanoseconds.
+}
+
+void OSDEP_sleep(unsigned int const msec)
+{
+	usleep(msec * 1000);
+}
+
+static void yield(void)
+{
+	sched_yield();
+}
+
+long OSDEP_atomicIncrement(long volatile *const p)
+{
+	return __sync_add_and_fetch(p, 1);
+}
+
+long OSDEP_atomicExchange(long volatile *const p, long const value)
+{
+	// a full barrier as InterlockedExchange (__sync_lock_test_and_set only
+	// acquires), so the stores before it are seen with the new value.
+	return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+}
+
+long OSDEP_atomicRead(long volatile const *const p)
+{
+	return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+void OSDEP_atomicRelease(long volatile *const p, long const value)
+{
+	__atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+long OSDEP_atomicCompareExchange(long volatile *const p, long const value, long const comparand)
+{
+	return __sync_val_compare_and_swap(p, comparand, value);
+}
+
+static void *thread_start(void *pParam)
+{
+	OSDEP_THREAD_START start = *(OSDEP_THREAD_START *)pParam;
+	free(pParam);
+	start.func(start.pArg);
+	return NULL;
+}
+
+int OSDEP_createThread(OSDEP_THREAD *const pThread, OSDEP_THREAD_FUNC const func, void *const pArg, int const lowPriority)
+{
+	OSDEP_THREAD_START *pStart = (OSDEP_THREAD_START *)malloc(sizeof(OSDEP_THREAD_START));
+	if (pStart == NULL) {
+		return -1;
+	}
+	pStart->func = func;
+	pStart->pArg = pArg;
+	if (pthread_create(pThread, NULL, thread_start, pStart) != 0) {
+		free(pStart);
+		return -1;
+	}
+	// lowPriority is ignored; the default scheduling policy has no priority.
+	return 0;
+}
+
+void OSDEP_joinThread(OSDEP_THREAD const thread)
+{
+	pthread_join(thread, NULL);
+}
+
+int OSDEP_createEvent(OSDEP_EVENT *const pEvent)
+{
+	if (pthread_mutex_init(&pEvent->mutex, NULL) != 0) {
+		return -1;
+	}
+	if (pthread_cond_init(&pEvent->cond, NULL) != 0) {
+		pthread_mutex_destroy(&pEvent->mutex);
+		return -1;
+	}
+	pEvent->isSet = 0;
+	return 0;
+}
+
+void OSDEP_setEvent(OSDEP_EVENT *const pEvent)
+{
+	pthread_mutex_lock(&pEvent->mutex);
+	pEvent->isSet = 1;
+	pthread_cond_signal(&pEvent->cond);
+	pthread_mutex_unlock(&pEvent->mutex);
+}
+
+void OSDEP_waitEvent(OSDEP_EVENT *const pEvent)
+{
+	pthread_mutex_lock(&pEvent->mutex);
+	while (!pEvent->isSet) {
+		pthread_cond_wait(&pEvent->cond, &pEvent->mutex);
+	}
+	pEvent->isSet = 0;	// auto-reset.
+	pthread_mutex_unlock(&pEvent->mutex);
+}
+
+int OSDEP_mapFile(char const *const pPath, OSDEP_MAPPING *const pMapping)
+{
+	pMapping->pView = NULL;
+	pMapping->size = 0;
+	pMapping->fd = open(pPath, O_RDONLY);
+	if (pMapping->fd < 0) {
+		return -1;
+	}
+	struct stat st;
+	if (fstat(pMapping->fd, &st) != 0 || st.st_size == 0) {
+		OSDEP_unmapFile(pMapping);
+		return -1;
+	}
+	pMapping->size = (unsigned long)st.st_size;
+	void *pView = mmap(NULL, pMapping->size, PROT_READ, MAP_PRIVATE, pMapping->fd, 0);
+	if (pView == MAP_FAILED) {
+		OSDEP_unmapFile(pMapping);
+		return -1;
+	}
+	pMapping->pView = (char const *)pView;
+	return 0;
+}
+
+void OSDEP_unmapFile(OSDEP_MAPPING *const pMapping)
+{
+	if (pMapping->pView != NULL) {
+		munmap((void *)pMapping->pView, pMapping->size);
+		pMapping->pView = NULL;
+	}
+	if (pMapping->fd >= 0) {
+		close(pMapping->fd);
+		pMapping->fd = -1;
+	}
+	pMapping->size = 0;
+}
+
+#endif // _WIN32
+
+/*!
+ * \brief Function converts ticks to microseconds.<br>
+ */
+OSDEP_INT64 OSDEP_toUsec(OSDEP_INT64 const ticks)
+{
+	OSDEP_INT64 freq = OSDEP_frequency();
+	// avoid overflow of ticks * 1000000.
+	return (ticks / freq) * 1000000 + ((ticks % freq) * 1000000) / freq;
+}
+
+/*!
+ * \brief Function converts ticks to nanoseconds.<br>
+ */
+OSDEP_INT64 OSDEP_toNsec(OSDEP_INT64 const ticks)
+{
+	OSDEP_INT64 freq = OSDEP_frequency();
+	return (ticks / freq) * 1000000000 + ((ticks % freq) * 1000000000) / freq;
+}
+
+/*!
+ * \brief Function converts microseconds to ticks.<br>
+ */
+OSDEP_INT64 OSDEP_fromUsec(OSDEP_INT64 const usec)
+{
+	OSDEP_INT64 freq = OSDEP_frequency();
+	return (usec / 1000000) * freq + ((usec % 1000000) * freq) / 1000000;
+}
+
+/*!
+ * \brief Function waits until the monotonic clock reaches deadline.<br>
+ * <br>
+ * Sleep is coarse (a scheduler tick), so the last 2 msec are spent
+ * spinning. The spin yields the processor to other ready threads.
+ */
+void OSDEP_waitUntil(OSDEP_INT64 const deadline)
+{
+	OSDEP_INT64 remain = deadline - OSDEP_now();
+	OSDEP_INT64 usec = OSDEP_toUsec(remain);
+	if (usec > 2000) {
+		OSDEP_sleep((unsigned int)(usec / 1000) - 2);
+	}
+	while (OSDEP_now() < deadline) {
+		yield();
+	}
+}
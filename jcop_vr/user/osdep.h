@@ -0,0 +1,118 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file osdep.h
+ * \brief OS dependent functions used by jcop_proxy and the host tools.
+ * \author Kenichi Kanai
+ *
+ * jcop_proxy itself only runs on Windows, but the JCOP simulator transport,
+ * the T=1 engine and the replay backend are also built on Linux (g++) for
+ * jcop_load. Everything which differs between the two lives here.
+ */
+#ifndef __OSDEP__
+#define __OSDEP__
+
+#ifdef _WIN32
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <windows.h>
+
+#ifdef __cplusplus
+}
+#endif
+
+typedef __int64 OSDEP_INT64;
+typedef HANDLE OSDEP_THREAD;
+typedef HANDLE OSDEP_EVENT;
+
+// static variable which has an instance per thread.
+#define OSDEP_THREAD_LOCAL __declspec(thread)
+
+#else // _WIN32
+
+#include <pthread.h>
+
+typedef long long OSDEP_INT64;
+typedef pthread_t OSDEP_THREAD;
+
+// auto-reset event.
+typedef struct _OSDEP_EVENT {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int isSet;
+} OSDEP_EVENT;
+
+#define OSDEP_THREAD_LOCAL __thread
+
+#define _vsnprintf vsnprintf
+#define _snprintf snprintf
+
+#endif // _WIN32
+
+typedef void (*OSDEP_THREAD_FUNC)(void *pArg);
+
+// read-only mapped file.
+typedef struct _OSDEP_MAPPING {
+	char const *pView;
+	unsigned long size;
+#ifdef _WIN32
+	HANDLE hFile;
+	HANDLE hMapping;
+#else
+	int fd;
+#endif
+} OSDEP_MAPPING;
+
+OSDEP_INT64 OSDEP_now(void);
+OSDEP_INT64 OSDEP_frequency(void);
+OSDEP_INT64 OSDEP_toUsec(OSDEP_INT64 const ticks);
+OSDEP_INT64 OSDEP_toNsec(OSDEP_INT64 const ticks);
+OSDEP_INT64 OSDEP_fromUsec(OSDEP_INT64 const usec);
+void OSDEP_sleep(unsigned int const msec);
+void OSDEP_waitUntil(OSDEP_INT64 const deadline);
+
+long OSDEP_atomicIncrement(long volatile *const p);
+long OSDEP_atomicExchange(long volatile *const p, long const value);
+long OSDEP_atomicRead(long volatile const *const p);
+void OSDEP_atomicRelease(long volatile *const p, long const value);
+long OSDEP_atomicCompareExchange(long volatile *const p, long const value, long const comparand);
+
+int OSDEP_createThread(OSDEP_THREAD *const pThread, OSDEP_THREAD_FUNC const func, void *const pArg, int const lowPriority);
+void OSDEP_joinThread(OSDEP_THREAD const thread);
+
+int OSDEP_createEvent(OSDEP_EVENT *const pEvent);
+void OSDEP_setEvent(OSDEP_EVENT *const pEvent);
+void OSDEP_waitEvent(OSDEP_EVENT *const pEvent);
+
+int OSDEP_mapFile(char const *const pPath, OSDEP_MAPPING *const pMapping);
+void OSDEP_unmapFile(OSDEP_MAPPING *const pMapping);
+
+#endif // __OSDEP__
@@ -0,0 +1,552 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file replay.cpp
+ * \brief Source file that replays a recorded transcript instead of JCOP Simulator.
+ * \author Kenichi Kanai
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "osdep.h"
+#include "replay.h"
+#include "transcript.h"
+#include "jcop_msg.h"
+#define DBG_CATEGORY DBG_CAT_TRANSPORT
+#include "dbglog.h"
+
+#define REPLAY_HASH_SIZE 4096	// must be a power of 2.
+#define REPLAY_NONE 0xFFFFFFFF
+#define REPLAY_EXCHANGE_INITIAL 1024	// initial number of exchanges.
+#define REPLAY_APDU_MAX 65544	// extended C-APDU / R-APDU.
+
+typedef struct _REPLAY_EXCHANGE {
+	unsigned char mty;	// JCOP_MSG_MTY_WAIT_FOR_CARD or JCOP_MSG_MTY_APDU.
+	bool owned;		// pCmd is allocated (reassembled from T=1 blocks).
+	unsigned short cmdLen;
+	unsigned short rspLen;
+	char const *pCmd;	// C-APDU (NULL for JCOP_MSG_MTY_WAIT_FOR_CARD).
+	char const *pRsp;	// R-APDU or ATR.
+	unsigned int latency;	// recorded processing latency (usec).
+	unsigned int next;	// next exchange in the same hash bucket.
+} REPLAY_EXCHANGE;
+
+// mapped transcript.
+static OSDEP_MAPPING g_mapping;
+static bool g_isMapped = false;
+static char const *g_pView = NULL;
+
+static REPLAY_EXCHANGE *g_pExchange = NULL;
+static unsigned int g_count = 0;
+static unsigned int g_max = 0;
+static unsigned int g_bucket[REPLAY_HASH_SIZE];
+
+// index of the next expected exchange. a thread (a connection of
+// jcop_load) follows the transcript by itself.
+static OSDEP_THREAD_LOCAL unsigned int g_pos = 0;
+static unsigned int g_timing = REPLAY_TIMING_ORIGINAL;
+
+// T=1 blocks being reassembled to an APDU exchange.
+#define T1_PHASE_COMMAND	0
+#define T1_PHASE_RESPONSE	1
+static int g_t1Phase = T1_PHASE_COMMAND;
+static char g_t1Cmd[REPLAY_APDU_MAX];
+static unsigned int g_t1CmdLen = 0;
+static char g_t1Rsp[REPLAY_APDU_MAX];
+static unsigned int g_t1RspLen = 0;
+static unsigned int g_t1Latency = 0;
+
+static unsigned int hash(char const *const p, unsigned short const len)
+{
+	// FNV-1a
+	unsigned int h = 2166136261U;
+	for (unsigned short i = 0; i < len; i++) {
+		h ^= (unsigned char)p[i];
+		h *= 16777619U;
+	}
+	return h & (REPLAY_HASH_SIZE - 1);
+}
+
+static int add_exchange(
+    unsigned char const mty,
+    char const *const pCmd,
+    unsigned short const cmdLen,
+    char const *const pRsp,
+    unsigned short const rspLen,
+    unsigned int const latency,
+    bool const owned
+)
+{
+	if (g_count == g_max) {
+		unsigned int max = (g_max == 0) ? REPLAY_EXCHANGE_INITIAL : g_max * 2;
+		REPLAY_EXCHANGE *pExchange = (REPLAY_EXCHANGE *)realloc(g_pExchange, max * sizeof(REPLAY_EXCHANGE));
+		if (pExchange == NULL) {
+			dbg_err("realloc failed! - %u exchanges", max);
+			return REPLAY_ERROR_MEMORY;
+		}
+		g_pExchange = pExchange;
+		g_max = max;
+	}
+	REPLAY_EXCHANGE *pExchange = &g_pExchange[g_count++];
+	pExchange->mty = mty;
+	pExchange->owned = owned;
+	pExchange->pCmd = pCmd;
+	pExchange->cmdLen = cmdLen;
+	pExchange->pRsp = pRsp;
+	pExchange->rspLen = rspLen;
+	pExchange->latency = latency;
+	pExchange->next = REPLAY_NONE;
+	return REPLAY_NO_ERROR;
+}
+
+static void t1_reset(void)
+{
+	g_t1Phase = T1_PHASE_COMMAND;
+	g_t1CmdLen = 0;
+	g_t1RspLen = 0;
+	g_t1Latency = 0;
+}
+
+/*!
+ * \brief Function appends INF of a T=1 block.<br>
+ *
+ * \retval 1 INF is appended.
+ * \retval 0 the block is malformed or the APDU is too long.
+ */
+static int t1_append(
+    char *const pBuf,
+    unsigned int *const pLen,
+    char const *const pBlock,
+    unsigned short const blockLen
+)
+{
+	// block: NAD PCB LEN | INF... | EDC
+	unsigned int infLen = pBlock[2] & 0xff;
+	if (3 + infLen > blockLen || *pLen + infLen > REPLAY_APDU_MAX) {
+		return 0;
+	}
+	memcpy(pBuf + *pLen, pBlock + 3, infLen);
+	*pLen += infLen;
+	return 1;
+}
+
+static int t1_emit(void)
+{
+	char *pData = (char *)malloc(g_t1CmdLen + g_t1RspLen);
+	if (pData == NULL) {
+		return REPLAY_ERROR_MEMORY;
+	}
+	memcpy(pData, g_t1Cmd, g_t1CmdLen);
+	memcpy(pData + g_t1CmdLen, g_t1Rsp, g_t1RspLen);
+	int status = add_exchange(
+	                 JCOP_MSG_MTY_APDU,
+	                 pData, (unsigned short)g_t1CmdLen,
+	                 pData + g_t1CmdLen, (unsigned short)g_t1RspLen,
+	                 g_t1Latency, true);
+	if (status != REPLAY_NO_ERROR) {
+		free(pData);
+	}
+	t1_reset();
+	return status;
+}
+
+/*!
+ * \brief Function converts a T=1 record to APDU exchanges.<br>
+ * <br>
+ * Chained I-blocks of the command and of the answer are reassembled;
+ * R-blocks and S-blocks are skipped. Every block of the chain, the last
+ * I-block too, is recorded as MTY 0x11 with the block sent by the driver.
+ */
+static int t1_convert(TRANSCRIPT_RECORD const *const pRecord, char const *const pCmd, char const *const pRsp)
+{
+	if (pRecord->cmdLen < 4 || pRecord->rspLen < 4) {
+		return REPLAY_NO_ERROR;
+	}
+	unsigned char cmdPcb = (unsigned char)pCmd[1];
+	unsigned char rspPcb = (unsigned char)pRsp[1];
+
+	if ((cmdPcb & 0x80) == 0) {
+		// I-block: a (part of) command.
+		if (g_t1Phase != T1_PHASE_COMMAND) {
+			t1_reset();	// the previous answer is incomplete.
+		}
+		g_t1Latency += pRecord->stage[TRANSCRIPT_STAGE_PROCESS];
+		if (!t1_append(g_t1Cmd, &g_t1CmdLen, pCmd, pRecord->cmdLen)) {
+			t1_reset();
+			return REPLAY_NO_ERROR;
+		}
+		if ((cmdPcb & 0x20) != 0) {
+			return REPLAY_NO_ERROR;	// more blocks, answered by R-block.
+		}
+		g_t1Phase = T1_PHASE_RESPONSE;
+	} else if ((cmdPcb & 0xC0) == 0x80 && g_t1Phase == T1_PHASE_RESPONSE) {
+		// R-block: request of the next block of the answer.
+		g_t1Latency += pRecord->stage[TRANSCRIPT_STAGE_PROCESS];
+	} else {
+		return REPLAY_NO_ERROR;
+	}
+
+	if ((rspPcb & 0x80) != 0) {
+		// not an I-block (e.g. the receive error R-block).
+		t1_reset();
+		return REPLAY_NO_ERROR;
+	}
+	if (!t1_append(g_t1Rsp, &g_t1RspLen, pRsp, pRecord->rspLen)) {
+		t1_reset();
+		return REPLAY_NO_ERROR;
+	}
+	if ((rspPcb & 0x20) != 0) {
+		return REPLAY_NO_ERROR;	// more blocks.
+	}
+	return t1_emit();
+}
+
+/*!
+ * \brief Function converts a batch (MTY 0x13) to an exchange for each
+ * C-APDU answered; the latency is shared among them.<br>
+ */
+static int batch_convert(TRANSCRIPT_RECORD const *const pRecord, char const *const pCmd, char const *const pRsp)
+{
+	unsigned int answers = 0;
+	unsigned long rspOffset = 0;
+	unsigned long rspItemLen;
+	while ((rspItemLen = JCOP_MSG_getBatchItem(pRsp, pRecord->rspLen, rspOffset)) != 0) {
+		answers++;
+		rspOffset += rspItemLen;
+	}
+	if (answers == 0) {
+		return REPLAY_NO_ERROR;
+	}
+
+	unsigned int latency = pRecord->stage[TRANSCRIPT_STAGE_PROCESS] / answers;
+	unsigned long cmdOffset = JCOP_MSG_BATCH_HEADER_SIZE;
+	rspOffset = 0;
+	for (unsigned int i = 0; i < answers; i++) {
+		unsigned long cmdItemLen = JCOP_MSG_getBatchItem(pCmd, pRecord->cmdLen, cmdOffset);
+		rspItemLen = JCOP_MSG_getBatchItem(pRsp, pRecord->rspLen, rspOffset);
+		if (cmdItemLen < JCOP_MSG_HEADER_SIZE + 4) {
+			return REPLAY_ERROR_FORMAT;
+		}
+		int status = add_exchange(JCOP_MSG_MTY_APDU,
+		                          pCmd + cmdOffset + JCOP_MSG_HEADER_SIZE,
+		                          (unsigned short)(cmdItemLen - JCOP_MSG_HEADER_SIZE),
+		                          pRsp + rspOffset + JCOP_MSG_HEADER_SIZE,
+		                          (unsigned short)(rspItemLen - JCOP_MSG_HEADER_SIZE),
+		                          latency, false);
+		if (status != REPLAY_NO_ERROR) {
+			return status;
+		}
+		cmdOffset += cmdItemLen;
+		rspOffset += rspItemLen;
+	}
+	return REPLAY_NO_ERROR;
+}
+
+static int convert(TRANSCRIPT_RECORD const *const pRecord, char const *const pCmd, char const *const pRsp)
+{
+	if (pRecord->status != 0) {
+		// failed requests are not replayed.
+		if (pRecord->mty == JCOP_MSG_MTY_T1) {
+			t1_reset();
+		}
+		return REPLAY_NO_ERROR;
+	}
+
+	unsigned int latency = pRecord->stage[TRANSCRIPT_STAGE_PROCESS];
+	switch (pRecord->mty) {
+		case JCOP_MSG_MTY_WAIT_FOR_CARD :
+			t1_reset();
+			return add_exchange(JCOP_MSG_MTY_WAIT_FOR_CARD, NULL, 0, pRsp, pRecord->rspLen, latency, false);
+		case JCOP_MSG_MTY_APDU :
+		case JCOP_MSG_MTY_T1_APDU :
+			if (pRecord->mty == JCOP_MSG_MTY_T1_APDU) {
+				t1_reset();	// T1_processApdu drops the chain.
+			}
+			if (pRecord->cmdLen < 4) {
+				return REPLAY_NO_ERROR;
+			}
+			return add_exchange(JCOP_MSG_MTY_APDU, pCmd, pRecord->cmdLen, pRsp, pRecord->rspLen, latency, false);
+		case JCOP_MSG_MTY_T1 :
+			return t1_convert(pRecord, pCmd, pRsp);
+		case JCOP_MSG_MTY_BATCH :
+			return batch_convert(pRecord, pCmd, pRsp);
+		default :
+			return REPLAY_NO_ERROR;
+	}
+}
+
+/*!
+ * \brief Function walks the records of the mapped transcript.<br>
+ */
+static int load(unsigned long const fileSize)
+{
+	if (fileSize < sizeof(TRANSCRIPT_FILE_HEADER)) {
+		return REPLAY_ERROR_FORMAT;
+	}
+	TRANSCRIPT_FILE_HEADER const *pHeader = (TRANSCRIPT_FILE_HEADER const *)g_pView;
+	if (pHeader->magic != TRANSCRIPT_MAGIC
+	        || pHeader->version != TRANSCRIPT_VERSION
+	        || pHeader->headerSize < sizeof(TRANSCRIPT_FILE_HEADER)) {
+		dbg_err("not a transcript file");
+		return REPLAY_ERROR_FORMAT;
+	}
+
+	// records end at the index, or at the end of file without trailer.
+	unsigned long end = fileSize;
+	if (fileSize >= pHeader->headerSize + sizeof(TRANSCRIPT_TRAILER)) {
+		TRANSCRIPT_TRAILER const *pTrailer =
+		    (TRANSCRIPT_TRAILER const *)(g_pView + fileSize - sizeof(TRANSCRIPT_TRAILER));
+		if (pTrailer->magic == TRANSCRIPT_INDEX_MAGIC
+		        && pTrailer->indexHigh == 0
+		        && pTrailer->indexLow <= fileSize - sizeof(TRANSCRIPT_TRAILER)) {
+			end = pTrailer->indexLow;
+		}
+	}
+
+	t1_reset();
+	unsigned long offset = pHeader->headerSize;
+	while (offset + sizeof(TRANSCRIPT_RECORD) <= end) {
+		TRANSCRIPT_RECORD const *pRecord = (TRANSCRIPT_RECORD const *)(g_pView + offset);
+		if (pRecord->recordSize < sizeof(TRANSCRIPT_RECORD)
+		        || pRecord->recordSize > end - offset
+		        || sizeof(TRANSCRIPT_RECORD) + pRecord->cmdLen + pRecord->rspLen > pRecord->recordSize) {
+			// the last record is truncated.
+			dbg_warn("broken record at %lu", offset);
+			break;
+		}
+		char const *pCmd = (char const *)(pRecord + 1);
+		int status = convert(pRecord, pCmd, pCmd + pRecord->cmdLen);
+		if (status != REPLAY_NO_ERROR) {
+			return status;
+		}
+		offset += pRecord->recordSize;
+	}
+
+	// hash chains keep the recorded order.
+	for (unsigned int i = 0; i < REPLAY_HASH_SIZE; i++) {
+		g_bucket[i] = REPLAY_NONE;
+	}
+	for (unsigned int i = g_count; i-- > 0;) {
+		if (g_pExchange[i].mty == JCOP_MSG_MTY_APDU) {
+			unsigned int h = hash(g_pExchange[i].pCmd, g_pExchange[i].cmdLen);
+			g_pExchange[i].next = g_bucket[h];
+			g_bucket[h] = i;
+		}
+	}
+	dbg_info("%u exchanges loaded", g_count);
+	return REPLAY_NO_ERROR;
+}
+
+static bool matches(unsigned int const i, char const *const pCmd, unsigned short const cmdLen)
+{
+	REPLAY_EXCHANGE const *pExchange = &g_pExchange[i];
+	return pExchange->mty == JCOP_MSG_MTY_APDU
+	       && pExchange->cmdLen == cmdLen
+	       && memcmp(pExchange->pCmd, pCmd, cmdLen) == 0;
+}
+
+/*!
+ * \brief Function finds the exchange which answers a command.<br>
+ *
+ * \retval index of the exchange, or REPLAY_NONE.
+ */
+static unsigned int lookup(char const *const pCmd, unsigned short const cmdLen)
+{
+	// the recorded sequence is followed.
+	if (g_pos < g_count && matches(g_pos, pCmd, cmdLen)) {
+		return g_pos;
+	}
+
+	unsigned int first = REPLAY_NONE;
+	for (unsigned int i = g_bucket[hash(pCmd, cmdLen)]; i != REPLAY_NONE; i = g_pExchange[i].next) {
+		if (!matches(i, pCmd, cmdLen)) {
+			continue;
+		}
+		if (i >= g_pos) {
+			return i;
+		}
+		if (first == REPLAY_NONE) {
+			first = i;
+		}
+	}
+	return first;
+}
+
+/*!
+ * \brief Function waits for the recorded latency scaled by the timing.<br>
+ */
+static void wait_latency(unsigned int const latency)
+{
+	if (g_timing == REPLAY_TIMING_NONE || latency == 0) {
+		return;
+	}
+	OSDEP_INT64 usec = (OSDEP_INT64)latency * g_timing / 100;
+	OSDEP_waitUntil(OSDEP_now() + OSDEP_fromUsec(usec));
+}
+
+static int replay_powerUp(char *const pAtr, unsigned short *const pAtrLen)
+{
+	// the next recorded power up, or the first one.
+	unsigned int i;
+	for (i = g_pos; i < g_count && g_pExchange[i].mty != JCOP_MSG_MTY_WAIT_FOR_CARD; i++) {
+	}
+	if (i == g_count) {
+		for (i = 0; i < g_count && g_pExchange[i].mty != JCOP_MSG_MTY_WAIT_FOR_CARD; i++) {
+		}
+	}
+	if (i == g_count) {
+		dbg_err("no power up is recorded");
+		*pAtrLen = 0;
+		return JCOP_SIMUL_ERROR_INITIALIZE;
+	}
+
+	REPLAY_EXCHANGE const *pExchange = &g_pExchange[i];
+	if (pExchange->rspLen > *pAtrLen) {
+		*pAtrLen = 0;
+		return JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL;
+	}
+	wait_latency(pExchange->latency);
+	memcpy(pAtr, pExchange->pRsp, pExchange->rspLen);
+	*pAtrLen = pExchange->rspLen;
+	g_pos = i + 1;
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+static int replay_transmit(
+    char const *const pSnd,
+    const unsigned short sndLen,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	if (sndLen < JCOP_MSG_HEADER_SIZE) {
+		return JCOP_SIMUL_ERROR_OTHER;
+	}
+	char const *pCmd = pSnd + JCOP_MSG_HEADER_SIZE;
+	unsigned short cmdLen = sndLen - JCOP_MSG_HEADER_SIZE;
+
+	unsigned int i = lookup(pCmd, cmdLen);
+	if (i == REPLAY_NONE) {
+		dbg_warn("command is not recorded");
+		dbg_ba2s(pCmd, cmdLen);
+		*pRcvLen = 0;
+		return JCOP_SIMUL_ERROR_OTHER;
+	}
+	if (i != g_pos) {
+		dbg_info("out of sequence: %u (expected %u)", i, g_pos);
+	}
+
+	REPLAY_EXCHANGE const *pExchange = &g_pExchange[i];
+	if (pExchange->rspLen > *pRcvLen) {
+		*pRcvLen = 0;
+		return JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL;
+	}
+	wait_latency(pExchange->latency);
+	memcpy(pRcv, pExchange->pRsp, pExchange->rspLen);
+	*pRcvLen = pExchange->rspLen;
+	g_pos = i + 1;
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+static void replay_close()
+{
+	// the position is kept; the next power up continues the transcript.
+}
+
+static JCOP_SIMUL_BACKEND const g_replayBackend = {
+	replay_powerUp,
+	replay_transmit,
+	replay_close,
+	NULL,	// the position of a session can't be handed over.
+	NULL,
+	NULL,
+	NULL
+};
+
+/*!
+ * \brief Function maps a transcript file to be replayed.<br>
+ * <br>
+ * \param [in] pPath path of the transcript file.
+ * \param [in] timingPercent percentage of the recorded latency to wait, REPLAY_TIMING_XXX.
+ *
+ * \retval REPLAY_NO_ERROR
+ * \retval REPLAY_ERROR_IO
+ * \retval REPLAY_ERROR_FORMAT
+ * \retval REPLAY_ERROR_MEMORY
+ */
+int REPLAY_open(char const *const pPath, unsigned int const timingPercent)
+{
+	REPLAY_close();
+
+	if (OSDEP_mapFile(pPath, &g_mapping) != 0) {
+		dbg_err("can't map %s", pPath);
+		return REPLAY_ERROR_IO;
+	}
+	g_isMapped = true;
+	g_pView = g_mapping.pView;
+
+	int status = load(g_mapping.size);
+	if (status != REPLAY_NO_ERROR) {
+		REPLAY_close();
+		return status;
+	}
+
+	g_timing = timingPercent;
+	g_pos = 0;
+	return REPLAY_NO_ERROR;
+}
+
+/*!
+ * \brief Function returns the backend to be set by JCOP_SIMUL_setBackend.<br>
+ */
+JCOP_SIMUL_BACKEND const *REPLAY_getBackend(void)
+{
+	return &g_replayBackend;
+}
+
+/*!
+ * \brief Function releases the transcript.<br>
+ */
+void REPLAY_close(void)
+{
+	for (unsigned int i = 0; i < g_count; i++) {
+		if (g_pExchange[i].owned) {
+			free((void *)g_pExchange[i].pCmd);
+		}
+	}
+	free(g_pExchange);
+	g_pExchange = NULL;
+	g_count = 0;
+	g_max = 0;
+	g_pos = 0;
+
+	if (g_isMapped) {
+		OSDEP_unmapFile(&g_mapping);
+		g_isMapped = false;
+	}
+	g_pView = NULL;
+}
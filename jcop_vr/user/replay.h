@@ -0,0 +1,59 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file replay.h
+ * \brief prototypes for the backend which replays a recorded transcript.
+ * \author Kenichi Kanai
+ *
+ * The replay backend answers JCOP_SIMUL_powerUp and JCOP_SIMUL_transmit from
+ * a transcript recorded by "jcop_proxy start -record", without JCOP
+ * simulator. T=1 records are converted to the APDU exchanges they carry.
+ *
+ * A command is answered by the next recorded exchange if its command bytes
+ * match; otherwise by the first exchange with the same command bytes after
+ * the current position, or before it if there is none.
+ */
+#ifndef __REPLAY__
+#define __REPLAY__
+
+#include "jcop_simul.h"
+
+#define REPLAY_NO_ERROR		0x00
+#define REPLAY_ERROR_IO		0x01
+#define REPLAY_ERROR_FORMAT	0x02
+#define REPLAY_ERROR_MEMORY	0x03
+
+// timing: percentage of the recorded processing latency to wait before an
+// answer. 0 answers at once, 100 reproduces the recorded latency.
+#define REPLAY_TIMING_NONE	0
+#define REPLAY_TIMING_ORIGINAL	100
+
+int REPLAY_open(char const *const pPath, unsigned int const timingPercent);
+JCOP_SIMUL_BACKEND const *REPLAY_getBackend(void);
+void REPLAY_close(void);
+
+#endif // __REPLAY__
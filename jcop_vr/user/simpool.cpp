@@ -0,0 +1,227 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*!
+ * \file simpool.cpp
+ * \brief Source file that contains the pool of powered up simulator sessions.
+ * \author Kenichi Kanai
+ *
+ * An entry of the pool moves EMPTY -> FILLING (a refill thread powers up)
+ * -> READY -> TAKEN (SIMPOOL_powerUp) -> EMPTY. Every move is a compare
+ * and exchange of the state, so the pool takes no lock.
+ *
+ * SIMPOOL_powerUp leaves the session it replaces in the emptied entry, and
+ * the refill thread powers it up again over the same connection, so a
+ * pooled reset doesn't cost a new connection to JCOP simulator.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "osdep.h"
+#include "shared_data.h"
+#include "jcop_simul.h"
+#include "simpool.h"
+#define DBG_CATEGORY DBG_CAT_TRANSPORT
+#include "dbglog.h"
+
+#define SIMPOOL_EMPTY	0
+#define SIMPOOL_FILLING	1
+#define SIMPOOL_READY	2
+#define SIMPOOL_TAKEN	3
+
+// refill threads look for an empty entry at this interval (msec).
+#define SIMPOOL_REFILL_INTERVAL 5
+// wait after a failed power up, multiplied by the failures in a row (msec).
+#define SIMPOOL_RETRY_INTERVAL 100
+#define SIMPOOL_MAX_RETRY_INTERVAL 1000
+
+typedef struct _SIMPOOL_ENTRY {
+	volatile long state;	// SIMPOOL_XXX
+	void *pSession;		// detached session: READY, or EMPTY to be reused.
+	unsigned short atrLen;
+	char atr[JCOP_PROXY_MAX_ATR_SIZE];
+} SIMPOOL_ENTRY;
+
+static SIMPOOL_ENTRY *g_pEntries = NULL;
+static unsigned int g_size = 0;
+static OSDEP_THREAD g_threads[SIMPOOL_MAX_THREADS];
+static unsigned int g_threadCount = 0;
+static volatile long g_isRunning = 0;
+static volatile long g_hits = 0;	// power ups answered from the pool.
+static volatile long g_misses = 0;	// power ups with no ready session.
+
+static SIMPOOL_ENTRY *claim(long const from, long const to)
+{
+	for (unsigned int i = 0; i < g_size; i++) {
+		SIMPOOL_ENTRY *pEntry = &g_pEntries[i];
+		if (OSDEP_atomicCompareExchange(&pEntry->state, to, from) == from) {
+			return pEntry;
+		}
+	}
+	return NULL;
+}
+
+static void refill(void *pParam)
+{
+	unsigned int failures = 0;
+	while (OSDEP_atomicRead(&g_isRunning) != 0) {
+		SIMPOOL_ENTRY *pEntry = claim(SIMPOOL_EMPTY, SIMPOOL_FILLING);
+		if (pEntry == NULL) {
+			OSDEP_sleep(SIMPOOL_REFILL_INTERVAL);
+			continue;
+		}
+
+		if (pEntry->pSession != NULL) {
+			// the session replaced by SIMPOOL_powerUp.
+			JCOP_SIMUL_attach(pEntry->pSession);
+			pEntry->pSession = NULL;
+		}
+		pEntry->atrLen = sizeof(pEntry->atr);
+		int status = JCOP_SIMUL_powerUp(pEntry->atr, &pEntry->atrLen);
+		void *pSession = (status == JCOP_SIMUL_NO_ERROR) ? JCOP_SIMUL_detach() : NULL;
+		if (pSession == NULL) {
+			dbg_warn("refill failed! - status: 0x%08X", status);
+			JCOP_SIMUL_close();
+			OSDEP_atomicExchange(&pEntry->state, SIMPOOL_EMPTY);
+			if (failures < SIMPOOL_MAX_RETRY_INTERVAL / SIMPOOL_RETRY_INTERVAL) {
+				failures++;
+			}
+			OSDEP_sleep(failures * SIMPOOL_RETRY_INTERVAL);
+			continue;
+		}
+		failures = 0;
+		pEntry->pSession = pSession;
+		OSDEP_atomicExchange(&pEntry->state, SIMPOOL_READY);
+	}
+	JCOP_SIMUL_close();
+}
+
+/*!
+ * \brief Function starts to fill the pool.<br>
+ * <br>
+ * Set the backend (JCOP_SIMUL_setBackend, JCOP_SIMUL_setServer) first.
+ * <br>
+ * \param [in] size number of sessions kept ready (1 to SIMPOOL_MAX_SIZE).
+ * \param [in] threads number of refill threads, i.e. sessions prepared at
+ *		the same time (1 to SIMPOOL_MAX_THREADS).
+ *
+ * \retval SIMPOOL_NO_ERROR
+ * \retval SIMPOOL_ERROR_NOT_SUPPORTED
+ * \retval SIMPOOL_ERROR_MEMORY
+ * \retval SIMPOOL_ERROR_THREAD
+ */
+int SIMPOOL_open(unsigned int const size, unsigned int const threads)
+{
+	if (!JCOP_SIMUL_canDetach()) {
+		return SIMPOOL_ERROR_NOT_SUPPORTED;
+	}
+	g_size = (size < 1) ? 1 : (size > SIMPOOL_MAX_SIZE) ? SIMPOOL_MAX_SIZE : size;
+	g_pEntries = (SIMPOOL_ENTRY *)calloc(g_size, sizeof(SIMPOOL_ENTRY));
+	if (g_pEntries == NULL) {
+		g_size = 0;
+		return SIMPOOL_ERROR_MEMORY;
+	}
+
+	OSDEP_atomicExchange(&g_isRunning, 1);
+	unsigned int count = (threads < 1) ? 1 : (threads > SIMPOOL_MAX_THREADS) ? SIMPOOL_MAX_THREADS : threads;
+	for (g_threadCount = 0; g_threadCount < count; g_threadCount++) {
+		if (OSDEP_createThread(&g_threads[g_threadCount], refill, NULL, 0) != 0) {
+			break;
+		}
+	}
+	if (g_threadCount == 0) {
+		SIMPOOL_close();
+		return SIMPOOL_ERROR_THREAD;
+	}
+	return SIMPOOL_NO_ERROR;
+}
+
+/*!
+ * \brief Function powers up the card with a session of the pool.<br>
+ * <br>
+ * The session of the calling thread is replaced by a ready session of the
+ * pool. If there is none (or the pool is not open), the card is powered up
+ * by JCOP_SIMUL_powerUp.
+ * <br>
+ * \param [out] pAtr A pointer to buffer of ATR.
+ * \param [in][out] pAtrLen [in]length of pAtr. [out]actual length of ATR.
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval status of JCOP_SIMUL_powerUp.
+ */
+int SIMPOOL_powerUp(char *const pAtr, unsigned short *const pAtrLen)
+{
+	SIMPOOL_ENTRY *pEntry = (g_size > 0) ? claim(SIMPOOL_READY, SIMPOOL_TAKEN) : NULL;
+	if (pEntry == NULL || *pAtrLen < pEntry->atrLen) {
+		if (pEntry != NULL) {
+			OSDEP_atomicExchange(&pEntry->state, SIMPOOL_READY);
+		}
+		if (g_size > 0) {
+			OSDEP_atomicIncrement(&g_misses);
+		}
+		return JCOP_SIMUL_powerUp(pAtr, pAtrLen);
+	}
+
+	memcpy(pAtr, pEntry->atr, pEntry->atrLen);
+	*pAtrLen = pEntry->atrLen;
+	void *pOld = JCOP_SIMUL_detach();	// NULL if there is no connection.
+	JCOP_SIMUL_attach(pEntry->pSession);
+	pEntry->pSession = pOld;
+	OSDEP_atomicExchange(&pEntry->state, SIMPOOL_EMPTY);
+	OSDEP_atomicIncrement(&g_hits);
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+/*!
+ * \brief Function returns the number of power ups answered from the pool
+ * (hits) and those with no ready session (misses).<br>
+ */
+void SIMPOOL_getCounts(unsigned long *const pHits, unsigned long *const pMisses)
+{
+	*pHits = (unsigned long)OSDEP_atomicRead(&g_hits);
+	*pMisses = (unsigned long)OSDEP_atomicRead(&g_misses);
+}
+
+/*!
+ * \brief Function stops the refill threads and closes the ready sessions.<br>
+ */
+void SIMPOOL_close(void)
+{
+	OSDEP_atomicExchange(&g_isRunning, 0);
+	for (unsigned int i = 0; i < g_threadCount; i++) {
+		OSDEP_joinThread(g_threads[i]);
+	}
+	g_threadCount = 0;
+	for (unsigned int i = 0; i < g_size; i++) {
+		if (g_pEntries[i].pSession != NULL) {
+			JCOP_SIMUL_discard(g_pEntries[i].pSession);
+		}
+	}
+	free(g_pEntries);
+	g_pEntries = NULL;
+	g_size = 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*!
+ * \file simpool.h
+ * \brief prototypes for the pool of powered up simulator sessions.
+ * \author Kenichi Kanai
+ *
+ * Refill threads connect to the backend, power the card up and keep the
+ * session in the pool. SIMPOOL_powerUp takes a ready session instead of
+ * powering up, so a reset does not wait for connect and power up; the
+ * refill threads prepare a replacement in the background.
+ *
+ * The backend must be able to hand a session over to another thread
+ * (JCOP_SIMUL_canDetach): JCOP simulator and the mock backend can, the
+ * transcript replay can't. JCOP simulator must accept as many connections
+ * as the pool holds plus one.
+ */
+#ifndef __SIMPOOL__
+#define __SIMPOOL__
+
+#define SIMPOOL_NO_ERROR		0x00
+#define SIMPOOL_ERROR_NOT_SUPPORTED	0x01	// the backend can't hand a session over.
+#define SIMPOOL_ERROR_MEMORY		0x02
+#define SIMPOOL_ERROR_THREAD		0x03
+
+#define SIMPOOL_MAX_SIZE	64
+#define SIMPOOL_MAX_THREADS	16
+
+int SIMPOOL_open(unsigned int const size, unsigned int const threads);
+int SIMPOOL_powerUp(char *const pAtr, unsigned short *const pAtrLen);
+void SIMPOOL_getCounts(unsigned long *const pHits, unsigned long *const pMisses);
+void SIMPOOL_close(void);
+
+#endif // __SIMPOOL__
@@ -0,0 +1,376 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file stats.cpp
+ * \brief Source file that contains the per-stage latency statistics of jcop_proxy.
+ * \author Kenichi Kanai
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "stats.h"
+
+// times STATS_snapshot tries to copy the data while it is being updated.
+#define STATS_SNAPSHOT_RETRIES 1000
+
+static char const *const g_stageNames[STATS_STAGES] = {
+	"wake",
+	"read",
+	"protocol",
+	"simulator",
+	"reply",
+	"return",
+	"total"
+};
+
+// used until STATS_setStorage is called.
+static STATS_DATA g_data;
+static STATS_DATA *g_pData = &g_data;
+
+/*!
+ * \brief Function sets where the statistics are kept.<br>
+ * <br>
+ * The statistics are cleared by STATS_reset.
+ * <br>
+ * \param [in] pData storage (e.g. a shared memory view), or NULL to use the
+ *		private storage.
+ */
+void STATS_setStorage(STATS_DATA *const pData)
+{
+	g_pData = (pData != NULL) ? pData : &g_data;
+}
+
+/*!
+ * \brief Function clears every stage and the transfer counters.<br>
+ */
+void STATS_reset(void)
+{
+	STATS_beginUpdate();
+	g_pData->magic = STATS_MAGIC;
+	g_pData->size = sizeof(STATS_DATA);
+	for (unsigned int i = 0; i < STATS_STAGES; i++) {
+		HISTOGRAM_reset(&g_pData->histograms[i]);
+	}
+	JCOP_PERF_reset(&g_pData->counters, (JCOP_PERF_UINT64)OSDEP_frequency());
+	STATS_endUpdate();
+}
+
+/*!
+ * \brief Function starts an update of the statistics.<br>
+ * <br>
+ * Readers retry STATS_snapshot until STATS_endUpdate is called, so keep the
+ * update short.
+ */
+void STATS_beginUpdate(void)
+{
+	OSDEP_atomicIncrement(&g_pData->seq);
+}
+
+/*!
+ * \brief Function ends an update of the statistics.<br>
+ */
+void STATS_endUpdate(void)
+{
+	OSDEP_atomicIncrement(&g_pData->seq);
+}
+
+/*!
+ * \brief Function records the latency of a stage.<br>
+ * <br>
+ * \param [in] stage STATS_STAGE_XXX.
+ * \param [in] ticks latency (OSDEP_now ticks). a negative value (clocks of
+ *		different processors) is ignored.
+ */
+void STATS_record(unsigned int const stage, OSDEP_INT64 const ticks)
+{
+	if (stage >= STATS_STAGES || ticks < 0) {
+		return;
+	}
+	HISTOGRAM_record(&g_pData->histograms[stage], OSDEP_toNsec(ticks));
+}
+
+/*!
+ * \brief Function returns the histogram (nsec) of a stage.<br>
+ */
+HISTOGRAM const *STATS_getHistogram(unsigned int const stage)
+{
+	return (stage < STATS_STAGES) ? &g_pData->histograms[stage] : NULL;
+}
+
+char const *STATS_getStageName(unsigned int const stage)
+{
+	return (stage < STATS_STAGES) ? g_stageNames[stage] : "";
+}
+
+/*!
+ * \brief Function returns the transfer counters of jcop_proxy.<br>
+ */
+JCOP_PERF_COUNTERS *STATS_getCounters(void)
+{
+	return &g_pData->counters;
+}
+
+/*!
+ * \brief Function copies the statistics published by another process.<br>
+ * <br>
+ * The data is copied again while jcop_proxy updates it, so the copy is
+ * consistent without locking the recording thread.
+ * <br>
+ * \param [in] pShared published statistics (may be a read-only view).
+ * \param [out] pCopy consistent copy.
+ *
+ * \retval 0 the statistics are copied.
+ * \retval -1 the data is not STATS_DATA or is updated too frequently.
+ */
+int STATS_snapshot(STATS_DATA const *const pShared, STATS_DATA *const pCopy)
+{
+	// copied word by word through a volatile pointer, so the compiler keeps
+	// the copy between the two reads of seq.
+	long volatile const *pSrc = (long volatile const *)pShared;
+	long *pDst = (long *)pCopy;
+	size_t const words = sizeof(STATS_DATA) / sizeof(long);
+
+	for (int retry = 0; retry < STATS_SNAPSHOT_RETRIES; retry++) {
+		if (retry > 0) {
+			OSDEP_sleep(0);	// let the recording thread finish the update.
+		}
+		long seq = OSDEP_atomicRead(&pShared->seq);
+		if ((seq & 1) != 0) {
+			continue;
+		}
+		for (size_t i = 0; i < words; i++) {
+			pDst[i] = pSrc[i];
+		}
+		if (OSDEP_atomicRead(&pShared->seq) != seq) {
+			continue;
+		}
+		if (pCopy->magic != STATS_MAGIC || pCopy->size != sizeof(STATS_DATA)) {
+			return -1;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+static double to_msec(JCOP_PERF_COUNTERS const *const pCounters, JCOP_PERF_UINT64 const ticks)
+{
+	if (pCounters->frequency == 0) {
+		return 0;
+	}
+	return (double)ticks * 1000 / (double)pCounters->frequency;
+}
+
+static void print_counters(
+    FILE *const fp,
+    JCOP_PERF_COUNTERS const *const pCounters,
+    JCOP_PERF_COUNTERS const *const pDriverCounters
+)
+{
+	static char const *const names[] = {
+		"transmits", "bytes sent", "bytes received", "T=1 blocks",
+		"chaining", "resets", "timeouts", "errors", "saved trips",
+		"cache hits", "cache misses", "prefetch hits", "prefetch misses",
+		"short commands", "bulk commands", "short refused", "bulk refused"
+	};
+	JCOP_PERF_UINT64 const values[] = {
+		pCounters->transmits, pCounters->bytesSent, pCounters->bytesReceived, pCounters->t1Blocks,
+		pCounters->chainingRounds, pCounters->resets, pCounters->timeouts, pCounters->errors,
+		pCounters->savedRoundTrips, pCounters->cacheHits, pCounters->cacheMisses,
+		pCounters->prefetchHits, pCounters->prefetchMisses,
+		pCounters->laneCommands[0], pCounters->laneCommands[1],
+		pCounters->laneRefused[0], pCounters->laneRefused[1]
+	};
+	JCOP_PERF_UINT64 driverValues[] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	if (pDriverCounters != NULL) {
+		driverValues[0] = pDriverCounters->transmits;
+		driverValues[1] = pDriverCounters->bytesSent;
+		driverValues[2] = pDriverCounters->bytesReceived;
+		driverValues[3] = pDriverCounters->t1Blocks;
+		driverValues[4] = pDriverCounters->chainingRounds;
+		driverValues[5] = pDriverCounters->resets;
+		driverValues[6] = pDriverCounters->timeouts;
+		driverValues[7] = pDriverCounters->errors;
+		driverValues[8] = pDriverCounters->savedRoundTrips;
+		driverValues[9] = pDriverCounters->cacheHits;
+		driverValues[10] = pDriverCounters->cacheMisses;
+		driverValues[11] = pDriverCounters->prefetchHits;
+		driverValues[12] = pDriverCounters->prefetchMisses;
+	}
+
+	fprintf(fp, "\n%-16s %14s %14s\n", "counter", "jcop_proxy", (pDriverCounters != NULL) ? "driver" : "");
+	for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+		fprintf(fp, "%-16s %14.0f", names[i], (double)values[i]);
+		if (pDriverCounters != NULL) {
+			fprintf(fp, " %14.0f", (double)driverValues[i]);
+		}
+		fprintf(fp, "\n");
+	}
+	fprintf(fp, "%-16s %14.1f", "wait (msec)", to_msec(pCounters, pCounters->waitTicks));
+	if (pDriverCounters != NULL) {
+		fprintf(fp, " %14.1f", to_msec(pDriverCounters, pDriverCounters->waitTicks));
+	}
+	fprintf(fp, "\n");
+	fprintf(fp, "%-16s %14.1f\n", "prefetch (msec)", to_msec(pCounters, pCounters->prefetchTicks));
+	fprintf(fp, "%-16s %14.1f\n", "short wait(msec)", to_msec(pCounters, pCounters->laneWaitTicks[0]));
+	fprintf(fp, "%-16s %14.1f\n", "bulk wait(msec)", to_msec(pCounters, pCounters->laneWaitTicks[1]));
+}
+
+/*!
+ * \brief Function writes the statistics of every stage and the transfer
+ * counters as a text table.<br>
+ * <br>
+ * \param [in] fp output stream.
+ * \param [in] pData statistics.
+ * \param [in] pDriverCounters transfer counters of the driver, or NULL.
+ */
+void STATS_write(FILE *const fp, STATS_DATA const *const pData, JCOP_PERF_COUNTERS const *const pDriverCounters)
+{
+	fprintf(fp, "latency in usec\n");
+	fprintf(fp, "%-10s %10s %10s %10s %10s %10s %10s\n",
+	        "stage", "count", "mean", "p50", "p99", "p99.9", "max");
+	for (unsigned int i = 0; i < STATS_STAGES; i++) {
+		HISTOGRAM const *pHistogram = &pData->histograms[i];
+		fprintf(fp, "%-10s %10.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		        g_stageNames[i],
+		        (double)pHistogram->total,
+		        HISTOGRAM_mean(pHistogram) / 1000,
+		        (double)HISTOGRAM_percentile(pHistogram, 50) / 1000,
+		        (double)HISTOGRAM_percentile(pHistogram, 99) / 1000,
+		        (double)HISTOGRAM_percentile(pHistogram, 99.9) / 1000,
+		        (double)pHistogram->max / 1000);
+	}
+	print_counters(fp, &pData->counters, pDriverCounters);
+}
+
+/*!
+ * \brief Function writes the statistics in the Prometheus text exposition
+ * format.<br>
+ * <br>
+ * The latency of each stage is written as a summary in seconds.
+ * <br>
+ * \param [in] fp output stream.
+ * \param [in] pData statistics.
+ */
+void STATS_writePrometheus(FILE *const fp, STATS_DATA const *const pData)
+{
+	static char const *const names[] = {
+		"transmits", "bytes_sent", "bytes_received", "t1_blocks",
+		"chaining_rounds", "resets", "timeouts", "errors", "saved_round_trips",
+		"apdu_cache_hits", "apdu_cache_misses", "prefetch_hits", "prefetch_misses"
+	};
+	static char const *const helps[] = {
+		"Commands transmitted to the card.",
+		"Bytes sent to the card.",
+		"Bytes received from the card.",
+		"T=1 blocks exchanged.",
+		"T=1 chaining rounds.",
+		"Card resets.",
+		"Requests timed out.",
+		"Requests failed.",
+		"GET RESPONSE and 6Cxx resends done by jcop_proxy instead of the host.",
+		"Commands answered from the response cache.",
+		"Whitelisted commands sent to the card.",
+		"GET RESPONSE answered with the answer prefetched by jcop_proxy.",
+		"Answers prefetched by jcop_proxy and discarded."
+	};
+	JCOP_PERF_COUNTERS const *pCounters = &pData->counters;
+	JCOP_PERF_UINT64 const values[] = {
+		pCounters->transmits, pCounters->bytesSent, pCounters->bytesReceived, pCounters->t1Blocks,
+		pCounters->chainingRounds, pCounters->resets, pCounters->timeouts, pCounters->errors,
+		pCounters->savedRoundTrips, pCounters->cacheHits, pCounters->cacheMisses,
+		pCounters->prefetchHits, pCounters->prefetchMisses
+	};
+	for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+		fprintf(fp, "# HELP jcop_proxy_%s_total %s\n", names[i], helps[i]);
+		fprintf(fp, "# TYPE jcop_proxy_%s_total counter\n", names[i]);
+		fprintf(fp, "jcop_proxy_%s_total %.0f\n", names[i], (double)values[i]);
+	}
+	fprintf(fp, "# HELP jcop_proxy_wait_seconds_total Time spent waiting for the card.\n");
+	fprintf(fp, "# TYPE jcop_proxy_wait_seconds_total counter\n");
+	fprintf(fp, "jcop_proxy_wait_seconds_total %.6f\n", to_msec(pCounters, pCounters->waitTicks) / 1000);
+	fprintf(fp, "# HELP jcop_proxy_prefetch_saved_seconds_total Time the card took for the prefetched answers the host used.\n");
+	fprintf(fp, "# TYPE jcop_proxy_prefetch_saved_seconds_total counter\n");
+	fprintf(fp, "jcop_proxy_prefetch_saved_seconds_total %.6f\n", to_msec(pCounters, pCounters->prefetchTicks) / 1000);
+
+	// the lanes of the session shared by -mux.
+	static char const *const lanes[JCOP_PERF_LANES] = { "short", "bulk" };
+	fprintf(fp, "# HELP jcop_proxy_lane_commands_total Commands sent to the shared session.\n");
+	fprintf(fp, "# TYPE jcop_proxy_lane_commands_total counter\n");
+	for (int i = 0; i < JCOP_PERF_LANES; i++) {
+		fprintf(fp, "jcop_proxy_lane_commands_total{lane=\"%s\"} %.0f\n", lanes[i], (double)pCounters->laneCommands[i]);
+	}
+	fprintf(fp, "# HELP jcop_proxy_lane_refused_total Commands refused, the lane was full.\n");
+	fprintf(fp, "# TYPE jcop_proxy_lane_refused_total counter\n");
+	for (int i = 0; i < JCOP_PERF_LANES; i++) {
+		fprintf(fp, "jcop_proxy_lane_refused_total{lane=\"%s\"} %.0f\n", lanes[i], (double)pCounters->laneRefused[i]);
+	}
+	fprintf(fp, "# HELP jcop_proxy_lane_wait_seconds_total Time the commands waited for the shared session.\n");
+	fprintf(fp, "# TYPE jcop_proxy_lane_wait_seconds_total counter\n");
+	for (int i = 0; i < JCOP_PERF_LANES; i++) {
+		fprintf(fp, "jcop_proxy_lane_wait_seconds_total{lane=\"%s\"} %.6f\n", lanes[i], to_msec(pCounters, pCounters->laneWaitTicks[i]) / 1000);
+	}
+
+	static double const quantiles[] = { 0.5, 0.99, 0.999 };
+	fprintf(fp, "# HELP jcop_proxy_stage_latency_seconds Latency of each stage of a request.\n");
+	fprintf(fp, "# TYPE jcop_proxy_stage_latency_seconds summary\n");
+	for (unsigned int i = 0; i < STATS_STAGES; i++) {
+		HISTOGRAM const *pHistogram = &pData->histograms[i];
+		for (int j = 0; j < (int)(sizeof(quantiles) / sizeof(quantiles[0])); j++) {
+			fprintf(fp, "jcop_proxy_stage_latency_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n",
+			        g_stageNames[i], quantiles[j],
+			        (double)HISTOGRAM_percentile(pHistogram, quantiles[j] * 100) / 1e9);
+		}
+		fprintf(fp, "jcop_proxy_stage_latency_seconds_sum{stage=\"%s\"} %.9f\n",
+		        g_stageNames[i], pHistogram->sum / 1e9);
+		fprintf(fp, "jcop_proxy_stage_latency_seconds_count{stage=\"%s\"} %.0f\n",
+		        g_stageNames[i], (double)pHistogram->total);
+	}
+}
+
+/*!
+ * \brief Function writes the statistics of every stage and the transfer
+ * counters to a text file.<br>
+ * <br>
+ * \param [in] pPath file path.
+ * \param [in] pDriverCounters transfer counters of the driver, or NULL.
+ *
+ * \retval 0 the file is written.
+ * \retval -1 the file could not be written.
+ */
+int STATS_save(char const *const pPath, JCOP_PERF_COUNTERS const *const pDriverCounters)
+{
+	FILE *fp = fopen(pPath, "w");
+	if (fp == NULL) {
+		return -1;
+	}
+	STATS_write(fp, g_pData, pDriverCounters);
+	int ret = ferror(fp) ? -1 : 0;
+	if (fclose(fp) != 0) {
+		ret = -1;
+	}
+	return ret;
+}
@@ -0,0 +1,91 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file stats.h
+ * \brief prototypes for the per-stage latency statistics of jcop_proxy.
+ * \author Kenichi Kanai
+ *
+ * A request of the driver passes the stages below. Each stage has a
+ * histogram, so the tail latency of a request can be attributed to the
+ * driver/proxy channel, jcop_proxy itself or JCOP simulator.
+ *
+ * The transfer counters of jcop_proxy (JCOP_PERF_COUNTERS) are kept here
+ * as well, so they can be compared with the counters of the driver.
+ *
+ * The stages are recorded by one thread; STATS_XXX are not thread safe.
+ * Other processes may read the statistics while they are recorded: the
+ * recording thread publishes them in a STATS_DATA (usually a named shared
+ * memory) guarded by a sequence counter, and a reader takes a consistent
+ * copy with STATS_snapshot without any lock.
+ */
+#ifndef __STATS__
+#define __STATS__
+
+#include <stdio.h>
+
+#include "osdep.h"
+#include "histogram.h"
+#include "perf_cntr.h"
+
+#define STATS_STAGE_WAKE	0	// the driver signals the request -> jcop_proxy wakes up.
+#define STATS_STAGE_READ	1	// ReadFile of the request.
+#define STATS_STAGE_PROTOCOL	2	// processing of jcop_proxy (T=1 engine), without JCOP simulator.
+#define STATS_STAGE_SIMULATOR	3	// JCOP simulator (or another backend).
+#define STATS_STAGE_REPLY	4	// WriteFile and SetEvent of the answer.
+#define STATS_STAGE_RETURN	5	// the answer is set -> the driver wakes up.
+#define STATS_STAGE_TOTAL	6	// the driver signals the request -> the driver wakes up.
+#define STATS_STAGES		7
+
+#define STATS_MAGIC 0x4A435354	// "JCST"
+
+/*!
+ * \brief statistics published by jcop_proxy.<br>
+ * <br>
+ * seq is odd while the recording thread updates the data.
+ */
+typedef struct _STATS_DATA {
+	unsigned int magic;	// STATS_MAGIC
+	unsigned int size;	// sizeof(STATS_DATA)
+	volatile long seq;
+	JCOP_PERF_COUNTERS counters;
+	HISTOGRAM histograms[STATS_STAGES];	// latency of each stage (nsec).
+} STATS_DATA;
+
+void STATS_setStorage(STATS_DATA *const pData);
+void STATS_reset(void);
+void STATS_beginUpdate(void);
+void STATS_endUpdate(void);
+void STATS_record(unsigned int const stage, OSDEP_INT64 const ticks);
+HISTOGRAM const *STATS_getHistogram(unsigned int const stage);
+char const *STATS_getStageName(unsigned int const stage);
+JCOP_PERF_COUNTERS *STATS_getCounters(void);
+int STATS_snapshot(STATS_DATA const *const pShared, STATS_DATA *const pCopy);
+void STATS_write(FILE *const fp, STATS_DATA const *const pData, JCOP_PERF_COUNTERS const *const pDriverCounters);
+void STATS_writePrometheus(FILE *const fp, STATS_DATA const *const pData);
+int STATS_save(char const *const pPath, JCOP_PERF_COUNTERS const *const pDriverCounters);
+
+#endif // __STATS__
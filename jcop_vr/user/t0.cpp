@@ -0,0 +1,375 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*!
+ * \file t0.cpp
+ * \brief Source file that contains T=0 functions.
+ * \author Kenichi Kanai
+ *
+ * A T=0 card answers SW 61xx when response data is waiting for GET
+ * RESPONSE, and 6Cxx when Le of a case 2 command is wrong. The host (or
+ * the application) usually sends these commands, each of them a round trip
+ * through the driver. T0_transmit sends them itself and answers the whole
+ * response at once.
+ *
+ * T0_transmitPrefetched leaves the GET RESPONSE to the host, but jcop_proxy
+ * sends it ahead (T0_prefetch) while the driver delivers 61xx, so the
+ * GET RESPONSE of the host is answered without JCOP simulator. A card drops
+ * its response data when any other command arrives, so the prefetched data
+ * is just discarded when the host sends another command, and the card is
+ * left as it would have been.
+ */
+#include <string.h>
+
+#include "osdep.h"
+#include "jcop_msg.h"
+#include "jcop_simul.h"
+#include "apducache.h"
+#include "t0.h"
+#define DBG_CATEGORY DBG_CAT_DISPATCH
+#include "dbglog.h"
+
+// GET RESPONSE rounds of a command at most (a card may answer 61xx forever).
+#define T0_MAX_ROUNDS 16
+
+// GET RESPONSE sent ahead of the host.
+typedef struct _T0_PREFETCH {
+	bool isWanted;		// the last answer to the host ended with 61xx.
+	bool isReady;		// rsp holds the answer of the GET RESPONSE.
+	bool isUsed;		// the host has got a part of rsp.
+	unsigned char nad;
+	char cla;		// CLA of the GET RESPONSE.
+	unsigned char le;	// xx of 61xx.
+	unsigned short dataLen;	// response data in rsp, without SW1 SW2.
+	unsigned short offset;	// response data already answered to the host.
+	char rsp[T0_MAX_RESPONSE_DATA + 2];
+	OSDEP_INT64 ticks;	// time JCOP simulator took to answer the GET RESPONSE.
+} T0_PREFETCH;
+
+static OSDEP_THREAD_LOCAL T0_PREFETCH g_prefetch;
+static OSDEP_THREAD_LOCAL unsigned long g_prefetchHits = 0;
+static OSDEP_THREAD_LOCAL unsigned long g_prefetchMisses = 0;
+static OSDEP_THREAD_LOCAL OSDEP_INT64 g_prefetchSavedTicks = 0;
+
+/*!
+ * \brief Function returns the CLA of GET RESPONSE on the logical channel
+ * of a command.<br>
+ */
+static char get_response_cla(char const cla)
+{
+	if ((cla & 0x40) != 0) {
+		return (char)(0x40 | (cla & 0x0F));	// further interindustry: channel 4 to 19.
+	}
+	return (char)(cla & 0x03);	// first interindustry: channel 0 to 3.
+}
+
+/*!
+ * \brief Function transmits a C-APDU and resolves SW 61xx and 6Cxx.<br>
+ * <br>
+ * 6Cxx of a case 2 command (CLA INS P1 P2 Le) is resent once with Le = xx.
+ * 61xx is answered by GET RESPONSE until the card answers another SW or
+ * T0_MAX_RESPONSE_DATA bytes are collected; in the latter case the last
+ * 61xx is returned after the data, as the card would.
+ * <br>
+ * \param [in] pSnd A pointer to first byte of message (MTY NAD LNH LNL | C-APDU).
+ * \param [in] sndLen length of message.
+ * \param [out] pRcv A pointer to buffer of received payload data.
+ * \param [in][out] pRcvLen [in]length of pRcv. [out]actual length of
+ *		received payload data (response data of every round and the last SW).
+ * \param [out] pRoundTrips commands sent besides the C-APDU, i.e. round trips
+ *		saved for the driver.
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL
+ * \retval status of JCOP_SIMUL_transmit.
+ */
+int T0_transmit(
+    char const *const pSnd,
+    const unsigned short sndLen,
+    char *const pRcv,
+    unsigned short *const pRcvLen,
+    unsigned int *const pRoundTrips
+)
+{
+	unsigned short const rcvSize = *pRcvLen;
+	*pRoundTrips = 0;
+
+	int status = APDUCACHE_transmit(pSnd, sndLen, pRcv, pRcvLen);
+	if (status != JCOP_SIMUL_NO_ERROR || *pRcvLen < 2) {
+		return status;
+	}
+
+	unsigned short const apduLen = sndLen - JCOP_MSG_HEADER_SIZE;
+	char const *const pApdu = pSnd + JCOP_MSG_HEADER_SIZE;
+	char snd[JCOP_MSG_HEADER_SIZE + 5];
+
+	// 6Cxx: case 2 command with a wrong Le.
+	if ((unsigned char)pRcv[*pRcvLen - 2] == 0x6C && apduLen == 5) {
+		JCOP_MSG_setHeader(snd, JCOP_MSG_MTY_APDU, (unsigned char)pSnd[1], 5);
+		memcpy(snd + JCOP_MSG_HEADER_SIZE, pApdu, 4);
+		snd[JCOP_MSG_HEADER_SIZE + 4] = pRcv[*pRcvLen - 1];
+		dbg_log("6C%02X: resend with Le=0x%02X", pRcv[*pRcvLen - 1] & 0xff, pRcv[*pRcvLen - 1] & 0xff);
+		*pRcvLen = rcvSize;
+		status = JCOP_SIMUL_transmit(snd, sizeof(snd), pRcv, pRcvLen);
+		if (status != JCOP_SIMUL_NO_ERROR || *pRcvLen < 2) {
+			return status;
+		}
+		(*pRoundTrips)++;
+	}
+
+	// 61xx: response data is waiting.
+	unsigned short dataLen = *pRcvLen - 2;
+	for (int round = 0; round < T0_MAX_ROUNDS; round++) {
+		if ((unsigned char)pRcv[dataLen] != 0x61) {
+			break;
+		}
+		unsigned short avail = (unsigned char)pRcv[dataLen + 1];
+		if (avail == 0) {
+			avail = 256;
+		}
+		unsigned short room = (dataLen < T0_MAX_RESPONSE_DATA) ? T0_MAX_RESPONSE_DATA - dataLen : 0;
+		if (room == 0) {
+			break;	// the host gets the rest.
+		}
+		unsigned short le = (avail < room) ? avail : room;
+		if (rcvSize < dataLen + le + 2) {
+			return JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL;
+		}
+
+		JCOP_MSG_setHeader(snd, JCOP_MSG_MTY_APDU, (unsigned char)pSnd[1], 5);
+		snd[JCOP_MSG_HEADER_SIZE] = get_response_cla(pApdu[0]);
+		snd[JCOP_MSG_HEADER_SIZE + 1] = (char)0xC0;	// GET RESPONSE
+		snd[JCOP_MSG_HEADER_SIZE + 2] = 0x00;
+		snd[JCOP_MSG_HEADER_SIZE + 3] = 0x00;
+		snd[JCOP_MSG_HEADER_SIZE + 4] = (char)(le & 0xff);
+		dbg_log("61%02X: GET RESPONSE Le=0x%02X", avail & 0xff, le & 0xff);
+		unsigned short len = rcvSize - dataLen;
+		status = JCOP_SIMUL_transmit(snd, sizeof(snd), pRcv + dataLen, &len);
+		if (status != JCOP_SIMUL_NO_ERROR) {
+			return status;
+		}
+		(*pRoundTrips)++;
+		if (len < 2) {
+			return JCOP_SIMUL_ERROR_OTHER;
+		}
+		dataLen += len - 2;
+	}
+	*pRcvLen = dataLen + 2;
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+/*!
+ * \brief Function notes whether the answer to the host asks for GET
+ * RESPONSE.<br>
+ */
+static void want_prefetch(
+    unsigned char const nad,
+    char const cla,
+    char const *const pRcv,
+    unsigned short const rcvLen
+)
+{
+	g_prefetch.isWanted = (rcvLen >= 2 && (unsigned char)pRcv[rcvLen - 2] == 0x61);
+	if (g_prefetch.isWanted) {
+		g_prefetch.nad = nad;
+		g_prefetch.cla = get_response_cla(cla);
+		g_prefetch.le = (unsigned char)pRcv[rcvLen - 1];
+	}
+}
+
+/*!
+ * \brief Function answers GET RESPONSE of the host with the prefetched
+ * answer.<br>
+ * <br>
+ * Le of the host is usually xx of 61xx. A smaller Le gets a part of the data
+ * and 61 with the rest, a larger one gets 6C with the data left, as the card
+ * would answer.
+ */
+static int answer_prefetched(
+    unsigned char const nad,
+    char const cla,
+    unsigned char const leByte,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	unsigned short const le = (leByte == 0) ? 256 : leByte;
+	unsigned short const avail = g_prefetch.dataLen - g_prefetch.offset;
+	if (*pRcvLen < ((le < avail) ? le : avail) + 2) {
+		return JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL;
+	}
+
+	if (avail > 0 && le > avail) {
+		pRcv[0] = (char)0x6C;
+		pRcv[1] = (char)(avail & 0xff);
+		*pRcvLen = 2;
+		return JCOP_SIMUL_NO_ERROR;
+	}
+
+	if (!g_prefetch.isUsed) {
+		g_prefetch.isUsed = true;
+		g_prefetchHits++;
+		g_prefetchSavedTicks += g_prefetch.ticks;
+	}
+	unsigned short const len = (le < avail) ? le : avail;
+	memcpy(pRcv, g_prefetch.rsp + g_prefetch.offset, len);
+	g_prefetch.offset += len;
+	if (g_prefetch.offset < g_prefetch.dataLen) {
+		unsigned short const rest = g_prefetch.dataLen - g_prefetch.offset;
+		pRcv[len] = (char)0x61;
+		pRcv[len + 1] = (char)(rest & 0xff);
+		*pRcvLen = len + 2;
+		return JCOP_SIMUL_NO_ERROR;
+	}
+
+	// the whole answer is delivered: its SW may ask for GET RESPONSE again.
+	pRcv[len] = g_prefetch.rsp[g_prefetch.dataLen];
+	pRcv[len + 1] = g_prefetch.rsp[g_prefetch.dataLen + 1];
+	*pRcvLen = len + 2;
+	g_prefetch.isReady = false;
+	want_prefetch(nad, cla, pRcv, *pRcvLen);
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+/*!
+ * \brief Function transmits a C-APDU, or answers GET RESPONSE with the
+ * answer prefetched by T0_prefetch.<br>
+ * <br>
+ * GET RESPONSE on the logical channel of the command answered with 61xx is
+ * answered from the prefetched answer. Any other command discards it and is
+ * sent by APDUCACHE_transmit.
+ * <br>
+ * \param [in] pSnd A pointer to first byte of message (MTY NAD LNH LNL | C-APDU).
+ * \param [in] sndLen length of message.
+ * \param [out] pRcv A pointer to buffer of received payload data.
+ * \param [in][out] pRcvLen [in]length of pRcv. [out]actual length of received payload data.
+ *
+ * \retval JCOP_SIMUL_NO_ERROR
+ * \retval JCOP_SIMUL_ERROR_BUFFER_TOO_SMALL
+ * \retval status of APDUCACHE_transmit.
+ */
+int T0_transmitPrefetched(
+    char const *const pSnd,
+    const unsigned short sndLen,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	unsigned short const apduLen = sndLen - JCOP_MSG_HEADER_SIZE;
+	char const *const pApdu = pSnd + JCOP_MSG_HEADER_SIZE;
+	unsigned char const nad = (unsigned char)pSnd[1];
+	g_prefetch.isWanted = false;
+
+	if (g_prefetch.isReady) {
+		if (apduLen == 5 && (unsigned char)pApdu[1] == 0xC0 && pApdu[2] == 0x00 && pApdu[3] == 0x00
+		        && get_response_cla(pApdu[0]) == g_prefetch.cla && nad == g_prefetch.nad) {
+			dbg_log("GET RESPONSE Le=0x%02X: prefetched", pApdu[4] & 0xff);
+			return answer_prefetched(nad, pApdu[0], (unsigned char)pApdu[4], pRcv, pRcvLen);
+		}
+		T0_discardPrefetch();
+	}
+
+	int status = APDUCACHE_transmit(pSnd, sndLen, pRcv, pRcvLen);
+	if (status == JCOP_SIMUL_NO_ERROR && apduLen > 0) {
+		want_prefetch(nad, pApdu[0], pRcv, *pRcvLen);
+	}
+	return status;
+}
+
+/*!
+ * \brief Function sends GET RESPONSE if the last answer of
+ * T0_transmitPrefetched ended with 61xx, and keeps the answer.<br>
+ * <br>
+ * Call it after the answer is delivered to the host, so JCOP simulator
+ * works while the host reads 61xx.
+ *
+ * \retval JCOP_SIMUL_NO_ERROR no GET RESPONSE is needed, or its answer is kept.
+ * \retval status of JCOP_SIMUL_transmit (the host's GET RESPONSE is sent as is).
+ */
+int T0_prefetch(void)
+{
+	if (!g_prefetch.isWanted) {
+		return JCOP_SIMUL_NO_ERROR;
+	}
+	g_prefetch.isWanted = false;
+
+	char snd[JCOP_MSG_HEADER_SIZE + 5];
+	JCOP_MSG_setHeader(snd, JCOP_MSG_MTY_APDU, g_prefetch.nad, 5);
+	snd[JCOP_MSG_HEADER_SIZE] = g_prefetch.cla;
+	snd[JCOP_MSG_HEADER_SIZE + 1] = (char)0xC0;	// GET RESPONSE
+	snd[JCOP_MSG_HEADER_SIZE + 2] = 0x00;
+	snd[JCOP_MSG_HEADER_SIZE + 3] = 0x00;
+	snd[JCOP_MSG_HEADER_SIZE + 4] = (char)g_prefetch.le;
+	dbg_log("61%02X: prefetch GET RESPONSE", g_prefetch.le);
+	unsigned short len = sizeof(g_prefetch.rsp);
+	OSDEP_INT64 start = OSDEP_now();
+	int status = JCOP_SIMUL_transmit(snd, sizeof(snd), g_prefetch.rsp, &len);
+	g_prefetch.ticks = OSDEP_now() - start;
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		return status;
+	}
+	if (len < 2) {
+		return JCOP_SIMUL_ERROR_OTHER;
+	}
+	g_prefetch.dataLen = len - 2;
+	g_prefetch.offset = 0;
+	g_prefetch.isUsed = false;
+	g_prefetch.isReady = true;
+	return JCOP_SIMUL_NO_ERROR;
+}
+
+/*!
+ * \brief Function discards the prefetched answer, e.g. at a reset.<br>
+ */
+void T0_discardPrefetch(void)
+{
+	if (g_prefetch.isReady && !g_prefetch.isUsed) {
+		g_prefetchMisses++;
+		dbg_log("prefetched GET RESPONSE discarded");
+	}
+	g_prefetch.isReady = false;
+	g_prefetch.isWanted = false;
+}
+
+/*!
+ * \brief Function gets the counts of the prefetched answers of the calling
+ * thread.<br>
+ * <br>
+ * \param [out] pHits GET RESPONSE of the host answered with a prefetched answer.
+ * \param [out] pMisses prefetched answers discarded.
+ * \param [out] pSavedTicks time JCOP simulator took for the answers of pHits.
+ */
+void T0_getPrefetchCounts(
+    unsigned long *const pHits,
+    unsigned long *const pMisses,
+    OSDEP_INT64 *const pSavedTicks
+)
+{
+	*pHits = g_prefetchHits;
+	*pMisses = g_prefetchMisses;
+	*pSavedTicks = g_prefetchSavedTicks;
+}
@@ -0,0 +1,63 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*!
+ * \file t0.h
+ * \brief prototypes for T=0 functions.
+ * \author Kenichi Kanai
+ */
+#ifndef __T0__
+#define __T0__
+
+#include "osdep.h"
+
+// data of a short R-APDU. the reply buffer of smclib (MIN_BUFFER_SIZE)
+// holds it with SW1 SW2.
+#define T0_MAX_RESPONSE_DATA 256
+
+int T0_transmit(
+    char const *const pSnd,
+    const unsigned short sndLen,
+    char *const pRcv,
+    unsigned short *const pRcvLen,
+    unsigned int *const pRoundTrips
+);
+int T0_transmitPrefetched(
+    char const *const pSnd,
+    const unsigned short sndLen,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+);
+int T0_prefetch(void);
+void T0_discardPrefetch(void);
+void T0_getPrefetchCounts(
+    unsigned long *const pHits,
+    unsigned long *const pMisses,
+    OSDEP_INT64 *const pSavedTicks
+);
+
+#endif // __T0__
@@ -30,28 +30,45 @@
  * \author Kenichi Kanai
  */
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "t1.h"
+#define DBG_CATEGORY DBG_CAT_T1
 #include "dbglog.h"
 
-#include <windows.h>
+#include "osdep.h"
 #include "shared_data.h"
 #include "jcop_simul.h"
+#include "apducache.h"
 
 #define PCB_I_SEQ	0x40
 #define PCB_I_MORE	0x20
 #define PCB_R_SEQ	0x10
 #define PCB_S_CARD	0x20
 
-static unsigned char g_sndISeq = 0x00;
-static char g_sndBuf[JCOP_PROXY_BUFFER_SIZE];
-static int g_sndBufOff = 0;
-
-static bool g_isRcvChaining = false;
-static char g_rcvBuf[JCOP_PROXY_BUFFER_SIZE];
-static int g_rcvBufOff = 0;
-static int g_rcvBufLen = 0;
+/*!
+ * \brief T=1 state of a card (or of a NAD routed by NADROUTE).<br>
+ */
+struct _T1_CONTEXT {
+	unsigned char sndISeq;
+	char sndBuf[JCOP_MSG_HEADER_SIZE + JCOP_PROXY_BUFFER_SIZE];	// message of MTY 0x01.
+	int sndBufOff;	// length of C-APDU after the message header.
+
+	bool isRcvChaining;
+	char rcvBuf[JCOP_PROXY_BUFFER_SIZE];
+	int rcvBufOff;
+	int rcvBufLen;
+};
+
+// a thread has its own T=1 state (jcop_load runs several).
+static OSDEP_THREAD_LOCAL T1_CONTEXT g_defaultContext;
+static OSDEP_THREAD_LOCAL T1_CONTEXT *g_pContext = NULL;	// NULL: g_defaultContext.
+
+static T1_CONTEXT *context()
+{
+	return (g_pContext != NULL) ? g_pContext : &g_defaultContext;
+}
 
 /*!
  * \brief Function creates T=1 message.<br>
@@ -88,17 +105,57 @@ static unsigned short createT1Msg(
 	return offEdc + 1;	// message length
 }
 
+/*!
+ * \brief Function allocates a T=1 state for T1_setContext.<br>
+ *
+ * \retval the state, or NULL if out of memory.
+ */
+T1_CONTEXT *T1_newContext()
+{
+	T1_CONTEXT *pContext = (T1_CONTEXT *)malloc(sizeof(T1_CONTEXT));
+	if (pContext != NULL) {
+		memset(pContext, 0, sizeof(T1_CONTEXT));
+	}
+	return pContext;
+}
+
+void T1_freeContext(T1_CONTEXT *const pContext)
+{
+	if (pContext == g_pContext) {
+		g_pContext = NULL;
+	}
+	free(pContext);
+}
+
+/*!
+ * \brief Function sets the T=1 state the following calls of the thread
+ * use.<br>
+ * <br>
+ * \param [in] pContext a state of T1_newContext, or NULL for the default one.
+ *
+ * \retval the state used so far (NULL: the default one).
+ */
+T1_CONTEXT *T1_setContext(T1_CONTEXT *const pContext)
+{
+	T1_CONTEXT *pPrevious = g_pContext;
+	g_pContext = pContext;
+	return pPrevious;
+}
+
 /*!
  * \brief reset ICC I-block sequence counter.<br>
  */
 void T1_resetSeq()
 {
-	g_sndISeq = 0x00;
+	context()->sndISeq = 0x00;
 }
 
 /*!
  * \brief Function process T=1 message.<br>
  * <br>
+ * The C-APDU is reassembled from the I-blocks in the T=1 state, so the
+ * message is left unchanged for the caller to count and record.
+ * <br>
  * \param [in] pSnd A pointer to first byte of message.
  * \param [in] iSndLen length of message.
  * \param [out] pRcv A pointer to buffer of received payload data.
@@ -115,6 +172,7 @@ int T1_processMsg(
     unsigned short *const pRcvLen
 )
 {
+	T1_CONTEXT *pCtx = context();
 	dbg_ba2s(pSnd, sndLen);
 
 	unsigned char nad = pSnd[4];	// T=1 NAD
@@ -148,7 +206,7 @@ int T1_processMsg(
 		return 0;
 	}
 
-	if (g_isRcvChaining) {
+	if (pCtx->isRcvChaining) {
 
 		if ((pcb & 0xC0) != 0x80) {
 			// Not R-block (I-block)..
@@ -164,7 +222,7 @@ int T1_processMsg(
 		}
 
 		// R-block
-		int remain = g_rcvBufLen - g_rcvBufOff;
+		int remain = pCtx->rcvBufLen - pCtx->rcvBufOff;
 		unsigned char rSeq = 0x00;
 		if ((pcb & PCB_R_SEQ) == PCB_R_SEQ) {
 			// set sequence bit.
@@ -179,11 +237,10 @@ int T1_processMsg(
 			               nad,
 			               (PCB_I_MORE | rSeq),
 			               MAX_IFS,
-			               &g_rcvBuf[g_rcvBufOff]
+			               &pCtx->rcvBuf[pCtx->rcvBufOff]
 			           );
-			g_isRcvChaining = true;
-			g_rcvBufOff += MAX_IFS;
-			g_rcvBufLen -= MAX_IFS;
+			pCtx->isRcvChaining = true;
+			pCtx->rcvBufOff += MAX_IFS;
 		} else {
 			// I-block resp chaining end.
 			*pRcvLen = createT1Msg(
@@ -191,16 +248,16 @@ int T1_processMsg(
 			               nad,
 			               (0x00 | rSeq),
 			               (remain & 0x00FF),
-			               &g_rcvBuf[g_rcvBufOff]
+			               &pCtx->rcvBuf[pCtx->rcvBufOff]
 			           );
-			g_isRcvChaining = false;
-			g_rcvBufOff = 0;
-			g_rcvBufLen = 0;
+			pCtx->isRcvChaining = false;
+			pCtx->rcvBufOff = 0;
+			pCtx->rcvBufLen = 0;
 		}
 
 		// set sequence bit for next I-block.
 		// invert sequence bit.
-		g_sndISeq = rSeq ^ PCB_I_SEQ;
+		pCtx->sndISeq = rSeq ^ PCB_I_SEQ;
 
 
 	} else {
@@ -222,8 +279,8 @@ int T1_processMsg(
 
 		// remove socket header & T=1 header and EDC..
 		unsigned short apduLen = sndLen - 4 - 4;
-		memcpy(&g_sndBuf[g_sndBufOff], &pSnd[4 + 3], apduLen);
-		g_sndBufOff += apduLen;
+		memcpy(&pCtx->sndBuf[JCOP_MSG_HEADER_SIZE + pCtx->sndBufOff], &pSnd[4 + 3], apduLen);
+		pCtx->sndBufOff += apduLen;
 
 		dbg_ba2s(pSnd, apduLen + 4);
 
@@ -251,47 +308,49 @@ int T1_processMsg(
 		// reconstruct socket message.
 		// pSnd: MTY NAD LNH LNL | NAD PCB LEN | INF... | EDC
 		// pSnd: 11000009 000005 80CA9F7F00 AF
-		pSnd[0] = 0x01;	// MTY=0x01:  Transmit APDU
-		pSnd[2] = g_sndBufOff / 256;	// LNH High byte of payload length
-		pSnd[3] = g_sndBufOff % 256;	// LNL Low byte of payload length
-		memcpy(&pSnd[4], g_sndBuf, g_sndBufOff);
-		// pSnd: MTY NAD LNH LNL | DATA...
-		// pSnd: 01000005 80CA9F7F00
-		dbg_ba2s(pSnd, g_sndBufOff + 4);
+		JCOP_MSG_setHeader(
+		    pCtx->sndBuf,
+		    JCOP_MSG_MTY_APDU,	// MTY=0x01:  Transmit APDU
+		    pSnd[1],
+		    (unsigned short)pCtx->sndBufOff
+		);
+		// sndBuf: MTY NAD LNH LNL | DATA...
+		// sndBuf: 01000005 80CA9F7F00
+		dbg_ba2s(pCtx->sndBuf, pCtx->sndBufOff + 4);
 
 		// send command to JCOP simulator.
 		unsigned short respLen = *pRcvLen;
-		status = JCOP_SIMUL_transmit(
-		             pSnd,
-		             g_sndBufOff + 4,
+		status = APDUCACHE_transmit(
+		             pCtx->sndBuf,
+		             pCtx->sndBufOff + 4,
 		             &pRcv[3],
 		             &respLen
 		         );
 		dbg_log("JCOP_SIMUL_transmit end with code %d", status);
 		if (status != JCOP_SIMUL_NO_ERROR) {
-			dbg_log("JCOP_SIMUL_transmit failed! - status: 0x%08X", status);
+			dbg_err("JCOP_SIMUL_transmit failed! - status: 0x%08X", status);
 			*pRcvLen = 0;
 			return status;
 		}
 
-		if (respLen < MAX_IFS) {
+		if (respLen <= MAX_IFS) {
 			// I-block resp end.
 			*pRcvLen = createT1Msg(
 			               pRcv,
 			               nad,
-			               g_sndISeq,
+			               pCtx->sndISeq,
 			               (unsigned char)respLen,
 			               &pRcv[3]);
 		} else {
 			// I-block resp chaining start.
-			memcpy(g_rcvBuf, &pRcv[3], respLen);
-			g_isRcvChaining = true;
-			g_rcvBufOff = MAX_IFS;
-			g_rcvBufLen = respLen;
+			memcpy(pCtx->rcvBuf, &pRcv[3], respLen);
+			pCtx->isRcvChaining = true;
+			pCtx->rcvBufOff = MAX_IFS;
+			pCtx->rcvBufLen = respLen;
 			*pRcvLen = createT1Msg(
 			               pRcv,
 			               nad,
-			               (g_sndISeq | PCB_I_MORE),
+			               (pCtx->sndISeq | PCB_I_MORE),
 			               MAX_IFS,
 			               &pRcv[3]
 			           );
@@ -299,10 +358,60 @@ int T1_processMsg(
 
 		// set sequence bit for next I-block.
 		// invert sequence bit.
-		g_sndISeq ^= PCB_I_SEQ;
+		pCtx->sndISeq ^= PCB_I_SEQ;
 
 		// I-block req chaining end.
-		g_sndBufOff = 0;
+		pCtx->sndBufOff = 0;
+	}
+
+	dbg_ba2s(pRcv, *pRcvLen);
+	return 0;
+}
+
+/*!
+ * \brief Function process T=1 APDU message.<br>
+ * <br>
+ * The whole C-APDU of MTY 0x12 is sent to JCOP simulator at once and the
+ * whole R-APDU is answered, so no block is exchanged. A chain left
+ * unfinished by a failed request is dropped; the I-block sequence is kept,
+ * as the smart card library does not see the blocks either.
+ * <br>
+ * \param [in] pSnd A pointer to first byte of message. MTY is changed to
+		0x01 while it is sent and restored before returning.
+ * \param [in] iSndLen length of message.
+ * \param [out] pRcv A pointer to buffer of received payload data.
+ * \param [in][out] pRcvLen [in]length of pRcv. caller's expected Max
+		length of receiving payload data.
+		[out]actual lengh of received payload data.
+ *
+ * \retval 0
+ */
+int T1_processApdu(
+    char *const pSnd,
+    const unsigned short sndLen,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+)
+{
+	T1_CONTEXT *pCtx = context();
+	dbg_ba2s(pSnd, sndLen);
+
+	pCtx->sndBufOff = 0;
+	pCtx->isRcvChaining = false;
+	pCtx->rcvBufOff = 0;
+	pCtx->rcvBufLen = 0;
+
+	// pSnd: MTY NAD LNH LNL | DATA...
+	// pSnd: 12000005 80CA9F7F00
+	char const mty = pSnd[0];
+	pSnd[0] = 0x01;	// MTY=0x01:  Transmit APDU
+	int status = APDUCACHE_transmit(pSnd, sndLen, pRcv, pRcvLen);
+	pSnd[0] = mty;	// the caller still counts and records the request.
+	dbg_log("JCOP_SIMUL_transmit end with code %d", status);
+	if (status != JCOP_SIMUL_NO_ERROR) {
+		dbg_err("JCOP_SIMUL_transmit failed! - status: 0x%08X", status);
+		*pRcvLen = 0;
+		return status;
 	}
 
 	dbg_ba2s(pRcv, *pRcvLen);
@@ -28,10 +28,19 @@
  * \file t1.h
  * \brief prototypes for T=1 functions.
  * \author Kenichi Kanai
+ *
+ * The T=1 state (I-block sequence and chaining) belongs to the calling
+ * thread. A thread serving several cards (NADROUTE) keeps a T1_CONTEXT for
+ * each and sets the one of the card before a block is processed.
  */
 #ifndef __T1__
 #define __T1__
 
+typedef struct _T1_CONTEXT T1_CONTEXT;
+
+T1_CONTEXT *T1_newContext();
+void T1_freeContext(T1_CONTEXT *const pContext);
+T1_CONTEXT *T1_setContext(T1_CONTEXT *const pContext);
 void T1_resetSeq();
 int T1_processMsg(
     char *const pSnd,
@@ -39,6 +48,12 @@ int T1_processMsg(
     char *const pRcv,
     unsigned short *const pRcvLen
 );
+int T1_processApdu(
+    char *const pSnd,
+    const unsigned short sndLen,
+    char *const pRcv,
+    unsigned short *const pRcvLen
+);
 
 #endif // __T1__
 
@@ -0,0 +1,138 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file trace.cpp
+ * \brief Source file that writes a trace for Chrome tracing / Perfetto.
+ * \author Kenichi Kanai
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+#include "dbglog.h"
+
+#define TRACE_WRITE_BUFFER_SIZE 65536
+#define TRACE_PID 1
+
+static FILE *g_fp = NULL;
+static char *g_pWriteBuffer = NULL;
+static OSDEP_INT64 g_origin = 0;	// timestamps are written relative to TRACE_open.
+
+static double to_usec(OSDEP_INT64 const ticks)
+{
+	return (double)OSDEP_toNsec(ticks - g_origin) / 1000;
+}
+
+/*!
+ * \brief Function creates a trace file.<br>
+ * <br>
+ * \param [in] pPath file path.
+ *
+ * \retval TRACE_NO_ERROR
+ * \retval TRACE_ERROR_IO the file could not be created.
+ */
+int TRACE_open(char const *const pPath)
+{
+	g_fp = fopen(pPath, "w");
+	if (g_fp == NULL) {
+		dbg_err("fopen failed! - %s", pPath);
+		return TRACE_ERROR_IO;
+	}
+	g_pWriteBuffer = (char *)malloc(TRACE_WRITE_BUFFER_SIZE);
+	if (g_pWriteBuffer != NULL) {
+		setvbuf(g_fp, g_pWriteBuffer, _IOFBF, TRACE_WRITE_BUFFER_SIZE);
+	}
+	g_origin = OSDEP_now();
+	fprintf(g_fp, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"jcop_proxy\"}}",
+	        TRACE_PID);
+	return TRACE_NO_ERROR;
+}
+
+int TRACE_isOpen(void)
+{
+	return (g_fp != NULL) ? 1 : 0;
+}
+
+/*!
+ * \brief Function names a track.<br>
+ * <br>
+ * \param [in] track track number.
+ * \param [in] pName name shown by the viewer (not escaped).
+ */
+void TRACE_nameTrack(unsigned int const track, char const *const pName)
+{
+	if (g_fp == NULL) {
+		return;
+	}
+	fprintf(g_fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+	        TRACE_PID, track, pName);
+}
+
+/*!
+ * \brief Function writes a span.<br>
+ * <br>
+ * \param [in] track track number.
+ * \param [in] pName name of the span (not escaped).
+ * \param [in] pCategory category of the span (not escaped).
+ * \param [in] start start time (OSDEP_now ticks).
+ * \param [in] end end time (OSDEP_now ticks).
+ * \param [in] pArgs members of the "args" object, e.g. "\"ins\":\"A4\"", or NULL.
+ */
+void TRACE_span(
+    unsigned int const track,
+    char const *const pName,
+    char const *const pCategory,
+    OSDEP_INT64 const start,
+    OSDEP_INT64 const end,
+    char const *const pArgs
+)
+{
+	if (g_fp == NULL || end < start) {
+		return;
+	}
+	fprintf(g_fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+	        pName, pCategory, TRACE_PID, track, to_usec(start), to_usec(end) - to_usec(start));
+	if (pArgs != NULL) {
+		fprintf(g_fp, ",\"args\":{%s}", pArgs);
+	}
+	fprintf(g_fp, "}");
+}
+
+/*!
+ * \brief Function closes the trace file.<br>
+ */
+void TRACE_close(void)
+{
+	if (g_fp == NULL) {
+		return;
+	}
+	fprintf(g_fp, "\n]\n");
+	fclose(g_fp);
+	g_fp = NULL;
+	free(g_pWriteBuffer);
+	g_pWriteBuffer = NULL;
+}
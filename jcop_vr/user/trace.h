@@ -0,0 +1,59 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file trace.h
+ * \brief prototypes for functions which write a trace for Chrome tracing / Perfetto.
+ * \author Kenichi Kanai
+ *
+ * The trace is a JSON array of trace events ("Trace Event Format"), which
+ * chrome://tracing and ui.perfetto.dev open. A span is a complete event
+ * ("ph":"X") on a track; spans on the same track nest by their time. The
+ * array is not closed until TRACE_close, but the viewers also accept an
+ * unterminated array (e.g. after a crash).
+ */
+#ifndef __TRACE__
+#define __TRACE__
+
+#include "osdep.h"
+
+#define TRACE_NO_ERROR		0x00
+#define TRACE_ERROR_IO		0x01
+
+int TRACE_open(char const *const pPath);
+int TRACE_isOpen(void);
+void TRACE_nameTrack(unsigned int const track, char const *const pName);
+void TRACE_span(
+    unsigned int const track,
+    char const *const pName,
+    char const *const pCategory,
+    OSDEP_INT64 const start,
+    OSDEP_INT64 const end,
+    char const *const pArgs
+);
+void TRACE_close(void);
+
+#endif // __TRACE__
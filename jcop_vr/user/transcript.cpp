@@ -0,0 +1,343 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file transcript.cpp
+ * \brief Source file that records the APDU transcript.
+ * \author Kenichi Kanai
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "transcript.h"
+#include "jcop_msg.h"
+#include "dbglog.h"
+
+#define TRANSCRIPT_WRITE_BUFFER_SIZE 65536
+#define TRANSCRIPT_INDEX_INITIAL 4096	// initial number of index entries.
+
+static FILE *g_fp = NULL;
+static char *g_pWriteBuffer = NULL;
+
+// file offset of the next record.
+static unsigned int g_offsetLow = 0;
+static unsigned int g_offsetHigh = 0;
+
+static TRANSCRIPT_INDEX_ENTRY *g_pIndex = NULL;
+static unsigned int g_indexCount = 0;
+static unsigned int g_indexMax = 0;
+
+// T=1: the current command is chained from the previous I-block.
+static int g_t1Chaining = 0;
+
+static char const g_padding[TRANSCRIPT_ALIGN] = { 0 };
+
+static void add_offset(unsigned int const size)
+{
+	g_offsetLow += size;
+	if (g_offsetLow < size) {
+		g_offsetHigh++;
+	}
+}
+
+static int write_data(void const *const pData, unsigned int const size)
+{
+	if (size == 0) {
+		return TRANSCRIPT_NO_ERROR;
+	}
+	if (fwrite(pData, 1, size, g_fp) != size) {
+		dbg_err("fwrite failed! - %u bytes", size);
+		return TRANSCRIPT_ERROR_IO;
+	}
+	add_offset(size);
+	return TRANSCRIPT_NO_ERROR;
+}
+
+/*!
+ * \brief Function gets the index key of a record.<br>
+ * <br>
+ * \param [in] pRecord record header.
+ * \param [in] pCmd payload of the request.
+ * \param [in] pRsp payload of the answer.
+ * \param [out] pEntry index entry (only cla, ins, sw1 and sw2 are set).
+ *
+ * \retval 1 the record starts a command and has to be indexed.
+ * \retval 0 the record is not indexed.
+ */
+static int get_key(
+    TRANSCRIPT_RECORD const *const pRecord,
+    char const *const pCmd,
+    char const *const pRsp,
+    TRANSCRIPT_INDEX_ENTRY *const pEntry
+)
+{
+	char const *pApdu;
+	unsigned short apduLen;
+	char const *pSw = NULL;
+
+	switch (pRecord->mty) {
+		case JCOP_MSG_MTY_WAIT_FOR_CARD :
+			g_t1Chaining = 0;	// a reset drops the chain.
+			return 0;
+		case JCOP_MSG_MTY_T1_APDU :
+			g_t1Chaining = 0;	// T1_processApdu drops the chain.
+			pApdu = pCmd;
+			apduLen = pRecord->cmdLen;
+			if (pRecord->rspLen >= 2) {
+				pSw = pRsp + pRecord->rspLen - 2;
+			}
+			break;
+		case JCOP_MSG_MTY_APDU :
+			pApdu = pCmd;
+			apduLen = pRecord->cmdLen;
+			if (pRecord->rspLen >= 2) {
+				pSw = pRsp + pRecord->rspLen - 2;
+			}
+			break;
+		case JCOP_MSG_MTY_T1 : {
+			// block: NAD PCB LEN | INF... | EDC
+			if (pRecord->cmdLen < 4 || (pCmd[1] & 0x80) != 0) {
+				return 0;	// not an I-block.
+			}
+			int chained = g_t1Chaining;
+			g_t1Chaining = ((pCmd[1] & 0x20) != 0);
+			if (chained) {
+				return 0;	// INF does not start with the command header.
+			}
+			pApdu = pCmd + 3;
+			apduLen = (unsigned short)(pCmd[2] & 0xff);
+			// the last I-block of the answer ends with SW1 SW2.
+			if (pRecord->rspLen >= 4 && (pRsp[1] & 0xA0) == 0) {
+				unsigned short infLen = (unsigned short)(pRsp[2] & 0xff);
+				if (infLen >= 2 && 3 + infLen <= pRecord->rspLen) {
+					pSw = pRsp + 3 + infLen - 2;
+				}
+			}
+			break;
+		}
+		default :
+			return 0;
+	}
+
+	if (apduLen < 4) {
+		return 0;
+	}
+	pEntry->cla = (unsigned char)pApdu[0];
+	pEntry->ins = (unsigned char)pApdu[1];
+	// 0xFFFF: no status word (error or chained answer).
+	pEntry->sw1 = (pSw != NULL) ? (unsigned char)pSw[0] : 0xFF;
+	pEntry->sw2 = (pSw != NULL) ? (unsigned char)pSw[1] : 0xFF;
+	return 1;
+}
+
+static int add_index(TRANSCRIPT_INDEX_ENTRY const *const pEntry)
+{
+	if (g_indexCount == g_indexMax) {
+		unsigned int max = (g_indexMax == 0) ? TRANSCRIPT_INDEX_INITIAL : g_indexMax * 2;
+		TRANSCRIPT_INDEX_ENTRY *pIndex = (TRANSCRIPT_INDEX_ENTRY *)realloc(
+		                                     g_pIndex, max * sizeof(TRANSCRIPT_INDEX_ENTRY));
+		if (pIndex == NULL) {
+			dbg_err("realloc failed! - %u entries", max);
+			return TRANSCRIPT_ERROR_MEMORY;
+		}
+		g_pIndex = pIndex;
+		g_indexMax = max;
+	}
+	g_pIndex[g_indexCount++] = *pEntry;
+	return TRANSCRIPT_NO_ERROR;
+}
+
+static int compare_index(void const *const p1, void const *const p2)
+{
+	TRANSCRIPT_INDEX_ENTRY const *pEntry1 = (TRANSCRIPT_INDEX_ENTRY const *)p1;
+	TRANSCRIPT_INDEX_ENTRY const *pEntry2 = (TRANSCRIPT_INDEX_ENTRY const *)p2;
+	int diff = memcmp(pEntry1, pEntry2, 4);	// CLA INS SW1 SW2
+	if (diff != 0) {
+		return diff;
+	}
+	if (pEntry1->offsetHigh != pEntry2->offsetHigh) {
+		return (pEntry1->offsetHigh < pEntry2->offsetHigh) ? -1 : 1;
+	}
+	if (pEntry1->offsetLow != pEntry2->offsetLow) {
+		return (pEntry1->offsetLow < pEntry2->offsetLow) ? -1 : 1;
+	}
+	return 0;
+}
+
+static void release(void)
+{
+	if (g_fp != NULL) {
+		fclose(g_fp);
+		g_fp = NULL;
+	}
+	free(g_pWriteBuffer);
+	g_pWriteBuffer = NULL;
+	free(g_pIndex);
+	g_pIndex = NULL;
+	g_indexCount = 0;
+	g_indexMax = 0;
+	g_offsetLow = 0;
+	g_offsetHigh = 0;
+	g_t1Chaining = 0;
+}
+
+/*!
+ * \brief Function creates a transcript file.<br>
+ * <br>
+ * \param [in] pPath path of the transcript file (overwritten).
+ * \param [in] freqLow low 32 bits of the timestamp frequency (ticks per second).
+ * \param [in] freqHigh high 32 bits of the timestamp frequency.
+ *
+ * \retval TRANSCRIPT_NO_ERROR
+ * \retval TRANSCRIPT_ERROR_IO
+ * \retval TRANSCRIPT_ERROR_MEMORY
+ */
+int TRANSCRIPT_open(char const *const pPath, unsigned int const freqLow, unsigned int const freqHigh)
+{
+	if (g_fp != NULL) {
+		TRANSCRIPT_close();
+	}
+
+	g_fp = fopen(pPath, "wb");
+	if (g_fp == NULL) {
+		dbg_err("fopen failed! - %s", pPath);
+		return TRANSCRIPT_ERROR_IO;
+	}
+	// records are small; write them in large chunks.
+	g_pWriteBuffer = (char *)malloc(TRANSCRIPT_WRITE_BUFFER_SIZE);
+	if (g_pWriteBuffer == NULL) {
+		release();
+		return TRANSCRIPT_ERROR_MEMORY;
+	}
+	setvbuf(g_fp, g_pWriteBuffer, _IOFBF, TRANSCRIPT_WRITE_BUFFER_SIZE);
+
+	TRANSCRIPT_FILE_HEADER header;
+	memset(&header, 0, sizeof(header));
+	header.magic = TRANSCRIPT_MAGIC;
+	header.version = TRANSCRIPT_VERSION;
+	header.headerSize = sizeof(TRANSCRIPT_FILE_HEADER);
+	header.freqLow = freqLow;
+	header.freqHigh = freqHigh;
+	int status = write_data(&header, sizeof(header));
+	if (status != TRANSCRIPT_NO_ERROR) {
+		release();
+		return status;
+	}
+
+	return TRANSCRIPT_NO_ERROR;
+}
+
+/*!
+ * \brief Function returns whether the transcript is recorded.<br>
+ */
+int TRANSCRIPT_isOpen(void)
+{
+	return (g_fp != NULL) ? 1 : 0;
+}
+
+/*!
+ * \brief Function appends a record to the transcript.<br>
+ * <br>
+ * \param [in][out] pRecord record header. recordSize is set by this function.
+ * \param [in] pCmd payload of the request (pRecord->cmdLen bytes).
+ * \param [in] pRsp payload of the answer (pRecord->rspLen bytes).
+ *
+ * \retval TRANSCRIPT_NO_ERROR
+ * \retval TRANSCRIPT_ERROR_NOT_OPEN
+ * \retval TRANSCRIPT_ERROR_IO
+ * \retval TRANSCRIPT_ERROR_MEMORY
+ */
+int TRANSCRIPT_record(
+    TRANSCRIPT_RECORD *const pRecord,
+    char const *const pCmd,
+    char const *const pRsp
+)
+{
+	if (g_fp == NULL) {
+		return TRANSCRIPT_ERROR_NOT_OPEN;
+	}
+
+	unsigned int dataLen = (unsigned int)pRecord->cmdLen + pRecord->rspLen;
+	unsigned int paddingLen = (TRANSCRIPT_ALIGN - (dataLen % TRANSCRIPT_ALIGN)) % TRANSCRIPT_ALIGN;
+	pRecord->recordSize = sizeof(TRANSCRIPT_RECORD) + dataLen + paddingLen;
+
+	TRANSCRIPT_INDEX_ENTRY entry;
+	if (get_key(pRecord, pCmd, pRsp, &entry)) {
+		entry.offsetLow = g_offsetLow;
+		entry.offsetHigh = g_offsetHigh;
+		int status = add_index(&entry);
+		if (status != TRANSCRIPT_NO_ERROR) {
+			return status;
+		}
+	}
+
+	int status = write_data(pRecord, sizeof(TRANSCRIPT_RECORD));
+	if (status == TRANSCRIPT_NO_ERROR) {
+		status = write_data(pCmd, pRecord->cmdLen);
+	}
+	if (status == TRANSCRIPT_NO_ERROR) {
+		status = write_data(pRsp, pRecord->rspLen);
+	}
+	if (status == TRANSCRIPT_NO_ERROR) {
+		status = write_data(g_padding, paddingLen);
+	}
+	return status;
+}
+
+/*!
+ * \brief Function writes the index and closes the transcript.<br>
+ *
+ * \retval TRANSCRIPT_NO_ERROR
+ * \retval TRANSCRIPT_ERROR_NOT_OPEN
+ * \retval TRANSCRIPT_ERROR_IO
+ */
+int TRANSCRIPT_close(void)
+{
+	if (g_fp == NULL) {
+		return TRANSCRIPT_ERROR_NOT_OPEN;
+	}
+
+	if (g_indexCount > 1) {
+		qsort(g_pIndex, g_indexCount, sizeof(TRANSCRIPT_INDEX_ENTRY), compare_index);
+	}
+
+	TRANSCRIPT_TRAILER trailer;
+	trailer.magic = TRANSCRIPT_INDEX_MAGIC;
+	trailer.count = g_indexCount;
+	trailer.indexLow = g_offsetLow;
+	trailer.indexHigh = g_offsetHigh;
+
+	int status = write_data(g_pIndex, g_indexCount * sizeof(TRANSCRIPT_INDEX_ENTRY));
+	if (status == TRANSCRIPT_NO_ERROR) {
+		status = write_data(&trailer, sizeof(trailer));
+	}
+	if (fflush(g_fp) != 0) {
+		status = TRANSCRIPT_ERROR_IO;
+	}
+	release();
+	return status;
+}
@@ -0,0 +1,117 @@
+/*
+ * $Id$
+ */
+
+/*
+ * Copyright (c) 2008 Kenichi Kanai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*!
+ * \file transcript.h
+ * \brief APDU transcript file format and recorder.
+ * \author Kenichi Kanai
+ *
+ * A transcript records every frame handled by jcop_proxy:
+ *
+ *   TRANSCRIPT_FILE_HEADER
+ *   TRANSCRIPT_RECORD | command | response | padding	(repeated)
+ *   TRANSCRIPT_INDEX_ENTRY				(repeated)
+ *   TRANSCRIPT_TRAILER
+ *
+ * Records are only appended and every record starts on a TRANSCRIPT_ALIGN
+ * boundary, so the file can be mapped and walked record by record. The
+ * index is written when the transcript is closed; it is sorted by
+ * CLA, INS, SW1, SW2 and file offset so the records of a command can be
+ * found by binary search without scanning the records. A file without
+ * trailer (the proxy was killed) can still be walked from the header.
+ *
+ * All fields are little endian and have a fixed size.
+ */
+#ifndef __TRANSCRIPT__
+#define __TRANSCRIPT__
+
+#define TRANSCRIPT_NO_ERROR		0x00
+#define TRANSCRIPT_ERROR_IO		0x01
+#define TRANSCRIPT_ERROR_MEMORY		0x02
+#define TRANSCRIPT_ERROR_NOT_OPEN	0x03
+
+#define TRANSCRIPT_MAGIC	0x5254434A	// "JCTR"
+#define TRANSCRIPT_INDEX_MAGIC	0x5844434A	// "JCDX"
+#define TRANSCRIPT_VERSION	1
+
+#define TRANSCRIPT_ALIGN	8
+
+// latency stages of a record.
+#define TRANSCRIPT_STAGES		8
+#define TRANSCRIPT_STAGE_READ		0	// ReadFile of the request.
+#define TRANSCRIPT_STAGE_PROCESS	1	// JCOP simulator / T=1 processing.
+#define TRANSCRIPT_STAGE_REPLY		2	// WriteFile and SetEvent of the answer.
+#define TRANSCRIPT_STAGE_WAKE		3	// the driver signals the request -> jcop_proxy wakes up.
+#define TRANSCRIPT_STAGE_SIMULATOR	4	// JCOP simulator part of TRANSCRIPT_STAGE_PROCESS.
+
+typedef struct _TRANSCRIPT_FILE_HEADER {
+	unsigned int magic;		// TRANSCRIPT_MAGIC
+	unsigned short version;		// TRANSCRIPT_VERSION
+	unsigned short headerSize;	// sizeof(TRANSCRIPT_FILE_HEADER)
+	unsigned int freqLow;		// timestamp ticks per second.
+	unsigned int freqHigh;
+	unsigned int reserved[4];
+} TRANSCRIPT_FILE_HEADER;
+
+typedef struct _TRANSCRIPT_RECORD {
+	unsigned int recordSize;	// whole record size including data and padding.
+	unsigned int session;		// incremented at every card power up.
+	unsigned int tsLow;		// timestamp of the request (monotonic ticks).
+	unsigned int tsHigh;
+	unsigned char mty;		// MTY of the request.
+	unsigned char nad;		// NAD of the request.
+	unsigned short status;		// 0, or JCOP_MSG_ERROR_XXX of the answer.
+	unsigned short cmdLen;		// payload length of the request.
+	unsigned short rspLen;		// payload length of the answer.
+	unsigned int stage[TRANSCRIPT_STAGES];	// latency of each stage (usec).
+} TRANSCRIPT_RECORD;
+
+typedef struct _TRANSCRIPT_INDEX_ENTRY {
+	unsigned char cla;
+	unsigned char ins;
+	unsigned char sw1;
+	unsigned char sw2;
+	unsigned int offsetLow;		// file offset of the record.
+	unsigned int offsetHigh;
+} TRANSCRIPT_INDEX_ENTRY;
+
+typedef struct _TRANSCRIPT_TRAILER {
+	unsigned int magic;		// TRANSCRIPT_INDEX_MAGIC
+	unsigned int count;		// number of index entries.
+	unsigned int indexLow;		// file offset of the first index entry.
+	unsigned int indexHigh;
+} TRANSCRIPT_TRAILER;
+
+int TRANSCRIPT_open(char const *const pPath, unsigned int const freqLow, unsigned int const freqHigh);
+int TRANSCRIPT_isOpen(void);
+int TRANSCRIPT_record(
+    TRANSCRIPT_RECORD *const pRecord,
+    char const *const pCmd,
+    char const *const pRsp
+);
+int TRANSCRIPT_close(void);
+
+#endif // __TRANSCRIPT__